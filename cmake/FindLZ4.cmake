@@ -0,0 +1,28 @@
+# Find the lz4 includes and library
+#
+#  LZ4_INCLUDE_DIR - where to find lz4.h
+#  LZ4_LIBRARIES   - List of libraries when using lz4.
+#  LZ4_FOUND       - True if lz4 is found.
+
+# check if already in cache, be silent
+IF (LZ4_INCLUDE_DIR)
+    SET (LZ4_FIND_QUIETLY TRUE)
+ENDIF (LZ4_INCLUDE_DIR)
+
+# find includes
+FIND_PATH (LZ4_INCLUDE_DIR lz4.h
+        /usr/local/include
+        /usr/include
+        )
+
+# find lib
+FIND_LIBRARY(LZ4_LIBRARIES
+        NAMES lz4 liblz4
+        PATHS /lib64 /lib /usr/lib64 /usr/lib /usr/local/lib64 /usr/local/lib /usr/lib/x86_64-linux-gnu
+        )
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("LZ4" DEFAULT_MSG
+        LZ4_INCLUDE_DIR LZ4_LIBRARIES)
+
+mark_as_advanced (LZ4_INCLUDE_DIR LZ4_LIBRARIES)
@@ -0,0 +1,28 @@
+# Find the zstd includes and library
+#
+#  ZSTD_INCLUDE_DIR - where to find zstd.h
+#  ZSTD_LIBRARIES   - List of libraries when using zstd.
+#  ZSTD_FOUND       - True if zstd is found.
+
+# check if already in cache, be silent
+IF (ZSTD_INCLUDE_DIR)
+    SET (ZSTD_FIND_QUIETLY TRUE)
+ENDIF (ZSTD_INCLUDE_DIR)
+
+# find includes
+FIND_PATH (ZSTD_INCLUDE_DIR zstd.h
+        /usr/local/include
+        /usr/include
+        )
+
+# find lib
+FIND_LIBRARY(ZSTD_LIBRARIES
+        NAMES zstd libzstd
+        PATHS /lib64 /lib /usr/lib64 /usr/lib /usr/local/lib64 /usr/local/lib /usr/lib/x86_64-linux-gnu
+        )
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("ZSTD" DEFAULT_MSG
+        ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
+
+mark_as_advanced (ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
@@ -0,0 +1,183 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vali Initrd Filesystem
+ * - Contains the implementation of the Vali Initrd Filesystem.
+ *   This filesystem is used to store the initrd of the kernel.
+ */
+
+#include <errno.h>
+#include "private.h"
+#include <stdlib.h>
+#include <string.h>
+
+// All allocations are aligned to this, which is enough for any of
+// the metadata structures, including the locks embedded in them.
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~((size_t)ARENA_ALIGNMENT - 1))
+
+struct __arena_chunk {
+    struct __arena_chunk* next;
+    size_t                size;
+    size_t                used;
+    uint8_t               data[];
+};
+
+struct VaFsArena {
+    mtx_t                 Lock;
+    size_t                ChunkSize;
+    struct __arena_chunk* Chunks;
+};
+
+int vafs_arena_create(
+    size_t             chunkSize,
+    struct VaFsArena** arenaOut)
+{
+    struct VaFsArena* arena;
+
+    if (chunkSize == 0 || arenaOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    arena = malloc(sizeof(struct VaFsArena));
+    if (!arena) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mtx_init(&arena->Lock, mtx_plain);
+    arena->ChunkSize = ARENA_ALIGN(chunkSize);
+    arena->Chunks    = NULL;
+    *arenaOut = arena;
+    return 0;
+}
+
+void vafs_arena_destroy(
+    struct VaFsArena* arena)
+{
+    struct __arena_chunk* chunk;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    chunk = arena->Chunks;
+    while (chunk) {
+        struct __arena_chunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    mtx_destroy(&arena->Lock);
+    free(arena);
+}
+
+static struct __arena_chunk* __new_chunk(
+    size_t size)
+{
+    struct __arena_chunk* chunk;
+
+    chunk = malloc(ARENA_ALIGN(sizeof(struct __arena_chunk)) + size);
+    if (!chunk) {
+        return NULL;
+    }
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = ARENA_ALIGN(sizeof(struct __arena_chunk)) - sizeof(struct __arena_chunk);
+    return chunk;
+}
+
+static void* __arena_alloc(
+    struct VaFsArena* arena,
+    size_t            size)
+{
+    struct __arena_chunk* chunk;
+    void*                 memory;
+
+    size  = ARENA_ALIGN(size);
+    chunk = arena->Chunks;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        // Large allocations get a chunk of their own, which is put behind the
+        // current chunk, so the space left in the current chunk is not wasted.
+        if (size > arena->ChunkSize / 4) {
+            struct __arena_chunk* large = __new_chunk(size + ARENA_ALIGNMENT);
+            if (!large) {
+                errno = ENOMEM;
+                return NULL;
+            }
+
+            if (chunk) {
+                large->next = chunk->next;
+                chunk->next = large;
+            }
+            else {
+                arena->Chunks = large;
+            }
+            memory = &large->data[large->used];
+            large->used += size;
+            return memory;
+        }
+
+        chunk = __new_chunk(arena->ChunkSize + ARENA_ALIGNMENT);
+        if (!chunk) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        chunk->next   = arena->Chunks;
+        arena->Chunks = chunk;
+    }
+
+    memory = &chunk->data[chunk->used];
+    chunk->used += size;
+    return memory;
+}
+
+void* vafs_arena_alloc(
+    struct VaFsArena* arena,
+    size_t            size)
+{
+    void* memory;
+
+    if (arena == NULL || size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Directories of an image opened for reading are loaded on demand, which
+    // may happen from multiple threads at once.
+    mtx_lock(&arena->Lock);
+    memory = __arena_alloc(arena, size);
+    mtx_unlock(&arena->Lock);
+    return memory;
+}
+
+char* vafs_arena_strndup(
+    struct VaFsArena* arena,
+    const char*       string,
+    size_t            length)
+{
+    char* copy;
+
+    copy = vafs_arena_alloc(arena, length + 1);
+    if (!copy) {
+        return NULL;
+    }
+
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+    return copy;
+}
@@ -0,0 +1,223 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vali Initrd Filesystem
+ * - Contains the implementation of the Vali Initrd Filesystem.
+ *   This filesystem is used to store the initrd of the kernel.
+ */
+
+#include <errno.h>
+#include "private.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct __async_request {
+    struct __async_request* next;
+    struct VaFsFileHandle*  handle;
+    void*                   buffer;
+    size_t                  size;
+    uint64_t                offset;
+    VaFsReadCompleteFunc    callback;
+    void*                   context;
+};
+
+struct VaFsAsyncPool {
+    mtx_t   Lock;
+    cnd_t   Signal;
+    int     Running;
+    thrd_t* Threads;
+    int     ThreadCount;
+
+    // Requests are handled in the order they were queued, there is
+    // no limit on the number of requests in flight.
+    struct __async_request* QueueHead;
+    struct __async_request* QueueTail;
+};
+
+static void __complete_request(
+    struct __async_request* request)
+{
+    size_t bytesRead;
+    int    error = 0;
+
+    bytesRead = vafs_file_read_at(request->handle, request->buffer, request->size, request->offset);
+    if (bytesRead == 0 && request->size != 0 && errno != ENODATA) {
+        error = errno;
+    }
+    request->callback(request->context, bytesRead, error);
+}
+
+static int __async_worker(void* context)
+{
+    struct VaFsAsyncPool*   pool = context;
+    struct __async_request* request;
+
+    mtx_lock(&pool->Lock);
+    while (1) {
+        while (pool->Running && pool->QueueHead == NULL) {
+            cnd_wait(&pool->Signal, &pool->Lock);
+        }
+
+        if (!pool->Running) {
+            break;
+        }
+
+        request = pool->QueueHead;
+        pool->QueueHead = request->next;
+        if (pool->QueueHead == NULL) {
+            pool->QueueTail = NULL;
+        }
+        mtx_unlock(&pool->Lock);
+
+        __complete_request(request);
+        free(request);
+        mtx_lock(&pool->Lock);
+    }
+    mtx_unlock(&pool->Lock);
+    return 0;
+}
+
+int vafs_asyncpool_create(
+    int                    threadCount,
+    struct VaFsAsyncPool** poolOut)
+{
+    struct VaFsAsyncPool* pool;
+    int                   i;
+
+    if (poolOut == NULL || threadCount <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool = malloc(sizeof(struct VaFsAsyncPool));
+    if (!pool) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(pool, 0, sizeof(struct VaFsAsyncPool));
+
+    pool->Threads = malloc(sizeof(thrd_t) * threadCount);
+    if (!pool->Threads) {
+        free(pool);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mtx_init(&pool->Lock, mtx_plain);
+    cnd_init(&pool->Signal);
+    pool->Running = 1;
+
+    for (i = 0; i < threadCount; i++) {
+        if (thrd_create(&pool->Threads[i], __async_worker, pool) != thrd_success) {
+            break;
+        }
+    }
+
+    // Run with the workers that could be started, and only fail if
+    // there are none at all.
+    if (i == 0) {
+        VAFS_ERROR("vafs_asyncpool_create: failed to start any workers\n");
+        cnd_destroy(&pool->Signal);
+        mtx_destroy(&pool->Lock);
+        free(pool->Threads);
+        free(pool);
+        errno = EAGAIN;
+        return -1;
+    }
+    else if (i < threadCount) {
+        VAFS_WARN("vafs_asyncpool_create: only started %i of %i workers\n", i, threadCount);
+    }
+
+    pool->ThreadCount = i;
+    *poolOut = pool;
+    return 0;
+}
+
+void vafs_asyncpool_destroy(
+    struct VaFsAsyncPool* pool)
+{
+    struct __async_request* request;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    // The workers finish the requests they are currently handling, the
+    // rest are completed as cancelled so their callers can clean up.
+    mtx_lock(&pool->Lock);
+    pool->Running = 0;
+    cnd_broadcast(&pool->Signal);
+    mtx_unlock(&pool->Lock);
+
+    for (int i = 0; i < pool->ThreadCount; i++) {
+        thrd_join(pool->Threads[i], NULL);
+    }
+
+    while (pool->QueueHead != NULL) {
+        request = pool->QueueHead;
+        pool->QueueHead = request->next;
+        request->callback(request->context, 0, ECANCELED);
+        free(request);
+    }
+
+    cnd_destroy(&pool->Signal);
+    mtx_destroy(&pool->Lock);
+    free(pool->Threads);
+    free(pool);
+}
+
+int vafs_asyncpool_queue(
+    struct VaFsAsyncPool*  pool,
+    struct VaFsFileHandle* handle,
+    void*                  buffer,
+    size_t                 size,
+    uint64_t               offset,
+    VaFsReadCompleteFunc   callback,
+    void*                  context)
+{
+    struct __async_request* request;
+
+    if (pool == NULL || handle == NULL || callback == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    request = malloc(sizeof(struct __async_request));
+    if (!request) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    request->next     = NULL;
+    request->handle   = handle;
+    request->buffer   = buffer;
+    request->size     = size;
+    request->offset   = offset;
+    request->callback = callback;
+    request->context  = context;
+
+    mtx_lock(&pool->Lock);
+    if (pool->QueueTail != NULL) {
+        pool->QueueTail->next = request;
+    }
+    else {
+        pool->QueueHead = request;
+    }
+    pool->QueueTail = request;
+    cnd_signal(&pool->Signal);
+    mtx_unlock(&pool->Lock);
+    return 0;
+}
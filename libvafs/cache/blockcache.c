@@ -22,42 +22,175 @@
 #include <errno.h>
 #include "blockcache.h"
 #include "hashtable.h"
-#include <limits.h>
+#include <platform.h>
 #include <stdlib.h>
 #include <string.h>
 
+#define SEGMENT_PROBATION 0
+#define SEGMENT_PROTECTED 1
+#define SEGMENT_COUNT     2
+
+// The ghost list is sized after the smallest block size
+// in use, which is the descriptor block size.
+#define GHOST_GRANULARITY (8 * 1024)
+#define GHOST_MIN_COUNT   64
+
 static uint64_t __cache_hash(const void* element);
 static int      __cache_cmp(const void* lh, const void* rh);
-static void     __cache_enum(int index, const void* element, void* userContext);
 static void     __cache_enum_free(int index, const void* element, void* userContext);
 
-static uint64_t __heatmap_hash(const void* element);
-static int      __heatmap_cmp(const void* lh, const void* rh);
+static uint64_t __ghost_hash(const void* element);
+static int      __ghost_cmp(const void* lh, const void* rh);
 
 struct __block_entry {
-    uint32_t index;
-    void*    buffer;
-    size_t   size;
-    int      uses;
+    uint64_t               key;
+    struct VaFsCacheBlock* block;
 };
 
-struct __heatmap_entry {
-    uint32_t index;
+struct __ghost_entry {
+    uint64_t key;
+    uint32_t sequence;
     int      hits;
 };
 
+struct __ghost_slot {
+    uint64_t key;
+    uint32_t sequence;
+};
+
+struct __block_list {
+    struct VaFsCacheBlock* head; // most recently used
+    struct VaFsCacheBlock* tail; // least recently used
+    size_t                 size;
+};
+
+struct __cache_policy_ops {
+    void                   (*insert)(struct VaFsBlockCache* cache, struct VaFsCacheBlock* block);
+    void                   (*hit)(struct VaFsBlockCache* cache, struct VaFsCacheBlock* block);
+    struct VaFsCacheBlock* (*victim)(struct VaFsBlockCache* cache);
+};
+
 struct VaFsBlockCache {
-    int         max_blocks;
-    hashtable_t heatmap;
-    hashtable_t cache;
+    mtx_t                            lock;
+    int                              references;
+    uint32_t                         owners;
+    size_t                           size;
+    size_t                           max_size;
+    size_t                           max_protected;
+    const struct __cache_policy_ops* ops;
+    struct __block_list              segments[SEGMENT_COUNT];
+    hashtable_t                      cache;
+
+    // The ghost list keeps track of recently requested block indices that
+    // are not in the cache. It is a fixed size ring, where the oldest entry
+    // is dropped when a new one is added.
+    hashtable_t                      ghosts;
+    struct __ghost_slot*             ghost_ring;
+    int                              ghost_capacity;
+    int                              ghost_head;
+    int                              ghost_count;
+    uint32_t                         ghost_sequence;
+
+    // Statistics, the evictions are guarded by the cache lock, while waits
+    // on the lock are counted before it is taken.
+    uint64_t                         evictions;
+    atomic_ullong                    contention;
 };
 
-struct cache_enum_context {
-    uint32_t index;
-    int      uses;
+// __cache_lock takes the cache lock on behalf of readers, and counts how
+// often they had to wait for it.
+static void __cache_lock(struct VaFsBlockCache* cache)
+{
+    if (mtx_trylock(&cache->lock) != thrd_success) {
+        atomic_fetch_add_explicit(&cache->contention, 1, memory_order_relaxed);
+        mtx_lock(&cache->lock);
+    }
+}
+
+static void __list_push_front(struct __block_list* list, struct VaFsCacheBlock* block)
+{
+    block->prev = NULL;
+    block->next = list->head;
+    if (list->head) {
+        list->head->prev = block;
+    } else {
+        list->tail = block;
+    }
+    list->head = block;
+    list->size += block->capacity;
+}
+
+static void __list_remove(struct __block_list* list, struct VaFsCacheBlock* block)
+{
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        list->head = block->next;
+    }
+
+    if (block->next) {
+        block->next->prev = block->prev;
+    } else {
+        list->tail = block->prev;
+    }
+    block->prev = NULL;
+    block->next = NULL;
+    list->size -= block->capacity;
+}
+
+static void __lru_insert(struct VaFsBlockCache* cache, struct VaFsCacheBlock* block)
+{
+    block->segment = SEGMENT_PROBATION;
+    __list_push_front(&cache->segments[SEGMENT_PROBATION], block);
+}
+
+static void __lru_hit(struct VaFsBlockCache* cache, struct VaFsCacheBlock* block)
+{
+    __list_remove(&cache->segments[block->segment], block);
+    __list_push_front(&cache->segments[block->segment], block);
+}
+
+static struct VaFsCacheBlock* __lru_victim(struct VaFsBlockCache* cache)
+{
+    return cache->segments[SEGMENT_PROBATION].tail;
+}
+
+static void __slru_hit(struct VaFsBlockCache* cache, struct VaFsCacheBlock* block)
+{
+    struct __block_list* protected = &cache->segments[SEGMENT_PROTECTED];
+    struct VaFsCacheBlock* demoted;
+
+    __list_remove(&cache->segments[block->segment], block);
+    block->segment = SEGMENT_PROTECTED;
+    __list_push_front(protected, block);
+
+    // When the protected segment overflows, the least recently used block
+    // of it gets another chance in the probation segment.
+    while (protected->size > cache->max_protected && protected->tail != block) {
+        demoted = protected->tail;
+        __list_remove(protected, demoted);
+        demoted->segment = SEGMENT_PROBATION;
+        __list_push_front(&cache->segments[SEGMENT_PROBATION], demoted);
+    }
+}
+
+static struct VaFsCacheBlock* __slru_victim(struct VaFsBlockCache* cache)
+{
+    if (cache->segments[SEGMENT_PROBATION].tail) {
+        return cache->segments[SEGMENT_PROBATION].tail;
+    }
+    return cache->segments[SEGMENT_PROTECTED].tail;
+}
+
+static const struct __cache_policy_ops g_lruOps = {
+    __lru_insert, __lru_hit, __lru_victim
+};
+
+static const struct __cache_policy_ops g_slruOps = {
+    __lru_insert, __slru_hit, __slru_victim
 };
 
-struct VaFsBlockCache* __block_cache_new(void)
+struct VaFsBlockCache* __block_cache_new(size_t size)
 {
     struct VaFsBlockCache* cache;
     int                    status;
@@ -66,223 +199,463 @@ struct VaFsBlockCache* __block_cache_new(void)
     if (!cache) {
         return NULL;
     }
-    memset(cache, 0, sizeof(sizeof(struct VaFsBlockCache)));
+    memset(cache, 0, sizeof(struct VaFsBlockCache));
+
+    cache->ghost_capacity = (int)(size / GHOST_GRANULARITY);
+    if (cache->ghost_capacity < GHOST_MIN_COUNT) {
+        cache->ghost_capacity = GHOST_MIN_COUNT;
+    }
+    cache->ghost_ring = malloc(sizeof(struct __ghost_slot) * cache->ghost_capacity);
+    if (!cache->ghost_ring) {
+        free(cache);
+        return NULL;
+    }
     
     status = vafs_hashtable_construct(
         &cache->cache, 0, sizeof(struct __block_entry), 
         __cache_hash, __cache_cmp
     );
     if (status != 0) {
+        free(cache->ghost_ring);
         free(cache);
         return NULL;
     }
 
     status = vafs_hashtable_construct(
-        &cache->heatmap, 0, sizeof(struct __heatmap_entry), 
-        __heatmap_hash, __heatmap_cmp
+        &cache->ghosts, 0, sizeof(struct __ghost_entry), 
+        __ghost_hash, __ghost_cmp
     );
     if (status != 0) {
         vafs_hashtable_destroy(&cache->cache);
+        free(cache->ghost_ring);
         free(cache);
         return NULL;
     }
+
+    mtx_init(&cache->lock, mtx_plain);
+    cache->references = 1;
     return cache;
 }
 
-int vafs_cache_create(int maxBlocks, struct VaFsBlockCache** cacheOut)
+int vafs_cache_create(size_t size, enum VaFsCachePolicy policy, struct VaFsBlockCache** cacheOut)
 {
     struct VaFsBlockCache* cache;
 
-    if (cacheOut == NULL || maxBlocks < 0) {
+    if (cacheOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (policy != VaFsCachePolicy_LRU && policy != VaFsCachePolicy_SLRU) {
         errno = EINVAL;
         return -1;
     }
 
-    cache = __block_cache_new();
+    cache = __block_cache_new(size);
     if (cache == NULL) {
+        errno = ENOMEM;
         return -1;
     }
 
-    cache->max_blocks = maxBlocks;
+    cache->max_size = size;
+    if (policy == VaFsCachePolicy_SLRU) {
+        // Reserve 80% of the cache for blocks that have been hit more than once
+        cache->ops           = &g_slruOps;
+        cache->max_protected = (size / 5) * 4;
+    } else {
+        cache->ops = &g_lruOps;
+    }
 
     *cacheOut = cache;
     return 0;
 }
 
+struct VaFsCacheBlock* vafs_cache_block_new(size_t capacity)
+{
+    struct VaFsCacheBlock* block;
+
+    block = malloc(sizeof(struct VaFsCacheBlock) + capacity);
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    block->key        = 0;
+    block->references = 1;
+    block->capacity   = capacity;
+    block->size       = 0;
+    block->buffer     = (char*)block + sizeof(struct VaFsCacheBlock);
+    block->prefetched = 0;
+    block->segment    = SEGMENT_PROBATION;
+    block->prev       = NULL;
+    block->next       = NULL;
+    return block;
+}
+
+struct VaFsCacheBlock* vafs_cache_block_wrap(const void* data, size_t length)
+{
+    struct VaFsCacheBlock* block;
+
+    block = malloc(sizeof(struct VaFsCacheBlock));
+    if (!block) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    block->key        = 0;
+    block->references = 1;
+    block->capacity   = length;
+    block->size       = length;
+    block->buffer     = (char*)data;
+    block->prefetched = 0;
+    block->segment    = SEGMENT_PROBATION;
+    block->prev       = NULL;
+    block->next       = NULL;
+    return block;
+}
+
+// __block_unref must be called with the cache lock held.
+static void __block_unref(struct VaFsCacheBlock* block)
+{
+    block->references--;
+    if (block->references == 0) {
+        free(block);
+    }
+}
+
+struct VaFsBlockCache* vafs_cache_acquire(struct VaFsBlockCache* cache)
+{
+    if (!cache) {
+        return NULL;
+    }
+
+    mtx_lock(&cache->lock);
+    cache->references++;
+    mtx_unlock(&cache->lock);
+    return cache;
+}
+
+uint32_t vafs_cache_register(struct VaFsBlockCache* cache)
+{
+    uint32_t owner;
+
+    if (!cache) {
+        return 0;
+    }
+
+    mtx_lock(&cache->lock);
+    owner = ++cache->owners;
+    mtx_unlock(&cache->lock);
+    return owner;
+}
+
 void vafs_cache_destroy(struct VaFsBlockCache* cache)
 {
+    int references;
+
     if (!cache) {
         return;
     }
+
+    mtx_lock(&cache->lock);
+    references = --cache->references;
+    mtx_unlock(&cache->lock);
+    if (references) {
+        return;
+    }
     
     vafs_hashtable_enumerate(&cache->cache, __cache_enum_free, NULL);
     vafs_hashtable_destroy(&cache->cache);
-    vafs_hashtable_destroy(&cache->heatmap);
+    vafs_hashtable_destroy(&cache->ghosts);
+    mtx_destroy(&cache->lock);
+    free(cache->ghost_ring);
     free(cache);
 }
 
-static void __heatmap_hit(struct VaFsBlockCache* cache, uint32_t index)
+static void __ghost_touch(struct VaFsBlockCache* cache, uint64_t key)
 {
-    struct __heatmap_entry* entry;
+    struct __ghost_entry* entry;
+    struct __ghost_slot*  slot;
 
-    entry = vafs_hashtable_get(&cache->heatmap, &(struct __heatmap_entry) { .index = index });
+    entry = vafs_hashtable_get(&cache->ghosts, &(struct __ghost_entry) { .key = key });
     if (entry != NULL) {
         entry->hits++;
-    } else {
-        // insert a new entry
-        vafs_hashtable_set(&cache->heatmap, &(struct __heatmap_entry) { .index = index, .hits = 1 });
+        return;
     }
+
+    // Drop the oldest ghost if the ring is full. The slot may be stale if the
+    // ghost was admitted to the cache since, or re-added under a newer sequence.
+    if (cache->ghost_count == cache->ghost_capacity) {
+        slot  = &cache->ghost_ring[cache->ghost_head];
+        entry = vafs_hashtable_get(&cache->ghosts, &(struct __ghost_entry) { .key = slot->key });
+        if (entry != NULL && entry->sequence == slot->sequence) {
+            vafs_hashtable_remove(&cache->ghosts, &(struct __ghost_entry) { .key = slot->key });
+        }
+        cache->ghost_head = (cache->ghost_head + 1) % cache->ghost_capacity;
+        cache->ghost_count--;
+    }
+
+    slot = &cache->ghost_ring[(cache->ghost_head + cache->ghost_count) % cache->ghost_capacity];
+    slot->key      = key;
+    slot->sequence = ++cache->ghost_sequence;
+    cache->ghost_count++;
+    vafs_hashtable_set(&cache->ghosts, &(struct __ghost_entry) {
+        .key      = key,
+        .sequence = slot->sequence,
+        .hits     = 1
+    });
 }
 
-static int __heatmap_hits(struct VaFsBlockCache* cache, uint32_t index)
+static int __ghost_admit(struct VaFsBlockCache* cache, uint64_t key)
 {
-    struct __heatmap_entry* entry = vafs_hashtable_get(&cache->heatmap, &(struct __heatmap_entry) { .index = index });
-    return entry != NULL ? entry->hits : 0;
+    struct __ghost_entry* entry;
+
+    entry = vafs_hashtable_get(&cache->ghosts, &(struct __ghost_entry) { .key = key });
+    if (entry == NULL || entry->hits <= 1) {
+        return 0;
+    }
+    vafs_hashtable_remove(&cache->ghosts, &(struct __ghost_entry) { .key = key });
+    return 1;
 }
 
-int vafs_cache_get(struct VaFsBlockCache* cache, uint32_t index, void** bufferOut, size_t* sizeOut)
+int vafs_cache_get(struct VaFsBlockCache* cache, uint64_t key, struct VaFsCacheBlock** blockOut)
 {
-    struct __block_entry* block;
+    struct __block_entry* entry;
 
-    if (!cache || !bufferOut || !sizeOut) {
+    if (!cache || !blockOut) {
         errno = EINVAL;
         return -1;
     }
 
-    // Mark the index hit, we use this to decide which blocks we will use and which
-    // we won't be caching. If the user is extracting the entire vafs image, then it 
-    // makes no sense to spend resources caching it. So a block index *must* have atleast
-    // two hits before we cache it.
-    __heatmap_hit(cache, index);
-
-    block = vafs_hashtable_get(&cache->cache, &(struct __block_entry){ .index = index });
-    if (!block) {
+    __cache_lock(cache);
+    entry = vafs_hashtable_get(&cache->cache, &(struct __block_entry){ .key = key });
+    if (!entry) {
+        // Mark the index in the ghost list, we use this to decide which blocks we will
+        // cache. If the user is extracting the entire vafs image, then it makes no sense
+        // to spend resources caching it. So a block index *must* be requested atleast
+        // twice while it is still in the ghost list before we cache it.
+        if (cache->max_size > 0) {
+            __ghost_touch(cache, key);
+        }
+        mtx_unlock(&cache->lock);
         errno = ENOENT;
         return -1;
     }
 
-    // Increase it's use count, this is different from the heatmap, and we use
-    // this count to decide which buffer we evict from the cache.
-    block->uses++;
+    // The first hit on a prefetched block is the first real use of it, so it
+    // must not be promoted like a block that is reused.
+    if (entry->block->prefetched) {
+        entry->block->prefetched = 0;
+        __lru_hit(cache, entry->block);
+    }
+    else {
+        cache->ops->hit(cache, entry->block);
+    }
 
-    // provide the user with the stored values.
-    *bufferOut = block->buffer;
-    *sizeOut = block->size;
+    // pin the block for the caller, it stays valid even if it gets
+    // evicted before the caller releases it.
+    entry->block->references++;
+    *blockOut = entry->block;
+    mtx_unlock(&cache->lock);
     return 0;
 }
 
-static void __eject_lowuse(struct VaFsBlockCache* cache)
+void vafs_cache_release(struct VaFsBlockCache* cache, struct VaFsCacheBlock* block)
+{
+    if (!cache || !block) {
+        return;
+    }
+
+    __cache_lock(cache);
+    __block_unref(block);
+    mtx_unlock(&cache->lock);
+}
+
+void vafs_cache_purge(struct VaFsBlockCache* cache, uint32_t owner)
 {
-    struct cache_enum_context context = { .index = UINT_MAX, .uses = INT_MAX };
-    struct __block_entry*     block;
+    struct VaFsCacheBlock* block;
+    struct VaFsCacheBlock* next;
 
-    if (cache->cache.element_count < cache->max_blocks) {
+    if (!cache) {
         return;
     }
 
-    vafs_hashtable_enumerate(&cache->cache, __cache_enum, &context);
-    if (context.index == UINT_MAX) {
-        return; // what?
+    mtx_lock(&cache->lock);
+    for (int i = 0; i < SEGMENT_COUNT; i++) {
+        block = cache->segments[i].head;
+        while (block) {
+            next = block->next;
+            if ((uint32_t)(block->key >> 32) == owner) {
+                __list_remove(&cache->segments[i], block);
+                cache->size -= block->capacity;
+                vafs_hashtable_remove(&cache->cache, &(struct __block_entry){ .key = block->key });
+                __block_unref(block);
+            }
+            block = next;
+        }
     }
-    
-    block = vafs_hashtable_remove(&cache->cache, &(struct __block_entry){ .index = context.index });
-    if (!block) {
+    mtx_unlock(&cache->lock);
+}
+
+static void __evict(struct VaFsBlockCache* cache, size_t size)
+{
+    struct VaFsCacheBlock* victim;
+
+    while (cache->size + size > cache->max_size) {
+        victim = cache->ops->victim(cache);
+        if (victim == NULL) {
+            return;
+        }
+
+        __list_remove(&cache->segments[victim->segment], victim);
+        cache->size -= victim->capacity;
+        vafs_hashtable_remove(&cache->cache, &(struct __block_entry){ .key = victim->key });
+
+        // Remember the evicted block, so it is readmitted right away if it
+        // turns out that it is still in use.
+        __ghost_touch(cache, victim->key);
+        __block_unref(victim);
+        cache->evictions++;
+    }
+}
+
+void vafs_cache_get_stats(struct VaFsBlockCache* cache, uint64_t* evictionsOut, uint64_t* contentionOut)
+{
+    if (!cache) {
+        *evictionsOut  = 0;
+        *contentionOut = 0;
         return;
     }
 
-    free(block->buffer);
+    mtx_lock(&cache->lock);
+    *evictionsOut = cache->evictions;
+    mtx_unlock(&cache->lock);
+    *contentionOut = atomic_load_explicit(&cache->contention, memory_order_relaxed);
 }
 
-static void* __memdup(const void* src, size_t size)
+int vafs_cache_contains(struct VaFsBlockCache* cache, uint64_t key)
 {
-    void* dst;
+    int present;
 
-    dst = malloc(size);
-    if (!dst) {
-        return NULL;
+    if (!cache) {
+        return 0;
     }
 
-    memcpy(dst, src, size);
-    return dst;
+    __cache_lock(cache);
+    present = vafs_hashtable_get(&cache->cache, &(struct __block_entry){ .key = key }) != NULL;
+    mtx_unlock(&cache->lock);
+    return present;
 }
 
-int vafs_cache_set(struct VaFsBlockCache* cache, uint32_t index, void* buffer, size_t size)
+// __cache_insert must be called with the cache lock held.
+static void __cache_insert(struct VaFsBlockCache* cache, uint64_t key, struct VaFsCacheBlock* block)
 {
-    struct __block_entry* block;
+    // Ensure we stay below our size limitation
+    __evict(cache, block->capacity);
+
+    // Store the new entry, the cache keeps its own reference to the block
+    // so no copy of the block data is needed.
+    block->key = key;
+    block->references++;
+    cache->ops->insert(cache, block);
+    cache->size += block->capacity;
+    vafs_hashtable_set(&cache->cache, &(struct __block_entry){ 
+        .key = key,
+        .block = block
+    });
+}
 
-    if (!cache || !buffer) {
+int vafs_cache_prefetch(struct VaFsBlockCache* cache, uint64_t key, struct VaFsCacheBlock* block)
+{
+    if (!cache || !block) {
         errno = EINVAL;
         return -1;
     }
 
-    // First and foremost, make sure that we actually want to cache this
-    // entry to ensure it has enough hits.
-    if (__heatmap_hits(cache, index) <= 1) {
-        // let's not cache blocks that are only used once
+    if (block->capacity > cache->max_size) {
         return 0;
     }
 
-    // Ensure that the block doesn't already exist in the system.
-    block = vafs_hashtable_get(&cache->cache, &(struct __block_entry){ .index = index });
-    if (block != NULL) {
-        errno = EEXIST;
+    __cache_lock(cache);
+    if (vafs_hashtable_get(&cache->cache, &(struct __block_entry){ .key = key }) == NULL) {
+        block->prefetched = 1;
+        __cache_insert(cache, key, block);
+    }
+    mtx_unlock(&cache->lock);
+    return 0;
+}
+
+int vafs_cache_set(struct VaFsBlockCache* cache, uint64_t key, struct VaFsCacheBlock* block)
+{
+    struct __block_entry* entry;
+
+    if (!cache || !block) {
+        errno = EINVAL;
         return -1;
     }
 
-    // Ensure we stay below our max blocks limitation, by ejecting blocks that
-    // are least used in the cache.
-    __eject_lowuse(cache);
+    // Blocks that are larger than the entire cache are never admitted
+    if (block->capacity > cache->max_size) {
+        return 0;
+    }
+
+    __cache_lock(cache);
 
-    // Store the new entry, and we dublicate the memory to ensure that we own
-    // the cached memory.
-    vafs_hashtable_set(&cache->cache, &(struct __block_entry){ 
-        .index  = index,
-        .buffer = __memdup(buffer, size),
-        .size   = size,
-        .uses   = 1
-    });
+    // Ensure that the block doesn't already exist in the system. This can
+    // happen if two readers loaded the same block at the same time.
+    entry = vafs_hashtable_get(&cache->cache, &(struct __block_entry){ .key = key });
+    if (entry != NULL) {
+        mtx_unlock(&cache->lock);
+        return 0;
+    }
+
+    // Make sure that we actually want to cache this entry, blocks
+    // that are only used once are not cached.
+    if (!__ghost_admit(cache, key)) {
+        mtx_unlock(&cache->lock);
+        return 0;
+    }
+
+    __cache_insert(cache, key, block);
+    mtx_unlock(&cache->lock);
     return 0;
 }
 
+// Keys have the owner in the upper bits, which the hashtable does not look
+// at, so fold it into the lower bits to spread out blocks of multiple owners.
+static inline uint64_t __key_hash(uint64_t key)
+{
+    return (key & 0xFFFFFFFF) ^ ((key >> 32) * 0x9E3779B1);
+}
+
 uint64_t __cache_hash(const void* element)
 {
     const struct __block_entry* block = element;
-    return block->index;
+    return __key_hash(block->key);
 }
 
 int __cache_cmp(const void* lh, const void* rh)
 {
     const struct __block_entry* lblock = lh;
     const struct __block_entry* rblock = rh;
-    return lblock->index == rblock->index ? 0 : -1;
-}
-
-void __cache_enum(int index, const void* element, void* userContext)
-{
-    const struct __block_entry*   block   = element;
-    struct cache_enum_context* context = userContext;
-    
-    if (block->uses < context->uses) {
-        context->index = block->index;
-        context->uses  = block->uses;
-    }
+    return lblock->key == rblock->key ? 0 : -1;
 }
 
 void __cache_enum_free(int index, const void* element, void* userContext)
 {
-    const struct __block_entry* block = element;
-    free(block->buffer);
+    const struct __block_entry* entry = element;
+    __block_unref(entry->block);
 }
 
-uint64_t __heatmap_hash(const void* element)
+uint64_t __ghost_hash(const void* element)
 {
-    const struct __heatmap_entry* block = element;
-    return block->index;
+    const struct __ghost_entry* ghost = element;
+    return __key_hash(ghost->key);
 }
 
-int __heatmap_cmp(const void* lh, const void* rh)
+int __ghost_cmp(const void* lh, const void* rh)
 {
-    const struct __heatmap_entry* lblock = lh;
-    const struct __heatmap_entry* rblock = rh;
-    return lblock->index == rblock->index ? 0 : -1;
+    const struct __ghost_entry* lghost = lh;
+    const struct __ghost_entry* rghost = rh;
+    return lghost->key == rghost->key ? 0 : -1;
 }
@@ -25,46 +25,146 @@
 #include <stdint.h>
 #include <stddef.h>
 
-struct VaFsBlockCache;
+#include <vafs.h>
 
 /**
- * @brief Creates a new block cache, that contains the N most-used blocks. The cache
- * will cache a maximum of @maxBlocks blocks, after this, the cache will start evicting
- * the least-used blocks.
+ * The block cache is created and destroyed through the public vafs_cache_create
+ * and vafs_cache_destroy functions, see vafs.h. Blocks are identified by a 64 bit key,
+ * where the upper 32 bits identifies the owner of the block (see vafs_cache_register),
+ * and the lower 32 bits the index of the block. This allows multiple streams to share
+ * the same cache.
+ */
+#define VAFS_CACHE_KEY(owner, index) (((uint64_t)(owner) << 32) | (uint32_t)(index))
+
+/**
+ * @brief Cache blocks are reference counted, which allows the cache and any number
+ * of readers to share the same decoded block without copying it. A block is freed
+ * when the last reference is released, which means a block that is evicted from the
+ * cache stays valid for as long as a reader has it pinned. The contents of a block
+ * must not be modified once it has been handed to the cache.
+ */
+struct VaFsCacheBlock {
+    uint64_t key;
+    int      references;
+    size_t   capacity;
+    size_t   size;
+    char*    buffer;
+
+    // Used by the cache to track the block in the
+    // eviction lists, must not be touched by users.
+    int                    prefetched;
+    int                    segment;
+    struct VaFsCacheBlock* prev;
+    struct VaFsCacheBlock* next;
+};
+
+/**
+ * @brief Takes a new reference on the cache, the reference must be released again with
+ * vafs_cache_destroy.
  * 
- * @param[In]  maxBlocks The maximum number of blocks to cache.
- * @param[Out] cacheOut  A pointer to store the newly malloc'd cache.
- * @return int 0 on success, -1 on failure, errno will be set accordingly.
+ * @param[In] cache The cache to reference.
+ * @return struct VaFsBlockCache* The cache that was passed.
+ */
+extern struct VaFsBlockCache* vafs_cache_acquire(struct VaFsBlockCache* cache);
+
+/**
+ * @brief Registers a new owner of blocks in the cache. The returned id is unique for the
+ * lifetime of the cache, and should be used in the upper 32 bits of all keys used by the owner.
+ * 
+ * @param[In] cache The cache to register a new owner in.
+ * @return uint32_t The unique owner id.
+ */
+extern uint32_t vafs_cache_register(struct VaFsBlockCache* cache);
+
+/**
+ * @brief Removes all blocks that belong to the owner from the cache. Blocks that are pinned
+ * by readers stay valid until they are released.
+ * 
+ * @param[In] cache The cache to remove blocks from.
+ * @param[In] owner The owner id returned by vafs_cache_register.
+ */
+extern void vafs_cache_purge(struct VaFsBlockCache* cache, uint32_t owner);
+
+/**
+ * @brief Allocates a new block that can hold up to @capacity bytes. The caller
+ * holds the only reference to the block.
+ * 
+ * @param[In] capacity The size of the block buffer.
+ * @return struct VaFsCacheBlock* The new block, or NULL if the allocation failed.
  */
-extern int vafs_cache_create(int maxBlocks, struct VaFsBlockCache** cacheOut);
+extern struct VaFsCacheBlock* vafs_cache_block_new(size_t capacity);
 
 /**
- * @brief Destroys the blocks cache and frees any resources allocated.
+ * @brief Allocates a new block that refers to existing data instead of owning a buffer, like
+ * data in a mapped image file. The data must stay valid for as long as the block is referenced,
+ * and is never written to. The caller holds the only reference to the block.
  * 
- * @param[In] cache The cache to destroy. 
+ * @param[In] data   The data the block should refer to.
+ * @param[In] length The length of the data.
+ * @return struct VaFsCacheBlock* The new block, or NULL if the allocation failed.
  */
-extern void vafs_cache_destroy(struct VaFsBlockCache* cache);
+extern struct VaFsCacheBlock* vafs_cache_block_wrap(const void* data, size_t length);
 
 /**
- * @brief Retrieves a block from the cache.
+ * @brief Retrieves a block from the cache. The block is pinned on behalf of the caller,
+ * and must be released again with vafs_cache_release.
  * 
- * @param[In]  cache     The cache to retrieve the block from. 
- * @param[In]  index     The index of the block to retrieve.
- * @param[Out] bufferOut A pointer where a buffer pointer will be stored. 
- * @param[Out] sizeOut   A pointer where the size of the block will be stored.
+ * @param[In]  cache    The cache to retrieve the block from. 
+ * @param[In]  key      The key of the block to retrieve.
+ * @param[Out] blockOut A pointer where the pinned block will be stored.
  * @return int 0 on success, -1 on failure, errno will be set accordingly. 
  */
-extern int vafs_cache_get(struct VaFsBlockCache* cache, uint32_t index, void** bufferOut, size_t* sizeOut);
+extern int vafs_cache_get(struct VaFsBlockCache* cache, uint64_t key, struct VaFsCacheBlock** blockOut);
+
+/**
+ * @brief Offers a block to the cache. If the cache decides to keep the block, it takes its
+ * own reference to it, the callers reference is not affected.
+ * 
+ * @param[In] cache The cache to store the block in. 
+ * @param[In] key   The key of the block to store.
+ * @param[In] block The block to store.
+ * @return int 0 on success, -1 on failure, errno will be set accordingly.
+ */
+extern int vafs_cache_set(struct VaFsBlockCache* cache, uint64_t key, struct VaFsCacheBlock* block);
+
+/**
+ * @brief Checks whether a block is present in the cache, without counting it
+ * as a request for the block.
+ * 
+ * @param[In] cache The cache to check.
+ * @param[In] key   The key of the block.
+ * @return int 1 if the block is present, otherwise 0.
+ */
+extern int vafs_cache_contains(struct VaFsBlockCache* cache, uint64_t key);
+
+/**
+ * @brief Stores a block that was loaded ahead of being requested. The block bypasses the
+ * admission check, and the first hit on it is not counted as a reuse of the block. Like
+ * vafs_cache_set, the cache takes its own reference to the block.
+ * 
+ * @param[In] cache The cache to store the block in.
+ * @param[In] key   The key of the block to store.
+ * @param[In] block The block to store.
+ * @return int 0 on success, -1 on failure, errno will be set accordingly.
+ */
+extern int vafs_cache_prefetch(struct VaFsBlockCache* cache, uint64_t key, struct VaFsCacheBlock* block);
+
+/**
+ * @brief Releases a reference to a block previously retrieved with vafs_cache_get, or
+ * allocated with vafs_cache_block_new.
+ * 
+ * @param[In] cache The cache the block belongs to.
+ * @param[In] block The block to release.
+ */
+extern void vafs_cache_release(struct VaFsBlockCache* cache, struct VaFsCacheBlock* block);
 
 /**
- * @brief Stores a block in the cache.
+ * @brief Retrieves the statistics of the cache, which cover all owners of the cache.
  * 
- * @param[In] cache  The cache to store the block in. 
- * @param[In] index  The index of the block to store.
- * @param[In] buffer The buffer to store, a copy of it will be created and managed by the cache.
- * @param[In] size   The size of the buffer.
- * @return int 
+ * @param[In]  cache         The cache to retrieve the statistics of, may be NULL.
+ * @param[Out] evictionsOut  Receives the number of blocks evicted from the cache.
+ * @param[Out] contentionOut Receives the number of times a reader waited for the cache lock.
  */
-extern int vafs_cache_set(struct VaFsBlockCache* cache, uint32_t index, void* buffer, size_t size);
+extern void vafs_cache_get_stats(struct VaFsBlockCache* cache, uint64_t* evictionsOut, uint64_t* contentionOut);
 
 #endif //!__VAFS_BLOCKCACHE_CACHE_H__
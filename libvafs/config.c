@@ -29,8 +29,10 @@ void vafs_config_initialize(struct VaFsConfiguration* configuration)
         return;
     }
 
-    configuration->Architecture  = VaFsArchitecture_UNKNOWN;
-    configuration->DataBlockSize = VA_FS_DATA_DEFAULT_BLOCKSIZE;
+    configuration->Architecture   = VaFsArchitecture_UNKNOWN;
+    configuration->DataBlockSize  = VA_FS_DATA_DEFAULT_BLOCKSIZE;
+    configuration->EncoderThreads = 1;
+    configuration->FeatureReserve = 0;
 }
 
 void vafs_config_set_architecture(struct VaFsConfiguration* configuration, enum VaFsArchitecture architecture)
@@ -55,3 +57,32 @@ void vafs_config_set_block_size(struct VaFsConfiguration* configuration, uint32_
 
     configuration->DataBlockSize = blockSize;
 }
+
+void vafs_config_set_encoder_threads(struct VaFsConfiguration* configuration, int threadCount)
+{
+    if (configuration == NULL) {
+        return;
+    }
+
+    if (threadCount < 1) {
+        VAFS_ERROR("Invalid number of encoder threads: %d", threadCount);
+        return;
+    }
+
+    configuration->EncoderThreads = threadCount;
+}
+
+void vafs_config_set_direct_write(struct VaFsConfiguration* configuration, uint32_t featureReserve)
+{
+    if (configuration == NULL) {
+        return;
+    }
+
+    // the overview is always written, so the reserve must at least hold that
+    if (featureReserve != 0 && featureReserve < sizeof(struct VaFsFeatureOverview)) {
+        VAFS_ERROR("Invalid feature reserve: %u", featureReserve);
+        return;
+    }
+
+    configuration->FeatureReserve = featureReserve;
+}
@@ -20,8 +20,237 @@
  */
 
 #include "crc.h"
+#include <string.h>
 
-static uint32_t g_crcTable[256] = { 0 };
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define __CRC32C_SSE42
+#define __CRC32_PCLMUL
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define __CRC32C_ARMV8
+#endif
+
+typedef uint32_t (*crc32c_func)(uint32_t, const uint8_t*, size_t);
+typedef uint32_t (*crc32_func)(uint32_t, const uint8_t*, size_t);
+
+// The tables for slice-by-8, table 0 is the regular bytewise table, and
+// table k holds the crc of a byte followed by k zero bytes.
+static uint32_t g_crcTable[8][256] = { { 0 } };
+
+// The same tables for CRC-32C, which is least significant bit first
+static uint32_t g_crc32cTable[8][256] = { { 0 } };
+
+static uint32_t __crc32c_software(uint32_t, const uint8_t*, size_t);
+static crc32c_func g_crc32c = __crc32c_software;
+
+static uint32_t __crc32_software(uint32_t, const uint8_t*, size_t);
+static crc32_func g_crc32 = __crc32_software;
+
+static inline uint32_t
+__load_le32(
+    const uint8_t* data)
+{
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+           ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint32_t
+__crc32c_software(
+    uint32_t       accumulator,
+    const uint8_t* data,
+    size_t         length)
+{
+    while (length >= 8) {
+        uint32_t low  = accumulator ^ __load_le32(data);
+        uint32_t high = __load_le32(data + 4);
+        accumulator = g_crc32cTable[7][low & 0xFF] ^ g_crc32cTable[6][(low >> 8) & 0xFF] ^
+                      g_crc32cTable[5][(low >> 16) & 0xFF] ^ g_crc32cTable[4][low >> 24] ^
+                      g_crc32cTable[3][high & 0xFF] ^ g_crc32cTable[2][(high >> 8) & 0xFF] ^
+                      g_crc32cTable[1][(high >> 16) & 0xFF] ^ g_crc32cTable[0][high >> 24];
+        data   += 8;
+        length -= 8;
+    }
+
+    while (length--) {
+        accumulator = (accumulator >> 8) ^ g_crc32cTable[0][(accumulator ^ *data++) & 0xFF];
+    }
+    return accumulator;
+}
+
+static inline uint32_t
+__load_be32(
+    const uint8_t* data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+           ((uint32_t)data[2] << 8)  | (uint32_t)data[3];
+}
+
+static uint32_t
+__crc32_software(
+    uint32_t       accumulator,
+    const uint8_t* data,
+    size_t         length)
+{
+    // Consume 8 bytes at the time, the crc is most significant bit first, so
+    // the first byte of the input is combined with the top byte of the crc.
+    while (length >= 8) {
+        uint32_t high = accumulator ^ __load_be32(data);
+        uint32_t low  = __load_be32(data + 4);
+        accumulator = g_crcTable[7][high >> 24] ^ g_crcTable[6][(high >> 16) & 0xFF] ^
+                      g_crcTable[5][(high >> 8) & 0xFF] ^ g_crcTable[4][high & 0xFF] ^
+                      g_crcTable[3][low >> 24] ^ g_crcTable[2][(low >> 16) & 0xFF] ^
+                      g_crcTable[1][(low >> 8) & 0xFF] ^ g_crcTable[0][low & 0xFF];
+        data   += 8;
+        length -= 8;
+    }
+
+    // Iterate each remaining byte and accumulate crc
+    while (length--) {
+        accumulator = (accumulator << 8) ^ g_crcTable[0][((accumulator >> 24) ^ *data++) & 0xFF];
+    }
+    return accumulator;
+}
+
+#if defined(__CRC32_PCLMUL)
+// The folding constants, x^n mod P for the distances folded over. The low
+// quadword multiplies the low half of a block, the high quadword the high half.
+static uint64_t g_crcFold128[2];
+static uint64_t g_crcFold512[2];
+
+static uint64_t
+__xpow_mod(
+    unsigned int n)
+{
+    uint64_t remainder = 1;
+
+    while (n--) {
+        remainder <<= 1;
+        if (remainder & 0x100000000ULL) {
+            remainder ^= 0x100000000ULL | POLYNOMIAL;
+        }
+    }
+    return remainder;
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i
+__crc32_fold(
+    __m128i block,
+    __m128i constants)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(block, constants, 0x00),
+                         _mm_clmulepi64_si128(block, constants, 0x11));
+}
+
+// Blocks are byte reversed on load, so bit 127 of a register is the first
+// bit of the message, and carry-less products need no further adjustment.
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i
+__crc32_load(
+    const uint8_t* data)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), reverse);
+}
+
+// Folds the message 64 bytes at the time into four 128-bit lanes, which are
+// congruent to the message modulo the polynomial, so the crc of the folded
+// remainder followed by the unfolded tail is the crc of the whole message.
+__attribute__((target("pclmul,ssse3")))
+static uint32_t
+__crc32_pclmul(
+    uint32_t       accumulator,
+    const uint8_t* data,
+    size_t         length)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i       fold128 = _mm_set_epi64x((long long)g_crcFold128[1], (long long)g_crcFold128[0]);
+    __m128i       fold512 = _mm_set_epi64x((long long)g_crcFold512[1], (long long)g_crcFold512[0]);
+    __m128i       x0, x1, x2, x3;
+    uint8_t       remainder[16];
+
+    if (length < 64) {
+        return __crc32_software(accumulator, data, length);
+    }
+
+    x0 = _mm_xor_si128(__crc32_load(data), _mm_set_epi32((int)accumulator, 0, 0, 0));
+    x1 = __crc32_load(data + 16);
+    x2 = __crc32_load(data + 32);
+    x3 = __crc32_load(data + 48);
+    data   += 64;
+    length -= 64;
+
+    while (length >= 64) {
+        x0 = _mm_xor_si128(__crc32_fold(x0, fold512), __crc32_load(data));
+        x1 = _mm_xor_si128(__crc32_fold(x1, fold512), __crc32_load(data + 16));
+        x2 = _mm_xor_si128(__crc32_fold(x2, fold512), __crc32_load(data + 32));
+        x3 = _mm_xor_si128(__crc32_fold(x3, fold512), __crc32_load(data + 48));
+        data   += 64;
+        length -= 64;
+    }
+
+    x1 = _mm_xor_si128(__crc32_fold(x0, fold128), x1);
+    x2 = _mm_xor_si128(__crc32_fold(x1, fold128), x2);
+    x3 = _mm_xor_si128(__crc32_fold(x2, fold128), x3);
+    while (length >= 16) {
+        x3 = _mm_xor_si128(__crc32_fold(x3, fold128), __crc32_load(data));
+        data   += 16;
+        length -= 16;
+    }
+
+    _mm_storeu_si128((__m128i*)remainder, _mm_shuffle_epi8(x3, reverse));
+    accumulator = __crc32_software(0, remainder, sizeof(remainder));
+    return __crc32_software(accumulator, data, length);
+}
+#endif
+
+#if defined(__CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static uint32_t
+__crc32c_sse42(
+    uint32_t       accumulator,
+    const uint8_t* data,
+    size_t         length)
+{
+    uint64_t wide = accumulator;
+
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(uint64_t));
+        wide    = _mm_crc32_u64(wide, word);
+        data   += 8;
+        length -= 8;
+    }
+
+    accumulator = (uint32_t)wide;
+    while (length--) {
+        accumulator = _mm_crc32_u8(accumulator, *data++);
+    }
+    return accumulator;
+}
+#elif defined(__CRC32C_ARMV8)
+static uint32_t
+__crc32c_armv8(
+    uint32_t       accumulator,
+    const uint8_t* data,
+    size_t         length)
+{
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(uint64_t));
+        accumulator = __crc32cd(accumulator, word);
+        data   += 8;
+        length -= 8;
+    }
+
+    while (length--) {
+        accumulator = __crc32cb(accumulator, *data++);
+    }
+    return accumulator;
+}
+#endif
 
 void
 crc_init(void)
@@ -39,8 +268,50 @@ crc_init(void)
                 accumulator = (accumulator << 1);
             }
         }
-        g_crcTable[i] = accumulator;
+        g_crcTable[0][i] = accumulator;
+    }
+
+    for (i = 0; i < 256; i++) {
+        accumulator = g_crcTable[0][i];
+        for (j = 1; j < 8; j++) {
+            accumulator = (accumulator << 8) ^ g_crcTable[0][accumulator >> 24];
+            g_crcTable[j][i] = accumulator;
+        }
+    }
+
+    for (i = 0; i < 256; i++) {
+        accumulator = (uint32_t)i;
+        for (j = 0; j < 8; j++) {
+            accumulator = (accumulator >> 1) ^ (POLYNOMIAL_CASTAGNOLI & (0 - (accumulator & 1)));
+        }
+        g_crc32cTable[0][i] = accumulator;
+    }
+
+    for (i = 0; i < 256; i++) {
+        accumulator = g_crc32cTable[0][i];
+        for (j = 1; j < 8; j++) {
+            accumulator = (accumulator >> 8) ^ g_crc32cTable[0][accumulator & 0xFF];
+            g_crc32cTable[j][i] = accumulator;
+        }
+    }
+
+#if defined(__CRC32_PCLMUL)
+    g_crcFold128[0] = __xpow_mod(128);
+    g_crcFold128[1] = __xpow_mod(192);
+    g_crcFold512[0] = __xpow_mod(512);
+    g_crcFold512[1] = __xpow_mod(576);
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+        g_crc32 = __crc32_pclmul;
+    }
+#endif
+
+#if defined(__CRC32C_SSE42)
+    if (__builtin_cpu_supports("sse4.2")) {
+        g_crc32c = __crc32c_sse42;
     }
+#elif defined(__CRC32C_ARMV8)
+    g_crc32c = __crc32c_armv8;
+#endif
 }
 
 uint32_t
@@ -49,13 +320,14 @@ crc_calculate(
     uint8_t* data, 
     size_t   length)
 {
-    size_t i, j;
+    return ~g_crc32(accumulator, data, length);
+}
 
-    // Iterate each byte and accumulate crc
-    for (j = 0; j < length; j++) {
-        i = ((int) (accumulator >> 24) ^ *data++) & 0xFF;
-        accumulator = (accumulator << 8) ^ g_crcTable[i];
-    }
-    accumulator = ~accumulator;
-    return accumulator;
+uint32_t
+crc32c_calculate(
+    uint32_t    accumulator,
+    const void* data,
+    size_t      length)
+{
+    return ~g_crc32c(accumulator, (const uint8_t*)data, length);
 }
@@ -24,9 +24,11 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <vafs/vafs.h>
 
 #define CRC_BEGIN  0xFFFFFFFF
 #define POLYNOMIAL 0x04c11db7L      // Standard CRC-32 ppolynomial
+#define POLYNOMIAL_CASTAGNOLI 0x82f63b78L // CRC-32C polynomial, reflected
 
 /**
  * @brief 
@@ -49,4 +51,39 @@ crc_calculate(
     uint8_t* data, 
     size_t   length);
 
+/**
+ * @brief Calculates the CRC-32C (Castagnoli) of the data. The crc instructions of the
+ * processor are used when they are available, which is detected by crc_init.
+ * 
+ * @param accumulator The initial value, CRC_BEGIN for a new checksum.
+ * @param data        The data to calculate the checksum of.
+ * @param length      The number of bytes of data.
+ * @return uint32_t   The final checksum.
+ */
+extern uint32_t
+crc32c_calculate(
+    uint32_t    accumulator, 
+    const void* data, 
+    size_t      length);
+
+/**
+ * @brief Calculates the checksum of a block with the checksum algorithm of the image.
+ * 
+ * @param algorithm The checksum algorithm, one of enum VaFsChecksum.
+ * @param data      The block data to calculate the checksum of.
+ * @param length    The number of bytes of data.
+ * @return uint32_t The checksum of the block.
+ */
+static inline uint32_t
+crc_block_checksum(
+    uint32_t    algorithm,
+    const void* data,
+    size_t      length)
+{
+    if (algorithm == VaFsChecksum_CRC32C) {
+        return crc32c_calculate(CRC_BEGIN, data, length);
+    }
+    return crc_calculate(CRC_BEGIN, (uint8_t*)data, length);
+}
+
 #endif //!__CRC_H__
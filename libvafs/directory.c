@@ -24,12 +24,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vafs/directory.h>
+#include <vafs/stat.h>
 
 struct VaFsDirectoryHandle {
-    struct VaFsDirectory* Directory;
-    int                   Index;
+    struct VaFsDirectory*      Directory;
+
+    // The entry that was returned last, the next read continues from
+    // its link instead of walking the list from the start again.
+    struct VaFsDirectoryEntry* Last;
 };
 
+struct __index_entry {
+    uint64_t                   hash;
+    const char*                name;
+    struct VaFsDirectoryEntry* entry;
+};
+
+static uint64_t __index_hash(const void* element);
+static int      __index_cmp(const void* lh, const void* rh);
+
 static void __initialize_file_descriptor(
     VaFsFileDescriptor_t* descriptor,
     uint32_t              permissions)
@@ -76,7 +89,7 @@ int vafs_directory_create_root(
         return -1;
     }
     
-    directory = malloc(sizeof(struct VaFsDirectoryWriter));
+    directory = vafs_arena_alloc(vafs->Arena, sizeof(struct VaFsDirectoryWriter));
     if (!directory) {
         errno = ENOMEM;
         return -1;
@@ -84,7 +97,7 @@ int vafs_directory_create_root(
     memset(directory, 0, sizeof(struct VaFsDirectoryWriter));
 
     directory->Base.VaFs = vafs;
-    directory->Base.Name = strdup("root");
+    directory->Base.Name = "root";
 
     // rwxrwxr-x
     __initialize_directory_descriptor(&directory->Base.Descriptor, 0775);
@@ -93,40 +106,21 @@ int vafs_directory_create_root(
     return 0;
 }
 
-static void __directory_entry_destroy(struct VaFsDirectoryEntry* entry)
+// Releases the resources owned by a directory reader and its loaded
+// subdirectories. The entries themselves live in the arena of the image.
+static void __directory_reader_release(struct VaFsDirectoryReader* reader)
 {
-    switch (entry->Type) {
-        case VaFsEntryType_Directory:
-            vafs_directory_destroy(entry->Directory);
-            break;
-        case VaFsEntryType_File:
-            vafs_file_destroy(entry->File);
-            break;
-        case VaFsEntryType_Symlink:
-            vafs_symlink_destroy(entry->Symlink);
-            break;
-    }
-    free(entry);
-}
+    struct VaFsDirectoryEntry* i;
 
-static void __cleanup_directory_entries(struct VaFsDirectoryEntry* entries)
-{
-    struct VaFsDirectoryEntry* i = entries;
-    while (i) {
-        struct VaFsDirectoryEntry* next = i->Link;
-        __directory_entry_destroy(i);
-        i = next;
+    vafs_hashtable_destroy(&reader->Index);
+    for (i = reader->Entries; i != NULL; i = i->Link) {
+        if (i->Type == VaFsEntryType_Directory) {
+            struct VaFsDirectoryReader* child = (struct VaFsDirectoryReader*)i->Directory;
+            __directory_reader_release(child);
+            mtx_destroy(&child->Lock);
+        }
     }
-}
-
-static void __directory_reader_destroy(struct VaFsDirectoryReader* reader)
-{
-    __cleanup_directory_entries(reader->Entries);
-}
-
-static void __directory_writer_destroy(struct VaFsDirectoryWriter* writer)
-{
-    __cleanup_directory_entries(writer->Entries);
+    reader->Entries = NULL;
 }
 
 void vafs_directory_destroy(struct VaFsDirectory* directory)
@@ -135,19 +129,14 @@ void vafs_directory_destroy(struct VaFsDirectory* directory)
         return;
     }
 
-    // A directory instance can either be a reader or a writer. They
-    // need different kinds of cleanup, but only one can be instanced
-    // at the time. When reading images, we only use directory readers, and
-    // when we write, we only use directory writers
+    // A directory instance can either be a reader or a writer. Only readers
+    // own resources outside the arena of the image, when reading images we
+    // only use directory readers, and when we write, only directory writers.
     if (directory->VaFs->Mode == VaFsMode_Read) {
-        __directory_reader_destroy((struct VaFsDirectoryReader*)directory);
-    } else if (directory->VaFs->Mode == VaFsMode_Write) {
-        __directory_writer_destroy((struct VaFsDirectoryWriter*)directory);
+        struct VaFsDirectoryReader* reader = (struct VaFsDirectoryReader*)directory;
+        __directory_reader_release(reader);
+        mtx_destroy(&reader->Lock);
     }
-
-    // free common resources
-    free((void*)directory->Name);
-    free(directory);
 }
 
 static int __get_descriptor_size(
@@ -155,6 +144,7 @@ static int __get_descriptor_size(
 {
     switch (type) {
         case VA_FS_DESCRIPTOR_TYPE_FILE:
+        case VA_FS_DESCRIPTOR_TYPE_FILE_INLINE:
             return sizeof(VaFsFileDescriptor_t);
         case VA_FS_DESCRIPTOR_TYPE_DIRECTORY:
             return sizeof(VaFsDirectoryDescriptor_t);
@@ -165,193 +155,266 @@ static int __get_descriptor_size(
     }
 }
 
-static int __read_descriptor(
-    struct VaFsDirectoryReader* reader,
-    char*                       buffer,
-    char**                      extendedBufferOut)
+// Descriptors are at most 64KB, so this is enough to assemble any
+// descriptor that crosses a block boundary in the descriptor stream.
+#define __DESCRIPTOR_SCRATCH_SIZE (UINT16_MAX + 1)
+
+struct __descriptor_parser {
+    struct VaFsStreamReader* Reader;
+    struct VaFsArena*        Arena;
+    struct VaFs*             VaFs;
+    char*                    Scratch;
+};
+
+/**
+ * @brief Provides <size> contiguous bytes of the descriptor stream. Data is borrowed
+ * directly from the current block when possible, and only copied into the scratch
+ * buffer when it crosses into the next block. The data is valid until the next read.
+ */
+static int __read_bytes(
+    struct __descriptor_parser* parser,
+    size_t                      size,
+    const char**                dataOut)
 {
-    VaFsDescriptor_t* base = (VaFsDescriptor_t*)buffer;
-    char*             ext  = (char*)buffer + sizeof(VaFsDescriptor_t);
-    int               status;
-    int               size;
-    size_t            read;
+    const void* data;
+    size_t      length;
+    size_t      read;
+    int         status;
 
-    if (buffer == NULL || extendedBufferOut == NULL) {
-        errno = EINVAL;
-        return -1;
+    status = vafs_stream_reader_borrow(parser->Reader, size, &data, &length);
+    if (status) {
+        return status;
     }
 
-    status = vafs_stream_read(
-        reader->Base.VaFs->DescriptorStream, 
-        buffer, sizeof(VaFsDescriptor_t),
+    if (length == size) {
+        *dataOut = data;
+        return 0;
+    }
+
+    if (parser->Scratch == NULL) {
+        parser->Scratch = malloc(__DESCRIPTOR_SCRATCH_SIZE);
+        if (!parser->Scratch) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    memcpy(parser->Scratch, data, length);
+    status = vafs_stream_reader_read(
+        parser->Reader,
+        parser->Scratch + length,
+        size - length,
         &read
     );
     if (status) {
-        VAFS_ERROR("__read_descriptor: failed to read base descriptor: %i\n", status);
         return status;
     }
+    *dataOut = parser->Scratch;
+    return 0;
+}
 
-    VAFS_INFO("__read_descriptor: desciptor found type=%u, length=%u\n",
-        base->Type, base->Length);
-    
-    size = __get_descriptor_size(base->Type);
-    if (base->Length < sizeof(VaFsDescriptor_t) || !size) {
-        VAFS_ERROR("__read_descriptor: invalid descriptor size: %i for type %i\n", base->Length, base->Type);
+static int __parse_entry(
+    struct __descriptor_parser* parser,
+    struct VaFsDirectoryEntry*  entry)
+{
+    VaFsDescriptor_t base;
+    const char*      data;
+    const char*      extendedData;
+    size_t           size;
+    size_t           extendedLength;
+    int              status;
+
+    status = __read_bytes(parser, sizeof(VaFsDescriptor_t), &data);
+    if (status) {
+        VAFS_ERROR("__parse_entry: failed to read base descriptor\n");
+        return status;
+    }
+    memcpy(&base, data, sizeof(VaFsDescriptor_t));
+
+    size = (size_t)__get_descriptor_size(base.Type);
+    if (!size || base.Length < size) {
+        VAFS_ERROR("__parse_entry: invalid descriptor size: %u for type %u\n", base.Length, base.Type);
         errno = EINVAL;
         return -1;
     }
 
-    if (base->Length > sizeof(VaFsDescriptor_t)) {
-        VAFS_DEBUG("__read_descriptor: read %u/%u descriptor bytes, reading rest\n", 
-            sizeof(VaFsDescriptor_t), size);
+    // the remaining part of the descriptor holds the type specific fields,
+    // followed by the names, read it in one go
+    status = __read_bytes(parser, base.Length - sizeof(VaFsDescriptor_t), &data);
+    if (status) {
+        VAFS_ERROR("__parse_entry: failed to read descriptor\n");
+        return status;
+    }
+    extendedData   = data + (size - sizeof(VaFsDescriptor_t));
+    extendedLength = base.Length - size;
 
-        status = vafs_stream_read(
-            reader->Base.VaFs->DescriptorStream, 
-            ext, size - sizeof(VaFsDescriptor_t),
-            &read
-        );
-        if (status) {
-            VAFS_ERROR("__read_descriptor: failed to read extension descriptor: %i\n", status);
-            return status;
+    entry->Type = base.Type;
+    if (base.Type == VA_FS_DESCRIPTOR_TYPE_FILE || base.Type == VA_FS_DESCRIPTOR_TYPE_FILE_INLINE) {
+        struct VaFsFile* file = vafs_arena_alloc(parser->Arena, sizeof(struct VaFsFile));
+        if (!file) {
+            return -1;
         }
 
-        if (base->Length > size) {
-            VAFS_DEBUG("__read_descriptor: read %u/%u bytes, reading descriptor extension data\n",
-                size, base->Length);
-
-            // read rest of descriptor
-            char* extendedBuffer = (char*)malloc(base->Length - size);
-            if (!extendedBuffer) {
-                VAFS_ERROR("__read_descriptor: failed to allocate extended buffer: %i\n", status);
-                errno = ENOMEM;
+        memcpy(&file->Descriptor.Base, &base, sizeof(VaFsDescriptor_t));
+        memcpy((char*)&file->Descriptor + sizeof(VaFsDescriptor_t), data, size - sizeof(VaFsDescriptor_t));
+        file->VaFs   = parser->VaFs;
+        file->Inline = NULL;
+        entry->Type  = VA_FS_DESCRIPTOR_TYPE_FILE;
+        entry->File  = file;
+
+        // the contents of inlined files follow the name, and are copied as
+        // the descriptor data is only valid until the next read
+        if (base.Type == VA_FS_DESCRIPTOR_TYPE_FILE_INLINE) {
+            void* contents;
+            if (file->Descriptor.FileLength > extendedLength) {
+                VAFS_ERROR("__parse_entry: inlined file exceeds the descriptor\n");
+                errno = EINVAL;
                 return -1;
             }
 
-            status = vafs_stream_read(
-                reader->Base.VaFs->DescriptorStream, 
-                extendedBuffer, base->Length - size,
-                &read
-            );
-            if (status) {
-                VAFS_ERROR("__read_descriptor: failed to read extended data: %i\n", status);
-                free(extendedBuffer);
-                return status;
+            extendedLength -= (size_t)file->Descriptor.FileLength;
+            if (file->Descriptor.FileLength != 0) {
+                contents = vafs_arena_alloc(parser->Arena, (size_t)file->Descriptor.FileLength);
+                if (!contents) {
+                    return -1;
+                }
+                memcpy(contents, extendedData + extendedLength, (size_t)file->Descriptor.FileLength);
+                file->Inline = contents;
             }
-            *extendedBufferOut = extendedBuffer;
         }
-    }
 
-    return 0;
-}
+        file->Name = vafs_arena_strndup(parser->Arena, extendedData, extendedLength);
+        return file->Name != NULL ? 0 : -1;
+    } else if (base.Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
+        struct VaFsDirectoryReader* directory = vafs_arena_alloc(parser->Arena, sizeof(struct VaFsDirectoryReader));
+        if (!directory) {
+            return -1;
+        }
 
-static const char* __read_extended_string(const char* buffer, size_t length)
-{
-    char* str = (char*)malloc(length + 1);
-    if (!str) {
-        VAFS_ERROR("__read_extended_string: failed to allocate string\n");
-        errno = ENOMEM;
-        return NULL;
-    }
+        memset(directory, 0, sizeof(struct VaFsDirectoryReader));
+        memcpy(&directory->Base.Descriptor.Base, &base, sizeof(VaFsDescriptor_t));
+        memcpy((char*)&directory->Base.Descriptor + sizeof(VaFsDescriptor_t), data, size - sizeof(VaFsDescriptor_t));
+        directory->Base.Name = vafs_arena_strndup(parser->Arena, extendedData, extendedLength);
+        directory->Base.VaFs = parser->VaFs;
+        directory->State     = VaFsDirectoryState_Open;
+        if (directory->Base.Name == NULL) {
+            return -1;
+        }
 
-    memcpy(str, buffer, length);
-    str[length] = '\0';
-    return str;
-}
+        // the lock is what makes the entry a live directory, so only
+        // link it once it can be torn down again
+        mtx_init(&directory->Lock, mtx_plain);
+        entry->Directory = &directory->Base;
+        return 0;
+    } else {
+        struct VaFsSymlink* symlink = vafs_arena_alloc(parser->Arena, sizeof(struct VaFsSymlink));
+        if (!symlink) {
+            return -1;
+        }
 
-static struct VaFsFile* __create_file_from_descriptor(
-    struct VaFs*          vafs,
-    VaFsFileDescriptor_t* descriptor,
-    const char*           extendedData)
-{
-    struct VaFsFile* file;
-    
-    file = (struct VaFsFile*)malloc(sizeof(struct VaFsFile));
-    if (!file) {
-        errno = ENOMEM;
-        return NULL;
+        memcpy(&symlink->Descriptor.Base, &base, sizeof(VaFsDescriptor_t));
+        memcpy((char*)&symlink->Descriptor + sizeof(VaFsDescriptor_t), data, size - sizeof(VaFsDescriptor_t));
+        if ((size_t)symlink->Descriptor.NameLength + symlink->Descriptor.TargetLength > extendedLength) {
+            VAFS_ERROR("__parse_entry: symlink names exceed the descriptor\n");
+            errno = EINVAL;
+            return -1;
+        }
+
+        symlink->Name   = vafs_arena_strndup(parser->Arena, extendedData, symlink->Descriptor.NameLength);
+        symlink->Target = vafs_arena_strndup(parser->Arena, extendedData + symlink->Descriptor.NameLength,
+            symlink->Descriptor.TargetLength);
+        symlink->VaFs   = parser->VaFs;
+        entry->Symlink  = symlink;
+        return (symlink->Name != NULL && symlink->Target != NULL) ? 0 : -1;
     }
-    
-    memcpy(&file->Descriptor, descriptor, sizeof(VaFsFileDescriptor_t));
-    file->Name = __read_extended_string(extendedData, descriptor->Base.Length - sizeof(VaFsFileDescriptor_t));
-    file->VaFs = vafs;
-    return file;
 }
 
-static struct VaFsDirectory* __create_directory_from_descriptor(
-    struct VaFs*               vafs,
-    VaFsDirectoryDescriptor_t* descriptor,
-    const char*                extendedData)
+static int __build_index(
+    struct VaFsDirectoryReader* reader,
+    uint32_t                    count)
 {
-    struct VaFsDirectoryReader* directory;
-    
-    directory = (struct VaFsDirectoryReader*)malloc(sizeof(struct VaFsDirectoryReader));
-    if (!directory) {
+    struct VaFsDirectoryEntry* i;
+    int                        status;
+
+    // size the table so it never needs to grow while being filled
+    status = vafs_hashtable_construct(
+        &reader->Index,
+        ((size_t)count * 100) / HASHTABLE_LOADFACTOR_GROW + 1,
+        sizeof(struct __index_entry),
+        __index_hash,
+        __index_cmp
+    );
+    if (status) {
         errno = ENOMEM;
-        return NULL;
+        return status;
     }
-    
-    directory->State     = VaFsDirectoryState_Open;
-    directory->Entries   = NULL;
-    directory->Base.Name = __read_extended_string(extendedData, descriptor->Base.Length - sizeof(VaFsDirectoryDescriptor_t));
-    directory->Base.VaFs = vafs;
-    memcpy(&directory->Base.Descriptor, descriptor, sizeof(VaFsDirectoryDescriptor_t));
-    return &directory->Base;
-}
 
-static struct VaFsSymlink* __create_symlink_from_descriptor(
-    struct VaFs*             vafs,
-    VaFsSymlinkDescriptor_t* descriptor,
-    const char*              extendedData)
-{
-    struct VaFsSymlink* symlink;
-    
-    symlink = (struct VaFsSymlink*)malloc(sizeof(struct VaFsSymlink));
-    if (!symlink) {
-        errno = ENOMEM;
-        return NULL;
+    for (i = reader->Entries; i != NULL; i = i->Link) {
+        const char* name = __vafs_directory_entry_name(i);
+        vafs_hashtable_set(&reader->Index, &(struct __index_entry) {
+            .hash  = __vafs_hash_string(name),
+            .name  = name,
+            .entry = i
+        });
     }
-    
-    memcpy(&symlink->Descriptor, descriptor, sizeof(VaFsSymlinkDescriptor_t));
-    symlink->Name   = __read_extended_string(extendedData, descriptor->NameLength);
-    symlink->Target = __read_extended_string(extendedData + descriptor->NameLength, descriptor->TargetLength);
-    symlink->VaFs   = vafs;
-    return symlink;
+    return 0;
 }
 
-static struct VaFsDirectoryEntry* __create_entry_from_descriptor(
-    struct VaFs*      vafs,
-    VaFsDescriptor_t* descriptor,
-    const char*       extendedData)
+static int __parse_entries(
+    struct VaFsDirectoryReader* reader,
+    struct VaFsStreamReader*    streamReader,
+    uint32_t                    count)
 {
-    struct VaFsDirectoryEntry* entry;
-    
-    entry = (struct VaFsDirectoryEntry*)malloc(sizeof(struct VaFsDirectoryEntry));
-    if (!entry) {
-        errno = ENOMEM;
-        return NULL;
+    struct __descriptor_parser parser;
+    struct VaFsDirectoryEntry* entries;
+    int                        status = 0;
+
+    if (count == 0) {
+        return 0;
     }
-    memset(entry, 0, sizeof(struct VaFsDirectoryEntry));
 
-    entry->Type = descriptor->Type;
-    if (entry->Type == VA_FS_DESCRIPTOR_TYPE_FILE) {
-        entry->File = __create_file_from_descriptor(vafs, (VaFsFileDescriptor_t*)descriptor, extendedData);
-    } else if (entry->Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
-        entry->Directory = __create_directory_from_descriptor(vafs, (VaFsDirectoryDescriptor_t*)descriptor, extendedData);
-    } else if (entry->Type == VA_FS_DESCRIPTOR_TYPE_SYMLINK) {
-        entry->Symlink = __create_symlink_from_descriptor(vafs, (VaFsSymlinkDescriptor_t*)descriptor, extendedData);
-    } else {
-        errno = EINVAL;
-        return NULL;
+    // the entries of a directory are allocated as one array, and everything
+    // they refer to is allocated from the arena of the image as well
+    entries = vafs_arena_alloc(reader->Base.VaFs->Arena, sizeof(struct VaFsDirectoryEntry) * count);
+    if (!entries) {
+        return -1;
     }
-    return entry;
+    memset(entries, 0, sizeof(struct VaFsDirectoryEntry) * count);
+
+    parser.Reader  = streamReader;
+    parser.Arena   = reader->Base.VaFs->Arena;
+    parser.VaFs    = reader->Base.VaFs;
+    parser.Scratch = NULL;
+
+    VAFS_DEBUG("__parse_entries: reading %u entries\n", count);
+    for (uint32_t i = 0; i < count; i++) {
+        status = __parse_entry(&parser, &entries[i]);
+        if (status) {
+            VAFS_ERROR("__parse_entries: failed to read entry %u/%u\n", i, count);
+            break;
+        }
+
+        // add the entry to the directory
+        entries[i].Link = reader->Entries;
+        reader->Entries = &entries[i];
+    }
+    free(parser.Scratch);
+
+    // memory of a partially loaded directory stays with the arena until
+    // the image is closed, but the loaded subdirectories must be released
+    if (status) {
+        __directory_reader_release(reader);
+    }
+    return status;
 }
 
 static int __load_directory(
     struct VaFsDirectoryReader* reader)
 {
-    VaFsDirectoryHeader_t header;
-    int                   status;
-    size_t                read;
+    VaFsDirectoryHeader_t   header;
+    struct VaFsStreamReader streamReader;
+    int                     status;
+    size_t                  read;
 
     VAFS_DEBUG("__load_directory(directory=%s)\n", reader->Base.Name);
 
@@ -361,73 +424,54 @@ static int __load_directory(
         return 0;
     }
 
-    status = vafs_stream_lock(reader->Base.VaFs->DescriptorStream);
+    // use a private reader for the descriptor stream, so multiple directories
+    // can be loaded at once without interfering with each other.
+    status = vafs_stream_reader_construct(reader->Base.VaFs->DescriptorStream, &streamReader);
     if (status) {
-        VAFS_ERROR("__load_directory: failed to get lock on stream\n");
         return status;
     }
 
-    // we lock the descriptor stream while reading the directory
-    // as only one can access the underlying media at the time due
-    // the c file interface.
-    status = vafs_stream_seek(
-        reader->Base.VaFs->DescriptorStream,
+    status = vafs_stream_reader_seek(
+        &streamReader,
         reader->Base.Descriptor.Descriptor.Index,
         reader->Base.Descriptor.Descriptor.Offset
     );
     if (status) {
         VAFS_ERROR("__load_directory: failed to seek to directory data\n");
-        vafs_stream_unlock(reader->Base.VaFs->DescriptorStream);
+        vafs_stream_reader_destroy(&streamReader);
         return status;
     }
 
     // read the directory descriptor
-    status = vafs_stream_read(
-        reader->Base.VaFs->DescriptorStream,
+    status = vafs_stream_reader_read(
+        &streamReader,
         &header, sizeof(VaFsDirectoryHeader_t),
         &read
     );
     if (status) {
         VAFS_ERROR("__load_directory: failed to read directory header\n");
-        vafs_stream_unlock(reader->Base.VaFs->DescriptorStream);
+        vafs_stream_reader_destroy(&streamReader);
         return status;
     }
 
-    // read the directory entries
-    VAFS_INFO("__load_directory: reading %u entries\n", header.Count);
-    for (uint32_t i = 0; i < header.Count; i++) {
-        struct VaFsDirectoryEntry* entry;
-        char                       buffer[64];
-        char*                      extendedData = NULL;
-        VAFS_INFO("__load_directory: reading entry %i/%u\n", i, header.Count);
-        
-        status = __read_descriptor(reader, &buffer[0], &extendedData);
-        if (status) {
-            VAFS_ERROR("__load_directory: failed to read descriptor\n");
-            vafs_stream_unlock(reader->Base.VaFs->DescriptorStream);
-            return status;
-        }
-
-        // create a new entry
-        entry = __create_entry_from_descriptor(reader->Base.VaFs, (VaFsDescriptor_t*)&buffer[0], extendedData);
-        free(extendedData);
+    status = __parse_entries(reader, &streamReader, header.Count);
+    if (status) {
+        VAFS_ERROR("__load_directory: failed to read directory entries\n");
+        vafs_stream_reader_destroy(&streamReader);
+        return status;
+    }
+    vafs_stream_reader_destroy(&streamReader);
 
-        if (!entry) {
-            VAFS_ERROR("__load_directory: failed to create entry\n");
-            vafs_stream_unlock(reader->Base.VaFs->DescriptorStream);
-            return -1;
+    // lookups fall back to walking the entries if the index could not be built
+    if (header.Count >= VA_FS_DIRECTORY_INDEX_THRESHOLD) {
+        if (__build_index(reader, header.Count)) {
+            VAFS_WARN("__load_directory: failed to build directory index\n");
         }
-
-        // add the entry to the directory
-        entry->Link = reader->Entries;
-        reader->Entries = entry;
     }
 
-    // unlock the descriptor stream
-    vafs_stream_unlock(reader->Base.VaFs->DescriptorStream);
-
     // set state to loaded
     reader->State = VaFsDirectoryState_Loaded;
+    atomic_fetch_add_explicit(&reader->Base.VaFs->DirectoryLoads, 1, memory_order_relaxed);
     return 0;
 }
 
@@ -445,7 +489,7 @@ int vafs_directory_open_root(
 
     VAFS_DEBUG("vafs_directory_open_root(pos=%u/%u)\n", position->Index, position->Offset);
     
-    reader = (struct VaFsDirectoryReader*)malloc(sizeof(struct VaFsDirectoryReader));
+    reader = vafs_arena_alloc(vafs->Arena, sizeof(struct VaFsDirectoryReader));
     if (!reader) {
         VAFS_ERROR("vafs_directory_open_root: failed to allocate directory reader\n");
         errno = ENOMEM;
@@ -453,9 +497,11 @@ int vafs_directory_open_root(
     }
 
     reader->Base.VaFs = vafs;
-    reader->Base.Name = strdup("root");
+    reader->Base.Name = "root";
+    mtx_init(&reader->Lock, mtx_plain);
     reader->State     = VaFsDirectoryState_Open;
     reader->Entries   = NULL;
+    memset(&reader->Index, 0, sizeof(hashtable_t));
     
     // initialize the root descriptor for the directory
     reader->Base.Descriptor.Base.Length = sizeof(VaFsDirectoryDescriptor_t);
@@ -468,19 +514,45 @@ int vafs_directory_open_root(
     return 0;
 }
 
-struct VaFsDirectoryEntry* __vafs_directory_entries(
+// __ensure_loaded loads the entries of a directory being read, if they are not
+// loaded yet. Failures keep their errno, so they are not mistaken for a missing
+// entry, which callers report as ENOENT.
+static int __ensure_loaded(
     struct VaFsDirectory* directory)
 {
-    VAFS_INFO("__vafs_directory_entries(directory=%s)\n", directory->Name);
-    if (directory->VaFs->Mode == VaFsMode_Read) {
-        struct VaFsDirectoryReader* reader = (struct VaFsDirectoryReader*)directory;
-        if (reader->State != VaFsDirectoryState_Loaded) {
-            if (__load_directory(reader)) {
-                VAFS_ERROR("__vafs_directory_entries: directory not loaded\n");
-                return NULL;
+    struct VaFsDirectoryReader* reader = (struct VaFsDirectoryReader*)directory;
+    int                         status = 0;
+
+    if (directory->VaFs->Mode != VaFsMode_Read) {
+        return 0;
+    }
+
+    // Directories are loaded on first access, which may happen from multiple
+    // threads at once. Entries are never modified once loaded.
+    mtx_lock(&reader->Lock);
+    if (reader->State != VaFsDirectoryState_Loaded) {
+        status = __load_directory(reader);
+        if (status) {
+            VAFS_ERROR("__ensure_loaded: directory not loaded\n");
+            if (errno == 0 || errno == ENOENT) {
+                errno = EIO;
             }
         }
-        return reader->Entries;
+    }
+    mtx_unlock(&reader->Lock);
+    return status;
+}
+
+struct VaFsDirectoryEntry* __vafs_directory_entries(
+    struct VaFsDirectory* directory)
+{
+    VAFS_DEBUG("__vafs_directory_entries(directory=%s)\n", directory->Name);
+    if (__ensure_loaded(directory)) {
+        return NULL;
+    }
+
+    if (directory->VaFs->Mode == VaFsMode_Read) {
+        return ((struct VaFsDirectoryReader*)directory)->Entries;
     }
     else {
         struct VaFsDirectoryWriter* writer = (struct VaFsDirectoryWriter*)directory;
@@ -512,7 +584,7 @@ static struct VaFsDirectoryHandle* __create_handle(
     }
 
     handle->Directory = directory;
-    handle->Index     = 0;
+    handle->Last      = NULL;
     return handle;
 }
 
@@ -521,69 +593,36 @@ int vafs_directory_open(
     const char*                  path,
     struct VaFsDirectoryHandle** handleOut)
 {
-    struct VaFsDirectoryEntry* entries;
-    const char*                remainingPath = path;
-    char                       token[VAFS_NAME_MAX + 1];
+    struct VaFsDirectoryEntry* entry;
+    struct VaFsDirectory*      directory;
+    int                        status;
 
     if (vafs == NULL || path == NULL || handleOut == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    if (__vafs_is_root_path(path)) {
-        *handleOut = __create_handle(vafs->RootDirectory);
-        return 0;
+    status = __vafs_path_lookup(vafs, path, 1, &entry);
+    if (status) {
+        return status;
     }
 
-    entries = __vafs_directory_entries(vafs->RootDirectory);
-    do {
-        int charsConsumed = __vafs_pathtoken(remainingPath, token, sizeof(token));
-        if (!charsConsumed) {
-            break;
-        }
-        remainingPath += charsConsumed;
-
-        // find the name in the directory
-        while (entries != NULL) {
-            if (!strcmp(__vafs_directory_entry_name(entries), token)) {
-                if (entries->Type == VA_FS_DESCRIPTOR_TYPE_SYMLINK) {
-                    char* pathBuffer = malloc(VAFS_PATH_MAX);
-                    int   written;
-                    int   status;
-                    if (!pathBuffer) {
-                        VAFS_ERROR("vafs_directory_open: failed to allocate path buffer\n");
-                        errno = ENOMEM;
-                        return -1;
-                    }
-
-                    written = __vafs_resolve_symlink(pathBuffer, VAFS_PATH_MAX, path, remainingPath - path, entries->Symlink->Target);
-                    if (written < 0) {
-                        VAFS_ERROR("vafs_directory_open: failed to resolve symlink %s\n", entries->Symlink->Target);
-                        free(pathBuffer);
-                        return -1;
-                    }
-
-                    status = vafs_directory_open(vafs, pathBuffer, handleOut);
-                    free(pathBuffer);
-                    return status;
-                } else if (entries->Type != VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
-                    errno = ENOTDIR;
-                    return -1;
-                }
-
-                if (remainingPath[0] == '\0') {
-                    // we found the directory
-                    *handleOut = __create_handle(entries->Directory);
-                    return 0;
-                }
+    // the root directory has no entry
+    if (entry == NULL) {
+        directory = vafs->RootDirectory;
+    } else if (entry->Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
+        directory = entry->Directory;
+    } else {
+        errno = ENOTDIR;
+        return -1;
+    }
 
-                entries = __vafs_directory_entries(entries->Directory);
-                break;
-            }
-            entries = entries->Link;
-        }
-    } while (1);
-    return -1;
+    *handleOut = __create_handle(directory);
+    if (*handleOut == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
 }
 
 static int __write_directory_header(
@@ -614,6 +653,12 @@ static int __write_file_descriptor(
     // for the null terminator
     entry->File->Descriptor.Base.Length += (uint16_t)strlen(entry->File->Name);
 
+    // inlined contents are stored after the name
+    if (entry->File->Inline != NULL) {
+        entry->File->Descriptor.Base.Type    = VA_FS_DESCRIPTOR_TYPE_FILE_INLINE;
+        entry->File->Descriptor.Base.Length += (uint16_t)entry->File->Descriptor.FileLength;
+    }
+
     status = vafs_stream_write(
         writer->Base.VaFs->DescriptorStream,
         &entry->File->Descriptor,
@@ -628,6 +673,15 @@ static int __write_file_descriptor(
         entry->File->Name,
         strlen(entry->File->Name)
     );
+    if (status != 0 || entry->File->Inline == NULL) {
+        return status;
+    }
+
+    status = vafs_stream_write(
+        writer->Base.VaFs->DescriptorStream,
+        entry->File->Inline,
+        (size_t)entry->File->Descriptor.FileLength
+    );
     return status;
 }
 
@@ -782,40 +836,50 @@ uint32_t vafs_directory_permissions(
     return handle->Directory->Descriptor.Permissions;
 }
 
+static struct VaFsDirectoryEntry* __directory_next(
+    struct VaFsDirectoryHandle* handle)
+{
+    struct VaFsDirectoryEntry* entry;
+
+    if (handle->Last != NULL) {
+        entry = handle->Last->Link;
+    } else {
+        // a directory that failed to load is not reported as empty
+        if (__ensure_loaded(handle->Directory)) {
+            return NULL;
+        }
+        entry = __vafs_directory_entries(handle->Directory);
+    }
+
+    if (entry == NULL) {
+        VAFS_DEBUG("vafs_directory_read: end of directory\n");
+        errno = ENOENT;
+        return NULL;
+    }
+    VAFS_DEBUG("vafs_directory_read: found entry %s\n",
+        __vafs_directory_entry_name(entry));
+
+    // we found an entry, move to next
+    handle->Last = entry;
+    return entry;
+}
+
 int vafs_directory_read(
     struct VaFsDirectoryHandle* handle,
     struct VaFsEntry*           entryOut)
 {
     struct VaFsDirectoryEntry* entry;
-    int                        i;
-    VAFS_INFO("vafs_directory_read(handle=%p)\n", handle);
+    VAFS_DEBUG("vafs_directory_read(handle=%p)\n", handle);
 
     if (handle == NULL || entryOut == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    VAFS_DEBUG("vafs_directory_read: locate index %i\n", handle->Index);
-    entry = __vafs_directory_entries(handle->Directory);
-    i       = 0;
-    while (entry != NULL) {
-        if (i == handle->Index) {
-            break;
-        }
-        entry = entry->Link;
-        i++;
-    }
-
+    entry = __directory_next(handle);
     if (entry == NULL) {
-        VAFS_INFO("vafs_directory_read: end of directory\n");
-        errno = ENOENT;
         return -1;
     }
-    VAFS_DEBUG("vafs_directory_read: found entry %s\n",
-        __vafs_directory_entry_name(entry));
-
-    // we found an entry, move to next
-    handle->Index++;
 
     // initialize the entry structure
     entryOut->Name = __vafs_directory_entry_name(entry);
@@ -823,6 +887,29 @@ int vafs_directory_read(
     return 0;
 }
 
+int vafs_directory_read_stat(
+    struct VaFsDirectoryHandle* handle,
+    struct VaFsEntry*           entryOut,
+    struct vafs_stat*           statOut)
+{
+    struct VaFsDirectoryEntry* entry;
+    VAFS_DEBUG("vafs_directory_read_stat(handle=%p)\n", handle);
+
+    if (handle == NULL || entryOut == NULL || statOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    entry = __directory_next(handle);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    entryOut->Name = __vafs_directory_entry_name(entry);
+    entryOut->Type = (enum VaFsEntryType)entry->Type;
+    return __vafs_entry_stat(entry, statOut);
+}
+
 int vafs_directory_close(
     struct VaFsDirectoryHandle* handle)
 {
@@ -836,20 +923,27 @@ int vafs_directory_close(
     return 0;
 }
 
-static int __add_file_entry(
+static int __add_entry(
     struct VaFsDirectoryWriter* writer,
-    struct VaFsFile*            entry)
+    int                         type,
+    void*                       object)
 {
     struct VaFsDirectoryEntry* newEntry;
 
-    newEntry = (struct VaFsDirectoryEntry*)malloc(sizeof(struct VaFsDirectoryEntry));
+    newEntry = vafs_arena_alloc(writer->Base.VaFs->Arena, sizeof(struct VaFsDirectoryEntry));
     if (!newEntry) {
         errno = ENOMEM;
         return -1;
     }
 
-    newEntry->Type = VA_FS_DESCRIPTOR_TYPE_FILE;
-    newEntry->File = entry;
+    newEntry->Type = type;
+    if (type == VA_FS_DESCRIPTOR_TYPE_FILE) {
+        newEntry->File = object;
+    } else if (type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
+        newEntry->Directory = object;
+    } else {
+        newEntry->Symlink = object;
+    }
     newEntry->Link = writer->Entries;
     writer->Entries = newEntry;
     return 0;
@@ -860,28 +954,29 @@ static int __create_file_entry(
     const char*                 name,
     uint32_t                    permissions)
 {
-    struct VaFsFile* entry;
-    int              status;
+    struct VaFsArena* arena = writer->Base.VaFs->Arena;
+    struct VaFsFile*  entry;
+    int               status;
 
-    entry = (struct VaFsFile*)malloc(sizeof(struct VaFsFile));
+    // Allocations are only released with the arena, so nothing needs
+    // to be freed if a later step fails.
+    entry = vafs_arena_alloc(arena, sizeof(struct VaFsFile));
     if (!entry) {
         errno = ENOMEM;
         return -1;
     }
 
-    entry->VaFs = writer->Base.VaFs;
-    entry->Name = strdup(name);
+    entry->VaFs   = writer->Base.VaFs;
+    entry->Inline = NULL;
+    entry->Name   = vafs_arena_strndup(arena, name, strlen(name));
     if (!entry->Name) {
-        free(entry);
         errno = ENOMEM;
         return -1;
     }
 
     __initialize_file_descriptor(&entry->Descriptor, permissions);
-    status = __add_file_entry(writer, entry);
+    status = __add_entry(writer, VA_FS_DESCRIPTOR_TYPE_FILE, entry);
     if (status) {
-        free((void*)entry->Name);
-        free(entry);
         return status;
     }
 
@@ -889,62 +984,32 @@ static int __create_file_entry(
     return 0;
 }
 
-static int __add_symlink_entry(
-    struct VaFsDirectoryWriter* writer,
-    struct VaFsSymlink*         entry)
-{
-    struct VaFsDirectoryEntry* newEntry;
-
-    newEntry = (struct VaFsDirectoryEntry*)malloc(sizeof(struct VaFsDirectoryEntry));
-    if (!newEntry) {
-        errno = ENOMEM;
-        return -1;
-    }
-
-    newEntry->Type    = VA_FS_DESCRIPTOR_TYPE_SYMLINK;
-    newEntry->Symlink = entry;
-    newEntry->Link    = writer->Entries;
-
-    writer->Entries = newEntry;
-    return 0;
-}
-
 static int __create_symlink_entry(
     struct VaFsDirectoryWriter* writer,
     const char*                 name,
     const char*                 target)
 {
+    struct VaFsArena*   arena = writer->Base.VaFs->Arena;
     struct VaFsSymlink* entry;
     int                 status;
 
-    entry = (struct VaFsSymlink*)malloc(sizeof(struct VaFsSymlink));
+    entry = vafs_arena_alloc(arena, sizeof(struct VaFsSymlink));
     if (!entry) {
         errno = ENOMEM;
         return -1;
     }
 
-    entry->VaFs = writer->Base.VaFs;
-    entry->Name = strdup(name);
-    if (!entry->Name) {
-        free(entry);
-        errno = ENOMEM;
-        return -1;
-    }
-
-    entry->Target = strdup(target);
-    if (!entry->Target) {
-        free((void*)entry->Name);
-        free(entry);
+    entry->VaFs   = writer->Base.VaFs;
+    entry->Name   = vafs_arena_strndup(arena, name, strlen(name));
+    entry->Target = vafs_arena_strndup(arena, target, strlen(target));
+    if (!entry->Name || !entry->Target) {
         errno = ENOMEM;
         return -1;
     }
 
     __initialize_symlink_descriptor(&entry->Descriptor);
-    status = __add_symlink_entry(writer, entry);
+    status = __add_entry(writer, VA_FS_DESCRIPTOR_TYPE_SYMLINK, entry);
     if (status) {
-        free((void*)entry->Target);
-        free((void*)entry->Name);
-        free(entry);
         return status;
     }
 
@@ -952,35 +1017,17 @@ static int __create_symlink_entry(
     return 0;
 }
 
-static int __add_directory_entry(
-    struct VaFsDirectoryWriter* writer,
-    struct VaFsDirectory*       entry)
-{
-    struct VaFsDirectoryEntry* newEntry;
-
-    newEntry = (struct VaFsDirectoryEntry*)malloc(sizeof(struct VaFsDirectoryEntry));
-    if (!newEntry) {
-        errno = ENOMEM;
-        return -1;
-    }
-
-    newEntry->Type = VA_FS_DESCRIPTOR_TYPE_DIRECTORY;
-    newEntry->Directory = entry;
-    newEntry->Link = writer->Entries;
-    writer->Entries = newEntry;
-    return 0;
-}
-
 static int __create_directory_entry(
     struct VaFsDirectoryWriter* writer,
     const char*                 name,
     uint32_t                    permissions)
 {
+    struct VaFsArena*           arena = writer->Base.VaFs->Arena;
     struct VaFsDirectoryWriter* entry;
     int                         status;
     VAFS_DEBUG("__create_directory_entry(name=%s)\n", name);
 
-    entry = (struct VaFsDirectoryWriter*)malloc(sizeof(struct VaFsDirectoryWriter));
+    entry = vafs_arena_alloc(arena, sizeof(struct VaFsDirectoryWriter));
     if (!entry) {
         errno = ENOMEM;
         return -1;
@@ -988,18 +1035,15 @@ static int __create_directory_entry(
 
     entry->Entries = NULL;
     entry->Base.VaFs = writer->Base.VaFs;
-    entry->Base.Name = strdup(name);
+    entry->Base.Name = vafs_arena_strndup(arena, name, strlen(name));
     if (!entry->Base.Name) {
-        free(entry);
         errno = ENOMEM;
         return -1;
     }
 
     __initialize_directory_descriptor(&entry->Base.Descriptor, permissions);
-    status = __add_directory_entry(writer, &entry->Base);
+    status = __add_entry(writer, VA_FS_DESCRIPTOR_TYPE_DIRECTORY, &entry->Base);
     if (status) {
-        free((void*)entry->Base.Name);
-        free(entry);
         return status;
     }
 
@@ -1007,20 +1051,41 @@ static int __create_directory_entry(
     return 0;
 }
 
-static struct VaFsDirectoryEntry* __find_entry(
+struct VaFsDirectoryEntry* __vafs_directory_find_entry(
     struct VaFsDirectory* directory,
-    const char*           token)
+    const char*           name)
 {
     struct VaFsDirectoryEntry* i;
 
-    // find the name in the directory
+    // this makes sure the directory is loaded, and thus that the
+    // index is present if the directory has one
+    if (__ensure_loaded(directory)) {
+        return NULL;
+    }
+
     i = __vafs_directory_entries(directory);
+    if (directory->VaFs->Mode == VaFsMode_Read) {
+        struct VaFsDirectoryReader* reader = (struct VaFsDirectoryReader*)directory;
+        if (reader->Index.elements) {
+            struct __index_entry* entry = vafs_hashtable_get(&reader->Index, &(struct __index_entry) {
+                .hash = __vafs_hash_string(name),
+                .name = name
+            });
+            if (entry == NULL) {
+                errno = ENOENT;
+                return NULL;
+            }
+            return entry->entry;
+        }
+    }
+
     while (i != NULL) {
-        if (!strcmp(__vafs_directory_entry_name(i), token)) {
+        if (!strcmp(__vafs_directory_entry_name(i), name)) {
             return i;
         }
         i = i->Link;
     }
+    errno = ENOENT;
     return NULL;
 }
 
@@ -1050,9 +1115,9 @@ int vafs_directory_open_directory(
     }
 
     // find the name in the directory
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
     if (entry == NULL) {
-        errno = ENOENT;
+        // errno tells a missing entry apart from a directory that failed to load
         return -1;
     }
 
@@ -1095,7 +1160,7 @@ int vafs_directory_create_directory(
     }
 
     // find the name in the directory
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
     if (entry != NULL) {
         *handleOut = __create_handle(entry->Directory);
         return 0;
@@ -1106,7 +1171,7 @@ int vafs_directory_create_directory(
     if (status != 0) {
         return status;
     }
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
 
     *handleOut = __create_handle(entry->Directory);
     return 0;
@@ -1139,9 +1204,9 @@ int vafs_directory_open_file(
     }
 
     // find the name in the directory
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
     if (entry == NULL) {
-        errno = ENOENT;
+        // errno tells a missing entry apart from a directory that failed to load
         return -1;
     }
 
@@ -1184,7 +1249,7 @@ int vafs_directory_create_file(
     }
 
     // find the name in the directory
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
     if (entry != NULL) {
         errno = EEXIST;
         return -1;
@@ -1195,7 +1260,7 @@ int vafs_directory_create_file(
     if (status != 0) {
         return status;
     }
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
     
     *handleOut = vafs_file_create_handle(entry->File);
     return 0;
@@ -1228,7 +1293,7 @@ int vafs_directory_create_symlink(
 
     // find the name in the directory
     VAFS_DEBUG("vafs_directory_create_symlink: locating %s\n", token);
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
     if (entry == NULL) {
         struct VaFsDirectoryWriter* writer = (struct VaFsDirectoryWriter*)handle->Directory;
         return __create_symlink_entry(writer, token, target);
@@ -1265,9 +1330,9 @@ int vafs_directory_read_symlink(
 
     // find the name in the directory
     VAFS_DEBUG("vafs_directory_read_symlink: locating %s\n", token);
-    entry = __find_entry(handle->Directory, token);
+    entry = __vafs_directory_find_entry(handle->Directory, token);
     if (entry == NULL) {
-        errno = ENOENT;
+        // errno tells a missing entry apart from a directory that failed to load
         return -1;
     }
     
@@ -1279,3 +1344,16 @@ int vafs_directory_read_symlink(
     *targetOut = entry->Symlink->Target;
     return 0;
 }
+
+static uint64_t __index_hash(const void* element)
+{
+    const struct __index_entry* entry = element;
+    return entry->hash;
+}
+
+static int __index_cmp(const void* lh, const void* rh)
+{
+    const struct __index_entry* lent = lh;
+    const struct __index_entry* rent = rh;
+    return strcmp(lent->name, rent->name);
+}
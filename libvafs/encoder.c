@@ -0,0 +1,290 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vali Initrd Filesystem
+ * - Contains the implementation of the Vali Initrd Filesystem.
+ *   This filesystem is used to store the initrd of the kernel.
+ */
+
+#include "crc.h"
+#include <errno.h>
+#include "private.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The number of blocks that may be in flight per encoder thread, this keeps
+// all threads busy while the writer is committing finished blocks.
+#define ENCODER_JOBS_PER_THREAD 2
+
+struct __encode_job {
+    struct VaFsEncodedBlock Block;
+    int                     Done;
+};
+
+struct VaFsEncoderPool {
+    mtx_t                Lock;
+    cnd_t                WorkSignal;
+    cnd_t                DoneSignal;
+    int                  Running;
+    struct VaFsFilter*   Filter;
+    uint32_t             Checksum;
+    uint32_t             BlockSize;
+
+    thrd_t*              Threads;
+    int                  ThreadCount;
+
+    // Jobs are kept in a ring in submission order, the sequence numbers
+    // are used to find the next job to encode and the next job to collect.
+    struct __encode_job* Jobs;
+    uint32_t             Capacity;
+    uint64_t             SubmitSequence;
+    uint64_t             PickSequence;
+    uint64_t             CollectSequence;
+};
+
+static void __encode_block(
+    struct VaFsEncoderPool*  pool,
+    void*                    context,
+    struct VaFsEncodedBlock* block)
+{
+    // The CRC is always calculated on the unencoded data
+    block->Crc = crc_block_checksum(pool->Checksum, block->Data, block->Length);
+
+    // Blocks the filter can not make smaller are stored as they are, which
+    // is signalled by the encoded length not being smaller than the block.
+    block->EncodedLength = block->Length;
+    block->Status = vafs_filter_encode(pool->Filter, context, block->Data, block->Length,
+        block->Encoded, &block->EncodedLength);
+    if (block->Status && errno == ENOSPC) {
+        block->EncodedLength = block->Length;
+        block->Status        = 0;
+    }
+}
+
+static int __encoder_worker(void* context)
+{
+    struct VaFsEncoderPool* pool = context;
+    struct __encode_job*    job;
+    void*                   filterContext = NULL;
+    int                     hasContext = 0;
+
+    mtx_lock(&pool->Lock);
+    while (1) {
+        while (pool->Running && pool->PickSequence == pool->SubmitSequence) {
+            cnd_wait(&pool->WorkSignal, &pool->Lock);
+        }
+
+        if (!pool->Running) {
+            break;
+        }
+
+        job = &pool->Jobs[pool->PickSequence++ % pool->Capacity];
+        mtx_unlock(&pool->Lock);
+
+        // The filter context is kept for the lifetime of the thread
+        if (!hasContext && !vafs_filter_context_acquire(pool->Filter, &filterContext)) {
+            hasContext = 1;
+        }
+
+        if (hasContext) {
+            __encode_block(pool, filterContext, &job->Block);
+        }
+        else {
+            job->Block.Status = -1;
+        }
+
+        mtx_lock(&pool->Lock);
+        job->Done = 1;
+        cnd_broadcast(&pool->DoneSignal);
+    }
+    mtx_unlock(&pool->Lock);
+
+    vafs_filter_context_release(pool->Filter, filterContext);
+    return 0;
+}
+
+static int __allocate_job_buffers(
+    struct VaFsEncoderPool* pool)
+{
+    for (uint32_t i = 0; i < pool->Capacity; i++) {
+        pool->Jobs[i].Block.Data    = malloc(pool->BlockSize);
+        pool->Jobs[i].Block.Encoded = malloc(pool->BlockSize);
+        if (!pool->Jobs[i].Block.Data || !pool->Jobs[i].Block.Encoded) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vafs_encoder_pool_create(
+    int                      threadCount,
+    struct VaFsFilter*       filter,
+    uint32_t                 checksum,
+    uint32_t                 blockSize,
+    struct VaFsEncoderPool** poolOut)
+{
+    struct VaFsEncoderPool* pool;
+
+    if (threadCount <= 0 || filter == NULL || blockSize == 0 || poolOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pool = malloc(sizeof(struct VaFsEncoderPool));
+    if (!pool) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(pool, 0, sizeof(struct VaFsEncoderPool));
+
+    mtx_init(&pool->Lock, mtx_plain);
+    cnd_init(&pool->WorkSignal);
+    cnd_init(&pool->DoneSignal);
+    pool->Filter    = filter;
+    pool->Checksum  = checksum;
+    pool->BlockSize = blockSize;
+    pool->Running   = 1;
+
+    pool->Capacity = (uint32_t)threadCount * ENCODER_JOBS_PER_THREAD;
+    pool->Jobs     = calloc(pool->Capacity, sizeof(struct __encode_job));
+    pool->Threads  = calloc((size_t)threadCount, sizeof(thrd_t));
+    if (!pool->Jobs || !pool->Threads || __allocate_job_buffers(pool)) {
+        vafs_encoder_pool_destroy(pool);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int i = 0; i < threadCount; i++) {
+        if (thrd_create(&pool->Threads[i], __encoder_worker, pool) != thrd_success) {
+            VAFS_ERROR("vafs_encoder_pool_create: failed to start encoder thread %i\n", i);
+            break;
+        }
+        pool->ThreadCount++;
+    }
+
+    if (pool->ThreadCount == 0) {
+        vafs_encoder_pool_destroy(pool);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *poolOut = pool;
+    return 0;
+}
+
+void vafs_encoder_pool_destroy(
+    struct VaFsEncoderPool* pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+
+    mtx_lock(&pool->Lock);
+    pool->Running = 0;
+    cnd_broadcast(&pool->WorkSignal);
+    mtx_unlock(&pool->Lock);
+
+    for (int i = 0; i < pool->ThreadCount; i++) {
+        thrd_join(pool->Threads[i], NULL);
+    }
+
+    if (pool->Jobs) {
+        for (uint32_t i = 0; i < pool->Capacity; i++) {
+            free(pool->Jobs[i].Block.Data);
+            free(pool->Jobs[i].Block.Encoded);
+        }
+    }
+
+    cnd_destroy(&pool->DoneSignal);
+    cnd_destroy(&pool->WorkSignal);
+    mtx_destroy(&pool->Lock);
+    free(pool->Threads);
+    free(pool->Jobs);
+    free(pool);
+}
+
+int vafs_encoder_pool_submit(
+    struct VaFsEncoderPool* pool,
+    void**                  data,
+    uint32_t                length)
+{
+    struct __encode_job* job;
+    void*                spare;
+
+    if (pool == NULL || data == NULL || *data == NULL || length > pool->BlockSize) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtx_lock(&pool->Lock);
+    if (pool->SubmitSequence - pool->CollectSequence == pool->Capacity) {
+        mtx_unlock(&pool->Lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    // The buffer of the job was collected already, so it can be handed back
+    job   = &pool->Jobs[pool->SubmitSequence++ % pool->Capacity];
+    spare = job->Block.Data;
+    job->Done                = 0;
+    job->Block.Data          = *data;
+    job->Block.Length        = length;
+    job->Block.EncodedLength = 0;
+    job->Block.Crc           = 0;
+    job->Block.Status        = 0;
+    *data = spare;
+    cnd_signal(&pool->WorkSignal);
+    mtx_unlock(&pool->Lock);
+    return 0;
+}
+
+int vafs_encoder_pool_collect(
+    struct VaFsEncoderPool*  pool,
+    int                      wait,
+    struct VaFsEncodedBlock* blockOut)
+{
+    struct __encode_job* job;
+
+    if (pool == NULL || blockOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtx_lock(&pool->Lock);
+    if (pool->CollectSequence == pool->SubmitSequence) {
+        mtx_unlock(&pool->Lock);
+        errno = ENOENT;
+        return -1;
+    }
+
+    // Blocks are handed out in the order they were submitted, even if
+    // later blocks finish encoding first.
+    job = &pool->Jobs[pool->CollectSequence % pool->Capacity];
+    while (!job->Done) {
+        if (!wait) {
+            mtx_unlock(&pool->Lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        cnd_wait(&pool->DoneSignal, &pool->Lock);
+    }
+
+    *blockOut = job->Block;
+    pool->CollectSequence++;
+    mtx_unlock(&pool->Lock);
+    return 0;
+}
@@ -32,9 +32,21 @@ enum VaFsFileState {
 };
 
 struct VaFsFileHandle {
-    struct VaFsFile*   File;
-    enum VaFsFileState State;
-    uint32_t           Position;
+    struct VaFsFile*        File;
+    enum VaFsFileState      State;
+    uint64_t                Position;
+
+    // Each handle reads through its own stream reader, so
+    // handles can be read from concurrently.
+    struct VaFsStreamReader Reader;
+
+    // When writing images with the inline feature, the contents of the
+    // file are collected here until it grows beyond the threshold.
+    char*                   InlineBuffer;
+
+    // The block size the data of the file is stored in, applied once the
+    // file is written to the data stream. Zero keeps the current size.
+    uint32_t                BlockSize;
 };
 
 
@@ -43,81 +55,33 @@ int vafs_file_open(
     const char*             path,
     struct VaFsFileHandle** handleOut)
 {
-    struct VaFsDirectoryEntry* entries;
-    const char*                remainingPath = path;
-    char                       token[VAFS_NAME_MAX + 1];
+    struct VaFsDirectoryEntry* entry;
+    int                        status;
 
     if (vafs == NULL || path == NULL || handleOut == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    if (__vafs_is_root_path(path)) {
+    status = __vafs_path_lookup(vafs, path, 1, &entry);
+    if (status) {
+        return status;
+    }
+
+    // the root directory has no entry
+    if (entry == NULL || entry->Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
         errno = EISDIR;
         return -1;
+    } else if (entry->Type != VA_FS_DESCRIPTOR_TYPE_FILE) {
+        errno = ENOENT;
+        return -1;
     }
 
-    entries = __vafs_directory_entries(vafs->RootDirectory);
-    do {
-        int charsConsumed = __vafs_pathtoken(remainingPath, token, sizeof(token));
-        if (!charsConsumed) {
-            break;
-        }
-        remainingPath += charsConsumed;
-
-        // find the name in the directory
-        while (entries != NULL) {
-            if (!strcmp(__vafs_directory_entry_name(entries), token)) {
-                if (entries->Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
-                    // If we encounter a directory in this case, we must not
-                    // be at the end of the path
-                    if (remainingPath[0] == '\0') {
-                        errno = EISDIR;
-                        return -1;
-                    }
-
-                    // fall through this entire if/else
-                } else if (entries->Type == VA_FS_DESCRIPTOR_TYPE_SYMLINK) {
-                    char* pathBuffer = malloc(VAFS_PATH_MAX);
-                    int   written;
-                    int   status;
-                    if (!pathBuffer) {
-                        VAFS_ERROR("vafs_directory_open: failed to allocate path buffer\n");
-                        errno = ENOMEM;
-                        return -1;
-                    }
-
-                    written = __vafs_resolve_symlink(pathBuffer, VAFS_PATH_MAX, path, remainingPath - path, entries->Symlink->Target);
-                    if (written < 0) {
-                        VAFS_ERROR("vafs_directory_open: failed to resolve symlink %s\n", entries->Symlink->Target);
-                        free(pathBuffer);
-                        return -1;
-                    }
-
-                    status = vafs_file_open(vafs, pathBuffer, handleOut);
-                    free(pathBuffer);
-                    return status;
-                } else if (entries->Type == VA_FS_DESCRIPTOR_TYPE_FILE) {
-                    // If we encounter a file in this case, we must be at the end of the path
-                    if (remainingPath[0] != '\0') {
-                        errno = EISDIR;
-                        return -1;
-                    }
-
-                    *handleOut = vafs_file_create_handle(entries->File);
-                    return 0;
-                } else {
-                    errno = ENOENT;
-                    return -1;
-                }
-
-                entries = __vafs_directory_entries(entries->Directory);
-                break;
-            }
-            entries = entries->Link;
-        }
-    } while (1);
-    return -1;
+    *handleOut = vafs_file_create_handle(entry->File);
+    if (*handleOut == NULL) {
+        return -1;
+    }
+    return 0;
 }
 
 struct VaFsFileHandle* vafs_file_create_handle(
@@ -134,35 +98,62 @@ struct VaFsFileHandle* vafs_file_create_handle(
     handle->File = fileEntry;
     handle->Position = 0;
     handle->State = VaFsFileState_Open;
-    
+    handle->InlineBuffer = NULL;
+    handle->BlockSize = 0;
+    memset(&handle->Reader, 0, sizeof(struct VaFsStreamReader));
+
+    if (fileEntry->VaFs->Mode == VaFsMode_Read) {
+        if (vafs_stream_reader_construct(fileEntry->VaFs->DataStream, &handle->Reader)) {
+            free(handle);
+            return NULL;
+        }
+    }
     return handle;
 }
 
-void vafs_file_destroy(
-    struct VaFsFile* file)
+// __file_commit_inline moves the collected contents of a file into the arena of
+// the image, from where they are written as part of the file descriptor.
+static int __file_commit_inline(
+    struct VaFsFileHandle* handle)
 {
-    if (file == NULL) {
-        return;
+    void* contents;
+
+    if (handle->InlineBuffer == NULL) {
+        return 0;
+    }
+
+    contents = vafs_arena_alloc(handle->File->VaFs->Arena, (size_t)handle->File->Descriptor.FileLength);
+    if (!contents) {
+        errno = ENOMEM;
+        return -1;
     }
 
-    free((void*)file->Name);
-    free(file);
+    memcpy(contents, handle->InlineBuffer, (size_t)handle->File->Descriptor.FileLength);
+    handle->File->Inline = contents;
+    free(handle->InlineBuffer);
+    handle->InlineBuffer = NULL;
+    return 0;
 }
 
 int vafs_file_close(
     struct VaFsFileHandle* handle)
 {
+    int status;
+
     if (!handle) {
         errno = EINVAL;
         return -1;
     }
 
+    status = __file_commit_inline(handle);
     if (handle->State == VaFsFileState_Write) {
         vafs_stream_unlock(handle->File->VaFs->DataStream);
     }
 
+    free(handle->InlineBuffer);
+    vafs_stream_reader_destroy(&handle->Reader);
     free(handle);
-    return 0;
+    return status;
 }
 
 size_t vafs_file_length(
@@ -192,6 +183,8 @@ int vafs_file_seek(
     long                   offset,
     int                    whence)
 {
+    int64_t position;
+
     if (!handle) {
         errno = EINVAL;
         return -1;
@@ -205,20 +198,20 @@ int vafs_file_seek(
 
     switch (whence) {
         case SEEK_SET:
-            handle->Position = offset;
+            position = offset;
             break;
         case SEEK_CUR:
-            handle->Position += offset;
+            position = (int64_t)handle->Position + offset;
             break;
         case SEEK_END:
-            handle->Position = handle->File->Descriptor.FileLength + offset;
+            position = (int64_t)handle->File->Descriptor.FileLength + offset;
             break;
         default:
             errno = EINVAL;
             return -1;
     }
 
-    handle->Position = MIN(MAX(handle->Position, 0), handle->File->Descriptor.FileLength);
+    handle->Position = MIN((uint64_t)MAX(position, 0), handle->File->Descriptor.FileLength);
     
     // reset the block buffer
     return 0;
@@ -229,7 +222,7 @@ size_t vafs_file_read(
     void*                  buffer,
     size_t                 size)
 {
-    size_t read;
+    size_t read = 0;
     int    status;
 
     if (!handle) {
@@ -243,36 +236,256 @@ size_t vafs_file_read(
         return 0;
     }
 
-    status = vafs_stream_lock(handle->File->VaFs->DataStream);
-    if (status) {
-        errno = EBUSY;
+    // never read beyond the end of the file, the data stream
+    // continues with the contents of the next file.
+    size = (size_t)MIN((uint64_t)size, handle->File->Descriptor.FileLength - handle->Position);
+    if (size == 0) {
+        errno = ENODATA;
         return 0;
     }
 
-    status = vafs_stream_seek(
-        handle->File->VaFs->DataStream,
+    if (handle->File->Inline != NULL) {
+        memcpy(buffer, (const char*)handle->File->Inline + handle->Position, size);
+        handle->Position += size;
+        return size;
+    }
+
+    status = vafs_stream_reader_seek(
+        &handle->Reader,
         handle->File->Descriptor.Data.Index,
         handle->File->Descriptor.Data.Offset + handle->Position
     );
     if (status) {
-        vafs_stream_unlock(handle->File->VaFs->DataStream);
         return 0;
     }
 
-    (void)vafs_stream_read(handle->File->VaFs->DataStream, buffer, size, &read);
-    vafs_stream_unlock(handle->File->VaFs->DataStream);
+    (void)vafs_stream_reader_read(&handle->Reader, buffer, size, &read);
+    handle->Position += read;
     return read;
 }
 
-size_t vafs_file_write(
+static size_t __file_read_vectors(
+    struct VaFsFileHandle*     handle,
+    const struct VaFsIoVector* vectors,
+    int                        count,
+    uint64_t                   offset)
+{
+    struct VaFsStreamReader reader;
+    uint64_t                fileLength;
+    size_t                  total = 0;
+    int                     status;
+    int                     i;
+
+    if (!handle || (!vectors && count) || count < 0) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    // this is not valid when writing files
+    if (handle->File->VaFs->Mode == VaFsMode_Write) {
+        errno = ENOTSUP;
+        return 0;
+    }
+
+    fileLength = handle->File->Descriptor.FileLength;
+    if (offset >= fileLength) {
+        errno = ENODATA;
+        return 0;
+    }
+
+    if (handle->File->Inline != NULL) {
+        for (i = 0; i < count && offset < fileLength; i++) {
+            size_t size = (size_t)MIN((uint64_t)vectors[i].Length, fileLength - offset);
+            memcpy(vectors[i].Buffer, (const char*)handle->File->Inline + offset, size);
+            total  += size;
+            offset += size;
+        }
+        return total;
+    }
+
+    // The reader is local to this call, so the handle carries no state that
+    // concurrent callers would race on. Consecutive vectors continue in the
+    // block the reader is positioned in, so requests that hit the same block
+    // only load it once.
+    if (vafs_stream_reader_construct(handle->File->VaFs->DataStream, &reader)) {
+        return 0;
+    }
+
+    status = vafs_stream_reader_seek(
+        &reader,
+        handle->File->Descriptor.Data.Index,
+        handle->File->Descriptor.Data.Offset + offset
+    );
+    if (status) {
+        vafs_stream_reader_destroy(&reader);
+        return 0;
+    }
+
+    for (i = 0; i < count && offset < fileLength; i++) {
+        size_t size = (size_t)MIN((uint64_t)vectors[i].Length, fileLength - offset);
+        size_t read = 0;
+
+        if (size == 0) {
+            continue;
+        }
+
+        status = vafs_stream_reader_read(&reader, vectors[i].Buffer, size, &read);
+        total  += read;
+        offset += read;
+        if (status) {
+            break;
+        }
+    }
+
+    vafs_stream_reader_destroy(&reader);
+    if (total == 0) {
+        errno = ENODATA;
+    }
+    return total;
+}
+
+size_t vafs_file_read_at(
     struct VaFsFileHandle* handle,
     void*                  buffer,
+    size_t                 size,
+    uint64_t               offset)
+{
+    struct VaFsIoVector vector = { buffer, size };
+
+    if (!buffer) {
+        errno = EINVAL;
+        return 0;
+    }
+    return __file_read_vectors(handle, &vector, 1, offset);
+}
+
+size_t vafs_file_readv(
+    struct VaFsFileHandle*     handle,
+    const struct VaFsIoVector* vectors,
+    int                        count,
+    uint64_t                   offset)
+{
+    return __file_read_vectors(handle, vectors, count, offset);
+}
+
+int vafs_file_read_async(
+    struct VaFsFileHandle* handle,
+    void*                  buffer,
+    size_t                 size,
+    uint64_t               offset,
+    VaFsReadCompleteFunc   callback,
+    void*                  context)
+{
+    if (!handle || !buffer || !callback) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the workers only exist for images opened for reading
+    if (handle->File->VaFs->AsyncPool == NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return vafs_asyncpool_queue(handle->File->VaFs->AsyncPool, handle, buffer, size, offset, callback, context);
+}
+
+static int __file_begin_write(
+    struct VaFsFileHandle* handle)
+{
+    int status;
+
+    if (handle->State == VaFsFileState_Write) {
+        return 0;
+    }
+
+    status = vafs_stream_lock(handle->File->VaFs->DataStream);
+    if (status) {
+        return -1;
+    }
+
+    // Set current file state to writing, so the stream gets unlocked.
+    handle->State = VaFsFileState_Write;
+
+    // the block size changes while the stream is locked, in between files
+    if (handle->BlockSize) {
+        return vafs_stream_set_block_size(handle->File->VaFs->DataStream, handle->BlockSize);
+    }
+    return 0;
+}
+
+static int __file_write_stream(
+    struct VaFsFileHandle* handle,
+    const void*            buffer,
     size_t                 size)
 {
     vafsblock_t block;
     uint32_t    offset;
     int         status;
 
+    status = __file_begin_write(handle);
+    if (status) {
+        return -1;
+    }
+
+    if (handle->File->Descriptor.Data.Offset == VA_FS_INVALID_OFFSET) {
+        status = vafs_stream_position(handle->File->VaFs->DataStream, &block, &offset);
+        if (status) {
+            return -1;
+        }
+        handle->File->Descriptor.Data.Index = block;
+        handle->File->Descriptor.Data.Offset = offset;
+    }
+
+    return vafs_stream_write(handle->File->VaFs->DataStream, buffer, size);
+}
+
+// __file_write_inline collects the written data while the file still fits the
+// inline threshold. Once it grows beyond, the collected data is written to the
+// data stream and the file is stored like any other. Returns 1 when the data
+// was not collected, and must be written to the data stream.
+static int __file_write_inline(
+    struct VaFsFileHandle* handle,
+    const void*            buffer,
+    size_t                 size)
+{
+    struct VaFs* vafs = handle->File->VaFs;
+    uint64_t     length = handle->File->Descriptor.FileLength;
+
+    // only files that are written from the start are inlined, shared
+    // files already point to their data
+    if (handle->InlineBuffer == NULL) {
+        if (!vafs->InlineThreshold || handle->State == VaFsFileState_Write ||
+            length != 0 || size > vafs->InlineThreshold) {
+            return 1;
+        }
+
+        handle->InlineBuffer = malloc(vafs->InlineThreshold);
+        if (!handle->InlineBuffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    if (length + size <= vafs->InlineThreshold) {
+        memcpy(handle->InlineBuffer + length, buffer, size);
+        return 0;
+    }
+
+    if (__file_write_stream(handle, handle->InlineBuffer, (size_t)length)) {
+        return -1;
+    }
+    free(handle->InlineBuffer);
+    handle->InlineBuffer = NULL;
+    return 1;
+}
+
+size_t vafs_file_write(
+    struct VaFsFileHandle* handle,
+    void*                  buffer,
+    size_t                 size)
+{
+    int status;
+
     if (!handle || !buffer || size == 0) {
         errno = EINVAL;
         return -1;
@@ -284,18 +497,60 @@ size_t vafs_file_write(
         return -1;
     }
 
-    if (handle->State != VaFsFileState_Write) {
-        status = vafs_stream_lock(handle->File->VaFs->DataStream);
+    status = __file_write_inline(handle, buffer, size);
+    if (status < 0) {
+        return -1;
+    }
+
+    if (status) {
+        status = __file_write_stream(handle, buffer, size);
         if (status) {
             return -1;
         }
+    }
+
+    // add to filelength
+    handle->File->Descriptor.FileLength += size;
+
+    // add to overview
+    handle->File->VaFs->Overview.TotalSizeUncompressed += size;
+
+    return 0;
+}
 
-        // Set current file state to writing, so the stream gets unlocked.
-        handle->State = VaFsFileState_Write;
+// __file_copy_block copies the block of the source that holds the data of
+// the source at the given position, if it holds the same data. Returns 1
+// when the block could not be copied and the data must be written instead.
+static int __file_copy_block(
+    struct VaFsFileHandle* handle,
+    struct VaFsFileHandle* source,
+    uint32_t               blockSize,
+    const void*            data)
+{
+    struct VaFs* vafs     = handle->File->VaFs;
+    uint64_t     position = handle->File->Descriptor.FileLength;
+    vafsblock_t  block;
+    uint32_t     offset;
+    int          status;
+
+    // The data of both files must start at the beginning of a block, so
+    // blocks of the source map to blocks of the file. All blocks of a
+    // file but the last one are full, so the block holds only this data.
+    if (source->File->Inline != NULL || source->File->Descriptor.Data.Offset != 0 ||
+        vafs_stream_block_size_at(source->File->VaFs->DataStream, source->File->Descriptor.Data.Index) != blockSize ||
+        position + blockSize > source->File->Descriptor.FileLength ||
+        (position != 0 && handle->File->Descriptor.Data.Offset != 0) ||
+        handle->InlineBuffer != NULL) {
+        return 1;
+    }
+
+    status = __file_begin_write(handle);
+    if (status) {
+        return -1;
     }
 
     if (handle->File->Descriptor.Data.Offset == VA_FS_INVALID_OFFSET) {
-        status = vafs_stream_position(handle->File->VaFs->DataStream, &block, &offset);
+        status = vafs_stream_position(vafs->DataStream, &block, &offset);
         if (status) {
             return -1;
         }
@@ -303,16 +558,157 @@ size_t vafs_file_write(
         handle->File->Descriptor.Data.Offset = offset;
     }
 
-    status = vafs_stream_write(handle->File->VaFs->DataStream, buffer, size);
-    if (status) {
+    return vafs_stream_copy_block(
+        vafs->DataStream,
+        source->File->VaFs->DataStream,
+        source->File->Descriptor.Data.Index + (vafsblock_t)(position / blockSize),
+        data
+    );
+}
+
+size_t vafs_file_write_from(
+    struct VaFsFileHandle* handle,
+    struct VaFsFileHandle* source,
+    void*                  buffer,
+    size_t                 size)
+{
+    const char* data = buffer;
+    uint32_t    blockSize;
+    int         status;
+
+    if (!handle || !buffer || size == 0) {
+        errno = EINVAL;
         return -1;
     }
 
-    // add to filelength
-    handle->File->Descriptor.FileLength += size;
+    // this is not valid when reading files
+    if (handle->File->VaFs->Mode == VaFsMode_Read) {
+        errno = ENOTSUP;
+        return -1;
+    }
 
-    // add to overview
-    handle->File->VaFs->Overview.TotalSizeUncompressed += size;
+    if (source == NULL || source->File->VaFs->Mode != VaFsMode_Read ||
+        !__vafs_same_filter(handle->File->VaFs, source->File->VaFs)) {
+        return vafs_file_write(handle, buffer, size);
+    }
+
+    // Split the data at the block boundaries of the file, every part that
+    // covers a full block may be copied from the source
+    blockSize = handle->BlockSize;
+    if (handle->State == VaFsFileState_Write || blockSize == 0) {
+        blockSize = vafs_stream_block_size(handle->File->VaFs->DataStream);
+    }
+    while (size) {
+        size_t count = blockSize - (size_t)(handle->File->Descriptor.FileLength % blockSize);
+        count = MIN(count, size);
+
+        status = 1;
+        if (count == blockSize) {
+            status = __file_copy_block(handle, source, blockSize, data);
+            if (status < 0) {
+                return -1;
+            }
+        }
+
+        if (status) {
+            if (vafs_file_write(handle, (void*)data, count)) {
+                return -1;
+            }
+        } else {
+            handle->File->Descriptor.FileLength += count;
+            handle->File->VaFs->Overview.TotalSizeUncompressed += count;
+        }
 
+        data += count;
+        size -= count;
+    }
     return 0;
 }
+
+int vafs_file_share(
+    struct VaFsFileHandle* handle,
+    struct VaFsFileHandle* source)
+{
+    if (!handle || !source || handle == source) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // this is only valid when writing files
+    if (handle->File->VaFs->Mode == VaFsMode_Read) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (handle->State == VaFsFileState_Write || handle->File->Descriptor.FileLength != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // contents that are still collected by the source must be committed
+    // first, so both files can be stored inline
+    if (__file_commit_inline(source)) {
+        return -1;
+    }
+
+    // Both descriptors point to the same position in the data stream, the
+    // data is only stored once but read back as two independent files.
+    handle->File->Descriptor.Data       = source->File->Descriptor.Data;
+    handle->File->Descriptor.FileLength = source->File->Descriptor.FileLength;
+    handle->File->Inline                = source->File->Inline;
+    handle->File->VaFs->Overview.TotalSizeUncompressed += source->File->Descriptor.FileLength;
+    return 0;
+}
+
+int vafs_file_set_block_size(
+    struct VaFsFileHandle* handle,
+    uint32_t               blockSize)
+{
+    if (!handle || blockSize < VA_FS_DATA_MIN_BLOCKSIZE || blockSize > VA_FS_DATA_MAX_BLOCKSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // this is only valid when writing files
+    if (handle->File->VaFs->Mode == VaFsMode_Read) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (handle->State == VaFsFileState_Write || handle->File->Descriptor.FileLength != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // Nothing changes until the data of the file is written to the data
+    // stream, so files that end up inlined keep the stream as it is.
+    handle->BlockSize = blockSize;
+    return 0;
+}
+
+int vafs_file_align(
+    struct VaFsFileHandle* handle)
+{
+    if (!handle) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // this is only valid when writing files
+    if (handle->File->VaFs->Mode == VaFsMode_Read) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (handle->State == VaFsFileState_Write || handle->File->Descriptor.FileLength != 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // The stream stays locked until the file is closed, so no other file
+    // can be written between the alignment and the data of this file.
+    if (__file_begin_write(handle)) {
+        return -1;
+    }
+    return vafs_stream_align(handle->File->VaFs->DataStream);
+}
@@ -0,0 +1,203 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vali Initrd Filesystem
+ * - Contains the implementation of the Vali Initrd Filesystem.
+ *   This filesystem is used to store the initrd of the kernel.
+ */
+
+#include <errno.h>
+#include "private.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The maximum number of idle contexts kept for decoding, contexts
+// that are released while the pool is full are destroyed.
+#define FILTER_CONTEXT_POOL_SIZE 16
+
+struct VaFsFilter {
+    struct VaFsFeatureFilterOps2 Ops;
+
+    // Filters installed with the first version of the operations have
+    // no contexts, and allocate the encoded data themselves.
+    VaFsFilterEncodeFunc         LegacyEncode;
+    VaFsFilterDecodeFunc         LegacyDecode;
+
+    mtx_t                        Lock;
+    void*                        Contexts[FILTER_CONTEXT_POOL_SIZE];
+    int                          ContextCount;
+};
+
+int vafs_filter_create(
+    struct VaFsFeatureHeader* ops,
+    struct VaFsFilter**       filterOut)
+{
+    struct VaFsFilter* filter;
+
+    if (ops == NULL || filterOut == NULL || ops->Length < sizeof(struct VaFsFeatureFilterOps)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    filter = malloc(sizeof(struct VaFsFilter));
+    if (!filter) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(filter, 0, sizeof(struct VaFsFilter));
+
+    if (ops->Length >= sizeof(struct VaFsFeatureFilterOps2)) {
+        memcpy(&filter->Ops, ops, sizeof(struct VaFsFeatureFilterOps2));
+    }
+    else {
+        struct VaFsFeatureFilterOps* legacy = (struct VaFsFeatureFilterOps*)ops;
+        filter->LegacyEncode = legacy->Encode;
+        filter->LegacyDecode = legacy->Decode;
+    }
+
+    mtx_init(&filter->Lock, mtx_plain);
+    *filterOut = filter;
+    return 0;
+}
+
+void vafs_filter_destroy(
+    struct VaFsFilter* filter)
+{
+    if (filter == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < filter->ContextCount; i++) {
+        filter->Ops.DestroyContext(filter->Contexts[i]);
+    }
+    mtx_destroy(&filter->Lock);
+    free(filter);
+}
+
+int vafs_filter_context_acquire(
+    struct VaFsFilter* filter,
+    void**             contextOut)
+{
+    void* context = NULL;
+
+    if (filter == NULL || contextOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (filter->Ops.CreateContext == NULL) {
+        *contextOut = NULL;
+        return 0;
+    }
+
+    mtx_lock(&filter->Lock);
+    if (filter->ContextCount) {
+        context = filter->Contexts[--filter->ContextCount];
+    }
+    mtx_unlock(&filter->Lock);
+
+    if (context == NULL && filter->Ops.CreateContext(&context)) {
+        VAFS_ERROR("vafs_filter_context_acquire: failed to create filter context\n");
+        return -1;
+    }
+
+    *contextOut = context;
+    return 0;
+}
+
+void vafs_filter_context_release(
+    struct VaFsFilter* filter,
+    void*              context)
+{
+    if (filter == NULL || context == NULL) {
+        return;
+    }
+
+    mtx_lock(&filter->Lock);
+    if (filter->ContextCount < FILTER_CONTEXT_POOL_SIZE) {
+        filter->Contexts[filter->ContextCount++] = context;
+        context = NULL;
+    }
+    mtx_unlock(&filter->Lock);
+
+    if (context != NULL) {
+        filter->Ops.DestroyContext(context);
+    }
+}
+
+static int __legacy_encode(
+    struct VaFsFilter* filter,
+    const void*        input,
+    uint32_t           inputLength,
+    void*              output,
+    uint32_t*          outputLength)
+{
+    void*    encoded;
+    uint32_t encodedLength;
+    int      status;
+
+    status = filter->LegacyEncode((void*)input, inputLength, &encoded, &encodedLength);
+    if (status) {
+        return status;
+    }
+
+    if (encodedLength > *outputLength) {
+        free(encoded);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memcpy(output, encoded, encodedLength);
+    free(encoded);
+    *outputLength = encodedLength;
+    return 0;
+}
+
+int vafs_filter_encode(
+    struct VaFsFilter* filter,
+    void*              context,
+    const void*        input,
+    uint32_t           inputLength,
+    void*              output,
+    uint32_t*          outputLength)
+{
+    if (filter->LegacyEncode) {
+        return __legacy_encode(filter, input, inputLength, output, outputLength);
+    }
+    if (filter->Ops.Encode) {
+        return filter->Ops.Encode(context, input, inputLength, output, outputLength);
+    }
+    errno = ENOTSUP;
+    return -1;
+}
+
+int vafs_filter_decode(
+    struct VaFsFilter* filter,
+    void*              context,
+    const void*        input,
+    uint32_t           inputLength,
+    void*              output,
+    uint32_t*          outputLength)
+{
+    if (filter->LegacyDecode) {
+        return filter->LegacyDecode((void*)input, inputLength, output, outputLength);
+    }
+    if (filter->Ops.Decode) {
+        return filter->Ops.Decode(context, input, inputLength, output, outputLength);
+    }
+    errno = ENOTSUP;
+    return -1;
+}
@@ -24,6 +24,19 @@
 
 #include <vafs/vafs.h>
 
+struct VaFsIoVector {
+    void*  Buffer;
+    size_t Length;
+};
+
+/**
+ * @brief Invoked when an asynchronous read has completed, on one of the workers of the image.
+ * Error is 0 when the read succeeded, BytesRead is 0 without an error when reading at or beyond
+ * the end of the file. Requests that were still queued when the image was closed are completed
+ * with ECANCELED.
+ */
+typedef void(*VaFsReadCompleteFunc)(void* Context, size_t BytesRead, int Error);
+
 /**
  * @brief 
  * 
@@ -78,7 +91,8 @@ extern int vafs_file_seek(
     int                    whence);
 
 /**
- * @brief 
+ * @brief Reads up to size bytes from the current position of the file, and advances
+ * the position by the number of bytes read. Consecutive reads thus read the file sequentially.
  * 
  * @param[In] handle
  * @param[In] buffer
@@ -94,6 +108,68 @@ extern size_t vafs_file_read(
     void*                  buffer,
     size_t                 size);
 
+/**
+ * @brief Reads up to size bytes from the given offset of the file. The position of the
+ * handle is neither used nor changed, so a handle may be shared by multiple threads that
+ * read through this function concurrently.
+ * 
+ * @param[In] handle The file handle to read from.
+ * @param[In] buffer The buffer to read data into.
+ * @param[In] size   The number of bytes to read.
+ * @param[In] offset The offset into the file to read from.
+ * @return size_t Returns the number of bytes read. If 0 is returned it's important to further see
+ *                the error code set in errno.
+ *                ENODATA - The offset is at or beyond the end of the file.
+ *                EINVAL - Invalid parameters supplied.
+ */
+extern size_t vafs_file_read_at(
+    struct VaFsFileHandle* handle,
+    void*                  buffer,
+    size_t                 size,
+    uint64_t               offset);
+
+/**
+ * @brief Vectored version of vafs_file_read_at. The vectors are filled in order with
+ * consecutive data of the file, starting at the given offset. Vectors that touch the
+ * same block are served from a single load of that block.
+ * 
+ * @param[In] handle  The file handle to read from.
+ * @param[In] vectors The buffers to read data into.
+ * @param[In] count   The number of entries in vectors.
+ * @param[In] offset  The offset into the file to read from.
+ * @return size_t Returns the total number of bytes read. See vafs_file_read_at for errors.
+ */
+extern size_t vafs_file_readv(
+    struct VaFsFileHandle*     handle,
+    const struct VaFsIoVector* vectors,
+    int                        count,
+    uint64_t                   offset);
+
+/**
+ * @brief Queues a read of up to size bytes from the given offset of the file, and returns
+ * without waiting for it. The blocks are loaded and decoded by the workers of the image, and
+ * callback is invoked from a worker once the buffer has been filled. Any number of reads may
+ * be in flight, also for the same handle. The handle and the buffer must stay valid until the
+ * callback has been invoked. Requires the async feature to be installed on the image.
+ * 
+ * @param[In] handle   The file handle to read from.
+ * @param[In] buffer   The buffer to read data into.
+ * @param[In] size     The number of bytes to read.
+ * @param[In] offset   The offset into the file to read from.
+ * @param[In] callback The function to invoke when the read has completed.
+ * @param[In] context  Passed to the callback.
+ * @return int 0 if the read was queued, -1 on failure. See errno for more details.
+ *             ENOTSUP - The async feature is not installed, or the image is not opened for reading.
+ *             EINVAL - Invalid parameters supplied.
+ */
+extern int vafs_file_read_async(
+    struct VaFsFileHandle* handle,
+    void*                  buffer,
+    size_t                 size,
+    uint64_t               offset,
+    VaFsReadCompleteFunc   callback,
+    void*                  context);
+
 /**
  * @brief 
  * 
@@ -107,4 +183,72 @@ extern size_t vafs_file_write(
     void*                  buffer,
     size_t                 size);
 
+/**
+ * @brief Makes the file refer to the data of another file in the image, instead of
+ * writing the same contents again. This is only valid when creating an image, the
+ * source must be completely written and the file must not have been written to yet.
+ * 
+ * @param[In] handle The file that should share the data.
+ * @param[In] source The file that holds the data.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ *             ENOTSUP - The image is not being created.
+ *             EBUSY - The file has already been written to.
+ *             EINVAL - Invalid parameters supplied.
+ */
+extern int vafs_file_share(
+    struct VaFsFileHandle* handle,
+    struct VaFsFileHandle* source);
+
+/**
+ * @brief Writes data to the file like vafs_file_write, but reuses the encoded data blocks of
+ * a file in another image wherever they hold the same data at the same offset. Such blocks are
+ * copied as they are stored in the other image, instead of encoding the data again. This only
+ * happens when both images use the same filter and block size, and the data of both files starts
+ * at the beginning of a block, see vafs_file_align. The data is written normally otherwise.
+ * 
+ * @param[In] handle The file to write to, in an image that is being created.
+ * @param[In] source A file with the previous contents, in an image opened for reading. May be NULL.
+ * @param[In] buffer The data to write.
+ * @param[In] size   The number of bytes to write.
+ * @return size_t 0 on success, -1 on failure. See errno for more details.
+ */
+extern size_t vafs_file_write_from(
+    struct VaFsFileHandle* handle,
+    struct VaFsFileHandle* source,
+    void*                  buffer,
+    size_t                 size);
+
+/**
+ * @brief Makes the data of the file start at the beginning of a new data block, so reading
+ * the file does not decode the end of the previous block. This is only valid when creating
+ * an image, and must be called before the file is written to. Aligned files are never inlined.
+ * 
+ * @param[In] handle The file that should be aligned.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ *             ENOTSUP - The image is not being created.
+ *             EBUSY - The file has already been written to.
+ *             EINVAL - Invalid parameters supplied.
+ */
+extern int vafs_file_align(
+    struct VaFsFileHandle* handle);
+
+/**
+ * @brief Selects the number of bytes of decoded data each block holding the file stores. Reading
+ * a small part of a file decodes at most one such block, so small blocks suit files that are read
+ * at random offsets, while large blocks compress better. The file starts in a new block if the
+ * size differs from the file written before it, and later files keep the size until it is changed
+ * again. This is only valid when creating an image, and must be called before the file is written to.
+ * 
+ * @param[In] handle    The file to select the block size of.
+ * @param[In] blockSize The block size, from 8kb to 1mb, sizes above the block size of the image
+ *                      are limited to it.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ *             ENOTSUP - The image is not being created.
+ *             EBUSY - The file has already been written to.
+ *             EINVAL - Invalid parameters supplied.
+ */
+extern int vafs_file_set_block_size(
+    struct VaFsFileHandle* handle,
+    uint32_t               blockSize);
+
 #endif //!__VAFS_FILE_H__
@@ -30,6 +30,7 @@
 #endif
 
 #if defined(_WIN32) || defined(_WIN64)
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <windows.h>
 
@@ -61,13 +62,93 @@ static inline int mtx_unlock(mtx_t* mtx) {
     return thrd_success;
 }
 
+typedef HANDLE thrd_t;
+typedef int (*thrd_start_t)(void*);
+
+struct __thrd_start {
+    thrd_start_t func;
+    void*        arg;
+};
+
+static DWORD WINAPI __thrd_entry(LPVOID param) {
+    struct __thrd_start start = *(struct __thrd_start*)param;
+    free(param);
+    return (DWORD)start.func(start.arg);
+}
+
+static inline int thrd_create(thrd_t* thr, thrd_start_t func, void* arg) {
+    struct __thrd_start* start = malloc(sizeof(struct __thrd_start));
+    if (!start) {
+        return thrd_error;
+    }
+    start->func = func;
+    start->arg  = arg;
+    *thr = CreateThread(NULL, 0, __thrd_entry, start, 0, NULL);
+    if (*thr == NULL) {
+        free(start);
+        return thrd_error;
+    }
+    return thrd_success;
+}
+
+static inline int thrd_join(thrd_t thr, int* res) {
+    DWORD code;
+    WaitForSingleObject(thr, INFINITE);
+    if (res && GetExitCodeThread(thr, &code)) {
+        *res = (int)code;
+    }
+    CloseHandle(thr);
+    return thrd_success;
+}
+
+typedef CONDITION_VARIABLE cnd_t;
+
+static inline int cnd_init(cnd_t* cnd) {
+    InitializeConditionVariable(cnd);
+    return thrd_success;
+}
+
+static inline void cnd_destroy(cnd_t* cnd) {
+    (void)cnd;
+}
+
+static inline int cnd_wait(cnd_t* cnd, mtx_t* mtx) {
+    return SleepConditionVariableCS(cnd, mtx, INFINITE) ? thrd_success : thrd_error;
+}
+
+static inline int cnd_signal(cnd_t* cnd) {
+    WakeConditionVariable(cnd);
+    return thrd_success;
+}
+
+static inline int cnd_broadcast(cnd_t* cnd) {
+    WakeAllConditionVariable(cnd);
+    return thrd_success;
+}
+
+// Only the relaxed counters used for statistics are provided
+typedef volatile LONG64 atomic_ullong;
+#define memory_order_relaxed 0
+
+static inline unsigned long long atomic_fetch_add_explicit(atomic_ullong* obj, unsigned long long arg, int order) {
+    (void)order;
+    return (unsigned long long)InterlockedExchangeAdd64(obj, (LONG64)arg);
+}
+
+static inline unsigned long long atomic_load_explicit(atomic_ullong* obj, int order) {
+    (void)order;
+    return (unsigned long long)InterlockedCompareExchange64(obj, 0, 0);
+}
+
 #if !defined S_ISDIR
     #define S_ISDIR(m) (((m) & _S_IFDIR) == _S_IFDIR)
 #endif
 #elif defined(VALI)
 #include <io.h>
+#include <stdatomic.h>
 #include <threads.h>
 #else
+#include <stdatomic.h>
 #include <sys/stat.h>
 #include <threads.h>
 #endif
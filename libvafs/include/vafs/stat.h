@@ -45,4 +45,19 @@ extern int vafs_path_stat(
     int               followLinks,
     struct vafs_stat* stat);
 
+/**
+ * @brief Reads the next entry of a directory like vafs_directory_read, and also
+ * provides the attributes of the entry. This avoids a path lookup per entry when
+ * both are needed. Symlinks are not followed.
+ * 
+ * @param[In]  handle The directory handle to read from.
+ * @param[Out] entry  A pointer to a struct VaFsEntry that is filled with information if an entry is available.
+ * @param[Out] stat   A pointer to a struct vafs_stat that is filled with the attributes of the entry.
+ * @return int Returns -1 on error or if no more entries are available (errno is set accordingly), 0 on success
+ */
+extern int vafs_directory_read_stat(
+    struct VaFsDirectoryHandle* handle,
+    struct VaFsEntry*           entry,
+    struct vafs_stat*           stat);
+
 #endif //!__VAFS_STAT_H__
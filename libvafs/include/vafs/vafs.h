@@ -32,6 +32,7 @@ struct VaFs;
 struct VaFsDirectoryHandle;
 struct VaFsFileHandle;
 struct VaFsSymlinkHandle;
+struct VaFsBlockCache;
 
 struct VaFsGuid {
     uint32_t Data1;
@@ -42,13 +43,36 @@ struct VaFsGuid {
 
 /**
  * List of builtin features for the filesystem
- * VA_FS_FEATURE_OVERVIEW   - Overview of the filesystem
- * VA_FS_FEATURE_FILTER     - Data filters can be applied for data streams
- * VA_FS_FEATURE_FILTER_OPS - Filter operations (Not persistant)
+ * VA_FS_FEATURE_OVERVIEW    - Overview of the filesystem
+ * VA_FS_FEATURE_FILTER      - Data filters can be applied for data streams
+ * VA_FS_FEATURE_FILTER_OPS  - Filter operations (Not persistant)
+ * VA_FS_FEATURE_FILTER_DICT - Dictionary used by the data filter
+ * VA_FS_FEATURE_CHECKSUM    - Checksum algorithm used for blocks
+ * VA_FS_FEATURE_VERIFY      - Block checksum verification mode (Not persistant)
+ * VA_FS_FEATURE_CACHE       - Block cache configuration (Not persistant)
+ * VA_FS_FEATURE_READAHEAD   - Sequential readahead of data blocks (Not persistant)
+ * VA_FS_FEATURE_PRELOAD     - Loading of the directory tree in the background (Not persistant)
+ * VA_FS_FEATURE_INLINE      - Small files are stored in their descriptors
+ * VA_FS_FEATURE_ASYNC       - Workers for asynchronous file reads (Not persistant)
  */
-#define VA_FS_FEATURE_OVERVIEW   { 0xB1382352, 0x4BC7, 0x45D2, { 0xB7, 0x59, 0x61, 0x5A, 0x42, 0xD4, 0x45, 0x2A } }
-#define VA_FS_FEATURE_FILTER     { 0x99C25D91, 0xFA99, 0x4A71, { 0x9C, 0xB5, 0x96, 0x1A, 0xA9, 0x3D, 0xDF, 0xBB } }
-#define VA_FS_FEATURE_FILTER_OPS { 0x17BC0212, 0x7DF3, 0x4BDD, { 0x99, 0x24, 0x5A, 0xC8, 0x13, 0xBE, 0x72, 0x49 } }
+#define VA_FS_FEATURE_OVERVIEW    { 0xB1382352, 0x4BC7, 0x45D2, { 0xB7, 0x59, 0x61, 0x5A, 0x42, 0xD4, 0x45, 0x2A } }
+#define VA_FS_FEATURE_FILTER      { 0x99C25D91, 0xFA99, 0x4A71, { 0x9C, 0xB5, 0x96, 0x1A, 0xA9, 0x3D, 0xDF, 0xBB } }
+#define VA_FS_FEATURE_FILTER_OPS  { 0x17BC0212, 0x7DF3, 0x4BDD, { 0x99, 0x24, 0x5A, 0xC8, 0x13, 0xBE, 0x72, 0x49 } }
+#define VA_FS_FEATURE_FILTER_DICT { 0x7B2C4252, 0x06BB, 0x4557, { 0x91, 0x2A, 0xC8, 0x57, 0x0E, 0xC4, 0x61, 0x00 } }
+#define VA_FS_FEATURE_CHECKSUM    { 0xBBDB21EA, 0x61B4, 0x4687, { 0x91, 0xA6, 0xAF, 0x66, 0x51, 0xD1, 0x6D, 0x48 } }
+#define VA_FS_FEATURE_VERIFY      { 0x1B6E454D, 0x793F, 0x4649, { 0xB6, 0xD0, 0x76, 0xC5, 0x78, 0x44, 0xB8, 0xD3 } }
+#define VA_FS_FEATURE_CACHE       { 0x5E0A7C3B, 0x2D41, 0x4F6A, { 0x8B, 0x1E, 0xC4, 0x93, 0x60, 0x7D, 0xA2, 0x15 } }
+#define VA_FS_FEATURE_READAHEAD   { 0xC2F4E816, 0x93A7, 0x4B0D, { 0xA5, 0x6C, 0x1F, 0x38, 0xD9, 0x42, 0x7E, 0xB0 } }
+#define VA_FS_FEATURE_PRELOAD     { 0x21295748, 0x230E, 0x4138, { 0x86, 0xB3, 0xE6, 0xF2, 0x55, 0x61, 0xBA, 0x7B } }
+#define VA_FS_FEATURE_INLINE      { 0x6D3A9F27, 0xC81E, 0x4E52, { 0xA0, 0x47, 0x3B, 0xD6, 0x19, 0x8C, 0xF2, 0x64 } }
+#define VA_FS_FEATURE_ASYNC       { 0x4F81C0B6, 0x5A2D, 0x47E3, { 0x9D, 0x14, 0x6B, 0xE0, 0x37, 0xA2, 0xC5, 0x8F } }
+
+// The largest threshold allowed for the inline feature
+#define VA_FS_INLINE_MAX_SIZE (16 * 1024)
+
+// The number of workers used by the async feature when none is given, and the most allowed
+#define VA_FS_ASYNC_DEFAULT_WORKERS 4
+#define VA_FS_ASYNC_MAX_WORKERS     64
 
 enum VaFsLogLevel {
     VaFsLogLevel_Error,
@@ -108,7 +132,8 @@ struct VaFsEntry {
 
 /**
  * @brief It is expected of the encode function to allocate a buffer of the size of the data and provide
- * the size of the allocated buffer for the encoded data in the Output/OutputLength parameters.
+ * the size of the allocated buffer for the encoded data in the Output/OutputLength parameters. If the
+ * image is configured with more than one encoder thread, the function is invoked from multiple threads at once.
  */
 typedef int(*VaFsFilterEncodeFunc)(void* Input, uint32_t InputLength, void** Output, uint32_t* OutputLength);
 
@@ -125,20 +150,231 @@ struct VaFsFeatureFilterOps {
     VaFsFilterDecodeFunc     Decode;
 };
 
+/**
+ * @brief Version 2 of the filter operations keeps the state of the filter in contexts, and
+ * encodes into buffers provided by the library, so no memory has to be allocated per block.
+ * The operations are installed through the VA_FS_FEATURE_FILTER_OPS feature as well, with
+ * the header length set to the size of struct VaFsFeatureFilterOps2.
+ *
+ * Contexts are created by the library as they are needed, each encoder thread keeps its own
+ * context, and decoders take one from a pool. A context is never used by more than one thread
+ * at a time. If CreateContext is NULL, the filter is stateless and is passed a NULL context.
+ */
+typedef int(*VaFsFilterCreateContextFunc)(void** ContextOut);
+typedef void(*VaFsFilterDestroyContextFunc)(void* Context);
+
+/**
+ * @brief The encode function is provided with an output buffer of OutputLength bytes, and should set OutputLength
+ * to the size of the encoded data. If the encoded data would not fit the output buffer, the function should fail
+ * with errno set to ENOSPC, in which case the block is stored as it is.
+ */
+typedef int(*VaFsFilterEncode2Func)(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength);
+
+/**
+ * @brief The decode function works like VaFsFilterDecodeFunc, with the addition of the context.
+ */
+typedef int(*VaFsFilterDecode2Func)(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength);
+
+struct VaFsFeatureFilterOps2 {
+    struct VaFsFeatureHeader     Header;
+    VaFsFilterCreateContextFunc  CreateContext;
+    VaFsFilterDestroyContextFunc DestroyContext;
+    VaFsFilterEncode2Func        Encode;
+    VaFsFilterDecode2Func        Decode;
+};
+
+/**
+ * @brief The checksum algorithms that can be used for the blocks of an image.
+ * VaFsChecksum_CRC32  - The default, CRC-32 most significant bit first.
+ * VaFsChecksum_CRC32C - CRC-32C (Castagnoli), calculated with the crc instructions
+ *                       of the processor where available.
+ */
+enum VaFsChecksum {
+    VaFsChecksum_CRC32,
+    VaFsChecksum_CRC32C
+};
+
+/**
+ * @brief The checksum feature selects the checksum algorithm used for all blocks of the image.
+ * It must be installed right after creating the image, before anything is written, and is stored
+ * in the disk image. Images without it use VaFsChecksum_CRC32. Images using an algorithm that is
+ * unknown to the library can not be opened.
+ */
+struct VaFsFeatureChecksum {
+    struct VaFsFeatureHeader Header;
+    uint32_t                 Algorithm;
+};
+
+/**
+ * @brief The verification modes for block checksums when reading an image.
+ * VaFsVerify_Always - The checksum of a block is verified every time it is read from the image.
+ * VaFsVerify_Once   - The checksum of a block is only verified the first time it is read, blocks
+ *                     that are evicted from the block cache and read again are not verified again.
+ */
+enum VaFsVerifyMode {
+    VaFsVerify_Always,
+    VaFsVerify_Once
+};
+
+/**
+ * @brief The verify feature controls how block checksums are verified while reading the image.
+ * Blocks served from the block cache are never verified again, by default blocks are verified
+ * every time they are read from the underlying storage.
+ *
+ * The feature must be installed right after opening the image, and is not transferred to the disk image.
+ */
+struct VaFsFeatureVerify {
+    struct VaFsFeatureHeader Header;
+    uint32_t                 Mode;
+};
+
+/**
+ * @brief The eviction policy used by a block cache once it is full. Both policies
+ * evict in constant time.
+ * VaFsCachePolicy_LRU  - Evicts the least recently used block.
+ * VaFsCachePolicy_SLRU - Segmented LRU, blocks that are hit while cached are moved into
+ *                        a protected segment, and are only evicted once they are the least
+ *                        recently used blocks of that segment. This keeps a single large
+ *                        sequential scan from flushing out the hot blocks.
+ */
+enum VaFsCachePolicy {
+    VaFsCachePolicy_LRU,
+    VaFsCachePolicy_SLRU
+};
+
+/**
+ * @brief The cache feature controls the block cache used when reading the image. By default
+ * each image has its own cache, which is shared by the descriptor and the data stream. If Cache
+ * is set, the image uses that cache instead, which allows multiple images to share a single memory
+ * budget. Otherwise a new cache of Size bytes is created for the image, a size of 0 disables caching.
+ *
+ * The feature must be installed right after opening the image, and is not transferred to the disk image.
+ */
+struct VaFsFeatureCache {
+    struct VaFsFeatureHeader Header;
+    size_t                   Size;
+    struct VaFsBlockCache*   Cache;
+};
+
+/**
+ * @brief The readahead feature enables loading of data blocks ahead of file reads. When a
+ * file handle is detected reading blocks in order, the following blocks are decoded into the
+ * block cache by a background worker, which lets decoding overlap with the consumption of the
+ * data. The number of blocks loaded ahead grows with the length of the sequential run, up to
+ * MaxBlocks. A MaxBlocks of 0 disables readahead again.
+ *
+ * The feature must be installed right after opening the image, and is not transferred to the disk image.
+ */
+struct VaFsFeatureReadahead {
+    struct VaFsFeatureHeader Header;
+    uint32_t                 MaxBlocks;
+};
+
+/**
+ * @brief The preload feature loads the entire directory tree of the image in the background,
+ * including the name indices of large directories. Directories are otherwise loaded on first
+ * access, which makes the first lookups in a freshly opened image slower than later ones. Lookups
+ * can be made while the preload is running, and load the directories they need themselves.
+ *
+ * The feature must be installed right after opening the image, after any filter operations, and
+ * is not transferred to the disk image.
+ */
+struct VaFsFeaturePreload {
+    struct VaFsFeatureHeader Header;
+};
+
+/**
+ * @brief The inline feature stores the contents of files of at most Threshold bytes in their
+ * descriptor instead of the data stream. Reading such a file is served from the directory it
+ * was loaded with, and never loads a data block. The threshold can be at most VA_FS_INLINE_MAX_SIZE.
+ *
+ * The feature must be installed right after creating the image, before any files are written, and
+ * is stored in the disk image. Images with inlined files can not be read by versions of the library
+ * that do not know this feature.
+ */
+struct VaFsFeatureInline {
+    struct VaFsFeatureHeader Header;
+    uint32_t                 Threshold;
+};
+
+/**
+ * @brief The async feature starts the workers that serve vafs_file_read_async. Each worker loads
+ * and decodes the blocks of one request at a time, so Workers is the number of requests that are
+ * read from the device concurrently, while any number of them can be queued. A Workers of 0 uses
+ * VA_FS_ASYNC_DEFAULT_WORKERS, and at most VA_FS_ASYNC_MAX_WORKERS are started.
+ *
+ * The feature must be installed right after opening the image, and is not transferred to the disk image.
+ */
+struct VaFsFeatureAsync {
+    struct VaFsFeatureHeader Header;
+    uint32_t                 Workers;
+};
+
+/**
+ * @brief Counters of a single stream of an image, see vafs_get_stats. Times are given
+ * in nanoseconds.
+ */
+struct VaFsStreamStats {
+    // Block requests of readers that were served by the
+    // block cache, and those that had to load the block.
+    uint64_t CacheHits;
+    uint64_t CacheMisses;
+
+    // Blocks that were decoded by the filter, and the time spent doing so
+    uint64_t BlocksDecoded;
+    uint64_t DecodeTime;
+
+    // Bytes of block data read or mapped from the image
+    uint64_t BytesRead;
+
+    // Time spent calculating block checksums
+    uint64_t VerifyTime;
+};
+
+struct VaFsStats {
+    struct VaFsStreamStats Descriptors;
+    struct VaFsStreamStats Data;
+
+    // Blocks evicted from the block cache of the image. A cache that is shared
+    // through VA_FS_FEATURE_CACHE counts the evictions of all images using it.
+    uint64_t               CacheEvictions;
+
+    // The number of times a reader had to wait for the lock of the block
+    // cache, or of an image device without positional reads.
+    uint64_t               LockContention;
+
+    // Directories whose entries were loaded from the descriptor stream
+    uint64_t               DirectoryLoads;
+};
+
 struct VaFsConfiguration {
     // Allow the filesystem to be valid only for a specific
     // architecture
     enum VaFsArchitecture Architecture;
 
-    // The data block size can override the dynamic selection of 
-    // block sizes, by enforcing all data block sizes to be of this
-    // size. The allowed range for this value is 8kb - 1mb.
+    // The number of bytes of decoded data each data block holds, unless
+    // files select smaller blocks with vafs_file_set_block_size. This
+    // is the largest block size of the image, and the allowed range for
+    // this value is 8kb - 1mb.
     uint32_t              DataBlockSize;
+
+    // The number of threads used to encode blocks when a filter
+    // is installed. Blocks are always written to the image in order,
+    // and a value of 1 or less encodes on the writing thread.
+    int                   EncoderThreads;
+
+    // When non-zero, data blocks are written straight to the image file
+    // instead of being staged and copied into the image on close. This many
+    // bytes following the image header are reserved for the features, and
+    // adding features that do not fit fails with ENOSPC.
+    uint32_t              FeatureReserve;
 };
 
 extern void vafs_config_initialize(struct VaFsConfiguration* configuration);
 extern void vafs_config_set_architecture(struct VaFsConfiguration* configuration, enum VaFsArchitecture architecture);
 extern void vafs_config_set_block_size(struct VaFsConfiguration* configuration, uint32_t blockSize);
+extern void vafs_config_set_encoder_threads(struct VaFsConfiguration* configuration, int threadCount);
+extern void vafs_config_set_direct_write(struct VaFsConfiguration* configuration, uint32_t featureReserve);
 
 /**
  * @brief Allows custom backends as vafs images. The default API for vafs only supports
@@ -192,8 +428,48 @@ struct VaFsOperations {
      * @return int 0 on success, -1 on failure. See errno for more details.
      */
     int (*close)(void* userData);
+
+    /**
+     * @brief Read bytes from a specific position on the storage, without using or changing
+     * the current position. When provided, this is used for all block loads, and may be invoked
+     * from multiple threads at once. Without it, block loads are serialized through seek+read.
+     * The pread function is optional, and must be set to NULL if not provided.
+     * @param userData  The user-supplied pointer that was given to vafs_open_ops
+     * @param buffer    The buffer that will be used to store the data.
+     * @param length    The number of bytes which will be read from the storage.
+     * @param offset    The absolute position on the storage to read from.
+     * @param bytesRead The actual number of bytes read, up to max <length>.
+     * @return int 0 on success, -1 on failure. See errno for more details.
+     */
+    int (*pread)(void* userData, void*, size_t, uint64_t, size_t*);
 };
 
+/**
+ * @brief Creates a new block cache that can be shared by multiple images through the
+ * VA_FS_FEATURE_CACHE feature. The cache holds decoded blocks up to a total of @size bytes,
+ * after this, blocks are evicted according to @policy. Blocks are only admitted to the cache when
+ * they are requested for a second time, which keeps a full extraction of an image from flushing the
+ * cache. The cache is reference counted, images using it keep it alive until they are closed.
+ * 
+ * @param[In]  size     The maximum number of bytes to cache.
+ * @param[In]  policy   The eviction policy to use.
+ * @param[Out] cacheOut A pointer where the handle of the cache will be stored.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ */
+extern int vafs_cache_create(
+    size_t                  size,
+    enum VaFsCachePolicy    policy,
+    struct VaFsBlockCache** cacheOut);
+
+/**
+ * @brief Releases the callers reference to the cache. The cache is destroyed once it is
+ * no longer used by any images.
+ * 
+ * @param[In] cache The cache to release.
+ */
+extern void vafs_cache_destroy(
+    struct VaFsBlockCache* cache);
+
 /**
  * @brief Control the log level of the library. This is useful for debugging. The default
  * log level is set to VaFsLogLevel_Warning.
@@ -229,6 +505,20 @@ extern int vafs_open_file(
     const char*   path,
     struct VaFs** vafsOut);
 
+/**
+ * @brief Opens an existing filesystem image by mapping it into memory. The image handle only permits
+ * operations that read from the image. Blocks are decoded directly from the mapping, and blocks that are
+ * stored without compression are served from the mapped pages without being copied. This is not supported
+ * on all platforms, in which case errno is set to ENOTSUP.
+ * 
+ * @param[In]  path    Path to the filesystem image. 
+ * @param[Out] vafsOut A pointer where the handle of the filesystem instance will be stored.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ */
+extern int vafs_open_mmap(
+    const char*   path,
+    struct VaFs** vafsOut);
+
 /**
  * @brief Opens an existing filesystem image buffer. The image handle only permits operations that read
  * from the image. All images that are created by this library are read-only. The image buffer needs to stay
@@ -295,4 +585,17 @@ extern int vafs_feature_query(
     struct VaFsGuid*           guid,
     struct VaFsFeatureHeader** featureOut);
 
+/**
+ * @brief Retrieves the runtime statistics of the image. The counters are updated without
+ * locks, so this may be called at any time while the image is in use. Counters start at 0
+ * when the image is opened.
+ * 
+ * @param[In]  vafs     The filesystem image to get the statistics of.
+ * @param[Out] statsOut A pointer to where the statistics will be stored.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ */
+extern int vafs_get_stats(
+    struct VaFs*      vafs,
+    struct VaFsStats* statsOut);
+
 #endif //!__VAFS_H__
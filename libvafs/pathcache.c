@@ -0,0 +1,225 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vali Initrd Filesystem
+ * - Contains the implementation of the Vali Initrd Filesystem.
+ *   This filesystem is used to store the initrd of the kernel.
+ */
+
+#include <errno.h>
+#include "private.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct __path_key {
+    uint64_t    hash;
+    const char* path;
+    int         follow;
+    uint32_t    slot;
+};
+
+struct __path_slot {
+    char*                      path;
+    int                        follow;
+    struct VaFsDirectoryEntry* entry;
+    int                        error;
+    int                        referenced;
+};
+
+struct VaFsPathCache {
+    mtx_t               Lock;
+    hashtable_t         Index;
+    struct __path_slot* Slots;
+    uint32_t            Capacity;
+    uint32_t            Hand;
+};
+
+static uint64_t __path_hash(const void* element);
+static int      __path_cmp(const void* lh, const void* rh);
+
+int vafs_pathcache_create(
+    uint32_t               capacity,
+    struct VaFsPathCache** cacheOut)
+{
+    struct VaFsPathCache* cache;
+    int                   status;
+
+    if (capacity == 0 || cacheOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    cache = malloc(sizeof(struct VaFsPathCache));
+    if (!cache) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(cache, 0, sizeof(struct VaFsPathCache));
+
+    cache->Slots = calloc(capacity, sizeof(struct __path_slot));
+    if (!cache->Slots) {
+        free(cache);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // size the index so it never needs to grow once the cache is full
+    status = vafs_hashtable_construct(
+        &cache->Index,
+        ((size_t)capacity * 100) / HASHTABLE_LOADFACTOR_GROW + 1,
+        sizeof(struct __path_key),
+        __path_hash,
+        __path_cmp
+    );
+    if (status) {
+        free(cache->Slots);
+        free(cache);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    mtx_init(&cache->Lock, mtx_plain);
+    cache->Capacity = capacity;
+    *cacheOut = cache;
+    return 0;
+}
+
+void vafs_pathcache_destroy(
+    struct VaFsPathCache* cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < cache->Capacity; i++) {
+        free(cache->Slots[i].path);
+    }
+    vafs_hashtable_destroy(&cache->Index);
+    mtx_destroy(&cache->Lock);
+    free(cache->Slots);
+    free(cache);
+}
+
+int vafs_pathcache_get(
+    struct VaFsPathCache*       cache,
+    const char*                 path,
+    int                         follow,
+    struct VaFsDirectoryEntry** entryOut,
+    int*                        errorOut)
+{
+    struct __path_key* key;
+    int                found = 0;
+
+    mtx_lock(&cache->Lock);
+    key = vafs_hashtable_get(&cache->Index, &(struct __path_key) {
+        .hash   = __vafs_hash_string(path),
+        .path   = path,
+        .follow = follow
+    });
+    if (key) {
+        struct __path_slot* slot = &cache->Slots[key->slot];
+        slot->referenced = 1;
+        *entryOut = slot->entry;
+        *errorOut = slot->error;
+        found = 1;
+    }
+    mtx_unlock(&cache->Lock);
+    return found;
+}
+
+static void __evict_slot(
+    struct VaFsPathCache* cache,
+    struct __path_slot*   slot)
+{
+    vafs_hashtable_remove(&cache->Index, &(struct __path_key) {
+        .hash   = __vafs_hash_string(slot->path),
+        .path   = slot->path,
+        .follow = slot->follow
+    });
+    free(slot->path);
+    slot->path = NULL;
+}
+
+void vafs_pathcache_set(
+    struct VaFsPathCache*      cache,
+    const char*                path,
+    int                        follow,
+    struct VaFsDirectoryEntry* entry,
+    int                        error)
+{
+    struct __path_key   key = {
+        .hash   = __vafs_hash_string(path),
+        .path   = path,
+        .follow = follow
+    };
+    struct __path_slot* slot;
+    char*               pathCopy;
+
+    pathCopy = strdup(path);
+    if (!pathCopy) {
+        return;
+    }
+
+    mtx_lock(&cache->Lock);
+
+    // another thread may have resolved the same path in the meantime
+    if (vafs_hashtable_get(&cache->Index, &key)) {
+        mtx_unlock(&cache->Lock);
+        free(pathCopy);
+        return;
+    }
+
+    // Select a slot using the clock algorithm, slots that have been hit
+    // since the hand last passed them get a second chance.
+    while (cache->Slots[cache->Hand].path && cache->Slots[cache->Hand].referenced) {
+        cache->Slots[cache->Hand].referenced = 0;
+        cache->Hand = (cache->Hand + 1) % cache->Capacity;
+    }
+
+    slot = &cache->Slots[cache->Hand];
+    if (slot->path) {
+        __evict_slot(cache, slot);
+    }
+
+    slot->path       = pathCopy;
+    slot->follow     = follow;
+    slot->entry      = entry;
+    slot->error      = error;
+    slot->referenced = 0;
+
+    key.path = pathCopy;
+    key.slot = cache->Hand;
+    vafs_hashtable_set(&cache->Index, &key);
+
+    cache->Hand = (cache->Hand + 1) % cache->Capacity;
+    mtx_unlock(&cache->Lock);
+}
+
+static uint64_t __path_hash(const void* element)
+{
+    const struct __path_key* key = element;
+    return key->hash;
+}
+
+static int __path_cmp(const void* lh, const void* rh)
+{
+    const struct __path_key* lkey = lh;
+    const struct __path_key* rkey = rh;
+    if (lkey->follow != rkey->follow) {
+        return 1;
+    }
+    return strcmp(lkey->path, rkey->path);
+}
@@ -0,0 +1,156 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vali Initrd Filesystem
+ * - Contains the implementation of the Vali Initrd Filesystem.
+ *   This filesystem is used to store the initrd of the kernel.
+ */
+
+#include <errno.h>
+#include "private.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The maximum number of outstanding prefetch requests, requests
+// that do not fit are dropped, and the block is loaded on demand instead.
+#define PREFETCH_QUEUE_SIZE 64
+
+struct __prefetch_request {
+    struct VaFsStream* stream;
+    vafsblock_t        index;
+};
+
+struct VaFsPrefetcher {
+    mtx_t  Lock;
+    cnd_t  Signal;
+    thrd_t Thread;
+    int    Running;
+
+    struct __prefetch_request Queue[PREFETCH_QUEUE_SIZE];
+    int                       QueueHead;
+    int                       QueueCount;
+};
+
+static int __prefetch_worker(void* context)
+{
+    struct VaFsPrefetcher*    prefetcher = context;
+    struct __prefetch_request request;
+
+    mtx_lock(&prefetcher->Lock);
+    while (1) {
+        while (prefetcher->Running && !prefetcher->QueueCount) {
+            cnd_wait(&prefetcher->Signal, &prefetcher->Lock);
+        }
+
+        if (!prefetcher->Running) {
+            break;
+        }
+
+        request = prefetcher->Queue[prefetcher->QueueHead];
+        prefetcher->QueueHead = (prefetcher->QueueHead + 1) % PREFETCH_QUEUE_SIZE;
+        prefetcher->QueueCount--;
+        mtx_unlock(&prefetcher->Lock);
+
+        if (vafs_stream_prefetch(request.stream, request.index)) {
+            VAFS_DEBUG("__prefetch_worker: failed to prefetch block %u\n", request.index);
+        }
+        mtx_lock(&prefetcher->Lock);
+    }
+    mtx_unlock(&prefetcher->Lock);
+    return 0;
+}
+
+int vafs_prefetcher_create(
+    struct VaFsPrefetcher** prefetcherOut)
+{
+    struct VaFsPrefetcher* prefetcher;
+
+    if (prefetcherOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    prefetcher = malloc(sizeof(struct VaFsPrefetcher));
+    if (!prefetcher) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(prefetcher, 0, sizeof(struct VaFsPrefetcher));
+
+    mtx_init(&prefetcher->Lock, mtx_plain);
+    cnd_init(&prefetcher->Signal);
+    prefetcher->Running = 1;
+
+    if (thrd_create(&prefetcher->Thread, __prefetch_worker, prefetcher) != thrd_success) {
+        VAFS_ERROR("vafs_prefetcher_create: failed to start prefetch worker\n");
+        cnd_destroy(&prefetcher->Signal);
+        mtx_destroy(&prefetcher->Lock);
+        free(prefetcher);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *prefetcherOut = prefetcher;
+    return 0;
+}
+
+void vafs_prefetcher_destroy(
+    struct VaFsPrefetcher* prefetcher)
+{
+    if (prefetcher == NULL) {
+        return;
+    }
+
+    // Outstanding requests are dropped, the worker only finishes
+    // the block it is currently loading.
+    mtx_lock(&prefetcher->Lock);
+    prefetcher->Running = 0;
+    cnd_signal(&prefetcher->Signal);
+    mtx_unlock(&prefetcher->Lock);
+
+    thrd_join(prefetcher->Thread, NULL);
+    cnd_destroy(&prefetcher->Signal);
+    mtx_destroy(&prefetcher->Lock);
+    free(prefetcher);
+}
+
+int vafs_prefetcher_queue(
+    struct VaFsPrefetcher* prefetcher,
+    struct VaFsStream*     stream,
+    vafsblock_t            blockIndex)
+{
+    int slot;
+
+    if (prefetcher == NULL || stream == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    mtx_lock(&prefetcher->Lock);
+    if (prefetcher->QueueCount == PREFETCH_QUEUE_SIZE) {
+        mtx_unlock(&prefetcher->Lock);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    slot = (prefetcher->QueueHead + prefetcher->QueueCount) % PREFETCH_QUEUE_SIZE;
+    prefetcher->Queue[slot].stream = stream;
+    prefetcher->Queue[slot].index  = blockIndex;
+    prefetcher->QueueCount++;
+    cnd_signal(&prefetcher->Signal);
+    mtx_unlock(&prefetcher->Lock);
+    return 0;
+}
@@ -0,0 +1,140 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Vali Initrd Filesystem
+ * - Contains the implementation of the Vali Initrd Filesystem.
+ *   This filesystem is used to store the initrd of the kernel.
+ */
+
+#include <errno.h>
+#include "private.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct VaFsPreloader {
+    mtx_t        Lock;
+    thrd_t       Thread;
+    int          Running;
+    struct VaFs* VaFs;
+};
+
+static int __is_running(
+    struct VaFsPreloader* preloader)
+{
+    int running;
+
+    mtx_lock(&preloader->Lock);
+    running = preloader->Running;
+    mtx_unlock(&preloader->Lock);
+    return running;
+}
+
+static int __preload_worker(void* context)
+{
+    struct VaFsPreloader*  preloader = context;
+    struct VaFsDirectory** pending;
+    size_t                 count = 0;
+    size_t                 capacity = 64;
+
+    pending = malloc(sizeof(struct VaFsDirectory*) * capacity);
+    if (!pending) {
+        VAFS_ERROR("__preload_worker: failed to allocate directory queue\n");
+        return -1;
+    }
+
+    // Walk the tree depth first. Loading goes through the same path as lookups
+    // do, so directories that are loaded on demand at the same time are simply
+    // found loaded, and the name indices are built as part of loading.
+    pending[count++] = preloader->VaFs->RootDirectory;
+    while (count && __is_running(preloader)) {
+        struct VaFsDirectory*      directory = pending[--count];
+        struct VaFsDirectoryEntry* entry;
+
+        for (entry = __vafs_directory_entries(directory); entry != NULL; entry = entry->Link) {
+            if (entry->Type != VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
+                continue;
+            }
+
+            if (count == capacity) {
+                struct VaFsDirectory** grown = realloc(pending, sizeof(struct VaFsDirectory*) * capacity * 2);
+                if (!grown) {
+                    VAFS_ERROR("__preload_worker: failed to grow directory queue\n");
+                    free(pending);
+                    return -1;
+                }
+                pending = grown;
+                capacity *= 2;
+            }
+            pending[count++] = entry->Directory;
+        }
+    }
+
+    VAFS_DEBUG("__preload_worker: done, %zu directories left\n", count);
+    free(pending);
+    return 0;
+}
+
+int vafs_preloader_create(
+    struct VaFs*           vafs,
+    struct VaFsPreloader** preloaderOut)
+{
+    struct VaFsPreloader* preloader;
+
+    if (vafs == NULL || preloaderOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    preloader = malloc(sizeof(struct VaFsPreloader));
+    if (!preloader) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(preloader, 0, sizeof(struct VaFsPreloader));
+
+    mtx_init(&preloader->Lock, mtx_plain);
+    preloader->Running = 1;
+    preloader->VaFs    = vafs;
+
+    if (thrd_create(&preloader->Thread, __preload_worker, preloader) != thrd_success) {
+        VAFS_ERROR("vafs_preloader_create: failed to start preload worker\n");
+        mtx_destroy(&preloader->Lock);
+        free(preloader);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    *preloaderOut = preloader;
+    return 0;
+}
+
+void vafs_preloader_destroy(
+    struct VaFsPreloader* preloader)
+{
+    if (preloader == NULL) {
+        return;
+    }
+
+    // The worker stops once the directory it is currently loading is done,
+    // what is left of the tree is loaded on demand instead.
+    mtx_lock(&preloader->Lock);
+    preloader->Running = 0;
+    mtx_unlock(&preloader->Lock);
+
+    thrd_join(preloader->Thread, NULL);
+    mtx_destroy(&preloader->Lock);
+    free(preloader);
+}
@@ -26,16 +26,30 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <vafs.h>
+#include <file.h>
+#include "cache/hashtable.h"
 
 struct VaFsStream;
 struct VaFsStreamDevice;
+struct VaFsCacheBlock;
+struct VaFsPrefetcher;
+struct VaFsAsyncPool;
+struct VaFsPreloader;
+struct VaFsEncoderPool;
+struct VaFsFilter;
+struct VaFsPathCache;
+struct VaFsArena;
+struct VaFsDirectoryEntry;
+struct vafs_stat;
 
 typedef uint32_t vafsblock_t;
 
 #define VA_FS_MAGIC       0x3144524D
-#define VA_FS_VERSION     0x00010000
+// Version 2.0 widened all offsets and lengths in the on-disk format to 64 bits,
+// images of version 1.0 are not compatible and must be rebuilt.
+#define VA_FS_VERSION     0x00020000
 
-#define VA_FS_INVALID_BLOCK  0xFFFF
+#define VA_FS_INVALID_BLOCK  0xFFFFFFFF
 #define VA_FS_INVALID_OFFSET 0xFFFFFFFF
 
 // I mean, do we really need more? But it's just a lazy implementation
@@ -49,11 +63,33 @@ typedef uint32_t vafsblock_t;
 #define VA_FS_DATA_DEFAULT_BLOCKSIZE (128 * 1024)
 #define VA_FS_DATA_MAX_BLOCKSIZE     (1024 * 1024)
 
+// Directories with at least this many entries get a hash index for name
+// lookups when loaded, smaller directories are searched linearly.
+#define VA_FS_DIRECTORY_INDEX_THRESHOLD 16
+
+// The number of resolved paths kept by the path cache of an image opened
+// for reading, and the maximum number of symlinks followed during a lookup.
+#define VA_FS_PATH_CACHE_DEFAULT_ENTRIES 4096
+#define VA_FS_SYMLINK_MAX_DEPTH          40
+
+// The size of the chunks the metadata arena of an image is carved from.
+#define VA_FS_ARENA_CHUNK_SIZE (64 * 1024)
+
+// The default block cache budget for an image, the cache is
+// shared by the descriptor and data stream of the image.
+#define VA_FS_CACHE_DEFAULT_SIZE     (32 * VA_FS_DATA_DEFAULT_BLOCKSIZE)
+
 // Logging macros
 #define VAFS_ERROR(...)  vafs_log_message(VaFsLogLevel_Error, "libvafs: " __VA_ARGS__)
 #define VAFS_WARN(...)   vafs_log_message(VaFsLogLevel_Warning, "libvafs: " __VA_ARGS__)
 #define VAFS_INFO(...)   vafs_log_message(VaFsLogLevel_Info, "libvafs: " __VA_ARGS__)
+// Debug messages are emitted from the hot paths, so release builds leave them
+// out entirely. The call is kept behind if (0) for the arguments to stay in use.
+#ifdef NDEBUG
+#define VAFS_DEBUG(...)  do { if (0) vafs_log_message(VaFsLogLevel_Debug, "libvafs: " __VA_ARGS__); } while (0)
+#else
 #define VAFS_DEBUG(...)  vafs_log_message(VaFsLogLevel_Debug, "libvafs: " __VA_ARGS__)
+#endif
 
 VAFS_ONDISK_STRUCT(VaFsBlockPosition, {
     vafsblock_t Index;
@@ -67,8 +103,8 @@ VAFS_ONDISK_STRUCT(VaFsHeader, {
     uint16_t            FeatureCount;
     uint16_t            Reserved;
     uint32_t            Attributes;
-    uint32_t            DescriptorBlockOffset;
-    uint32_t            DataBlockOffset;
+    uint64_t            DescriptorBlockOffset;
+    uint64_t            DataBlockOffset;
     VaFsBlockPosition_t RootDescriptor;
 });
 
@@ -76,6 +112,11 @@ VAFS_ONDISK_STRUCT(VaFsHeader, {
 #define VA_FS_DESCRIPTOR_TYPE_DIRECTORY 0x02
 #define VA_FS_DESCRIPTOR_TYPE_SYMLINK   0x03
 
+// A file descriptor that is followed by the name and then the contents
+// of the file, only present in images with the inline feature. Entries
+// of these descriptors are of the file type once loaded.
+#define VA_FS_DESCRIPTOR_TYPE_FILE_INLINE 0x04
+
 VAFS_ONDISK_STRUCT(VaFsDescriptor, {
     uint16_t Type;
     uint16_t Length; // Length of the descriptor
@@ -84,7 +125,7 @@ VAFS_ONDISK_STRUCT(VaFsDescriptor, {
 VAFS_ONDISK_STRUCT(VaFsFileDescriptor, {
     VaFsDescriptor_t    Base;
     VaFsBlockPosition_t Data;
-    uint32_t            FileLength;
+    uint64_t            FileLength;
     uint32_t            Permissions;
 });
 
@@ -113,6 +154,10 @@ struct VaFsFile {
     struct VaFs*         VaFs;
     VaFsFileDescriptor_t Descriptor;
     const char*          Name;
+
+    // The contents of the file when stored in the descriptor, otherwise
+    // the contents are read from the data stream.
+    const void*          Inline;
 };
 
 struct VaFsDirectory {
@@ -140,13 +185,43 @@ struct VaFs {
     // The file stream device
     struct VaFsStreamDevice* ImageDevice;
 
+    // The number of bytes reserved for features when the image is
+    // written directly, 0 when the streams are staged.
+    uint32_t                 FeatureReserve;
+
     // The following two streams are either tied up to the
     // the image device (reading), or to a temporary device (writing).
+    // When writing directly, the data stream writes to the image device.
     struct VaFsStreamDevice* DescriptorDevice;
     struct VaFsStream*       DescriptorStream;
     struct VaFsStreamDevice* DataDevice;
     struct VaFsStream*       DataStream;
 
+    // Files up to this size are stored in their descriptors when writing,
+    // 0 when the inline feature is not installed.
+    uint32_t                 InlineThreshold;
+
+    // The filter both streams encode and decode blocks with
+    struct VaFsFilter*       Filter;
+
+    // The prefetcher is created when readahead is enabled
+    struct VaFsPrefetcher* Prefetcher;
+
+    // The preloader is created when preloading of the tree is enabled
+    struct VaFsPreloader* Preloader;
+
+    // The workers serving asynchronous reads, created by the async feature
+    struct VaFsAsyncPool* AsyncPool;
+
+    // Counted for vafs_get_stats
+    atomic_ullong         DirectoryLoads;
+
+    // Resolved path lookups, only present for images opened for reading
+    struct VaFsPathCache* PathCache;
+
+    // Backing memory of the directory tree, which includes all entries, their
+    // names and targets. Released in one go when the image is closed.
+    struct VaFsArena*     Arena;
     struct VaFsDirectory* RootDirectory;
 };
 
@@ -169,6 +244,17 @@ extern int vafs_streamdevice_open_memory(
     size_t                    length,
     struct VaFsStreamDevice** deviceOut);
 
+/**
+ * @brief Maps the file at the given path into memory and wraps the mapping in a read-only
+ * streamdevice object. The mapping is removed when vafs_streamdevice_close is called.
+ *
+ * @param[In]  path      The path of the image file to map.
+ * @param[Out] deviceOut A pointer to where to store the handle of the stream device.
+ * @return Returns -1 if any error occured, otherwise 0.
+ */
+extern int vafs_streamdevice_open_mmap(
+    const char*               path,
+    struct VaFsStreamDevice** deviceOut);
 
 extern int vafs_streamdevice_open_ops(
     struct VaFsOperations*    operations,
@@ -183,12 +269,22 @@ extern int vafs_streamdevice_create_memory(
     size_t                    blockSize,
     struct VaFsStreamDevice** deviceOut);
 
+/**
+ * @brief Creates a stream device backed by an anonymous temporary file, which is
+ * removed when the device is closed. Used to stage streams without holding them in memory.
+ *
+ * @param[Out] deviceOut A pointer to where to store the handle of the stream device.
+ * @return Returns -1 if any error occured, otherwise 0.
+ */
+extern int vafs_streamdevice_create_temporary(
+    struct VaFsStreamDevice** deviceOut);
+
 extern int vafs_streamdevice_close(
     struct VaFsStreamDevice* device);
 
-extern long vafs_streamdevice_seek(
+extern int64_t vafs_streamdevice_seek(
     struct VaFsStreamDevice* device,
-    long                     offset,
+    int64_t                  offset,
     int                      whence);
 
 extern int vafs_streamdevice_read(
@@ -203,6 +299,42 @@ extern int vafs_streamdevice_write(
     size_t                   length,
     size_t*                  bytesWritten);
 
+/**
+ * @brief Reads data from a specific offset of the device. If the device provides positional
+ * reads they are used directly, otherwise the device is locked for the duration of the seek and
+ * read. Either way multiple threads can read from the same device without disturbing each other.
+ *
+ * @param[In]  device    The device to read from.
+ * @param[In]  offset    The absolute offset on the device to read from.
+ * @param[In]  buffer    The buffer to read data into.
+ * @param[In]  length    The number of bytes to read.
+ * @param[Out] bytesRead The number of bytes actually read.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ */
+extern int vafs_streamdevice_read_at(
+    struct VaFsStreamDevice* device,
+    uint64_t                 offset,
+    void*                    buffer,
+    size_t                   length,
+    size_t*                  bytesRead);
+
+/**
+ * @brief Retrieves a pointer directly into the storage of the device, which is only possible
+ * for devices that are backed by memory, like memory buffers or mapped files. The pointer stays
+ * valid until the device is closed, and must not be written to.
+ *
+ * @param[In]  device  The device to map data from.
+ * @param[In]  offset  The absolute offset on the device.
+ * @param[In]  length  The number of bytes that must be available at the offset.
+ * @param[Out] dataOut A pointer to where to store the pointer to the data.
+ * @return int 0 on success, -1 if the device is not mappable or the range is invalid.
+ */
+extern int vafs_streamdevice_map(
+    struct VaFsStreamDevice* device,
+    uint64_t                 offset,
+    size_t                   length,
+    const void**             dataOut);
+
 extern int vafs_streamdevice_copy(
     struct VaFsStreamDevice* destination,
     struct VaFsStreamDevice* source);
@@ -213,6 +345,16 @@ extern int vafs_streamdevice_lock(
 extern int vafs_streamdevice_unlock(
     struct VaFsStreamDevice* device);
 
+/**
+ * @brief Retrieves the number of positional reads that had to wait for another reader
+ * of the device. Devices with positional read operations never wait.
+ *
+ * @param[In] device The device to retrieve the count of.
+ * @return uint64_t The number of contended reads.
+ */
+extern uint64_t vafs_streamdevice_contention(
+    struct VaFsStreamDevice* device);
+
 /**
  * @brief 
  * 
@@ -224,7 +366,7 @@ extern int vafs_streamdevice_unlock(
  */
 extern int vafs_stream_create(
     struct VaFsStreamDevice* device,
-    long                     deviceOffset,
+    uint64_t                 deviceOffset,
     uint32_t                 blockSize,
     struct VaFsStream**      streamOut);
 
@@ -233,26 +375,90 @@ extern int vafs_stream_create(
  * 
  * @param[In]  device       The stream device to read from.
  * @param[In]  deviceOffset The offset in the device to start reading from.
+ * @param[In]  cache        The block cache to use for the stream, the stream takes a reference.
  * @param[Out] streamOut    A pointer to where to store the handle of the stream.
  * @return int 0 if the stream was valid and successfully opened, otherwise -1.
  */
 extern int vafs_stream_open(
     struct VaFsStreamDevice* device,
-    long                     deviceOffset,
+    uint64_t                 deviceOffset,
+    struct VaFsBlockCache*   cache,
     struct VaFsStream**      streamOut);
 
 /**
- * @brief 
+ * @brief Sets the filter that blocks of the stream are encoded and decoded with. The filter
+ * is owned by the image, and must stay valid until the stream is closed.
  * 
- * @param stream 
- * @param encode 
- * @param decode 
- * @return int 
+ * @param[In] stream The stream to set the filter for.
+ * @param[In] filter The filter to use, or NULL to store blocks as they are.
+ * @return int 0 on success, -1 on failure.
  */
 extern int vafs_stream_set_filter(
-    struct VaFsStream*   stream,
-    VaFsFilterEncodeFunc encode,
-    VaFsFilterDecodeFunc decode);
+    struct VaFsStream* stream,
+    struct VaFsFilter* filter);
+
+/**
+ * @brief Sets the checksum algorithm used for the blocks of the stream. For streams that
+ * are written, this must be set before any data is written to the stream.
+ * 
+ * @param[In] stream    The stream to set the checksum algorithm for.
+ * @param[In] algorithm The checksum algorithm, one of enum VaFsChecksum.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_stream_set_checksum(
+    struct VaFsStream* stream,
+    uint32_t           algorithm);
+
+/**
+ * @brief Sets how block checksums are verified when blocks are read. This must not
+ * be changed while the stream has readers.
+ * 
+ * @param[In] stream The stream to set the verification mode for.
+ * @param[In] mode   The verification mode, one of enum VaFsVerifyMode.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_stream_set_verify(
+    struct VaFsStream* stream,
+    uint32_t           mode);
+
+/**
+ * @brief Enables readahead for readers of the stream. Once a reader has been detected
+ * reading blocks in order, the following blocks are loaded into the block cache by the
+ * prefetcher. The number of blocks loaded ahead grows with the length of the sequential
+ * run, up to @maxBlocks. This must not be changed while the stream has readers.
+ * 
+ * @param[In] stream     The stream to enable readahead for.
+ * @param[In] prefetcher The prefetcher to queue requests on, or NULL to disable readahead.
+ * @param[In] maxBlocks  The maximum number of blocks to load ahead of a reader.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_stream_set_readahead(
+    struct VaFsStream*     stream,
+    struct VaFsPrefetcher* prefetcher,
+    uint32_t               maxBlocks);
+
+/**
+ * @brief Loads a block into the block cache of the stream, if it is not present already.
+ * 
+ * @param[In] stream     The stream to load the block from.
+ * @param[In] blockIndex The index of the block to load.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_stream_prefetch(
+    struct VaFsStream* stream,
+    vafsblock_t        blockIndex);
+
+/**
+ * @brief Replaces the block cache used by the stream. Any blocks the stream had in the
+ * previous cache are removed from it. This must not be done while the stream has readers.
+ * 
+ * @param[In] stream The stream to change the cache for.
+ * @param[In] cache  The new block cache, the stream takes a reference.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_stream_set_cache(
+    struct VaFsStream*     stream,
+    struct VaFsBlockCache* cache);
 
 /**
  * @brief 
@@ -268,17 +474,50 @@ extern int vafs_stream_position(
     uint32_t*          offsetOut);
 
 /**
- * @brief 
- * 
- * @param stream 
- * @param blockOut 
- * @param offsetOut 
- * @return int 
+ * @brief Retrieves the number of bytes of decoded data held by each block that is currently
+ * being written to the stream, see vafs_stream_set_block_size.
+ *
+ * @param[In] stream The stream to retrieve the block size of.
+ * @return The block size of the blocks being written.
  */
-extern int vafs_stream_seek(
-    struct VaFsStream* stream, 
-    vafsblock_t        blockIndex,
-    uint32_t           blockOffset);
+extern uint32_t vafs_stream_block_size(
+    struct VaFsStream* stream);
+
+/**
+ * @brief Retrieves the number of bytes of decoded data held by the blocks of the run that
+ * holds the given block. This is the size of every block of a file in the run, except for
+ * the last block of the file.
+ *
+ * @param[In] stream     The stream to retrieve the block size of.
+ * @param[In] blockIndex The index of the block.
+ * @return The block size of the run holding the block.
+ */
+extern uint32_t vafs_stream_block_size_at(
+    struct VaFsStream* stream,
+    vafsblock_t        blockIndex);
+
+/**
+ * @brief Retrieves the counters of the stream.
+ *
+ * @param[In]  stream   The stream to retrieve the counters of.
+ * @param[Out] statsOut Receives the counters of the stream.
+ */
+extern void vafs_stream_get_stats(
+    struct VaFsStream*      stream,
+    struct VaFsStreamStats* statsOut);
+
+/**
+ * @brief Retrieves the counters of the block cache used by the stream. A stream without
+ * a block cache reports 0 for both.
+ *
+ * @param[In]  stream        The stream whose block cache to retrieve the counters of.
+ * @param[Out] evictionsOut  Receives the number of blocks evicted from the cache.
+ * @param[Out] contentionOut Receives the number of times the cache lock was contended.
+ */
+extern void vafs_stream_get_cache_stats(
+    struct VaFsStream* stream,
+    uint64_t*          evictionsOut,
+    uint64_t*          contentionOut);
 
 /**
  * @brief 
@@ -294,18 +533,139 @@ extern int vafs_stream_write(
     size_t             size);
 
 /**
- * @brief 
+ * @brief A stream reader keeps its own position and block buffer, which means
+ * any number of readers can be active on the same stream at once. The stream itself
+ * is never modified through a reader, and blocks that are not present in the
+ * block cache are loaded through positioned reads on the stream device.
+ */
+struct VaFsStreamReader {
+    struct VaFsStream*     Stream;
+
+    // The block the reader is positioned in. The reader keeps the
+    // block pinned, which means it stays valid even if the block
+    // cache decides to evict it.
+    struct VaFsCacheBlock* Block;
+    vafsblock_t            BlockIndex;
+    uint32_t               BlockLength;
+    uint32_t               BlockOffset;
+
+    // Readahead state, the number of consecutive blocks that have been
+    // read in order and the next block that has not been prefetched yet.
+    uint32_t               SequentialRun;
+    vafsblock_t            ReadaheadNext;
+};
+
+/**
+ * @brief Initializes a new reader for the given stream. The reader is not positioned
+ * until vafs_stream_reader_seek has been called.
  * 
- * @param stream 
- * @param buffer 
- * @param size 
- * @return int 
+ * @param[In] stream The stream the reader should read from.
+ * @param[In] reader The reader to initialize.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_stream_reader_construct(
+    struct VaFsStream*       stream,
+    struct VaFsStreamReader* reader);
+
+/**
+ * @brief Releases any resources held by the reader. The reader itself is not freed.
+ * 
+ * @param[In] reader The reader to destroy.
+ */
+extern void vafs_stream_reader_destroy(
+    struct VaFsStreamReader* reader);
+
+/**
+ * @brief Positions the reader at the given block and offset. The offset may exceed
+ * the size of the block, in which case the position will be moved into the following blocks.
+ * 
+ * @param[In] reader      The reader to position.
+ * @param[In] blockIndex  The block index to seek to.
+ * @param[In] blockOffset The offset into the block.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ */
+extern int vafs_stream_reader_seek(
+    struct VaFsStreamReader* reader,
+    vafsblock_t              blockIndex,
+    uint64_t                 blockOffset);
+
+/**
+ * @brief Reads data from the current position of the reader, and advances the position
+ * by the number of bytes read.
+ * 
+ * @param[In]  reader    The reader to read from.
+ * @param[In]  buffer    The buffer to read data into.
+ * @param[In]  size      The number of bytes to read.
+ * @param[Out] bytesRead The number of bytes actually read.
+ * @return int 0 on success, -1 on failure. See errno for more details.
  */
-extern int vafs_stream_read(
+extern int vafs_stream_reader_read(
+    struct VaFsStreamReader* reader,
+    void*                    buffer,
+    size_t                   size,
+    size_t*                  bytesRead);
+
+/**
+ * @brief Borrows data directly from the block the reader is positioned in, without
+ * copying it. At most <size> bytes are provided, and never more than what is left of
+ * the current block. The position is advanced by the number of bytes provided. The data
+ * is only valid until the next operation on the reader.
+ * 
+ * @param[In]  reader    The reader to borrow data from.
+ * @param[In]  size      The maximum number of bytes to borrow.
+ * @param[Out] dataOut   A pointer to where the data pointer will be stored.
+ * @param[Out] lengthOut The number of bytes available at <dataOut>.
+ * @return int 0 on success, -1 on failure. See errno for more details.
+ */
+extern int vafs_stream_reader_borrow(
+    struct VaFsStreamReader* reader,
+    size_t                   size,
+    const void**             dataOut,
+    size_t*                  lengthOut);
+
+/**
+ * @brief Appends a block of another stream to a stream being written, as it is stored in the
+ * source stream, which saves encoding the data again. The block is only copied if the stream is
+ * positioned at the start of a block, both streams store blocks the same way, and the block decodes
+ * to exactly the data it replaces. The caller must make sure both streams use the same filter.
+ *
+ * @param[In] stream     The stream being written.
+ * @param[In] source     The stream of an image opened for reading to copy the block from.
+ * @param[In] blockIndex The index of the block in the source stream.
+ * @param[In] data       The block size bytes of data the copied block replaces.
+ * @return Returns 0 if the block was copied, 1 if the data must be written instead, and -1 on errors.
+ */
+extern int vafs_stream_copy_block(
     struct VaFsStream* stream,
-    void*              buffer,
-    size_t             size,
-    size_t*            bytesRead);
+    struct VaFsStream* source,
+    vafsblock_t        blockIndex,
+    const void*        data);
+
+/**
+ * @brief Ends the current block of a stream being written, so the next write starts at the
+ * beginning of a new block. Blocks are otherwise always filled completely, so this may only
+ * be called in between two files, and never while the data of a file is being written.
+ *
+ * @param[In] stream The stream to align.
+ * @return Returns -1 if any error occured, otherwise 0.
+ */
+extern int vafs_stream_align(
+    struct VaFsStream* stream);
+
+/**
+ * @brief Changes the number of bytes of decoded data the blocks written to the stream hold
+ * from here on. The current block is ended with its previous size if the size changes, so like
+ * vafs_stream_align this may only be called in between two files. Every file is then stored in
+ * blocks of one size, which is recorded in the stream for reading it back.
+ *
+ * @param[In] stream    The stream being written.
+ * @param[In] blockSize The new block size, at least 8kb. Larger sizes than the block size of the
+ *                      stream are limited to it.
+ * @return Returns -1 if any error occured, otherwise 0.
+ */
+extern int vafs_stream_set_block_size(
+    struct VaFsStream* stream,
+    uint32_t           blockSize);
 
 /**
  * @brief 
@@ -328,8 +688,8 @@ extern int vafs_stream_close(
 /**
  * @brief Locks a specific stream for exclusive access, this is neccessary while
  * writing data to the stream, to avoid any concurrent access to those streams, or
- * the user deciding to write two files at once. For read access this is not as neccessary
- * but could still be done.
+ * the user deciding to write two files at once. Readers do not need to lock the stream,
+ * as they go through their own stream reader.
  * 
  * @param[In] stream The stream that should be locked.
  * @return int Returns -1 if the stream is already locked, 0 on success.
@@ -346,6 +706,359 @@ extern int vafs_stream_lock(
 extern int vafs_stream_unlock(
     struct VaFsStream* stream);
 
+/**
+ * @brief Enables encoding of data blocks on multiple threads for a stream that was
+ * opened for writing. Blocks are still written to the stream in order. This only has
+ * an effect if an encode filter is set for the stream.
+ * 
+ * @param[In] stream      The stream to set the number of encoder threads for.
+ * @param[In] threadCount The number of encoder threads, 1 or less encodes on the writing thread.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_stream_set_encoders(
+    struct VaFsStream* stream,
+    int                threadCount);
+
+/**
+ * @brief Creates a filter from the filter operations feature, which may be either version
+ * of the operations. Filters installed with the first version are adapted to the second.
+ * 
+ * @param[In]  ops       The VA_FS_FEATURE_FILTER_OPS feature.
+ * @param[Out] filterOut A pointer to where to store the handle of the filter.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_filter_create(
+    struct VaFsFeatureHeader* ops,
+    struct VaFsFilter**       filterOut);
+
+/**
+ * @brief Destroys the filter and all contexts that are kept in its pool. All contexts must
+ * have been released.
+ * 
+ * @param[In] filter The filter to destroy.
+ */
+extern void vafs_filter_destroy(
+    struct VaFsFilter* filter);
+
+/**
+ * @brief Takes a context from the pool of the filter, or creates a new one if the pool is
+ * empty. Stateless filters hand out NULL contexts.
+ * 
+ * @param[In]  filter     The filter to get a context for.
+ * @param[Out] contextOut A pointer to where to store the context.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_filter_context_acquire(
+    struct VaFsFilter* filter,
+    void**             contextOut);
+
+/**
+ * @brief Returns a context to the pool of the filter.
+ * 
+ * @param[In] filter  The filter the context was acquired from.
+ * @param[In] context The context to return.
+ */
+extern void vafs_filter_context_release(
+    struct VaFsFilter* filter,
+    void*              context);
+
+/**
+ * @brief Encodes the input into the output buffer. Fails with errno set to ENOSPC if the
+ * encoded data does not fit into the output buffer.
+ * 
+ * @param[In]      filter       The filter to encode with.
+ * @param[In]      context      A context acquired from the filter.
+ * @param[In]      input        The data to encode.
+ * @param[In]      inputLength  The length of the data to encode.
+ * @param[In]      output       The buffer to encode into.
+ * @param[In, Out] outputLength The size of the output buffer, updated to the encoded size.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_filter_encode(
+    struct VaFsFilter* filter,
+    void*              context,
+    const void*        input,
+    uint32_t           inputLength,
+    void*              output,
+    uint32_t*          outputLength);
+
+/**
+ * @brief Decodes the input into the output buffer.
+ * 
+ * @param[In]      filter       The filter to decode with.
+ * @param[In]      context      A context acquired from the filter.
+ * @param[In]      input        The data to decode.
+ * @param[In]      inputLength  The length of the data to decode.
+ * @param[In]      output       The buffer to decode into.
+ * @param[In, Out] outputLength The size of the output buffer, updated to the decoded size.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_filter_decode(
+    struct VaFsFilter* filter,
+    void*              context,
+    const void*        input,
+    uint32_t           inputLength,
+    void*              output,
+    uint32_t*          outputLength);
+
+/**
+ * @brief A block that has been encoded by the encoder pool. Data is the unencoded block
+ * that was submitted, and both Data and Encoded are owned by the pool. They stay valid
+ * until the next block is submitted.
+ */
+struct VaFsEncodedBlock {
+    void*    Data;
+    uint32_t Length;
+    void*    Encoded;
+    uint32_t EncodedLength;
+    uint32_t Crc;
+    int      Status;
+};
+
+/**
+ * @brief Creates a pool of threads that encode blocks using the provided filter. Each thread
+ * keeps its own filter context, and all block buffers are allocated up front.
+ * 
+ * @param[In]  threadCount The number of encoder threads to start.
+ * @param[In]  filter      The filter to encode with.
+ * @param[In]  checksum    The checksum algorithm to calculate block checksums with.
+ * @param[In]  blockSize   The size of the blocks that will be submitted.
+ * @param[Out] poolOut     A pointer to where to store the handle of the pool.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_encoder_pool_create(
+    int                      threadCount,
+    struct VaFsFilter*       filter,
+    uint32_t                 checksum,
+    uint32_t                 blockSize,
+    struct VaFsEncoderPool** poolOut);
+
+/**
+ * @brief Stops all encoder threads and frees the pool, including all block buffers.
+ * 
+ * @param[In] pool The pool to destroy.
+ */
+extern void vafs_encoder_pool_destroy(
+    struct VaFsEncoderPool* pool);
+
+/**
+ * @brief Submits a block for encoding. The pool takes the block buffer, and hands back one
+ * of its own buffers of the block size in its place. The pool only accepts a limited number
+ * of blocks that have not been collected yet.
+ * 
+ * @param[In]      pool   The pool to submit the block to.
+ * @param[In, Out] data   The block buffer, which is exchanged for an unused buffer.
+ * @param[In]      length The length of the block data.
+ * @return int 0 on success, -1 with errno set to EBUSY if the pool is full.
+ */
+extern int vafs_encoder_pool_submit(
+    struct VaFsEncoderPool* pool,
+    void**                  data,
+    uint32_t                length);
+
+/**
+ * @brief Collects the oldest submitted block from the pool once it has been encoded. Blocks
+ * are always collected in the order they were submitted.
+ * 
+ * @param[In]  pool     The pool to collect the block from.
+ * @param[In]  wait     Whether to wait for the block to finish encoding.
+ * @param[Out] blockOut A pointer to where the encoded block will be stored.
+ * @return int 0 on success, -1 with errno set to ENOENT if no blocks are pending, or
+ *             EAGAIN if the oldest block is not done and wait was not set.
+ */
+extern int vafs_encoder_pool_collect(
+    struct VaFsEncoderPool*  pool,
+    int                      wait,
+    struct VaFsEncodedBlock* blockOut);
+
+/**
+ * @brief Creates a new arena, which hands out memory from larger chunks that are only
+ * released when the arena is destroyed. Used for metadata that lives as long as its owner.
+ * 
+ * @param[In]  chunkSize The size of the chunks allocations are carved from.
+ * @param[Out] arenaOut  A pointer to where to store the handle of the arena.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_arena_create(
+    size_t             chunkSize,
+    struct VaFsArena** arenaOut);
+
+/**
+ * @brief Frees the arena and every allocation made from it.
+ * 
+ * @param[In] arena The arena to destroy.
+ */
+extern void vafs_arena_destroy(
+    struct VaFsArena* arena);
+
+/**
+ * @brief Allocates memory from the arena. The memory is suitably aligned for
+ * any of the metadata structures, and is not initialized.
+ * 
+ * @param[In] arena The arena to allocate from.
+ * @param[In] size  The number of bytes to allocate.
+ * @return void* The allocated memory, or NULL on failure.
+ */
+extern void* vafs_arena_alloc(
+    struct VaFsArena* arena,
+    size_t            size);
+
+/**
+ * @brief Copies a string of <length> bytes into the arena, and zero terminates it.
+ * 
+ * @param[In] arena  The arena to allocate from.
+ * @param[In] string The string to copy, does not need to be zero terminated.
+ * @param[In] length The number of bytes to copy.
+ * @return char* The copied string, or NULL on failure.
+ */
+extern char* vafs_arena_strndup(
+    struct VaFsArena* arena,
+    const char*       string,
+    size_t            length);
+
+/**
+ * @brief Creates a new path cache, which maps paths to the directory entries they resolve
+ * to. Failed lookups are cached as well. As entries are never changed or freed while an
+ * image is open for reading, the cache never needs to be invalidated.
+ * 
+ * @param[In]  capacity The maximum number of paths to keep, once full the least recently
+ *                      used paths are replaced.
+ * @param[Out] cacheOut A pointer to where to store the handle of the path cache.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_pathcache_create(
+    uint32_t               capacity,
+    struct VaFsPathCache** cacheOut);
+
+/**
+ * @brief Frees the path cache and all paths in it.
+ * 
+ * @param[In] cache The path cache to destroy.
+ */
+extern void vafs_pathcache_destroy(
+    struct VaFsPathCache* cache);
+
+/**
+ * @brief Looks up a previously resolved path.
+ * 
+ * @param[In]  cache    The path cache to look in.
+ * @param[In]  path     The path as it was passed to the lookup.
+ * @param[In]  follow   Whether the lookup followed a symlink in the last component.
+ * @param[Out] entryOut The entry the path resolved to, NULL for the root directory.
+ * @param[Out] errorOut 0 if the path resolved, otherwise the errno the lookup failed with.
+ * @return int 1 if the path was present in the cache, otherwise 0.
+ */
+extern int vafs_pathcache_get(
+    struct VaFsPathCache*       cache,
+    const char*                 path,
+    int                         follow,
+    struct VaFsDirectoryEntry** entryOut,
+    int*                        errorOut);
+
+/**
+ * @brief Stores the result of a path lookup in the cache.
+ * 
+ * @param[In] cache  The path cache to store the result in.
+ * @param[In] path   The path as it was passed to the lookup.
+ * @param[In] follow Whether the lookup followed a symlink in the last component.
+ * @param[In] entry  The entry the path resolved to, NULL for the root directory.
+ * @param[In] error  0 if the path resolved, otherwise the errno the lookup failed with.
+ */
+extern void vafs_pathcache_set(
+    struct VaFsPathCache*      cache,
+    const char*                path,
+    int                        follow,
+    struct VaFsDirectoryEntry* entry,
+    int                        error);
+
+/**
+ * @brief Creates a new prefetcher, which owns a background worker that loads
+ * blocks into the block cache ahead of readers.
+ * 
+ * @param[Out] prefetcherOut A pointer to where to store the handle of the prefetcher.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_prefetcher_create(
+    struct VaFsPrefetcher** prefetcherOut);
+
+/**
+ * @brief Stops the worker of the prefetcher and frees it. Any requests not yet
+ * handled are dropped. This must be done before the streams are closed.
+ * 
+ * @param[In] prefetcher The prefetcher to destroy.
+ */
+extern void vafs_prefetcher_destroy(
+    struct VaFsPrefetcher* prefetcher);
+
+/**
+ * @brief Creates a new pool of workers that serve asynchronous file reads.
+ * 
+ * @param[In]  threadCount The number of workers to start.
+ * @param[Out] poolOut     A pointer to where to store the handle of the pool.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_asyncpool_create(
+    int                    threadCount,
+    struct VaFsAsyncPool** poolOut);
+
+/**
+ * @brief Stops the workers of the pool and frees it. Reads that have not been started
+ * are completed with ECANCELED. This must be done before the streams are closed.
+ * 
+ * @param[In] pool The pool to destroy.
+ */
+extern void vafs_asyncpool_destroy(
+    struct VaFsAsyncPool* pool);
+
+/**
+ * @brief Queues a read of the file handle on the pool, see vafs_file_read_async.
+ * 
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_asyncpool_queue(
+    struct VaFsAsyncPool*  pool,
+    struct VaFsFileHandle* handle,
+    void*                  buffer,
+    size_t                 size,
+    uint64_t               offset,
+    VaFsReadCompleteFunc   callback,
+    void*                  context);
+
+/**
+ * @brief Creates a new preloader, which owns a background worker that loads
+ * every directory of the image, starting from the root directory.
+ * 
+ * @param[In]  vafs         The image to load the directory tree of.
+ * @param[Out] preloaderOut A pointer to where to store the handle of the preloader.
+ * @return int 0 on success, -1 on failure.
+ */
+extern int vafs_preloader_create(
+    struct VaFs*           vafs,
+    struct VaFsPreloader** preloaderOut);
+
+/**
+ * @brief Stops the worker of the preloader and frees it. Directories that have not
+ * been loaded yet are left for lookups to load. This must be done before the streams
+ * and the directory tree are torn down.
+ * 
+ * @param[In] preloader The preloader to destroy.
+ */
+extern void vafs_preloader_destroy(
+    struct VaFsPreloader* preloader);
+
+/**
+ * @brief Queues a block of the stream to be loaded into the block cache.
+ * 
+ * @param[In] prefetcher The prefetcher to queue the request on.
+ * @param[In] stream     The stream the block belongs to.
+ * @param[In] blockIndex The index of the block to load.
+ * @return int 0 on success, -1 if the queue is full.
+ */
+extern int vafs_prefetcher_queue(
+    struct VaFsPrefetcher* prefetcher,
+    struct VaFsStream*     stream,
+    vafsblock_t            blockIndex);
+
 /**
  * @brief 
  * 
@@ -395,22 +1108,6 @@ extern int vafs_directory_open_root(
 extern struct VaFsFileHandle* vafs_file_create_handle(
     struct VaFsFile* fileEntry);
 
-/**
- * @brief 
- * 
- * @param file 
- */
-extern void vafs_file_destroy(
-    struct VaFsFile* file);
-
-/**
- * @brief 
- * 
- * @param symlink 
- */
-extern void vafs_symlink_destroy(
-    struct VaFsSymlink* symlink);
-
 /**
  * @brief 
  * 
@@ -424,8 +1121,6 @@ extern void vafs_log_message(
     ...);
 
 // Utility functions
-struct VaFsDirectoryEntry;
-
 enum VaFsDirectoryState {
     VaFsDirectoryState_Open,
     VaFsDirectoryState_Loaded
@@ -433,8 +1128,13 @@ enum VaFsDirectoryState {
 
 struct VaFsDirectoryReader {
     struct VaFsDirectory       Base;
+    mtx_t                      Lock;
     enum VaFsDirectoryState    State;
     struct VaFsDirectoryEntry* Entries;
+
+    // Name index of the entries, only built for directories with at least
+    // VA_FS_DIRECTORY_INDEX_THRESHOLD entries. Never modified once loaded.
+    hashtable_t                Index;
 };
 
 struct VaFsDirectoryWriter {
@@ -455,7 +1155,13 @@ struct VaFsDirectoryEntry {
 extern int __vafs_is_root_path(const char* path);
 extern int __vafs_pathtoken(const char* path, char* token, size_t tokenSize);
 extern int __vafs_resolve_symlink(char* buffer, size_t bufferLength, const char* baseStart, size_t baseLength, const char* symlinkTarget);
+extern uint64_t __vafs_hash_string(const char* string);
+extern uint64_t __vafs_time_ns(void);
+extern int __vafs_path_lookup(struct VaFs* vafs, const char* path, int followLinks, struct VaFsDirectoryEntry** entryOut);
 extern struct VaFsDirectoryEntry* __vafs_directory_entries(struct VaFsDirectory* directory);
+extern struct VaFsDirectoryEntry* __vafs_directory_find_entry(struct VaFsDirectory* directory, const char* name);
 extern const char* __vafs_directory_entry_name(struct VaFsDirectoryEntry* entry);
+extern int __vafs_entry_stat(struct VaFsDirectoryEntry* entry, struct vafs_stat* stat);
+extern int __vafs_same_filter(struct VaFs* vafs, struct VaFs* other);
 
 #endif // __VAFS_PRIVATE_H__
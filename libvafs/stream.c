@@ -29,14 +29,20 @@
 
 #define STREAM_MAGIC       0x314D5356 // VSM1
 
+// Streams whose blocks are not all of the same size, the block size runs
+// are stored after the block headers
+#define STREAM_MAGIC_RUNS  0x324D5356 // VSM2
+
 #define STREAM_TYPE_FILE   0
 #define STREAM_TYPE_MEMORY 1
 
-#define STREAM_CACHE_SIZE  32
+// The block is stored as it is, as the filter did not make it any smaller
+#define BLOCK_FLAG_RAW     0x1
+
 
 VAFS_ONDISK_STRUCT(BlockHeader, {
     uint32_t LengthOnDisk;
-    uint32_t Offset;
+    uint64_t Offset;
     uint32_t Crc;
     uint16_t Flags;
     uint16_t Reserved;
@@ -48,38 +54,85 @@ struct VaFsStreamBlockHeaders {
     struct BlockHeader* Headers;
 };
 
+// The blocks from FirstBlock up to the first block of the next run each hold
+// BlockSize bytes of decoded data, except for the last block of each file. The
+// blocks in front of the first run hold the block size of the stream header.
+VAFS_ONDISK_STRUCT(BlockRun, {
+    uint32_t FirstBlock;
+    uint32_t BlockSize;
+});
+
+struct VaFsStreamBlockRuns {
+    uint32_t         Count;
+    uint32_t         Capacity;
+    struct BlockRun* Runs;
+};
+
 VAFS_ONDISK_STRUCT(VaFsStreamHeader, {
     uint32_t Magic;
     uint32_t BlockSize;
-    uint32_t BlockHeadersOffset;
+    uint64_t BlockHeadersOffset;
     uint32_t BlockHeadersCount;
 });
 
+// Counters for vafs_get_stats, updated without any lock held
+struct VaFsStreamCounters {
+    atomic_ullong CacheHits;
+    atomic_ullong CacheMisses;
+    atomic_ullong BlocksDecoded;
+    atomic_ullong DecodeTime;
+    atomic_ullong BytesRead;
+    atomic_ullong VerifyTime;
+};
+
 struct VaFsStream {
     struct VaFsStreamHeader       Header;
     struct VaFsStreamDevice*      Device;
-    long                          DeviceOffset;
-    VaFsFilterEncodeFunc          Encode;
-    VaFsFilterDecodeFunc          Decode;
+    uint64_t                      DeviceOffset;
+    struct VaFsFilter*            Filter;
     struct VaFsBlockCache*        BlockCache;
+    uint32_t                      CacheOwner;
+    struct VaFsPrefetcher*        Prefetcher;
+    uint32_t                      ReadaheadMax;
+    struct VaFsEncoderPool*       Encoders;
+    int                           EncoderThreads;
+    uint32_t                      Checksum;
     struct VaFsStreamBlockHeaders BlockHeaders;
+    struct VaFsStreamBlockRuns    BlockRuns;
+
+    // Blocks whose checksum has been verified, only tracked when
+    // blocks are verified once. Guarded by the verify lock.
+    mtx_t                         VerifyLock;
+    uint8_t*                      Verified;
+
+    struct VaFsStreamCounters     Counters;
 
     // The block buffer is used for staging data before
     // we flush it to the data stream. The staging buffer
-    // is always the size of the block size.
+    // is always the size of the block size. Streams opened
+    // for reading have no block buffer, all reads are done
+    // through stream readers. Blocks are flushed once they
+    // hold the write block size, which is at most the block
+    // size of the stream.
     char*       BlockBuffer;
     vafsblock_t BlockBufferIndex;
     uint32_t    BlockBufferOffset;
+    uint32_t    WriteBlockSize;
+
+    // Blocks that are encoded without the encoder pool are encoded
+    // into the encode buffer, using the filter context of the stream.
+    char*       EncodeBuffer;
+    void*       EncodeContext;
 };
 
 static int __new_stream(
     struct VaFsStreamDevice* device,
-    long                     deviceOffset,
+    uint64_t                 deviceOffset,
     struct VaFsStream**      streamOut)
 {
     struct VaFsStream* stream;
 
-    VAFS_DEBUG("__new_stream(offset=%lu)\n", deviceOffset);
+    VAFS_DEBUG("__new_stream(offset=%llu)\n", deviceOffset);
     
     stream = (struct VaFsStream*)malloc(sizeof(struct VaFsStream));
     if (!stream) {
@@ -111,7 +164,7 @@ static int __allocate_blockbuffer(
 
 int vafs_stream_create(
     struct VaFsStreamDevice* device,
-    long                     deviceOffset,
+    uint64_t                 deviceOffset,
     uint32_t                 blockSize,
     struct VaFsStream**      streamOut)
 {
@@ -132,6 +185,7 @@ int vafs_stream_create(
     // initialize the stream header to initial values
     stream->Header.Magic     = STREAM_MAGIC;
     stream->Header.BlockSize = blockSize;
+    stream->WriteBlockSize   = blockSize;
 
     // write the initial stream header
     status = vafs_streamdevice_write(device, &stream->Header, sizeof(struct VaFsStreamHeader), &written);
@@ -153,19 +207,19 @@ int vafs_stream_create(
     return 0;
 }
 
-static long  __get_header_offset(
+static uint64_t __get_header_offset(
     struct VaFsStream* stream)
 {
     return stream->DeviceOffset;
 }
 
-static long __get_data_offset(
+static uint64_t __get_data_offset(
     struct VaFsStream* stream)
 {
     return stream->DeviceOffset + sizeof(struct VaFsStreamHeader);
 }
 
-static long __get_block_headers_offset(
+static uint64_t __get_block_headers_offset(
     struct VaFsStream* stream)
 {
     return stream->DeviceOffset + stream->Header.BlockHeadersOffset;
@@ -181,10 +235,32 @@ static struct BlockHeader* __get_block_header(
     return &stream->BlockHeaders.Headers[block];
 }
 
+// __get_block_size returns the number of bytes of decoded data the blocks of the
+// run holding the block contain, which is the size of all blocks in the run but
+// the last block of a file.
+static uint32_t __get_block_size(
+    struct VaFsStream* stream,
+    vafsblock_t        block)
+{
+    uint32_t low  = 0;
+    uint32_t high = stream->BlockRuns.Count;
+
+    // find the first run that starts after the block
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (stream->BlockRuns.Runs[mid].FirstBlock <= block) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low ? stream->BlockRuns.Runs[low - 1].BlockSize : stream->Header.BlockSize;
+}
+
 static int __verify_header(
     struct VaFsStreamHeader* header)
 {
-    if (header->Magic != STREAM_MAGIC) {
+    if (header->Magic != STREAM_MAGIC && header->Magic != STREAM_MAGIC_RUNS) {
         VAFS_ERROR("__verify_header: invalid stream magic\n");
         return -1;
     }
@@ -195,7 +271,7 @@ static int __verify_header(
     }
 
     VAFS_DEBUG("__verify_header: block size: %u\n", header->BlockSize);
-    VAFS_DEBUG("__verify_header: block headers offset: %u\n", header->BlockHeadersOffset);
+    VAFS_DEBUG("__verify_header: block headers offset: %llu\n", header->BlockHeadersOffset);
     VAFS_DEBUG("__verify_header: block headers count: %u\n", header->BlockHeadersCount);
 
     return 0;
@@ -218,13 +294,10 @@ static int __load_block_headers(
         return -1;
     }
 
-    // seek to block headers
-    VAFS_DEBUG("__load_block_headers: seeking to block headers %lu\n", __get_block_headers_offset(stream));
-    vafs_streamdevice_seek(stream->Device, __get_block_headers_offset(stream), SEEK_SET);
-
     // read the block headers
-    status = vafs_streamdevice_read(
-        stream->Device, stream->BlockHeaders.Headers,
+    VAFS_DEBUG("__load_block_headers: reading block headers at %llu\n", __get_block_headers_offset(stream));
+    status = vafs_streamdevice_read_at(
+        stream->Device, __get_block_headers_offset(stream), stream->BlockHeaders.Headers,
         sizeof(struct BlockHeader) * stream->BlockHeaders.Count,
         &read
     );
@@ -235,6 +308,65 @@ static int __load_block_headers(
     return 0;
 }
 
+static int __load_block_runs(
+    struct VaFsStream* stream)
+{
+    uint64_t offset;
+    uint32_t count;
+    size_t   read;
+    int      status;
+    uint32_t i;
+
+    VAFS_DEBUG("__load_block_runs()\n");
+
+    // the number of runs is stored in front of them, right after the block headers
+    offset = __get_block_headers_offset(stream) + sizeof(struct BlockHeader) * stream->BlockHeaders.Count;
+    status = vafs_streamdevice_read_at(stream->Device, offset, &count, sizeof(uint32_t), &read);
+    if (status != 0) {
+        VAFS_ERROR("__load_block_runs: failed to read block run count: %i\n", status);
+        return status;
+    }
+
+    if (count == 0 || count > stream->Header.BlockHeadersCount + 1) {
+        VAFS_ERROR("__load_block_runs: invalid block run count: %u\n", count);
+        errno = EINVAL;
+        return -1;
+    }
+
+    stream->BlockRuns.Count    = count;
+    stream->BlockRuns.Capacity = count;
+    stream->BlockRuns.Runs     = (struct BlockRun*)malloc(sizeof(struct BlockRun) * count);
+    if (!stream->BlockRuns.Runs) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    status = vafs_streamdevice_read_at(
+        stream->Device, offset + sizeof(uint32_t), stream->BlockRuns.Runs,
+        sizeof(struct BlockRun) * count,
+        &read
+    );
+    if (status != 0) {
+        VAFS_ERROR("__load_block_runs: failed to read block runs: %i\n", status);
+        return status;
+    }
+
+    // Runs must be in order, and no block may be larger than what the buffers
+    // of the stream are allocated for
+    for (i = 0; i < count; i++) {
+        struct BlockRun* run = &stream->BlockRuns.Runs[i];
+        if ((i && run->FirstBlock <= stream->BlockRuns.Runs[i - 1].FirstBlock) ||
+            run->FirstBlock > stream->Header.BlockHeadersCount ||
+            run->BlockSize < VA_FS_DATA_MIN_BLOCKSIZE || run->BlockSize > stream->Header.BlockSize) {
+            VAFS_ERROR("__load_block_runs: invalid block run %u\n", i);
+            errno = EINVAL;
+            return -1;
+        }
+        VAFS_DEBUG("__load_block_runs: block %u onwards holds %u bytes\n", run->FirstBlock, run->BlockSize);
+    }
+    return 0;
+}
+
 static int __load_metadata(
     struct VaFsStream* stream)
 {
@@ -243,8 +375,9 @@ static int __load_metadata(
 
     VAFS_DEBUG("__load_metadata()\n");
 
-    status = vafs_streamdevice_read(
+    status = vafs_streamdevice_read_at(
         stream->Device,
+        __get_header_offset(stream),
         &stream->Header,
         sizeof(struct VaFsStreamHeader),
         &read
@@ -257,19 +390,25 @@ static int __load_metadata(
     if (status != 0) {
         return -1;
     }
-    return __load_block_headers(stream);
+
+    status = __load_block_headers(stream);
+    if (status != 0 || stream->Header.Magic != STREAM_MAGIC_RUNS) {
+        return status;
+    }
+    return __load_block_runs(stream);
 }
 
 int vafs_stream_open(
     struct VaFsStreamDevice* device,
-    long                     deviceOffset,
+    uint64_t                 deviceOffset,
+    struct VaFsBlockCache*   cache,
     struct VaFsStream**      streamOut)
 {
     struct VaFsStream* stream;
     int                status;
-    VAFS_DEBUG("vafs_stream_open(offset=%lu)\n", deviceOffset);
+    VAFS_DEBUG("vafs_stream_open(offset=%llu)\n", deviceOffset);
 
-    if (device == NULL || streamOut == NULL) {
+    if (device == NULL || cache == NULL || streamOut == NULL) {
         errno = EINVAL;
         return -1;
     }
@@ -286,38 +425,109 @@ int vafs_stream_open(
         return -1;
     }
 
-    // create the block cache
-    status = vafs_cache_create(STREAM_CACHE_SIZE, &stream->BlockCache);
-    if (status != 0) {
-        VAFS_ERROR("vafs_stream_open: failed to create block cache\n");
-        vafs_stream_close(stream);
+    vafs_stream_set_cache(stream, cache);
+    *streamOut = stream;
+    return 0;
+}
+
+int vafs_stream_set_filter(
+    struct VaFsStream* stream,
+    struct VaFsFilter* filter)
+{
+    if (stream == NULL) {
+        errno = EINVAL;
         return -1;
     }
 
-    // allocate the block buffer
-    status = __allocate_blockbuffer(stream);
-    if (status != 0) {
-        VAFS_ERROR("vafs_stream_open: failed to allocate block buffer\n");
-        vafs_stream_close(stream);
+    stream->Filter = filter;
+    return 0;
+}
+
+int vafs_stream_set_cache(
+    struct VaFsStream*     stream,
+    struct VaFsBlockCache* cache)
+{
+    if (stream == NULL || cache == NULL) {
+        errno = EINVAL;
         return -1;
     }
 
-    *streamOut = stream;
+    if (stream->BlockCache) {
+        vafs_cache_purge(stream->BlockCache, stream->CacheOwner);
+        vafs_cache_destroy(stream->BlockCache);
+    }
+
+    // Register the stream as a new owner in the cache, this keeps blocks of
+    // different streams apart when the cache is shared.
+    stream->BlockCache = vafs_cache_acquire(cache);
+    stream->CacheOwner = vafs_cache_register(cache);
     return 0;
 }
 
-int vafs_stream_set_filter(
-    struct VaFsStream*   stream,
-    VaFsFilterEncodeFunc encode,
-    VaFsFilterDecodeFunc decode)
+int vafs_stream_set_encoders(
+    struct VaFsStream* stream,
+    int                threadCount)
+{
+    if (stream == NULL || stream->Encoders != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stream->EncoderThreads = threadCount;
+    return 0;
+}
+
+int vafs_stream_set_checksum(
+    struct VaFsStream* stream,
+    uint32_t           algorithm)
+{
+    if (stream == NULL || stream->Encoders != NULL ||
+        (algorithm != VaFsChecksum_CRC32 && algorithm != VaFsChecksum_CRC32C)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stream->Checksum = algorithm;
+    return 0;
+}
+
+int vafs_stream_set_verify(
+    struct VaFsStream* stream,
+    uint32_t           mode)
+{
+    if (stream == NULL || (mode != VaFsVerify_Always && mode != VaFsVerify_Once)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (mode == VaFsVerify_Once && stream->Verified == NULL) {
+        stream->Verified = calloc(stream->BlockHeaders.Count + 1, sizeof(uint8_t));
+        if (!stream->Verified) {
+            errno = ENOMEM;
+            return -1;
+        }
+        mtx_init(&stream->VerifyLock, mtx_plain);
+    }
+    else if (mode == VaFsVerify_Always && stream->Verified != NULL) {
+        mtx_destroy(&stream->VerifyLock);
+        free(stream->Verified);
+        stream->Verified = NULL;
+    }
+    return 0;
+}
+
+int vafs_stream_set_readahead(
+    struct VaFsStream*     stream,
+    struct VaFsPrefetcher* prefetcher,
+    uint32_t               maxBlocks)
 {
     if (stream == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    stream->Encode = encode;
-    stream->Decode = decode;
+    stream->Prefetcher   = maxBlocks ? prefetcher : NULL;
+    stream->ReadaheadMax = maxBlocks;
     return 0;
 }
 
@@ -336,244 +546,865 @@ int vafs_stream_position(
     return 0;
 }
 
-static uint32_t __get_blockbuffer_crc(
+uint32_t vafs_stream_block_size(
+    struct VaFsStream* stream)
+{
+    return stream->WriteBlockSize;
+}
+
+uint32_t vafs_stream_block_size_at(
+    struct VaFsStream* stream,
+    vafsblock_t        blockIndex)
+{
+    return __get_block_size(stream, blockIndex);
+}
+
+void vafs_stream_get_stats(
+    struct VaFsStream*      stream,
+    struct VaFsStreamStats* statsOut)
+{
+    statsOut->CacheHits     = atomic_load_explicit(&stream->Counters.CacheHits, memory_order_relaxed);
+    statsOut->CacheMisses   = atomic_load_explicit(&stream->Counters.CacheMisses, memory_order_relaxed);
+    statsOut->BlocksDecoded = atomic_load_explicit(&stream->Counters.BlocksDecoded, memory_order_relaxed);
+    statsOut->DecodeTime    = atomic_load_explicit(&stream->Counters.DecodeTime, memory_order_relaxed);
+    statsOut->BytesRead     = atomic_load_explicit(&stream->Counters.BytesRead, memory_order_relaxed);
+    statsOut->VerifyTime    = atomic_load_explicit(&stream->Counters.VerifyTime, memory_order_relaxed);
+}
+
+void vafs_stream_get_cache_stats(
+    struct VaFsStream* stream,
+    uint64_t*          evictionsOut,
+    uint64_t*          contentionOut)
+{
+    vafs_cache_get_stats(stream->BlockCache, evictionsOut, contentionOut);
+}
+
+static inline void __count(
+    atomic_ullong* counter,
+    uint64_t       value)
+{
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static uint32_t __get_block_crc(
     struct VaFsStream* stream,
+    const void*        buffer,
     size_t             length)
 {
-    return crc_calculate(
-        CRC_BEGIN, 
-        (uint8_t*)stream->BlockBuffer, 
-        length
-    );
+    return crc_block_checksum(stream->Checksum, buffer, length);
 }
 
-static int __load_blockbuffer(
+static int __is_block_verified(
     struct VaFsStream* stream,
     vafsblock_t        blockIndex)
 {
-    struct BlockHeader* blockHeader;
-    void*               blockData;
-    size_t              blockSize;
-    size_t              read;
-    uint32_t            crc;
-    int                 status;
-    long                position;
-    VAFS_DEBUG("__load_blockbuffer(block=%u)\n", blockIndex);
+    int verified;
 
-    // Always check the block cache first
-    status = vafs_cache_get(stream->BlockCache, blockIndex, &blockData, &blockSize);
-    if (status == 0) {
-        // We have the block in the cache, so we can just copy the data
-        // to the block buffer and return.
-        memcpy(stream->BlockBuffer, blockData, blockSize);
+    if (stream->Verified == NULL) {
         return 0;
     }
 
-    blockHeader = __get_block_header(stream, blockIndex);
-    if (!blockHeader) {
-        VAFS_ERROR("__load_blockbuffer: invalid block index: %u\n", blockIndex);
-        return -1;
+    mtx_lock(&stream->VerifyLock);
+    verified = stream->Verified[blockIndex];
+    mtx_unlock(&stream->VerifyLock);
+    return verified;
+}
+
+static void __set_block_verified(
+    struct VaFsStream* stream,
+    vafsblock_t        blockIndex)
+{
+    if (stream->Verified == NULL) {
+        return;
     }
 
-    VAFS_DEBUG("__load_blockbuffer: block offset: %u\n", blockHeader->Offset);
-    VAFS_DEBUG("__load_blockbuffer: block size: %u\n", blockHeader->LengthOnDisk);
+    mtx_lock(&stream->VerifyLock);
+    stream->Verified[blockIndex] = 1;
+    mtx_unlock(&stream->VerifyLock);
+}
 
-    blockSize   = blockHeader->LengthOnDisk;
-    blockData   = malloc(blockSize);
-    if (!blockData) {
-        errno = ENOMEM;
-        return -1;
+static int __read_block_data(
+    struct VaFsStream*  stream,
+    struct BlockHeader* blockHeader,
+    const void**        dataOut,
+    void**              stagingOut)
+{
+    uint64_t offset = stream->DeviceOffset + blockHeader->Offset;
+    void*    staging;
+    size_t   read;
+    int      status;
+
+    // Devices backed by memory hand out the block data directly, which
+    // saves both the staging buffer and the read.
+    *stagingOut = NULL;
+    __count(&stream->Counters.BytesRead, blockHeader->LengthOnDisk);
+    if (!vafs_streamdevice_map(stream->Device, offset, blockHeader->LengthOnDisk, dataOut)) {
+        return 0;
     }
 
-    position = vafs_streamdevice_seek(stream->Device, stream->DeviceOffset + blockHeader->Offset, SEEK_SET);
-    if (position == -1) {
-        VAFS_ERROR("__load_blockbuffer: failed to seek to block: %u\n", blockIndex);
-        free(blockData);
+    staging = malloc(blockHeader->LengthOnDisk);
+    if (!staging) {
+        errno = ENOMEM;
         return -1;
     }
 
-    status = vafs_streamdevice_read(stream->Device, blockData, blockSize, &read);
+    status = vafs_streamdevice_read_at(stream->Device, offset, staging, blockHeader->LengthOnDisk, &read);
     if (status) {
-        VAFS_ERROR("__load_blockbuffer: failed to read block: %u\n", blockIndex);
+        free(staging);
         return status;
     }
 
-    // Handle data filters
-    if (stream->Decode) {
-        uint32_t blockBufferSize = stream->Header.BlockSize;
+    *dataOut    = staging;
+    *stagingOut = staging;
+    return 0;
+}
 
-        VAFS_DEBUG("__load_blockbuffer decoding buffer of size %zu\n", blockSize);
-        status = stream->Decode(blockData, (uint32_t)blockSize, stream->BlockBuffer, &blockBufferSize);
-        if (status) {
-            VAFS_ERROR("__load_blockbuffer: failed to decode block, %i\n", errno);
-            free(blockData);
-            return status;
-        }
-        VAFS_DEBUG("__load_blockbuffer decoded buffer size %u\n", blockBufferSize);
+static struct BlockHeader* __get_valid_block_header(
+    struct VaFsStream* stream,
+    vafsblock_t        blockIndex)
+{
+    struct BlockHeader* blockHeader;
 
-        // TODO we should keep a current length of block
-        // verify the length of the block is correct, the actual size
-        // of the decoded data is now in blockSize
-        blockSize = blockBufferSize;
+    blockHeader = __get_block_header(stream, blockIndex);
+    if (!blockHeader) {
+        VAFS_ERROR("__read_block: invalid block index: %u\n", blockIndex);
+        errno = EINVAL;
+        return NULL;
     }
-    else {
-        memcpy(stream->BlockBuffer, blockData, blockSize);
+
+    VAFS_DEBUG("__read_block: block offset: %llu\n", blockHeader->Offset);
+    VAFS_DEBUG("__read_block: block size: %u\n", blockHeader->LengthOnDisk);
+
+    // Blocks that are not decoded must fit in a block as they are
+    if ((!stream->Filter || (blockHeader->Flags & BLOCK_FLAG_RAW)) &&
+        blockHeader->LengthOnDisk > __get_block_size(stream, blockIndex)) {
+        VAFS_ERROR("__read_block: block %u is larger than the block size\n", blockIndex);
+        errno = EINVAL;
+        return NULL;
+    }
+    return blockHeader;
+}
+
+static int __verify_block(
+    struct VaFsStream*  stream,
+    vafsblock_t         blockIndex,
+    struct BlockHeader* blockHeader,
+    const void*         data,
+    size_t              length)
+{
+    uint64_t start;
+    uint32_t crc;
+
+    if (__is_block_verified(stream, blockIndex)) {
+        return 0;
     }
-    free(blockData);
 
-    crc = __get_blockbuffer_crc(stream, blockSize);
+    start = __vafs_time_ns();
+    crc   = __get_block_crc(stream, data, length);
+    __count(&stream->Counters.VerifyTime, __vafs_time_ns() - start);
     if (crc != blockHeader->Crc) {
-        VAFS_WARN("__load_blockbuffer: CRC mismatch: %u != %u\n", crc, blockHeader->Crc);
+        VAFS_WARN("__read_block: CRC mismatch: %u != %u\n", crc, blockHeader->Crc);
         errno = EIO;
         return -1;
     }
-
-    // Cache the block
-    status = vafs_cache_set(stream->BlockCache, blockIndex, stream->BlockBuffer, blockSize);
-    if (status) {
-        VAFS_WARN("__load_blockbuffer: failed to cache block %u\n", blockIndex);
-    }
+    __set_block_verified(stream, blockIndex);
     return 0;
 }
 
-int vafs_stream_seek(
-    struct VaFsStream* stream, 
+// __read_block_into reads and decodes a block into the provided buffer, which
+// must be able to hold the block size of the run the block is in.
+static int __read_block_into(
+    struct VaFsStream* stream,
     vafsblock_t        blockIndex,
-    uint32_t           blockOffset)
+    void*              buffer,
+    uint32_t*          lengthOut)
 {
     struct BlockHeader* blockHeader;
+    struct VaFsFilter*  filter;
+    const void*         blockData;
+    void*               staging;
+    uint32_t            blockSize;
     int                 status;
-    vafsblock_t         targetBlock  = blockIndex;
-    uint32_t            targetOffset = blockOffset;
-    vafsblock_t         i            = blockIndex;
-    VAFS_DEBUG("vafs_stream_seek(blockIndex=%u, blockOffset=%u)\n",
-        blockIndex, blockOffset);
 
-    if (stream == NULL) {
-        errno = EINVAL;
+    blockHeader = __get_valid_block_header(stream, blockIndex);
+    if (!blockHeader) {
         return -1;
     }
-    
-    // seek to start of stream
-    while (1) {
-        blockHeader = __get_block_header(stream, i);
-        if (!blockHeader) {
-            errno = EINVAL;
-            return -1;
-        }
 
-        // have we reached the target block, and does it contain our index?
-        if (i == targetBlock) {
-            // is the offset inside the current block?
-            if (targetOffset < stream->Header.BlockSize) {
-                break; // yep, we are done here
-            }
+    status = __read_block_data(stream, blockHeader, &blockData, &staging);
+    if (status) {
+        VAFS_ERROR("__read_block: failed to read block: %u\n", blockIndex);
+        return status;
+    }
 
-            // nope, reduce offset, switch to next block
-            targetOffset -= stream->Header.BlockSize;
-            targetBlock++;
+    // Handle data filters, raw blocks skip the filter entirely
+    filter    = (blockHeader->Flags & BLOCK_FLAG_RAW) ? NULL : stream->Filter;
+    blockSize = blockHeader->LengthOnDisk;
+    if (filter) {
+        uint32_t blockBufferSize = __get_block_size(stream, blockIndex);
+        void*    context;
+        uint64_t start;
+
+        VAFS_DEBUG("__read_block decoding buffer of size %u\n", blockSize);
+        status = vafs_filter_context_acquire(filter, &context);
+        if (!status) {
+            start  = __vafs_time_ns();
+            status = vafs_filter_decode(filter, context, blockData, blockSize, buffer, &blockBufferSize);
+            __count(&stream->Counters.DecodeTime, __vafs_time_ns() - start);
+            __count(&stream->Counters.BlocksDecoded, 1);
+            vafs_filter_context_release(filter, context);
+        }
+        free(staging);
+        if (status) {
+            VAFS_ERROR("__read_block: failed to decode block, %i\n", errno);
+            return status;
+        }
+        VAFS_DEBUG("__read_block decoded buffer size %u\n", blockBufferSize);
+        if (blockBufferSize > __get_block_size(stream, blockIndex)) {
+            VAFS_ERROR("__read_block: decoded block %u is larger than the block size\n", blockIndex);
+            errno = EIO;
+            return -1;
         }
-        i++;
+        blockSize = blockBufferSize;
+    }
+    else {
+        memcpy(buffer, blockData, blockSize);
+        free(staging);
     }
 
-    status = __load_blockbuffer(stream, targetBlock);
+    status = __verify_block(stream, blockIndex, blockHeader, buffer, blockSize);
     if (status) {
-        VAFS_ERROR("vafs_stream_seek: load blockbuffer failed: %i\n", status);
         return status;
     }
-
-    stream->BlockBufferIndex  = targetBlock;
-    stream->BlockBufferOffset = targetOffset;
+    *lengthOut = blockSize;
     return 0;
 }
 
-static int __add_block_header(
-    struct VaFsStream* stream,
-    uint32_t           blockLength)
+static int __read_block(
+    struct VaFsStream*      stream,
+    vafsblock_t             blockIndex,
+    struct VaFsCacheBlock** blockOut)
 {
-    long     offset;
-    uint32_t crc;
-
-    offset = vafs_streamdevice_seek(stream->Device, 0, SEEK_CUR);
+    struct BlockHeader*    blockHeader;
+    struct VaFsCacheBlock* block;
+    const void*            blockData;
+    uint32_t               blockSize;
+    int                    status;
 
-    VAFS_DEBUG("__add_block_header: adding block mapping %u => %lu\n",
-        stream->BlockBufferIndex, offset);
-    VAFS_DEBUG("__add_block_header: block length %u\n", blockLength);
-
-    // perform the CRC on the uncompressed data
-    crc = __get_blockbuffer_crc(stream, stream->BlockBufferOffset);
-
-    if (stream->BlockHeaders.Count == stream->BlockHeaders.Capacity) {
-        struct BlockHeader* newHeaders;
-        uint32_t            newCapacity;
+    blockHeader = __get_valid_block_header(stream, blockIndex);
+    if (!blockHeader) {
+        return -1;
+    }
 
-        newCapacity = stream->BlockHeaders.Capacity * 2;
-        if (newCapacity == 0) {
-            newCapacity = 8;
+    // Blocks that are not decoded and can be mapped are used as they are
+    if ((!stream->Filter || (blockHeader->Flags & BLOCK_FLAG_RAW)) &&
+        !vafs_streamdevice_map(stream->Device, stream->DeviceOffset + blockHeader->Offset,
+                               blockHeader->LengthOnDisk, &blockData)) {
+        __count(&stream->Counters.BytesRead, blockHeader->LengthOnDisk);
+        if (__verify_block(stream, blockIndex, blockHeader, blockData, blockHeader->LengthOnDisk)) {
+            return -1;
         }
 
-        newHeaders = realloc(stream->BlockHeaders.Headers, newCapacity * sizeof(struct BlockHeader));
-        if (!newHeaders) {
-            errno = ENOMEM;
+        block = vafs_cache_block_wrap(blockData, blockHeader->LengthOnDisk);
+        if (!block) {
             return -1;
         }
-        memset(
-            &newHeaders[stream->BlockHeaders.Capacity],
-            0, 
-            (newCapacity - stream->BlockHeaders.Capacity) * sizeof(struct BlockHeader)
-        );
+        *blockOut = block;
+        return 0;
+    }
 
-        stream->BlockHeaders.Headers  = newHeaders;
-        stream->BlockHeaders.Capacity = newCapacity;
+    block = vafs_cache_block_new(__get_block_size(stream, blockIndex));
+    if (!block) {
+        return -1;
     }
 
-    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].LengthOnDisk = blockLength;
-    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].Offset       = (uint32_t)offset;
-    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].Crc          = crc;
-    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].Flags        = 0;
-    stream->BlockHeaders.Count++;
+    status = __read_block_into(stream, blockIndex, block->buffer, &blockSize);
+    if (status) {
+        vafs_cache_release(stream->BlockCache, block);
+        return status;
+    }
+    block->size = blockSize;
+    *blockOut   = block;
     return 0;
 }
 
-static int __flush_block(
-    struct VaFsStream* stream)
+static int __load_block(
+    struct VaFsStream*      stream,
+    vafsblock_t             blockIndex,
+    struct VaFsCacheBlock** blockOut)
 {
-    void*    compressedData = stream->BlockBuffer;
-    uint32_t compressedSize = stream->BlockBufferOffset;
-    size_t   written;
-    int      status;
-    VAFS_DEBUG("__flush_block(blockLength=%u)\n", stream->BlockBufferOffset);
+    struct VaFsCacheBlock* block;
+    int                    status;
+    VAFS_DEBUG("__load_block(block=%u)\n", blockIndex);
 
-    if (!stream->BlockBufferOffset) {
-        // empty block, ignore it
+    // Always check the block cache first, a hit gives us
+    // a pinned reference to the cached block.
+    status = vafs_cache_get(stream->BlockCache, VAFS_CACHE_KEY(stream->CacheOwner, blockIndex), blockOut);
+    if (status == 0) {
+        __count(&stream->Counters.CacheHits, 1);
         return 0;
     }
-    
-    // Handle compressions
-    if (stream->Encode) {
-        status = stream->Encode(stream->BlockBuffer, stream->BlockBufferOffset, &compressedData, &compressedSize);
-        if (status) {
-            return status;
-        }
-        VAFS_DEBUG("__flush_block compressed buffer size %u\n", compressedSize);
-    }
+    __count(&stream->Counters.CacheMisses, 1);
+
+    status = __read_block(stream, blockIndex, &block);
+    if (status) {
+        return status;
+    }
+
+    // Offer the block to the cache, the cache takes its own reference
+    // if it decides to keep it.
+    status = vafs_cache_set(stream->BlockCache, VAFS_CACHE_KEY(stream->CacheOwner, blockIndex), block);
+    if (status) {
+        VAFS_WARN("__load_block: failed to cache block %u\n", blockIndex);
+    }
+
+    *blockOut = block;
+    return 0;
+}
+
+int vafs_stream_prefetch(
+    struct VaFsStream* stream,
+    vafsblock_t        blockIndex)
+{
+    struct VaFsCacheBlock* block;
+    uint64_t               key;
+    int                    status;
+
+    if (stream == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    key = VAFS_CACHE_KEY(stream->CacheOwner, blockIndex);
+    if (vafs_cache_contains(stream->BlockCache, key)) {
+        return 0;
+    }
+
+    status = __read_block(stream, blockIndex, &block);
+    if (status) {
+        return status;
+    }
+
+    status = vafs_cache_prefetch(stream->BlockCache, key, block);
+    vafs_cache_release(stream->BlockCache, block);
+    return status;
+}
+
+int vafs_stream_reader_construct(
+    struct VaFsStream*       stream,
+    struct VaFsStreamReader* reader)
+{
+    if (stream == NULL || reader == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(reader, 0, sizeof(struct VaFsStreamReader));
+    reader->Stream = stream;
+    return 0;
+}
+
+void vafs_stream_reader_destroy(
+    struct VaFsStreamReader* reader)
+{
+    if (reader == NULL || reader->Block == NULL) {
+        return;
+    }
+
+    vafs_cache_release(reader->Stream->BlockCache, reader->Block);
+    reader->Block       = NULL;
+    reader->BlockLength = 0;
+}
+
+static void __reader_readahead(
+    struct VaFsStreamReader* reader,
+    vafsblock_t              blockIndex,
+    int                      sequential)
+{
+    struct VaFsStream* stream = reader->Stream;
+    vafsblock_t        last;
+    vafsblock_t        i;
+    uint32_t           window;
+
+    if (!sequential) {
+        reader->SequentialRun = 0;
+        reader->ReadaheadNext = blockIndex + 1;
+        return;
+    }
+
+    // Grow the readahead window exponentially with the length of the
+    // sequential run, a reader that keeps going gets more blocks ahead.
+    reader->SequentialRun++;
+    window = 1u << MIN(reader->SequentialRun, 16);
+    window = MIN(window, stream->ReadaheadMax);
+
+    last = blockIndex + window;
+    if (last >= stream->Header.BlockHeadersCount) {
+        last = stream->Header.BlockHeadersCount - 1;
+    }
+
+    i = MAX(reader->ReadaheadNext, blockIndex + 1);
+    for (; i <= last; i++) {
+        if (vafs_prefetcher_queue(stream->Prefetcher, stream, i)) {
+            break;
+        }
+    }
+    reader->ReadaheadNext = i;
+}
+
+static int __reader_load_block(
+    struct VaFsStreamReader* reader,
+    vafsblock_t              blockIndex)
+{
+    struct VaFsCacheBlock* block;
+    int                    status;
+    int                    sequential;
+
+    status = __load_block(reader->Stream, blockIndex, &block);
+    if (status) {
+        return status;
+    }
+
+    if (reader->Stream->Prefetcher) {
+        sequential = reader->Block != NULL && reader->BlockIndex + 1 == blockIndex;
+        __reader_readahead(reader, blockIndex, sequential);
+    }
+
+    // unpin the previous block before switching
+    vafs_stream_reader_destroy(reader);
+    reader->Block       = block;
+    reader->BlockIndex  = blockIndex;
+    reader->BlockLength = (uint32_t)block->size;
+    reader->BlockOffset = 0;
+    return 0;
+}
+
+int vafs_stream_reader_seek(
+    struct VaFsStreamReader* reader,
+    vafsblock_t              blockIndex,
+    uint64_t                 blockOffset)
+{
+    struct VaFsStream* stream;
+    int                status;
+    uint64_t           targetBlock;
+    uint32_t           targetOffset;
+    uint32_t           blockSize;
+    VAFS_DEBUG("vafs_stream_reader_seek(blockIndex=%u, blockOffset=%llu)\n",
+        blockIndex, blockOffset);
+
+    if (reader == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    stream = reader->Stream;
+
+    // All blocks a file spans, except the last one, hold exactly the block size of
+    // its run of decoded data, as streams are only aligned and only change their
+    // block size in between files. So the target position can be calculated directly.
+    blockSize    = __get_block_size(stream, blockIndex);
+    targetBlock  = blockIndex + (blockOffset / blockSize);
+    targetOffset = (uint32_t)(blockOffset % blockSize);
+    if (targetBlock >= VA_FS_INVALID_BLOCK || !__get_block_header(stream, (vafsblock_t)targetBlock)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Only load the block if the reader is not already positioned in it, this
+    // makes repeated reads inside the same block cheap. Blocks that were read
+    // directly into the buffer of the caller are not held by the reader.
+    if (!reader->BlockLength || reader->BlockIndex != targetBlock || reader->Block == NULL) {
+        status = __reader_load_block(reader, (vafsblock_t)targetBlock);
+        if (status) {
+            VAFS_ERROR("vafs_stream_reader_seek: load block failed: %i\n", status);
+            return status;
+        }
+    }
+
+    if (targetOffset > reader->BlockLength) {
+        errno = ENODATA;
+        return -1;
+    }
+    reader->BlockOffset = targetOffset;
+    return 0;
+}
+
+static int __reader_advance(
+    struct VaFsStreamReader* reader)
+{
+    if (reader->BlockOffset < reader->BlockLength) {
+        return 0;
+    }
+
+    VAFS_DEBUG("__reader_advance: loading block %u\n", reader->BlockIndex + 1);
+    if (__reader_load_block(reader, reader->BlockIndex + 1)) {
+        VAFS_ERROR("__reader_advance: failed to load block\n");
+        errno = ENODATA;
+        return -1;
+    }
+    return 0;
+}
+
+// __reader_read_direct reads the next block straight into the buffer, which
+// must be able to hold a full block. Returns 1 if the block is cached, in
+// which case the reader is positioned in the cached block instead.
+static int __reader_read_direct(
+    struct VaFsStreamReader* reader,
+    void*                    buffer,
+    size_t*                  bytesReadOut)
+{
+    struct VaFsStream*     stream = reader->Stream;
+    struct VaFsCacheBlock* block;
+    vafsblock_t            blockIndex = reader->BlockIndex + 1;
+    uint32_t               blockLength;
+    int                    status;
+
+    if (!vafs_cache_get(stream->BlockCache, VAFS_CACHE_KEY(stream->CacheOwner, blockIndex), &block)) {
+        __count(&stream->Counters.CacheHits, 1);
+        if (stream->Prefetcher) {
+            __reader_readahead(reader, blockIndex, 1);
+        }
+        vafs_stream_reader_destroy(reader);
+        reader->Block       = block;
+        reader->BlockIndex  = blockIndex;
+        reader->BlockLength = (uint32_t)block->size;
+        reader->BlockOffset = 0;
+        return 1;
+    }
+
+    __count(&stream->Counters.CacheMisses, 1);
+    if (stream->Prefetcher) {
+        __reader_readahead(reader, blockIndex, 1);
+    }
+
+    status = __read_block_into(stream, blockIndex, buffer, &blockLength);
+    if (status) {
+        return -1;
+    }
+
+    // The reader is left at the end of the block, without holding it
+    vafs_stream_reader_destroy(reader);
+    reader->BlockIndex  = blockIndex;
+    reader->BlockLength = blockLength;
+    reader->BlockOffset = blockLength;
+    *bytesReadOut = blockLength;
+    return 0;
+}
+
+int vafs_stream_reader_read(
+    struct VaFsStreamReader* reader,
+    void*                    buffer,
+    size_t                   size,
+    size_t*                  bytesRead)
+{
+    uint8_t* data        = (uint8_t*)buffer;
+    size_t   bytesToRead = size;
+    VAFS_DEBUG("vafs_stream_reader_read(size=%zu)\n", size);
+
+    if (reader == NULL || buffer == NULL || size == 0 || bytesRead == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!reader->BlockLength) {
+        // reader has not been positioned
+        *bytesRead = 0;
+        errno = EINVAL;
+        return -1;
+    }
+
+    // read the data from stream, taking care of block boundaries
+    while (bytesToRead) {
+        size_t byteCount;
+
+        // Whole blocks are decoded directly into the buffer, unless they are
+        // cached already. The last block of the stream may be shorter.
+        if (reader->BlockOffset == reader->BlockLength &&
+            bytesToRead >= __get_block_size(reader->Stream, reader->BlockIndex + 1) &&
+            __get_block_header(reader->Stream, reader->BlockIndex + 1) != NULL) {
+            int status = __reader_read_direct(reader, data, &byteCount);
+            if (status < 0) {
+                *bytesRead = (size - bytesToRead);
+                errno = ENODATA;
+                return -1;
+            }
+            else if (status == 0) {
+                data        += byteCount;
+                bytesToRead -= byteCount;
+                continue;
+            }
+        }
+
+        if (__reader_advance(reader)) {
+            *bytesRead = (size - bytesToRead);
+            return -1;
+        }
+
+        byteCount = MIN(bytesToRead, reader->BlockLength - reader->BlockOffset);
+        VAFS_DEBUG("vafs_stream_reader_read: reading %zu bytes from block %u, offset %u\n",
+            byteCount, reader->BlockIndex, reader->BlockOffset);
+        memcpy(data, reader->Block->buffer + reader->BlockOffset, byteCount);
+        
+        reader->BlockOffset += (uint32_t)byteCount;
+        data                += byteCount;
+        bytesToRead         -= byteCount;
+    }
+
+    *bytesRead = size;
+    return 0;
+}
+
+int vafs_stream_reader_borrow(
+    struct VaFsStreamReader* reader,
+    size_t                   size,
+    const void**             dataOut,
+    size_t*                  lengthOut)
+{
+    size_t byteCount;
+
+    if (reader == NULL || size == 0 || dataOut == NULL || lengthOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!reader->BlockLength) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (__reader_advance(reader)) {
+        return -1;
+    }
+
+    byteCount = MIN(size, reader->BlockLength - reader->BlockOffset);
+    *dataOut   = reader->Block->buffer + reader->BlockOffset;
+    *lengthOut = byteCount;
+    reader->BlockOffset += (uint32_t)byteCount;
+    return 0;
+}
+
+static int __add_block_header(
+    struct VaFsStream* stream,
+    uint32_t           blockLength,
+    uint32_t           crc,
+    uint16_t           flags)
+{
+    int64_t offset;
+
+    offset = vafs_streamdevice_seek(stream->Device, 0, SEEK_CUR);
+    if (offset < 0) {
+        VAFS_ERROR("__add_block_header: failed to get the device position\n");
+        return -1;
+    }
+
+    VAFS_DEBUG("__add_block_header: adding block mapping %u => %lld\n",
+        stream->BlockHeaders.Count, (long long)offset);
+    VAFS_DEBUG("__add_block_header: block length %u\n", blockLength);
+
+    if (stream->BlockHeaders.Count == stream->BlockHeaders.Capacity) {
+        struct BlockHeader* newHeaders;
+        uint32_t            newCapacity;
+
+        newCapacity = stream->BlockHeaders.Capacity * 2;
+        if (newCapacity == 0) {
+            newCapacity = 8;
+        }
+
+        newHeaders = realloc(stream->BlockHeaders.Headers, newCapacity * sizeof(struct BlockHeader));
+        if (!newHeaders) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(
+            &newHeaders[stream->BlockHeaders.Capacity],
+            0, 
+            (newCapacity - stream->BlockHeaders.Capacity) * sizeof(struct BlockHeader)
+        );
+
+        stream->BlockHeaders.Headers  = newHeaders;
+        stream->BlockHeaders.Capacity = newCapacity;
+    }
+
+    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].LengthOnDisk = blockLength;
+    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].Offset       = (uint64_t)offset - stream->DeviceOffset;
+    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].Crc          = crc;
+    stream->BlockHeaders.Headers[stream->BlockHeaders.Count].Flags        = flags;
+    stream->BlockHeaders.Count++;
+    return 0;
+}
+
+static int __commit_block(
+    struct VaFsStream* stream,
+    const void*        data,
+    uint32_t           length,
+    uint32_t           crc,
+    uint16_t           flags)
+{
+    size_t written;
+    int    status;
 
     // add index mapping
-    status = __add_block_header(stream, compressedSize);
+    status = __add_block_header(stream, length, crc, flags);
     if (status) {
-        VAFS_ERROR("__flush_block: failed to add block header\n");
+        VAFS_ERROR("__commit_block: failed to add block header\n");
         return status;
     }
 
-    status = vafs_streamdevice_write(stream->Device, compressedData, compressedSize, &written);
+    status = vafs_streamdevice_write(stream->Device, (void*)data, length, &written);
     if (status) {
-        VAFS_ERROR("__flush_block: failed to write block data\n");
+        VAFS_ERROR("__commit_block: failed to write block data\n");
         return status;
     }
+    return 0;
+}
+
+// __commit_encoded_block returns 0 if a block was committed, 1 if
+// no block was ready to be committed, and -1 on errors.
+static int __commit_encoded_block(
+    struct VaFsStream* stream,
+    int                wait)
+{
+    struct VaFsEncodedBlock block;
+    int                     status;
+
+    if (vafs_encoder_pool_collect(stream->Encoders, wait, &block)) {
+        return 1;
+    }
+
+    status = block.Status;
+    if (status) {
+        VAFS_ERROR("__commit_encoded_block: failed to encode block\n");
+    }
+    else if (block.EncodedLength >= block.Length) {
+        status = __commit_block(stream, block.Data, block.Length, block.Crc, BLOCK_FLAG_RAW);
+    }
+    else {
+        status = __commit_block(stream, block.Encoded, block.EncodedLength, block.Crc, 0);
+    }
+
+    return status ? -1 : 0;
+}
+
+static int __commit_encoded_blocks(
+    struct VaFsStream* stream,
+    int                wait)
+{
+    int status;
+
+    do {
+        status = __commit_encoded_block(stream, wait);
+    } while (status == 0);
+    return status < 0 ? -1 : 0;
+}
+
+static int __submit_block(
+    struct VaFsStream* stream)
+{
+    void* blockBuffer = stream->BlockBuffer;
+    int   status;
+
+    if (stream->Encoders == NULL) {
+        status = vafs_encoder_pool_create(stream->EncoderThreads, stream->Filter, stream->Checksum,
+            stream->Header.BlockSize, &stream->Encoders);
+        if (status) {
+            VAFS_ERROR("__submit_block: failed to create encoder pool\n");
+            return status;
+        }
+    }
+
+    // When the pool is full, we wait for the oldest block to be
+    // encoded and commit it, which frees up a slot. The pool hands
+    // back one of its buffers for staging the next block.
+    while (vafs_encoder_pool_submit(stream->Encoders, &blockBuffer, stream->BlockBufferOffset)) {
+        if (__commit_encoded_block(stream, 1)) {
+            return -1;
+        }
+    }
+    stream->BlockBuffer = blockBuffer;
+
+    // commit any blocks that are already done, without waiting
+    return __commit_encoded_blocks(stream, 0);
+}
+
+static int __encode_block(
+    struct VaFsStream* stream,
+    uint32_t*          encodedSizeOut)
+{
+    int status;
+
+    if (stream->EncodeBuffer == NULL) {
+        status = vafs_filter_context_acquire(stream->Filter, &stream->EncodeContext);
+        if (status) {
+            return status;
+        }
+
+        stream->EncodeBuffer = malloc(stream->Header.BlockSize);
+        if (!stream->EncodeBuffer) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // Blocks that do not fit into the size of the block they were encoded
+    // from are stored as they are
+    *encodedSizeOut = stream->BlockBufferOffset;
+    status = vafs_filter_encode(stream->Filter, stream->EncodeContext, stream->BlockBuffer,
+        stream->BlockBufferOffset, stream->EncodeBuffer, encodedSizeOut);
+    if (status && errno == ENOSPC) {
+        *encodedSizeOut = stream->BlockBufferOffset;
+        return 0;
+    }
+    return status;
+}
+
+static int __flush_block(
+    struct VaFsStream* stream)
+{
+    void*    compressedData = stream->BlockBuffer;
+    uint32_t compressedSize = stream->BlockBufferOffset;
+    uint16_t flags = 0;
+    uint32_t crc;
+    int      status;
+    VAFS_DEBUG("__flush_block(blockLength=%u)\n", stream->BlockBufferOffset);
+
+    if (!stream->BlockBufferOffset) {
+        // empty block, ignore it
+        return 0;
+    }
 
-    // In the case of a compressed stream, we need to free the compressed data
-    if (stream->Encode) {
-        free(compressedData);
+    if (stream->Filter && stream->EncoderThreads > 1) {
+        status = __submit_block(stream);
+        if (status) {
+            return status;
+        }
+        stream->BlockBufferIndex++;
+        stream->BlockBufferOffset = 0;
+        return 0;
+    }
+
+    // perform the CRC on the uncompressed data
+    crc = __get_block_crc(stream, stream->BlockBuffer, stream->BlockBufferOffset);
+    
+    // Handle compressions, the block is stored as it is if the filter did not
+    // make it smaller, which also means it will never have to be decoded again
+    if (stream->Filter) {
+        status = __encode_block(stream, &compressedSize);
+        if (status) {
+            return status;
+        }
+        VAFS_DEBUG("__flush_block compressed buffer size %u\n", compressedSize);
+
+        if (compressedSize < stream->BlockBufferOffset) {
+            compressedData = stream->EncodeBuffer;
+        }
+        else {
+            compressedSize = stream->BlockBufferOffset;
+            flags          = BLOCK_FLAG_RAW;
+        }
+    }
+
+    status = __commit_block(stream, compressedData, compressedSize, crc, flags);
+    if (status) {
+        return status;
     }
 
     stream->BlockBufferIndex++;
@@ -600,7 +1431,7 @@ int vafs_stream_write(
         size_t byteCount;
         size_t bytesLeftInBlock;
 
-        bytesLeftInBlock = stream->Header.BlockSize - (stream->BlockBufferOffset % stream->Header.BlockSize);
+        bytesLeftInBlock = stream->WriteBlockSize - (stream->BlockBufferOffset % stream->WriteBlockSize);
         byteCount        = MIN(bytesToWrite, bytesLeftInBlock);
 
         memcpy(stream->BlockBuffer + stream->BlockBufferOffset, data, byteCount);
@@ -609,7 +1440,7 @@ int vafs_stream_write(
         data                      += byteCount;
         bytesToWrite              -= byteCount;
 
-        if (stream->BlockBufferOffset == stream->Header.BlockSize) {
+        if (stream->BlockBufferOffset == stream->WriteBlockSize) {
             if (__flush_block(stream)) {
                 VAFS_ERROR("vafs_stream_write: failed to flush block\n");
                 return -1;
@@ -620,66 +1451,200 @@ int vafs_stream_write(
     return 0;
 }
 
-int vafs_stream_read(
+int vafs_stream_align(
+    struct VaFsStream* stream)
+{
+    if (stream == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // a partially filled block is ended early, the next write starts a new block
+    return __flush_block(stream);
+}
+
+static int __add_block_run(
     struct VaFsStream* stream,
-    void*              buffer,
-    size_t             size,
-    size_t*            bytesRead)
+    vafsblock_t        firstBlock,
+    uint32_t           blockSize)
 {
-    uint8_t* data        = (uint8_t*)buffer;
-    size_t   bytesToRead = size;
-    size_t   bytesLeftInBlock;
-    VAFS_DEBUG("vafs_stream_read(size=%u)\n", size);
+    struct VaFsStreamBlockRuns* runs = &stream->BlockRuns;
+    uint32_t                    previousSize;
 
-    if (stream == NULL || buffer == NULL || size == 0) {
-        *bytesRead = 0;
+    // A run that holds no blocks yet is replaced, and the run is not needed
+    // if the blocks before it already have the same size
+    if (runs->Count && runs->Runs[runs->Count - 1].FirstBlock == firstBlock) {
+        runs->Count--;
+    }
+
+    previousSize = runs->Count ? runs->Runs[runs->Count - 1].BlockSize : stream->Header.BlockSize;
+    if (previousSize == blockSize) {
+        return 0;
+    }
+
+    if (runs->Count == runs->Capacity) {
+        struct BlockRun* newRuns;
+        uint32_t         newCapacity;
+
+        newCapacity = runs->Capacity * 2;
+        if (newCapacity == 0) {
+            newCapacity = 8;
+        }
+
+        newRuns = realloc(runs->Runs, newCapacity * sizeof(struct BlockRun));
+        if (!newRuns) {
+            errno = ENOMEM;
+            return -1;
+        }
+        runs->Runs     = newRuns;
+        runs->Capacity = newCapacity;
+    }
+
+    runs->Runs[runs->Count].FirstBlock = firstBlock;
+    runs->Runs[runs->Count].BlockSize  = blockSize;
+    runs->Count++;
+    return 0;
+}
+
+int vafs_stream_set_block_size(
+    struct VaFsStream* stream,
+    uint32_t           blockSize)
+{
+    int status;
+
+    if (stream == NULL || blockSize < VA_FS_DATA_MIN_BLOCKSIZE) {
         errno = EINVAL;
         return -1;
     }
 
-    // read the data from stream, taking care of block boundaries
-    while (bytesToRead) {
-        size_t byteCount;
+    // the buffers of the stream hold at most the block size of the stream
+    blockSize = MIN(blockSize, stream->Header.BlockSize);
+    if (blockSize == stream->WriteBlockSize) {
+        return 0;
+    }
 
-        bytesLeftInBlock = stream->Header.BlockSize - stream->BlockBufferOffset;
-        byteCount = MIN(bytesToRead, bytesLeftInBlock);
+    // The current block is ended with the old size, the blocks after it
+    // start a new run of the requested size
+    status = __flush_block(stream);
+    if (status) {
+        return status;
+    }
 
-        VAFS_DEBUG("vafs_stream_read: reading %u bytes from block %u, offset %u\n",
-            byteCount, stream->BlockBufferIndex, stream->BlockBufferOffset);
-        memcpy(data, stream->BlockBuffer + stream->BlockBufferOffset, byteCount);
-        
-        stream->BlockBufferOffset += (uint32_t)byteCount;
-        data                      += byteCount;
-        bytesToRead               -= byteCount;
+    status = __add_block_run(stream, stream->BlockBufferIndex, blockSize);
+    if (status) {
+        return status;
+    }
 
-        if (stream->BlockBufferOffset == stream->Header.BlockSize) {
-            VAFS_DEBUG("vafs_stream_read: loading block %u\n", stream->BlockBufferIndex);
-            if (__load_blockbuffer(stream, stream->BlockBufferIndex + 1)) {
-                VAFS_ERROR("vafs_stream_read: failed to load block\n");
-                *bytesRead = (size - bytesToRead);
-                errno = ENODATA;
-                return -1;
-            }
+    VAFS_DEBUG("vafs_stream_set_block_size: block %u onwards holds %u bytes\n",
+        stream->BlockBufferIndex, blockSize);
+    stream->WriteBlockSize = blockSize;
+    return 0;
+}
+
+// __block_equals decodes a block of the stream and compares it with the data.
+// Returns 0 if the block holds exactly the data, 1 if not, and -1 on errors.
+static int __block_equals(
+    struct VaFsStream* stream,
+    vafsblock_t        blockIndex,
+    const void*        data,
+    uint32_t           length)
+{
+    void*    buffer;
+    uint32_t blockLength;
+    int      status;
+
+    buffer = malloc(__get_block_size(stream, blockIndex));
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // a block that can not be read back is not reused, the data is written instead
+    status = 1;
+    if (!__read_block_into(stream, blockIndex, buffer, &blockLength)) {
+        status = (blockLength != length || memcmp(buffer, data, length)) ? 1 : 0;
+    } else {
+        VAFS_WARN("__block_equals: failed to read block %u of the source\n", blockIndex);
+    }
+    free(buffer);
+    return status;
+}
 
-            stream->BlockBufferIndex++;
-            stream->BlockBufferOffset = 0;
+int vafs_stream_copy_block(
+    struct VaFsStream* stream,
+    struct VaFsStream* source,
+    vafsblock_t        blockIndex,
+    const void*        data)
+{
+    struct BlockHeader* blockHeader;
+    const void*         blockData;
+    void*               staging;
+    int                 status;
+
+    if (stream == NULL || source == NULL || data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The block must be stored the same way in both streams, and replace a
+    // full block of the stream being written
+    if (stream->BlockBufferOffset != 0 || __get_block_size(source, blockIndex) != stream->WriteBlockSize ||
+        source->Checksum != stream->Checksum) {
+        return 1;
+    }
+
+    blockHeader = __get_valid_block_header(source, blockIndex);
+    if (blockHeader == NULL ||
+        blockHeader->Crc != __get_block_crc(stream, data, stream->WriteBlockSize)) {
+        return 1;
+    }
+
+    // A matching checksum does not mean the data is the same, so the block is
+    // decoded and compared, which is still much cheaper than encoding it again
+    status = __block_equals(source, blockIndex, data, stream->WriteBlockSize);
+    if (status != 0) {
+        return status;
+    }
+
+    // blocks still being encoded come before the copied block
+    if (stream->Encoders) {
+        status = __commit_encoded_blocks(stream, 1);
+        if (status) {
+            return status;
         }
     }
 
-    *bytesRead = (size - bytesToRead);
+    status = __read_block_data(source, blockHeader, &blockData, &staging);
+    if (status) {
+        return status;
+    }
+
+    VAFS_DEBUG("vafs_stream_copy_block: copying block %u to %u\n", blockIndex, stream->BlockBufferIndex);
+    status = __commit_block(stream, blockData, blockHeader->LengthOnDisk, blockHeader->Crc, blockHeader->Flags);
+    free(staging);
+    if (status) {
+        return status;
+    }
+
+    stream->BlockBufferIndex++;
     return 0;
 }
 
 static int __write_block_headers(
     struct VaFsStream* stream)
 {
-    size_t written;
-    int    status;
-    long   offset;
+    size_t  written;
+    int     status;
+    int64_t offset;
     VAFS_DEBUG("__write_index_mapping()\n");
 
     // get current offset
     offset = vafs_streamdevice_seek(stream->Device, 0, SEEK_CUR);
+    if (offset < 0) {
+        VAFS_ERROR("__write_index_mapping: failed to get the device position\n");
+        return -1;
+    }
+
     status = vafs_streamdevice_write(
         stream->Device,
         stream->BlockHeaders.Headers,
@@ -691,12 +1656,36 @@ static int __write_block_headers(
         return status;
     }
 
+    // Streams with blocks of different sizes store their runs right after
+    // the block headers, which older readers can not make sense of. A run
+    // started at the very end holds no blocks.
+    while (stream->BlockRuns.Count &&
+           stream->BlockRuns.Runs[stream->BlockRuns.Count - 1].FirstBlock >= stream->BlockHeaders.Count) {
+        stream->BlockRuns.Count--;
+    }
+    if (stream->BlockRuns.Count) {
+        status = vafs_streamdevice_write(stream->Device, &stream->BlockRuns.Count, sizeof(uint32_t), &written);
+        if (!status) {
+            status = vafs_streamdevice_write(
+                stream->Device,
+                stream->BlockRuns.Runs,
+                stream->BlockRuns.Count * sizeof(struct BlockRun),
+                &written
+            );
+        }
+        if (status) {
+            VAFS_ERROR("__write_index_mapping: failed to write block runs\n");
+            return status;
+        }
+        stream->Header.Magic = STREAM_MAGIC_RUNS;
+    }
+
     VAFS_DEBUG("__write_index_mapping: written %u bytes\n", written);
-    VAFS_DEBUG("__write_index_mapping: BlockHeadersOffset %ld\n", offset - stream->DeviceOffset);
+    VAFS_DEBUG("__write_index_mapping: BlockHeadersOffset %llu\n", (uint64_t)offset - stream->DeviceOffset);
     VAFS_DEBUG("__write_index_mapping: BlockHeadersCount %i\n", stream->BlockHeaders.Count);
 
     // update the header
-    stream->Header.BlockHeadersOffset = offset - stream->DeviceOffset;
+    stream->Header.BlockHeadersOffset = (uint64_t)offset - stream->DeviceOffset;
     stream->Header.BlockHeadersCount  = stream->BlockHeaders.Count;
     return 0;
 }
@@ -704,15 +1693,15 @@ static int __write_block_headers(
 static int __update_stream_header(
     struct VaFsStream* stream)
 {
-    size_t written;
-    int    status;
-    long   original;
-    long   position;
+    size_t  written;
+    int     status;
+    int64_t original;
+    int64_t position;
     VAFS_DEBUG("__update_stream_header()\n");
 
     original = vafs_streamdevice_seek(stream->Device, 0, SEEK_CUR);
-    position = (int)vafs_streamdevice_seek(stream->Device, stream->DeviceOffset, SEEK_SET);
-    if (position == -1) {
+    position = vafs_streamdevice_seek(stream->Device, (int64_t)stream->DeviceOffset, SEEK_SET);
+    if (original < 0 || position < 0) {
         VAFS_ERROR("__update_stream_header: failed to seek to stream header\n");
         return -1;
     }
@@ -728,7 +1717,7 @@ static int __update_stream_header(
         return status;
     }
 
-    VAFS_DEBUG("__update_stream_header: written %u bytes at %lu\n", written, position);
+    VAFS_DEBUG("__update_stream_header: written %u bytes at %lld\n", written, (long long)position);
 
     vafs_streamdevice_seek(stream->Device, original, SEEK_SET);
     return 0;
@@ -751,6 +1740,15 @@ int vafs_stream_finish(
         return status;
     }
 
+    // all blocks must be committed before the block headers are written
+    if (stream->Encoders) {
+        status = __commit_encoded_blocks(stream, 1);
+        if (status) {
+            VAFS_ERROR("vafs_stream_finish: failed to commit encoded blocks\n");
+            return status;
+        }
+    }
+
     status = __write_block_headers(stream);
     if (status) {
         VAFS_ERROR("vafs_stream_close: failed to write block headers\n");
@@ -774,8 +1772,21 @@ int vafs_stream_close(
         return -1;
     }
 
-    vafs_cache_destroy(stream->BlockCache);
+    if (stream->BlockCache) {
+        vafs_cache_purge(stream->BlockCache, stream->CacheOwner);
+        vafs_cache_destroy(stream->BlockCache);
+    }
+    vafs_encoder_pool_destroy(stream->Encoders);
+    if (stream->EncodeBuffer) {
+        vafs_filter_context_release(stream->Filter, stream->EncodeContext);
+        free(stream->EncodeBuffer);
+    }
+    if (stream->Verified) {
+        mtx_destroy(&stream->VerifyLock);
+        free(stream->Verified);
+    }
     free(stream->BlockHeaders.Headers);
+    free(stream->BlockRuns.Runs);
     free(stream->BlockBuffer);
     free(stream);
     return 0;
@@ -20,54 +20,103 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include "private.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define __TRANSFER_BUFFER_SIZE 1024*1024
-
-static long __file_seek(void*, long, int);
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#elif !defined(VALI)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#define __VAFS_HAS_MMAP
+#define __VAFS_HAS_PREAD
+#endif
+
+#define __TRANSFER_BUFFER_SIZE (1024 * 1024)
+
+// The devices implemented here seek with 64-bit offsets on all platforms, unlike
+// the seek of VaFsOperations, which is limited to the size of a long
+typedef int64_t (*VaFsSeekFunc)(void* userData, int64_t offset, int whence);
+
+#if defined(_WIN32) || defined(_WIN64)
+#define __fseek64(file, offset, whence) _fseeki64(file, offset, whence)
+#define __ftell64(file)                 _ftelli64(file)
+#elif !defined(VALI)
+#define __fseek64(file, offset, whence) fseeko(file, (off_t)(offset), whence)
+#define __ftell64(file)                 (int64_t)ftello(file)
+#else
+#define __fseek64(file, offset, whence) fseek(file, (long)(offset), whence)
+#define __ftell64(file)                 (int64_t)ftell(file)
+#endif
+
+static int64_t __file_seek(void*, int64_t, int);
 static int  __file_read(void*, void*, size_t, size_t*);
 static int  __file_write(void*, const void*, size_t, size_t*);
 static int  __file_close(void*);
+#if defined(_WIN32) || defined(_WIN64) || defined(__VAFS_HAS_PREAD)
+static int  __file_pread(void*, void*, size_t, uint64_t, size_t*);
+#else
+#define __file_pread NULL
+#endif
 
-static long __memory_seek(void*, long, int);
+static int64_t __memory_seek(void*, int64_t, int);
 static int  __memory_read(void*, void*, size_t, size_t*);
 static int  __memory_write(void*, const void*, size_t, size_t*);
 static int  __memory_close(void*);
+static int  __memory_pread(void*, void*, size_t, uint64_t, size_t*);
+static int  __mmap_close(void*);
 
 static struct VaFsOperations g_fileOperations = {
-    .seek = __file_seek,
     .read = __file_read,
     .write = __file_write,
-    .close = __file_close
+    .close = __file_close,
+    .pread = __file_pread
 };
 static struct VaFsOperations g_memoryOperations = {
-    .seek = __memory_seek,
     .read = __memory_read,
     .write = __memory_write,
-    .close = __memory_close
+    .close = __memory_close,
+    .pread = __memory_pread
+};
+static struct VaFsOperations g_mmapOperations = {
+    .read = __memory_read,
+    .write = __memory_write,
+    .close = __mmap_close,
+    .pread = __memory_pread
 };
 
 struct VaFsStreamDevice {
     int                   ReadOnly;
+    int                   Mappable;
     mtx_t                 Lock;
     struct VaFsOperations Operations;
+    VaFsSeekFunc          Seek;
     void*                 UserData;
 
+    // Positional reads that had to wait for another reader
+    atomic_ullong         Contention;
+
     union {
         struct {
             char* Buffer;
             // Current byte capacity of Buffer
-            long Capacity;
+            size_t Capacity;
             // The number of valid bytes in Buffer
-            long Size;
+            size_t Size;
             // The current position into buffer. This can not
             // be beyond Size.
-            long Position;
+            size_t Position;
             // Whether the streamdevice owns Buffer.
             int Owned;
+#if defined(_WIN32) || defined(_WIN64)
+            // The file and mapping handles when Buffer is a file mapping
+            HANDLE FileHandle;
+            HANDLE MapHandle;
+#endif
         } Memory;
         FILE* File;
     };
@@ -75,9 +124,10 @@ struct VaFsStreamDevice {
 
 static int __validate_ops(
     struct VaFsOperations* operations,
+    VaFsSeekFunc           seek,
     int                    readOnly)
 {
-    if (operations->read == NULL || operations->seek == NULL) {
+    if (operations->read == NULL || (operations->seek == NULL && seek == NULL)) {
         errno = EINVAL;
         return -1;
     }
@@ -92,6 +142,7 @@ static int __new_streamdevice(
     int                       readOnly,
     void*                     userData,
     struct VaFsOperations*    operations,
+    VaFsSeekFunc              seek,
     struct VaFsStreamDevice** deviceOut)
 {
     struct VaFsStreamDevice* device;
@@ -99,8 +150,9 @@ static int __new_streamdevice(
     // Validate the operations provided, based on the read-only status
     // of the vafs image, there must be some of the operations set. The
     // minimum is seek/read, but if it's not read-only, then write must
-    // also be provided. Close is always optional.
-    if (__validate_ops(operations, readOnly)) {
+    // also be provided. Close is always optional. The devices of this
+    // file provide their own 64-bit seek instead.
+    if (__validate_ops(operations, seek, readOnly)) {
         return -1;
     }
     
@@ -114,6 +166,7 @@ static int __new_streamdevice(
     memcpy(&device->Operations, operations, sizeof(struct VaFsOperations));
 
     mtx_init(&device->Lock, mtx_plain);
+    device->Seek     = seek;
     device->ReadOnly = readOnly;
     device->UserData = userData;
 
@@ -139,7 +192,7 @@ int vafs_streamdevice_open_file(
         return -1;
     }
 
-    status = __new_streamdevice(1, NULL, &g_fileOperations, &device);
+    status = __new_streamdevice(1, NULL, &g_fileOperations, __file_seek, &device);
     if (status) {
         fclose(handle);
         return -1;
@@ -165,22 +218,136 @@ int vafs_streamdevice_open_memory(
         return -1;
     }
 
-    status = __new_streamdevice(1, NULL, &g_memoryOperations, &device);
+    status = __new_streamdevice(1, NULL, &g_memoryOperations, __memory_seek, &device);
     if (status) {
         return -1;
     }
 
     device->UserData        = device;
     device->Memory.Buffer   = (void*)buffer;
-    device->Memory.Capacity = (long)length;
-    device->Memory.Size     = (long)length;
+    device->Memory.Capacity = length;
+    device->Memory.Size     = length;
     device->Memory.Position = 0;
     device->Memory.Owned    = 0;
+    device->Mappable        = 1;
     
     *deviceOut = device;
     return 0;
 }
 
+#if defined(_WIN32) || defined(_WIN64)
+static int __map_file(
+    struct VaFsStreamDevice* device,
+    const char*              path)
+{
+    LARGE_INTEGER size;
+
+    device->Memory.FileHandle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (device->Memory.FileHandle == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (!GetFileSizeEx(device->Memory.FileHandle, &size) || size.QuadPart == 0 || (uint64_t)size.QuadPart > SIZE_MAX) {
+        CloseHandle(device->Memory.FileHandle);
+        errno = EINVAL;
+        return -1;
+    }
+
+    device->Memory.MapHandle = CreateFileMappingA(device->Memory.FileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (device->Memory.MapHandle == NULL) {
+        CloseHandle(device->Memory.FileHandle);
+        errno = EIO;
+        return -1;
+    }
+
+    device->Memory.Buffer = MapViewOfFile(device->Memory.MapHandle, FILE_MAP_READ, 0, 0, 0);
+    if (device->Memory.Buffer == NULL) {
+        CloseHandle(device->Memory.MapHandle);
+        CloseHandle(device->Memory.FileHandle);
+        errno = EIO;
+        return -1;
+    }
+    device->Memory.Capacity = (size_t)size.QuadPart;
+    return 0;
+}
+#elif defined(__VAFS_HAS_MMAP)
+static int __map_file(
+    struct VaFsStreamDevice* device,
+    const char*              path)
+{
+    struct stat stats;
+    void*       mapping;
+    int         fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &stats) || stats.st_size == 0 || (uint64_t)stats.st_size > SIZE_MAX) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    mapping = mmap(NULL, (size_t)stats.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return -1;
+    }
+
+    device->Memory.Buffer   = mapping;
+    device->Memory.Capacity = (size_t)stats.st_size;
+    return 0;
+}
+#else
+static int __map_file(
+    struct VaFsStreamDevice* device,
+    const char*              path)
+{
+    (void)device;
+    (void)path;
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
+
+int vafs_streamdevice_open_mmap(
+    const char*               path,
+    struct VaFsStreamDevice** deviceOut)
+{
+    struct VaFsStreamDevice* device;
+    int                      status;
+
+    if (path == NULL || deviceOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    status = __new_streamdevice(1, NULL, &g_mmapOperations, __memory_seek, &device);
+    if (status) {
+        return -1;
+    }
+
+    status = __map_file(device, path);
+    if (status) {
+        mtx_destroy(&device->Lock);
+        free(device);
+        return -1;
+    }
+
+    device->UserData        = device;
+    device->Memory.Size     = device->Memory.Capacity;
+    device->Memory.Position = 0;
+    device->Memory.Owned    = 0;
+    device->Mappable        = 1;
+
+    *deviceOut = device;
+    return 0;
+}
+
 int vafs_streamdevice_open_ops(
     struct VaFsOperations*    operations,
     void*                     userData,
@@ -194,7 +361,7 @@ int vafs_streamdevice_open_ops(
         return -1;
     }
 
-    status = __new_streamdevice(1, userData, operations, &device);
+    status = __new_streamdevice(1, userData, operations, NULL, &device);
     if (status) {
         return -1;
     }
@@ -221,7 +388,37 @@ int vafs_streamdevice_create_file(
         return -1;
     }
 
-    status = __new_streamdevice(0, NULL, &g_fileOperations, &device);
+    status = __new_streamdevice(0, NULL, &g_fileOperations, __file_seek, &device);
+    if (status) {
+        fclose(handle);
+        return -1;
+    }
+
+    device->UserData = device;
+    device->File     = handle;
+    
+    *deviceOut = device;
+    return 0;
+}
+
+int vafs_streamdevice_create_temporary(
+    struct VaFsStreamDevice** deviceOut)
+{
+    struct VaFsStreamDevice* device;
+    FILE*                    handle;
+    int                      status;
+
+    if (deviceOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    handle = tmpfile();
+    if (!handle) {
+        return -1;
+    }
+
+    status = __new_streamdevice(0, NULL, &g_fileOperations, __file_seek, &device);
     if (status) {
         fclose(handle);
         return -1;
@@ -253,7 +450,7 @@ int vafs_streamdevice_create_memory(
         return -1;
     }
 
-    status = __new_streamdevice(0, NULL, &g_memoryOperations, &device);
+    status = __new_streamdevice(0, NULL, &g_memoryOperations, __memory_seek, &device);
     if (status) {
         free(buffer);
         return -1;
@@ -261,7 +458,7 @@ int vafs_streamdevice_create_memory(
 
     device->UserData = device;
     device->Memory.Buffer = buffer;
-    device->Memory.Capacity = (long)blockSize;
+    device->Memory.Capacity = blockSize;
     device->Memory.Size = 0;
     device->Memory.Position = 0;
     device->Memory.Owned = 1;
@@ -287,17 +484,37 @@ int vafs_streamdevice_close(
     return 0;
 }
 
-long vafs_streamdevice_seek(
+static int64_t __device_seek(
     struct VaFsStreamDevice* device,
-    long                     offset,
+    int64_t                  offset,
     int                      whence)
 {
-    VAFS_DEBUG("vafs_streamdevice_seek(offset=%ld, whence=%i)\n", offset, whence);
+    long position;
+
+    if (device->Seek) {
+        return device->Seek(device->UserData, offset, whence);
+    }
+
+    // user supplied operations only take offsets that fit a long
+    if (offset > LONG_MAX || offset < LONG_MIN) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    position = device->Operations.seek(device->UserData, (long)offset, whence);
+    return position < 0 ? -1 : (int64_t)position;
+}
+
+int64_t vafs_streamdevice_seek(
+    struct VaFsStreamDevice* device,
+    int64_t                  offset,
+    int                      whence)
+{
+    VAFS_DEBUG("vafs_streamdevice_seek(offset=%lld, whence=%i)\n", (long long)offset, whence);
     if (device == NULL) {
         errno = EINVAL;
         return -1;
     }
-    return device->Operations.seek(device->UserData, offset, whence);
+    return __device_seek(device, offset, whence);
 }
 
 int vafs_streamdevice_read(
@@ -313,6 +530,79 @@ int vafs_streamdevice_read(
     return device->Operations.read(device->UserData, buffer, length, bytesRead);
 }
 
+int vafs_streamdevice_read_at(
+    struct VaFsStreamDevice* device,
+    uint64_t                 offset,
+    void*                    buffer,
+    size_t                   length,
+    size_t*                  bytesRead)
+{
+    int64_t position;
+    int     status;
+
+    if (device == NULL || buffer == NULL || length == 0 || bytesRead == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Positional reads do not touch the device position, so there
+    // is no need to serialize them.
+    if (device->Operations.pread) {
+        return device->Operations.pread(device->UserData, buffer, length, offset, bytesRead);
+    }
+
+    if (offset > INT64_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    // The underlying operations only provide seek+read, so the pair must
+    // be done atomically with regards to other readers of the device.
+    if (mtx_trylock(&device->Lock) != thrd_success) {
+        atomic_fetch_add_explicit(&device->Contention, 1, memory_order_relaxed);
+        mtx_lock(&device->Lock);
+    }
+    position = __device_seek(device, (int64_t)offset, SEEK_SET);
+    if (position != (int64_t)offset) {
+        mtx_unlock(&device->Lock);
+        VAFS_ERROR("vafs_streamdevice_read_at: failed to seek to %llu\n", (unsigned long long)offset);
+        errno = EIO;
+        return -1;
+    }
+
+    status = device->Operations.read(device->UserData, buffer, length, bytesRead);
+    mtx_unlock(&device->Lock);
+    return status;
+}
+
+int vafs_streamdevice_map(
+    struct VaFsStreamDevice* device,
+    uint64_t                 offset,
+    size_t                   length,
+    const void**             dataOut)
+{
+    if (device == NULL || dataOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!device->Mappable) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (offset > (uint64_t)device->Memory.Size ||
+        length > (uint64_t)device->Memory.Size - offset) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    // The buffer of a mappable device never changes, so no locking is
+    // needed to hand out pointers into it.
+    *dataOut = device->Memory.Buffer + offset;
+    return 0;
+}
+
 int vafs_streamdevice_write(
     struct VaFsStreamDevice* device,
     void*                    buffer,
@@ -336,9 +626,9 @@ int vafs_streamdevice_copy(
     struct VaFsStreamDevice* destination,
     struct VaFsStreamDevice* source)
 {
-    char*  transferBuffer;
-    int    status = 0;
-    size_t bytesRead;
+    char*   transferBuffer;
+    int     status = 0;
+    int64_t length;
     VAFS_DEBUG("vafs_streamdevice_copy()\n");
 
     if (destination == NULL || source == NULL) {
@@ -351,35 +641,51 @@ int vafs_streamdevice_copy(
         return -1;
     }
 
-    transferBuffer = malloc(__TRANSFER_BUFFER_SIZE);
-    if (transferBuffer == NULL) {
+    // the source size is known up front, so any short read is a real failure
+    // and not mistaken for the end of the source.
+    length = __device_seek(source, 0, SEEK_END);
+    if (length < 0 || __device_seek(source, 0, SEEK_SET) < 0) {
+        VAFS_ERROR("vafs_streamdevice_copy failed to determine the size of the source\n");
         return -1;
     }
 
-    // seek source back to start
-    status = source->Operations.seek(source->UserData, 0, SEEK_SET);
-    if (status) {
-        VAFS_ERROR("vafs_streamdevice_copy failed to seek source back to beginning\n");
+    transferBuffer = malloc(__TRANSFER_BUFFER_SIZE);
+    if (transferBuffer == NULL) {
         return -1;
     }
 
     // copy all contents of source to destination using an intermediate buffer
     // of size __TRANSFER_BUFFER_SIZE.
-    do {
+    while (length > 0) {
+        size_t bytesToCopy = (size_t)MIN(length, __TRANSFER_BUFFER_SIZE);
+        size_t bytesRead;
         size_t bytesWritten;
 
-        status = source->Operations.read(source->UserData, transferBuffer, __TRANSFER_BUFFER_SIZE, &bytesRead);
+        errno = 0;
+        status = source->Operations.read(source->UserData, transferBuffer, bytesToCopy, &bytesRead);
         VAFS_DEBUG("vafs_streamdevice_copy read %zu bytes\n", bytesRead);
-        if (status || bytesRead == 0) {
+        if (status || bytesRead != bytesToCopy) {
+            VAFS_ERROR("vafs_streamdevice_copy failed to read source: %zu of %zu bytes\n",
+                bytesRead, bytesToCopy);
+            if (errno == 0) {
+                errno = EIO;
+            }
+            status = -1;
             break;
         }
 
         status = destination->Operations.write(destination->UserData, transferBuffer, bytesRead, &bytesWritten);
         VAFS_DEBUG("vafs_streamdevice_copy wrote %zu bytes\n", bytesWritten);
         if (status || bytesWritten != bytesRead) {
+            VAFS_ERROR("vafs_streamdevice_copy failed to write destination\n");
+            if (errno == 0) {
+                errno = EIO;
+            }
+            status = -1;
             break;
         }
-    } while (1);
+        length -= (int64_t)bytesRead;
+    }
 
     free(transferBuffer);
     return status;
@@ -415,19 +721,28 @@ int vafs_streamdevice_unlock(
     return 0;
 }
 
-static long __file_seek(void* data, long offset, int whence)
+uint64_t vafs_streamdevice_contention(
+    struct VaFsStreamDevice* device)
+{
+    if (!device) {
+        return 0;
+    }
+    return atomic_load_explicit(&device->Contention, memory_order_relaxed);
+}
+
+static int64_t __file_seek(void* data, int64_t offset, int whence)
 {
     struct VaFsStreamDevice* device = data;
 
     if (offset == 0 && whence == SEEK_CUR) {
-        return ftell(device->File);
+        return __ftell64(device->File);
     }
 
-    int status = fseek(device->File, offset, whence);
+    int status = __fseek64(device->File, offset, whence);
     if (status != 0) {
         return -1;
     }
-    return ftell(device->File);
+    return __ftell64(device->File);
 }
 
 static int __file_read(void* data, void* buffer, size_t length, size_t* bytesRead)
@@ -450,6 +765,60 @@ static int __file_write(void* data, const void* buffer, size_t length, size_t* b
     return 0;
 }
 
+#if defined(_WIN32) || defined(_WIN64)
+static int __file_pread(void* data, void* buffer, size_t length, uint64_t offset, size_t* bytesRead)
+{
+    struct VaFsStreamDevice* device = data;
+    HANDLE                   handle = (HANDLE)_get_osfhandle(_fileno(device->File));
+    OVERLAPPED               overlapped = { 0 };
+    DWORD                    read;
+
+    if (length > MAXDWORD) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    overlapped.Offset     = (DWORD)(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    if (!ReadFile(handle, buffer, (DWORD)length, &read, &overlapped)) {
+        errno = EIO;
+        return -1;
+    }
+
+    *bytesRead = read;
+    if (read != length) {
+        return -1;
+    }
+    return 0;
+}
+#elif defined(__VAFS_HAS_PREAD)
+static int __file_pread(void* data, void* buffer, size_t length, uint64_t offset, size_t* bytesRead)
+{
+    struct VaFsStreamDevice* device = data;
+    size_t                   total  = 0;
+    ssize_t                  result;
+
+    // Image files are only ever read through the descriptor once opened, so
+    // bypassing the buffering of the FILE handle is safe.
+    while (total < length) {
+        result = pread(fileno(device->File), (char*)buffer + total, length - total, (off_t)(offset + total));
+        if (result <= 0) {
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        total += (size_t)result;
+    }
+
+    *bytesRead = total;
+    if (total != length) {
+        return -1;
+    }
+    return 0;
+}
+#endif
+
 static int __file_close(void* data)
 {
     struct VaFsStreamDevice* device = data;
@@ -463,7 +832,7 @@ static int __grow_buffer(
     void*  buffer;
     size_t newSize;
     
-    newSize = (size_t)device->Memory.Capacity + length;
+    newSize = device->Memory.Capacity + length;
     buffer = realloc(device->Memory.Buffer, newSize);
     if (!buffer) {
         errno = ENOMEM;
@@ -471,48 +840,50 @@ static int __grow_buffer(
     }
 
     device->Memory.Buffer   = buffer;
-    device->Memory.Capacity = (long)newSize;
+    device->Memory.Capacity = newSize;
     return 0;
 }
 
-static inline int __memsize_available(
+static inline size_t __memsize_available(
     struct VaFsStreamDevice* device)
 {
     return device->Memory.Capacity - device->Memory.Position;
 }
 
-static long __memory_seek(void* data, long offset, int whence)
+static int64_t __memory_seek(void* data, int64_t offset, int whence)
 {
     struct VaFsStreamDevice* device = data;
+    int64_t                  position;
 
     if (offset == 0 && whence == SEEK_CUR) {
-        return device->Memory.Position;
+        return (int64_t)device->Memory.Position;
     }
 
     switch (whence) {
         case SEEK_SET:
-            device->Memory.Position = offset;
+            position = offset;
             break;
         case SEEK_CUR:
-            device->Memory.Position += offset;
+            position = (int64_t)device->Memory.Position + offset;
             break;
         case SEEK_END:
-            device->Memory.Position = device->Memory.Size + offset;
+            position = (int64_t)device->Memory.Size + offset;
             break;
         default:
             errno = EINVAL;
             return -1;
     }
-    device->Memory.Position = MIN(MAX(device->Memory.Position, 0), device->Memory.Size);
-    return device->Memory.Position;
+    position = MIN(MAX(position, 0), (int64_t)device->Memory.Size);
+    device->Memory.Position = (size_t)position;
+    return position;
 }
 
 static int __memory_read(void* data, void* buffer, size_t length, size_t* bytesRead)
 {
     struct VaFsStreamDevice* device = data;
-    size_t byteCount = MIN(length, (size_t)(device->Memory.Size - device->Memory.Position));
+    size_t byteCount = MIN(length, device->Memory.Size - device->Memory.Position);
     memcpy(buffer, device->Memory.Buffer + device->Memory.Position, byteCount);
-    device->Memory.Position += (long)byteCount;
+    device->Memory.Position += byteCount;
     *bytesRead = byteCount;
     return 0;
 }
@@ -529,7 +900,7 @@ static int __memory_write(void* data, const void* buffer, size_t length, size_t*
     }
 
     memcpy(device->Memory.Buffer + device->Memory.Position, buffer, length);
-    device->Memory.Position += (long)length;
+    device->Memory.Position += length;
 
     // Keep track of the number of valid bytes in the memory stream.
     if (device->Memory.Position > device->Memory.Size) {
@@ -540,6 +911,22 @@ static int __memory_write(void* data, const void* buffer, size_t length, size_t*
     return 0;
 }
 
+static int __memory_pread(void* data, void* buffer, size_t length, uint64_t offset, size_t* bytesRead)
+{
+    struct VaFsStreamDevice* device = data;
+
+    if (offset > (uint64_t)device->Memory.Size ||
+        length > device->Memory.Size - (size_t)offset) {
+        *bytesRead = 0;
+        errno = ERANGE;
+        return -1;
+    }
+
+    memcpy(buffer, device->Memory.Buffer + offset, length);
+    *bytesRead = length;
+    return 0;
+}
+
 static int __memory_close(void* data)
 {
     struct VaFsStreamDevice* device = data;
@@ -549,3 +936,16 @@ static int __memory_close(void* data)
     }
     return 0;
 }
+
+static int __mmap_close(void* data)
+{
+    struct VaFsStreamDevice* device = data;
+#if defined(_WIN32) || defined(_WIN64)
+    UnmapViewOfFile(device->Memory.Buffer);
+    CloseHandle(device->Memory.MapHandle);
+    CloseHandle(device->Memory.FileHandle);
+#elif defined(__VAFS_HAS_MMAP)
+    munmap(device->Memory.Buffer, device->Memory.Capacity);
+#endif
+    return 0;
+}
@@ -49,73 +49,33 @@ int vafs_symlink_open(
         const char*                path,
         struct VaFsSymlinkHandle** handleOut)
 {
-    struct VaFsDirectoryEntry* entries;
-    const char*                remainingPath = path;
-    char                       token[VAFS_NAME_MAX + 1];
+    struct VaFsDirectoryEntry* entry;
+    int                        status;
 
     if (vafs == NULL || path == NULL || handleOut == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    if (__vafs_is_root_path(path)) {
+    status = __vafs_path_lookup(vafs, path, 0, &entry);
+    if (status) {
+        return status;
+    }
+
+    // the root directory has no entry
+    if (entry == NULL || entry->Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
         errno = EISDIR;
         return -1;
+    } else if (entry->Type != VA_FS_DESCRIPTOR_TYPE_SYMLINK) {
+        errno = ENOENT;
+        return -1;
     }
 
-    entries = __vafs_directory_entries(vafs->RootDirectory);
-    do {
-        int charsConsumed = __vafs_pathtoken(remainingPath, token, sizeof(token));
-        if (!charsConsumed) {
-            break;
-        }
-        remainingPath += charsConsumed;
-
-        // find the name in the directory
-        while (entries != NULL) {
-            if (!strcmp(__vafs_directory_entry_name(entries), token)) {
-                if (entries->Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
-                    // If we encounter a directory in this case, we must not
-                    // be at the end of the path
-                    if (remainingPath[0] == '\0') {
-                        errno = EISDIR;
-                        return -1;
-                    }
-
-                    // fall through this entire if/else
-                } else if (entries->Type == VA_FS_DESCRIPTOR_TYPE_SYMLINK) {
-                    // If we encounter a symlink in this case, we must be at the end of the path
-                    if (remainingPath[0] != '\0') {
-                        errno = ENOTDIR;
-                        return -1;
-                    }
-
-                    *handleOut = __symlink_handle_new(entries->Symlink);
-                    return 0;
-                } else {
-                    errno = ENOENT;
-                    return -1;
-                }
-
-                entries = __vafs_directory_entries(entries->Directory);
-                break;
-            }
-            entries = entries->Link;
-        }
-    } while (1);
-    return -1;
-}
-
-void vafs_symlink_destroy(
-    struct VaFsSymlink* symlink)
-{
-    if (symlink == NULL) {
-        return;
+    *handleOut = __symlink_handle_new(entry->Symlink);
+    if (*handleOut == NULL) {
+        return -1;
     }
-
-    free((void*)symlink->Name);
-    free((void*)symlink->Target);
-    free(symlink);
+    return 0;
 }
 
 int vafs_symlink_close(
@@ -23,6 +23,7 @@
 #include "private.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <vafs/stat.h>
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -157,108 +158,291 @@ int __vafs_resolve_symlink(
     return (int)j;
 }
 
-int vafs_path_stat(
-    struct VaFs*      vafs,
-    const char*       path,
-    int               followLinks,
-    struct vafs_stat* stat)
+uint64_t __vafs_time_ns(void)
 {
-    struct VaFsDirectoryEntry* entries;
-    const char*                remainingPath = path;
-    char                       token[VAFS_NAME_MAX + 1];
+#if defined(_WIN32) || defined(_WIN64)
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER        counter;
 
-    if (vafs == NULL || path == NULL || stat == NULL) {
-        errno = EINVAL;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#else
+    struct timespec ts;
+
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t __vafs_hash_string(
+    const char* string)
+{
+    uint32_t hash = 5381;
+    size_t   i    = 0;
+
+    while (string[i]) {
+        hash = ((hash << 5) + hash) + string[i++];
+    }
+    return (uint64_t)hash;
+}
+
+static int __is_end_of_path(
+    const char* path)
+{
+    while (*path == '/') {
+        path++;
+    }
+    return *path == '\0';
+}
+
+static int __lookup_path(
+    struct VaFs*                vafs,
+    const char*                 path,
+    int                         followLinks,
+    int                         depth,
+    struct VaFsDirectoryEntry** entryOut);
+
+static int __follow_symlink(
+    struct VaFs*                vafs,
+    const char*                 path,
+    size_t                      baseLength,
+    const char*                 target,
+    const char*                 remainingPath,
+    int                         followLinks,
+    int                         depth,
+    struct VaFsDirectoryEntry** entryOut)
+{
+    char*  pathBuffer;
+    int    written;
+    int    status;
+    size_t remainingLength;
+
+    if (depth >= VA_FS_SYMLINK_MAX_DEPTH) {
+        errno = ELOOP;
         return -1;
     }
 
-    // special case - root directory, we specfiy
-    // default access for it for now
-    if (__vafs_is_root_path(path)) {
-        stat->mode = S_IFDIR | 0755;
-        stat->size = 0;
-        return 0;
+    pathBuffer = malloc(VAFS_PATH_MAX);
+    if (!pathBuffer) {
+        VAFS_ERROR("__follow_symlink: failed to allocate path buffer\n");
+        errno = ENOMEM;
+        return -1;
     }
 
-    entries = __vafs_directory_entries(vafs->RootDirectory);
+    // absolute targets are relative to the root of the image, relative targets
+    // to the directory containing the symlink, including the separator
+    if (target[0] == '/') {
+        baseLength = 0;
+    } else {
+        while (path[baseLength] == '/') {
+            baseLength++;
+        }
+    }
+
+    written = __vafs_resolve_symlink(pathBuffer, VAFS_PATH_MAX - 1, path, baseLength, target);
+    if (written < 0) {
+        VAFS_ERROR("__follow_symlink: failed to resolve symlink %s\n", target);
+        free(pathBuffer);
+        return -1;
+    }
+
+    // continue with the rest of the path, if the symlink was not the last component
+    remainingLength = strlen(remainingPath);
+    if (!__is_end_of_path(remainingPath)) {
+        if ((size_t)written + remainingLength + 1 >= VAFS_PATH_MAX) {
+            free(pathBuffer);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (remainingPath[0] != '/') {
+            pathBuffer[written++] = '/';
+        }
+        memcpy(&pathBuffer[written], remainingPath, remainingLength + 1);
+    }
+
+    status = __lookup_path(vafs, pathBuffer, followLinks, depth + 1, entryOut);
+    free(pathBuffer);
+    return status;
+}
+
+static int __walk_path(
+    struct VaFs*                vafs,
+    const char*                 path,
+    int                         followLinks,
+    int                         depth,
+    struct VaFsDirectoryEntry** entryOut)
+{
+    struct VaFsDirectory*      directory = vafs->RootDirectory;
+    struct VaFsDirectoryEntry* entry = NULL;
+    const char*                remainingPath = path;
+    char                       token[VAFS_NAME_MAX + 1];
+
     do {
         const char* previousPath = remainingPath;
         int         charsConsumed = __vafs_pathtoken(remainingPath, token, sizeof(token));
         if (!charsConsumed) {
+            if (errno == ENAMETOOLONG) {
+                return -1;
+            }
             break;
         }
         remainingPath += charsConsumed;
 
+        // trailing separators
+        if (token[0] == '\0') {
+            break;
+        }
+
+        // every component but the last must be a directory
+        if (entry != NULL) {
+            if (entry->Type != VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
+                errno = ENOTDIR;
+                return -1;
+            }
+            directory = entry->Directory;
+        }
+
         // find the name in the directory
-        while (entries != NULL) {
-            if (!strcmp(__vafs_directory_entry_name(entries), token)) {
-                if (entries->Type == VA_FS_DESCRIPTOR_TYPE_DIRECTORY) {
-                    if (remainingPath[0] == '\0') {
-                        stat->mode = S_IFDIR | entries->Directory->Descriptor.Permissions;
-                        stat->size = 0;
-                        return 0;
-                    }
+        entry = __vafs_directory_find_entry(directory, token);
+        if (entry == NULL) {
+            // errno tells a missing entry apart from a directory that failed to load
+            return -1;
+        }
 
-                    // otherwise fall-through and continue
-                } else if (entries->Type == VA_FS_DESCRIPTOR_TYPE_SYMLINK) {
-                    if (!followLinks) {
-                        if (remainingPath[0] == '\0') {
-                            stat->mode = S_IFLNK | 0777;
-                            stat->size = strlen(entries->Symlink->Target);
-                            return 0;
-                        } else {
-                            errno = ENOTDIR;
-                            return -1;
-                        }
-                    }
+        if (entry->Type == VA_FS_DESCRIPTOR_TYPE_SYMLINK &&
+            (followLinks || !__is_end_of_path(remainingPath))) {
+            return __follow_symlink(
+                vafs,
+                path,
+                previousPath - path,
+                entry->Symlink->Target,
+                remainingPath,
+                followLinks,
+                depth,
+                entryOut
+            );
+        }
+    } while (1);
 
-                    char* pathBuffer = malloc(VAFS_PATH_MAX);
-                    int   written;
-                    int   status;
-                    if (!pathBuffer) {
-                        VAFS_ERROR("vafs_directory_open: failed to allocate path buffer\n");
-                        errno = ENOMEM;
-                        return -1;
-                    }
+    *entryOut = entry;
+    return 0;
+}
 
-                    written = __vafs_resolve_symlink(
-                            pathBuffer,
-                            VAFS_PATH_MAX,
-                            path,
-                            previousPath - path,
-                            entries->Symlink->Target
-                    );
-                    if (written < 0) {
-                        VAFS_ERROR("vafs_directory_open: failed to resolve symlink %s\n", entries->Symlink->Target);
-                        free(pathBuffer);
-                        return -1;
-                    }
+static int __is_cacheable_error(
+    int error)
+{
+    // Errors that are caused by the contents of the image will never
+    // change, while errors like ENOMEM may not happen on a retry.
+    return error == ENOENT || error == ENOTDIR || error == ELOOP || error == ENAMETOOLONG;
+}
 
-                    status = vafs_path_stat(vafs, pathBuffer, followLinks, stat);
-                    free(pathBuffer);
-                    return status;
-                } else if (entries->Type == VA_FS_DESCRIPTOR_TYPE_FILE) {
-                    // If we encounter a file in this case, we must be at the end of the path
-                    if (remainingPath[0] != '\0') {
-                        errno = ENOTDIR;
-                        return -1;
-                    }
+static int __lookup_path(
+    struct VaFs*                vafs,
+    const char*                 path,
+    int                         followLinks,
+    int                         depth,
+    struct VaFsDirectoryEntry** entryOut)
+{
+    struct VaFsDirectoryEntry* entry;
+    int                        error;
+    int                        status;
 
-                    stat->mode = S_IFREG | entries->File->Descriptor.Permissions;
-                    stat->size = entries->File->Descriptor.FileLength;
-                    return 0;
-                } else {
-                    errno = ENOENT;
-                    return -1;
-                }
+    if (vafs->PathCache && vafs_pathcache_get(vafs->PathCache, path, followLinks, &entry, &error)) {
+        if (error) {
+            errno = error;
+            return -1;
+        }
+        *entryOut = entry;
+        return 0;
+    }
 
-                entries = __vafs_directory_entries(entries->Directory);
-                break;
-            }
-            entries = entries->Link;
+    status = __walk_path(vafs, path, followLinks, depth, &entry);
+    if (vafs->PathCache) {
+        if (!status) {
+            vafs_pathcache_set(vafs->PathCache, path, followLinks, entry, 0);
+        } else if (__is_cacheable_error(errno)) {
+            error = errno;
+            vafs_pathcache_set(vafs->PathCache, path, followLinks, NULL, error);
+            errno = error;
         }
-    } while (1);
+    }
+
+    if (!status) {
+        *entryOut = entry;
+    }
+    return status;
+}
+
+int __vafs_path_lookup(
+    struct VaFs*                vafs,
+    const char*                 path,
+    int                         followLinks,
+    struct VaFsDirectoryEntry** entryOut)
+{
+    if (vafs == NULL || path == NULL || entryOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return __lookup_path(vafs, path, followLinks, 0, entryOut);
+}
+
+int __vafs_entry_stat(
+    struct VaFsDirectoryEntry* entry,
+    struct vafs_stat*          stat)
+{
+    // special case - root directory, we specfiy
+    // default access for it for now
+    if (entry == NULL) {
+        stat->mode = S_IFDIR | 0755;
+        stat->size = 0;
+        return 0;
+    }
+
+    switch (entry->Type) {
+        case VA_FS_DESCRIPTOR_TYPE_DIRECTORY:
+            stat->mode = S_IFDIR | entry->Directory->Descriptor.Permissions;
+            stat->size = 0;
+            return 0;
+        case VA_FS_DESCRIPTOR_TYPE_SYMLINK:
+            stat->mode = S_IFLNK | 0777;
+            stat->size = strlen(entry->Symlink->Target);
+            return 0;
+        case VA_FS_DESCRIPTOR_TYPE_FILE:
+            stat->mode = S_IFREG | entry->File->Descriptor.Permissions;
+            stat->size = entry->File->Descriptor.FileLength;
+            return 0;
+        default:
+            errno = ENOENT;
+            return -1;
+    }
+}
+
+int vafs_path_stat(
+    struct VaFs*      vafs,
+    const char*       path,
+    int               followLinks,
+    struct vafs_stat* stat)
+{
+    struct VaFsDirectoryEntry* entry;
+    int                        status;
+
+    if (vafs == NULL || path == NULL || stat == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    status = __vafs_path_lookup(vafs, path, followLinks, &entry);
+    if (status) {
+        return status;
+    }
 
-    errno = ENOENT;
-    return -1;
+    return __vafs_entry_stat(entry, stat);
 }
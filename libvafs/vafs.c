@@ -19,6 +19,7 @@
  *   This filesystem is used to store the initrd of the kernel.
  */
 
+#include "cache/blockcache.h"
 #include "crc.h"
 #include <errno.h>
 #include "private.h"
@@ -31,6 +32,14 @@ static void vafs_destroy(struct VaFs* vafs);
 static struct VaFsGuid g_overviewGuid  = VA_FS_FEATURE_OVERVIEW;
 static struct VaFsGuid g_filterGuid    = VA_FS_FEATURE_FILTER;
 static struct VaFsGuid g_filterOpsGuid = VA_FS_FEATURE_FILTER_OPS;
+static struct VaFsGuid g_cacheGuid     = VA_FS_FEATURE_CACHE;
+static struct VaFsGuid g_readaheadGuid = VA_FS_FEATURE_READAHEAD;
+static struct VaFsGuid g_asyncGuid     = VA_FS_FEATURE_ASYNC;
+static struct VaFsGuid g_preloadGuid   = VA_FS_FEATURE_PRELOAD;
+static struct VaFsGuid g_checksumGuid  = VA_FS_FEATURE_CHECKSUM;
+static struct VaFsGuid g_verifyGuid    = VA_FS_FEATURE_VERIFY;
+static struct VaFsGuid g_inlineGuid    = VA_FS_FEATURE_INLINE;
+static struct VaFsGuid g_filterDictGuid = VA_FS_FEATURE_FILTER_DICT;
 static int             g_initialized   = 0;
 
 static void vafs_init(void)
@@ -46,19 +55,198 @@ static inline int __compare_guids(
     return memcmp(lh, rh, sizeof(struct VaFsGuid));
 }
 
+static int __handle_feature_cache(
+    struct VaFs*             vafs,
+    struct VaFsFeatureCache* feature)
+{
+    struct VaFsBlockCache* cache = feature->Cache;
+    int                    status;
+
+    // Images that are being created do not read any blocks back
+    if (vafs->Mode != VaFsMode_Read) {
+        return 0;
+    }
+
+    if (cache == NULL) {
+        status = vafs_cache_create(feature->Size, VaFsCachePolicy_SLRU, &cache);
+        if (status) {
+            VAFS_ERROR("__handle_feature_cache: failed to create block cache\n");
+            return status;
+        }
+    }
+    else {
+        vafs_cache_acquire(cache);
+    }
+
+    vafs_stream_set_cache(vafs->DescriptorStream, cache);
+    vafs_stream_set_cache(vafs->DataStream, cache);
+    vafs_cache_destroy(cache);
+    return 0;
+}
+
+static int __handle_feature_readahead(
+    struct VaFs*                 vafs,
+    struct VaFsFeatureReadahead* feature)
+{
+    int status;
+
+    // Images that are being created do not read any blocks back
+    if (vafs->Mode != VaFsMode_Read) {
+        return 0;
+    }
+
+    if (feature->MaxBlocks && vafs->Prefetcher == NULL) {
+        status = vafs_prefetcher_create(&vafs->Prefetcher);
+        if (status) {
+            VAFS_ERROR("__handle_feature_readahead: failed to create prefetcher\n");
+            return status;
+        }
+    }
+
+    // Only the data stream is read sequentially in larger amounts, descriptor
+    // blocks are small and read once per directory.
+    vafs_stream_set_readahead(vafs->DataStream, vafs->Prefetcher, feature->MaxBlocks);
+    return 0;
+}
+
+static int __handle_feature_preload(
+    struct VaFs*               vafs,
+    struct VaFsFeaturePreload* feature)
+{
+    int status;
+    (void)feature;
+
+    // Images that are being created have their tree in memory already
+    if (vafs->Mode != VaFsMode_Read || vafs->Preloader != NULL) {
+        return 0;
+    }
+
+    status = vafs_preloader_create(vafs, &vafs->Preloader);
+    if (status) {
+        VAFS_ERROR("__handle_feature_preload: failed to create preloader\n");
+    }
+    return status;
+}
+
+static int __handle_feature_async(
+    struct VaFs*             vafs,
+    struct VaFsFeatureAsync* feature)
+{
+    int workers = (int)MIN(feature->Workers, VA_FS_ASYNC_MAX_WORKERS);
+    int status;
+
+    // Images that are being created do not read any blocks back
+    if (vafs->Mode != VaFsMode_Read || vafs->AsyncPool != NULL) {
+        return 0;
+    }
+
+    status = vafs_asyncpool_create(workers ? workers : VA_FS_ASYNC_DEFAULT_WORKERS, &vafs->AsyncPool);
+    if (status) {
+        VAFS_ERROR("__handle_feature_async: failed to create async workers\n");
+    }
+    return status;
+}
+
+static int __handle_feature_verify(
+    struct VaFs*              vafs,
+    struct VaFsFeatureVerify* feature)
+{
+    // Images that are being created do not read any blocks back
+    if (vafs->Mode != VaFsMode_Read) {
+        return 0;
+    }
+
+    // Reject unknown modes before touching either stream, so an invalid
+    // feature never leaves the streams with different modes.
+    if (feature->Mode != VaFsVerify_Always && feature->Mode != VaFsVerify_Once) {
+        VAFS_ERROR("__handle_feature_verify: invalid verification mode %u\n", feature->Mode);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (vafs_stream_set_verify(vafs->DescriptorStream, feature->Mode) ||
+        vafs_stream_set_verify(vafs->DataStream, feature->Mode)) {
+        VAFS_ERROR("__handle_feature_verify: failed to set verification mode %u\n", feature->Mode);
+        return -1;
+    }
+    return 0;
+}
+
+static int __handle_feature_filter_ops(
+    struct VaFs*              vafs,
+    struct VaFsFeatureHeader* feature)
+{
+    struct VaFsFilter* filter;
+    int                status;
+
+    status = vafs_filter_create(feature, &filter);
+    if (status) {
+        VAFS_ERROR("__handle_feature_filter_ops: invalid filter operations\n");
+        return status;
+    }
+
+    // The filter must be installed before any blocks are read or written, so
+    // a filter that was installed before this one is not in use yet.
+    vafs_stream_set_filter(vafs->DescriptorStream, filter);
+    vafs_stream_set_filter(vafs->DataStream, filter);
+    vafs_filter_destroy(vafs->Filter);
+    vafs->Filter = filter;
+    return 0;
+}
+
+// __is_feature_ops returns whether the feature is one of the operation features,
+// which are handled when added but never stored in the image.
+static int __is_feature_ops(
+    struct VaFsFeatureHeader* feature)
+{
+    return !__compare_guids(&feature->Guid, &g_cacheGuid) ||
+           !__compare_guids(&feature->Guid, &g_readaheadGuid) ||
+           !__compare_guids(&feature->Guid, &g_preloadGuid) ||
+           !__compare_guids(&feature->Guid, &g_verifyGuid) ||
+           !__compare_guids(&feature->Guid, &g_asyncGuid);
+}
+
 static int __handle_feature_ops(
     struct VaFs*              vafs,
     struct VaFsFeatureHeader* feature)
 {
-    if (!__compare_guids(&feature->Guid, &g_filterOpsGuid)) {
-        struct VaFsFeatureFilterOps* ops = (struct VaFsFeatureFilterOps*)feature;
-        vafs_stream_set_filter(vafs->DescriptorStream, ops->Encode, ops->Decode);
-        vafs_stream_set_filter(vafs->DataStream, ops->Encode, ops->Decode);
-        return 0;
+    if (!__compare_guids(&feature->Guid, &g_cacheGuid)) {
+        return __handle_feature_cache(vafs, (struct VaFsFeatureCache*)feature);
     }
+    else if (!__compare_guids(&feature->Guid, &g_readaheadGuid)) {
+        return __handle_feature_readahead(vafs, (struct VaFsFeatureReadahead*)feature);
+    }
+    else if (!__compare_guids(&feature->Guid, &g_preloadGuid)) {
+        return __handle_feature_preload(vafs, (struct VaFsFeaturePreload*)feature);
+    }
+    else if (!__compare_guids(&feature->Guid, &g_verifyGuid)) {
+        return __handle_feature_verify(vafs, (struct VaFsFeatureVerify*)feature);
+    }
+    else if (!__compare_guids(&feature->Guid, &g_asyncGuid)) {
+        return __handle_feature_async(vafs, (struct VaFsFeatureAsync*)feature);
+    }
+    errno = EINVAL;
     return -1;
 }
 
+// __feature_fits returns whether the feature fits in the space reserved for
+// features when writing directly. Room is always kept for the overview, which
+// is added when the image is closed.
+static int __feature_fits(
+    struct VaFs*              vafs,
+    struct VaFsFeatureHeader* feature)
+{
+    uint64_t length = feature->Length;
+
+    for (int i = 0; i < vafs->FeatureCount; i++) {
+        length += vafs->Features[i]->Length;
+    }
+    if (__compare_guids(&feature->Guid, &g_overviewGuid)) {
+        length += sizeof(struct VaFsFeatureOverview);
+    }
+    return length <= vafs->FeatureReserve;
+}
+
 int vafs_feature_add(
     struct VaFs*              vafs,
     struct VaFsFeatureHeader* feature)
@@ -68,10 +256,35 @@ int vafs_feature_add(
         return -1;
     }
 
+    // The filter operations are not installed either, but the failure
+    // to create the filter must be reported.
+    if (!__compare_guids(&feature->Guid, &g_filterOpsGuid)) {
+        return __handle_feature_filter_ops(vafs, feature);
+    }
+
     // So we have the operation features which we do not want installed, but rather
-    // just extract some handlers for.
-    if (!__handle_feature_ops(vafs, feature)) {
-        return 0;
+    // just extract some handlers for. Failing to set them up must be reported.
+    if (__is_feature_ops(feature)) {
+        return __handle_feature_ops(vafs, feature);
+    }
+
+    if (vafs->Mode == VaFsMode_Write && vafs->FeatureReserve && !__feature_fits(vafs, feature)) {
+        VAFS_ERROR("vafs_feature_add: feature does not fit in the reserved space\n");
+        errno = ENOSPC;
+        return -1;
+    }
+
+    // The checksum feature is stored in the image, but the streams of an image that is
+    // being created must also start using the algorithm before anything is written.
+    if (!__compare_guids(&feature->Guid, &g_checksumGuid) && vafs->Mode == VaFsMode_Write) {
+        struct VaFsFeatureChecksum* checksum = (struct VaFsFeatureChecksum*)feature;
+        if (feature->Length < sizeof(struct VaFsFeatureChecksum) ||
+            vafs_stream_set_checksum(vafs->DescriptorStream, checksum->Algorithm) ||
+            vafs_stream_set_checksum(vafs->DataStream, checksum->Algorithm)) {
+            VAFS_ERROR("vafs_feature_add: unsupported checksum algorithm\n");
+            errno = EINVAL;
+            return -1;
+        }
     }
 
     for (int i = 0; i < vafs->FeatureCount; i++) {
@@ -81,6 +294,19 @@ int vafs_feature_add(
         }
     }
 
+    // The inline feature is stored in the image, files that are written
+    // after it has been installed are inlined when small enough.
+    if (!__compare_guids(&feature->Guid, &g_inlineGuid) && vafs->Mode == VaFsMode_Write) {
+        struct VaFsFeatureInline* inlineFeature = (struct VaFsFeatureInline*)feature;
+        if (feature->Length < sizeof(struct VaFsFeatureInline) ||
+            inlineFeature->Threshold > VA_FS_INLINE_MAX_SIZE) {
+            VAFS_ERROR("vafs_feature_add: invalid inline threshold\n");
+            errno = EINVAL;
+            return -1;
+        }
+        vafs->InlineThreshold = inlineFeature->Threshold;
+    }
+
     vafs->Features[vafs->FeatureCount] = malloc(feature->Length);
     if (!vafs->Features[vafs->FeatureCount]) {
         errno = ENOMEM;
@@ -114,6 +340,55 @@ int vafs_feature_query(
     return -1;
 }
 
+int vafs_get_stats(
+    struct VaFs*      vafs,
+    struct VaFsStats* statsOut)
+{
+    uint64_t contention;
+
+    if (vafs == NULL || statsOut == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(statsOut, 0, sizeof(struct VaFsStats));
+    vafs_stream_get_stats(vafs->DescriptorStream, &statsOut->Descriptors);
+    vafs_stream_get_stats(vafs->DataStream, &statsOut->Data);
+
+    // Both streams of an image use the same block cache
+    vafs_stream_get_cache_stats(vafs->DataStream, &statsOut->CacheEvictions, &contention);
+    statsOut->LockContention = contention + vafs_streamdevice_contention(vafs->ImageDevice);
+    statsOut->DirectoryLoads = atomic_load_explicit(&vafs->DirectoryLoads, memory_order_relaxed);
+    return 0;
+}
+
+// __compare_feature returns 0 if both images hold the same feature, or none of them do
+static int __compare_feature(
+    struct VaFs*     vafs,
+    struct VaFs*     other,
+    struct VaFsGuid* guid)
+{
+    struct VaFsFeatureHeader* feature      = NULL;
+    struct VaFsFeatureHeader* otherFeature = NULL;
+
+    (void)vafs_feature_query(vafs, guid, &feature);
+    (void)vafs_feature_query(other, guid, &otherFeature);
+    if (feature == NULL || otherFeature == NULL) {
+        return feature == otherFeature ? 0 : -1;
+    }
+    return (feature->Length == otherFeature->Length && !memcmp(feature, otherFeature, feature->Length)) ? 0 : -1;
+}
+
+int __vafs_same_filter(
+    struct VaFs* vafs,
+    struct VaFs* other)
+{
+    // blocks of both images can only be decoded the same way if they use
+    // the same filter, with the same dictionary
+    return !__compare_feature(vafs, other, &g_filterGuid) &&
+           !__compare_feature(vafs, other, &g_filterDictGuid);
+}
+
 static int __initialize_root(
     struct VaFs* vafs)
 {
@@ -131,12 +406,12 @@ static struct VaFsFeatureHeader* __load_feature(
     struct VaFsFeatureHeader  header;
     struct VaFsFeatureHeader* feature;
     int                       status;
-    long                      offset;
+    int64_t                   offset;
     size_t                    read;
 
     offset = vafs_streamdevice_seek(vafs->ImageDevice, 0, SEEK_CUR);
     if (offset < 0) {
-        VAFS_ERROR("__load_feature: failed to retrieve current offset: %i\n", offset);
+        VAFS_ERROR("__load_feature: failed to retrieve current offset\n");
         return NULL;
     }
 
@@ -152,9 +427,8 @@ static struct VaFsFeatureHeader* __load_feature(
         return NULL;
     }
 
-    status = (int)vafs_streamdevice_seek(vafs->ImageDevice, offset, SEEK_SET);
-    if (status < 0) {
-        VAFS_ERROR("__load_feature: failed to seek to offset %i\n", offset);
+    if (vafs_streamdevice_seek(vafs->ImageDevice, offset, SEEK_SET) < 0) {
+        VAFS_ERROR("__load_feature: failed to seek to offset %lld\n", (long long)offset);
         free(feature);
         return NULL;
     }
@@ -182,16 +456,36 @@ static int __default_fail_decode()
     return -1;
 }
 
-static void __parse_known_features(
+static int __parse_known_features(
     struct VaFs* vafs)
 {
     for (int i = 0; i < vafs->Header.FeatureCount; i++) {
         if (!__compare_guids(&vafs->Features[i]->Guid, &g_filterGuid)) {
+            struct VaFsFeatureFilterOps ops = {
+                .Header = { .Guid = VA_FS_FEATURE_FILTER_OPS, .Length = sizeof(struct VaFsFeatureFilterOps) },
+                .Encode = __default_fail_encode,
+                .Decode = __default_fail_decode
+            };
+
             // A filter is present, force the use of filter ops
-            vafs_stream_set_filter(vafs->DescriptorStream, __default_fail_encode, __default_fail_decode);
-            vafs_stream_set_filter(vafs->DataStream, __default_fail_encode, __default_fail_decode);
+            if (__handle_feature_filter_ops(vafs, &ops.Header)) {
+                return -1;
+            }
+        }
+        else if (!__compare_guids(&vafs->Features[i]->Guid, &g_checksumGuid)) {
+            struct VaFsFeatureChecksum* checksum = (struct VaFsFeatureChecksum*)vafs->Features[i];
+
+            // Blocks can not be verified without knowing the algorithm
+            if (checksum->Header.Length < sizeof(struct VaFsFeatureChecksum) ||
+                vafs_stream_set_checksum(vafs->DescriptorStream, checksum->Algorithm) ||
+                vafs_stream_set_checksum(vafs->DataStream, checksum->Algorithm)) {
+                VAFS_ERROR("__parse_known_features: unsupported checksum algorithm\n");
+                errno = ENOTSUP;
+                return -1;
+            }
         }
     }
+    return 0;
 }
 
 static int __load_features(
@@ -220,7 +514,8 @@ static int __verify_header(
     }
     
     if (vafs->Header.Version != VA_FS_VERSION) {
-        VAFS_ERROR("__verify_header: invalid image version 0x%x\n", vafs->Header.Version);
+        VAFS_ERROR("__verify_header: unsupported image version 0x%x, expected 0x%x\n",
+            vafs->Header.Version, VA_FS_VERSION);
         return -1;
     }
     
@@ -278,37 +573,67 @@ static int __initialize_imagestream(
 static int __initialize_fsstreams_read(
     struct VaFs* vafs)
 {
-    int status;
+    struct VaFsBlockCache* cache;
+    int                    status;
     
     VAFS_DEBUG("__initialize_fsstreams_read: vafs: %p\n", vafs);
+    // both streams share the default block cache of the image, until
+    // the user decides otherwise through the cache feature.
+    status = vafs_cache_create(VA_FS_CACHE_DEFAULT_SIZE, VaFsCachePolicy_SLRU, &cache);
+    if (status) {
+        VAFS_ERROR("__initialize_fsstreams_read: failed to create block cache: %i\n", status);
+        return status;
+    }
+
     // create the descriptor and data streams, when reading we do not
     // provide any compression parameter as it's set on block level.
     status = vafs_stream_open(
         vafs->ImageDevice, 
         vafs->Header.DescriptorBlockOffset,
+        cache,
         &vafs->DescriptorStream
     );
     if (status) {
         VAFS_ERROR("__initialize_fsstreams_read: failed to create descriptor stream: %i\n", status);
+        vafs_cache_destroy(cache);
         return status;
     }
 
     status = vafs_stream_open(
         vafs->ImageDevice, 
         vafs->Header.DataBlockOffset,
+        cache,
         &vafs->DataStream
     );
+    vafs_cache_destroy(cache);
     return status;
 }
 
+// __create_staging_device creates the device a stream is staged in until the
+// image is closed. Staging goes to a temporary file, so large images are never
+// held in, and grown, in memory. Memory is only used if no temporary file
+// could be created.
+static int __create_staging_device(
+    size_t                    blockSize,
+    struct VaFsStreamDevice** deviceOut)
+{
+    if (!vafs_streamdevice_create_temporary(deviceOut)) {
+        return 0;
+    }
+    VAFS_WARN("__create_staging_device: no temporary file available, staging in memory\n");
+    return vafs_streamdevice_create_memory(blockSize, deviceOut);
+}
+
 static int __initialize_fsstreams_write(
     struct VaFs*              vafs,
     struct VaFsConfiguration* configuration)
 {
-    int status;
+    struct VaFsStreamDevice* dataDevice;
+    uint64_t                 dataOffset = 0;
+    int                      status;
     
     VAFS_DEBUG("__initialize_fsstreams_write: vafs: %p\n", vafs);
-    status = vafs_streamdevice_create_memory(
+    status = __create_staging_device(
         VA_FS_DESCRIPTOR_BLOCK_SIZE, 
         &vafs->DescriptorDevice
     );
@@ -317,13 +642,27 @@ static int __initialize_fsstreams_write(
         return status;
     }
 
-    status = vafs_streamdevice_create_memory(
-        configuration->DataBlockSize,
-        &vafs->DataDevice
-    );
-    if (status) {
-        VAFS_ERROR("__initialize_fsstreams_write: failed to create data stream device: %i\n", status);
-        return status;
+    // When writing directly, the data stream is placed right after the header
+    // and the space reserved for features. The descriptor stream is appended
+    // after the data stream once the image is closed.
+    vafs->FeatureReserve = configuration->FeatureReserve;
+    if (vafs->FeatureReserve) {
+        dataOffset = sizeof(VaFsHeader_t) + vafs->FeatureReserve;
+        if (vafs_streamdevice_seek(vafs->ImageDevice, (int64_t)dataOffset, SEEK_SET) < 0) {
+            VAFS_ERROR("__initialize_fsstreams_write: failed to seek to data stream offset\n");
+            return -1;
+        }
+        dataDevice = vafs->ImageDevice;
+    } else {
+        status = __create_staging_device(
+            configuration->DataBlockSize,
+            &vafs->DataDevice
+        );
+        if (status) {
+            VAFS_ERROR("__initialize_fsstreams_write: failed to create data stream device: %i\n", status);
+            return status;
+        }
+        dataDevice = vafs->DataDevice;
     }
 
     status = vafs_stream_create(
@@ -338,12 +677,19 @@ static int __initialize_fsstreams_write(
     }
 
     status = vafs_stream_create(
-        vafs->DataDevice, 
-        0,
+        dataDevice, 
+        dataOffset,
         configuration->DataBlockSize,
         &vafs->DataStream
     );
-    return status;
+    if (status) {
+        VAFS_ERROR("__initialize_fsstreams_write: failed to create data stream: %i\n", status);
+        return status;
+    }
+
+    // Descriptor blocks are few and small, so only the data stream gets
+    // encoded in parallel.
+    return vafs_stream_set_encoders(vafs->DataStream, configuration->EncoderThreads);
 }
 
 static int __initialize_fsstreams(
@@ -385,6 +731,13 @@ static int __new_vafs(
 
     vafs->Mode = mode;
 
+    status = vafs_arena_create(VA_FS_ARENA_CHUNK_SIZE, &vafs->Arena);
+    if (status) {
+        VAFS_ERROR("__new_vafs: failed to create metadata arena: %i\n", status);
+        vafs_destroy(vafs);
+        return -1;
+    }
+
     vafs->Features = malloc(sizeof(struct VaFsFeatureHeader*) * VA_FS_MAX_FEATURES);
     if (!vafs->Features) {
         vafs_destroy(vafs);
@@ -414,9 +767,22 @@ static int __new_vafs(
         return -1;
     }
 
-    // Handle any known features that have been loaded
+    // Handle any known features that have been loaded. The tree of an image
+    // opened for reading never changes, which means path lookups can be cached.
     if (vafs->Mode == VaFsMode_Read) {
-        __parse_known_features(vafs);
+        status = __parse_known_features(vafs);
+        if (status) {
+            VAFS_ERROR("__new_vafs: failed to parse image features: %i\n", status);
+            vafs_destroy(vafs);
+            return -1;
+        }
+
+        status = vafs_pathcache_create(VA_FS_PATH_CACHE_DEFAULT_ENTRIES, &vafs->PathCache);
+        if (status) {
+            VAFS_ERROR("__new_vafs: failed to create path cache: %i\n", status);
+            vafs_destroy(vafs);
+            return -1;
+        }
     }
 
     *vafsOut = vafs;
@@ -473,6 +839,22 @@ int vafs_open_file(
     return __new_vafs(VaFsMode_Read, imageDevice, 0, vafsOut);
 }
 
+int vafs_open_mmap(
+    const char*   path,
+    struct VaFs** vafsOut)
+{
+    struct VaFsStreamDevice* imageDevice;
+    int                      status;
+    VAFS_INFO("vafs_open_mmap: mapping existing image file\n");
+
+    status = vafs_streamdevice_open_mmap(path, &imageDevice);
+    if (status) {
+        VAFS_ERROR("vafs_open_mmap: failed to map image file: %i\n", status);
+        return status;
+    }
+    return __new_vafs(VaFsMode_Read, imageDevice, 0, vafsOut);
+}
+
 int vafs_open_memory(
         const void*   buffer,
         size_t        size,
@@ -532,49 +914,38 @@ static int __write_vafs_features(
     return 0;
 }
 
-static int __write_vafs_header(
-    struct VaFs* vafs)
+static void __layout_vafs_header(
+    struct VaFs* vafs,
+    uint64_t     descriptorBlockOffset,
+    uint64_t     dataBlockOffset)
 {
-    size_t written;
-    long   descriptorBlockSize;
-    long   descriptorBlockOffset;
-    int    i;
-    VAFS_INFO("__write_vafs_header: writing header\n");
-
-    descriptorBlockSize = vafs_streamdevice_seek(vafs->DescriptorDevice, 0, SEEK_CUR);
-    if (descriptorBlockSize < 0) {
-        VAFS_ERROR("__write_vafs_header: failed to seek to current position: %i\n", descriptorBlockSize);
-        return -1;
-    }
-
     vafs->Header.FeatureCount = (uint16_t)vafs->FeatureCount;
-
-    // calculate the data block offsets
-    descriptorBlockOffset = sizeof(VaFsHeader_t);
-    for (i = 0; i < vafs->FeatureCount; i++) {
-        descriptorBlockOffset += vafs->Features[i]->Length;
-    }
-
     vafs->Header.DescriptorBlockOffset = descriptorBlockOffset;
-    vafs->Header.DataBlockOffset = descriptorBlockOffset + (uint32_t)descriptorBlockSize;
-    VAFS_DEBUG("__write_vafs_header: descriptor block offset: %i\n", vafs->Header.DescriptorBlockOffset);
-    VAFS_DEBUG("__write_vafs_header: data block offset: %i\n", vafs->Header.DataBlockOffset);
+    vafs->Header.DataBlockOffset = dataBlockOffset;
+    VAFS_DEBUG("__layout_vafs_header: descriptor block offset: %llu\n", vafs->Header.DescriptorBlockOffset);
+    VAFS_DEBUG("__layout_vafs_header: data block offset: %llu\n", vafs->Header.DataBlockOffset);
 
     vafs->Header.RootDescriptor.Index = vafs->RootDirectory->Descriptor.Descriptor.Index;
     vafs->Header.RootDescriptor.Offset = vafs->RootDirectory->Descriptor.Descriptor.Offset;
-    VAFS_DEBUG("__write_vafs_header: root descriptor index: %i\n", vafs->Header.RootDescriptor.Index);
-    VAFS_DEBUG("__write_vafs_header: root descriptor offset: %i\n", vafs->Header.RootDescriptor.Offset);
+    VAFS_DEBUG("__layout_vafs_header: root descriptor index: %i\n", vafs->Header.RootDescriptor.Index);
+    VAFS_DEBUG("__layout_vafs_header: root descriptor offset: %i\n", vafs->Header.RootDescriptor.Offset);
+}
 
+static int __write_vafs_header(
+    struct VaFs* vafs)
+{
+    size_t written;
+    VAFS_INFO("__write_vafs_header: writing header\n");
     return vafs_streamdevice_write(vafs->ImageDevice, &vafs->Header, sizeof(VaFsHeader_t), &written);
 }
 
-static int __create_image(
+static int __flush_vafs(
     struct VaFs* vafs)
 {
     int status;
 
     // flush files
-    VAFS_DEBUG("__create_image: flushing files\n");
+    VAFS_DEBUG("__flush_vafs: flushing files\n");
     status = vafs_directory_flush(vafs->RootDirectory);
     if (status) {
         VAFS_ERROR("Failed to flush files: %i\n", status);
@@ -582,7 +953,7 @@ static int __create_image(
     }
 
     // flush streams
-    VAFS_DEBUG("__create_image: flushing streams\n");
+    VAFS_DEBUG("__flush_vafs: flushing streams\n");
     status = vafs_stream_finish(vafs->DescriptorStream);
     if (status) {
         VAFS_ERROR("Failed to flush descriptor stream: %i\n", status);
@@ -596,38 +967,116 @@ static int __create_image(
     }
 
     // install the overview
-    VAFS_DEBUG("__create_image: writing overview\n");
-    status = vafs_feature_add(vafs, &vafs->Overview.Header);
-    if (status) {
+    VAFS_DEBUG("__flush_vafs: writing overview\n");
+    return vafs_feature_add(vafs, &vafs->Overview.Header);
+}
+
+// __create_image_staged writes the header, the features and then copies the
+// staged descriptor and data streams into the image.
+static int __create_image_staged(
+    struct VaFs* vafs)
+{
+    int64_t  descriptorBlockSize;
+    uint64_t descriptorBlockOffset;
+    int      status;
+    int      i;
+
+    descriptorBlockSize = vafs_streamdevice_seek(vafs->DescriptorDevice, 0, SEEK_CUR);
+    if (descriptorBlockSize < 0) {
+        VAFS_ERROR("__create_image_staged: failed to seek to current position\n");
         return -1;
     }
 
+    // calculate the data block offsets
+    descriptorBlockOffset = sizeof(VaFsHeader_t);
+    for (i = 0; i < vafs->FeatureCount; i++) {
+        descriptorBlockOffset += vafs->Features[i]->Length;
+    }
+    __layout_vafs_header(vafs, descriptorBlockOffset, descriptorBlockOffset + (uint64_t)descriptorBlockSize);
+
     // write the header
-    VAFS_DEBUG("__create_image: writing header\n");
+    VAFS_DEBUG("__create_image_staged: writing header\n");
     status = __write_vafs_header(vafs);
     if (status) {
         return -1;
     }
 
     // write the features
-    VAFS_DEBUG("__create_image: writing features\n");
+    VAFS_DEBUG("__create_image_staged: writing features\n");
     status = __write_vafs_features(vafs);
     if (status) {
         return -1;
     }
 
     // write the descriptor stream
-    VAFS_DEBUG("__create_image: writing descriptor stream\n");
+    VAFS_DEBUG("__create_image_staged: writing descriptor stream\n");
     status = vafs_streamdevice_copy(vafs->ImageDevice, vafs->DescriptorDevice);
     if (status) {
         return -1;
     }
 
     // write the data stream
-    VAFS_DEBUG("__create_image: writing data stream\n");
+    VAFS_DEBUG("__create_image_staged: writing data stream\n");
     return vafs_streamdevice_copy(vafs->ImageDevice, vafs->DataDevice);
 }
 
+// __create_image_direct finishes an image whose data stream was written in place.
+// The descriptor stream is appended after the data stream, and then the header
+// and the features are written into the space reserved at the start.
+static int __create_image_direct(
+    struct VaFs* vafs)
+{
+    uint64_t descriptorBlockOffset;
+    int64_t  position;
+    int      status;
+
+    position = vafs_streamdevice_seek(vafs->ImageDevice, 0, SEEK_END);
+    if (position < 0) {
+        VAFS_ERROR("__create_image_direct: failed to seek to end of image\n");
+        return -1;
+    }
+    descriptorBlockOffset = (uint64_t)position;
+
+    VAFS_DEBUG("__create_image_direct: writing descriptor stream\n");
+    status = vafs_streamdevice_copy(vafs->ImageDevice, vafs->DescriptorDevice);
+    if (status) {
+        return -1;
+    }
+
+    __layout_vafs_header(vafs, descriptorBlockOffset, sizeof(VaFsHeader_t) + vafs->FeatureReserve);
+    if (vafs_streamdevice_seek(vafs->ImageDevice, 0, SEEK_SET) < 0) {
+        VAFS_ERROR("__create_image_direct: failed to seek to start of image\n");
+        return -1;
+    }
+
+    VAFS_DEBUG("__create_image_direct: writing header\n");
+    status = __write_vafs_header(vafs);
+    if (status) {
+        return -1;
+    }
+
+    // the features are read right after the header, the remaining
+    // reserved space is never read
+    VAFS_DEBUG("__create_image_direct: writing features\n");
+    return __write_vafs_features(vafs);
+}
+
+static int __create_image(
+    struct VaFs* vafs)
+{
+    int status;
+
+    status = __flush_vafs(vafs);
+    if (status) {
+        return -1;
+    }
+
+    if (vafs->FeatureReserve) {
+        return __create_image_direct(vafs);
+    }
+    return __create_image_staged(vafs);
+}
+
 int vafs_close(
     struct VaFs* vafs)
 {
@@ -654,6 +1103,11 @@ static void vafs_destroy(
 {
     VAFS_INFO("vafs_close: cleaning up\n");
 
+    // stop the background workers before the streams and the tree they use
+    vafs_asyncpool_destroy(vafs->AsyncPool);
+    vafs_preloader_destroy(vafs->Preloader);
+    vafs_prefetcher_destroy(vafs->Prefetcher);
+
     // close all open streams
     vafs_stream_close(vafs->DescriptorStream);
     vafs_stream_close(vafs->DataStream);
@@ -661,7 +1115,9 @@ static void vafs_destroy(
     // close all the stream devices active
     if (vafs->Mode == VaFsMode_Write) {
         vafs_streamdevice_close(vafs->DescriptorDevice);
-        vafs_streamdevice_close(vafs->DataDevice);
+        if (vafs->DataDevice != NULL) {
+            vafs_streamdevice_close(vafs->DataDevice);
+        }
     }
     vafs_streamdevice_close(vafs->ImageDevice);
 
@@ -671,8 +1127,14 @@ static void vafs_destroy(
     }
     free(vafs->Features);
 
-    // cleanup directory instances
+    // cleanup directory instances, the path cache refers to them. The
+    // directory tree itself is released with the arena.
+    vafs_pathcache_destroy(vafs->PathCache);
     vafs_directory_destroy(vafs->RootDirectory);
+    vafs_arena_destroy(vafs->Arena);
+
+    // the streams must be closed before the filter, as they may hold contexts
+    vafs_filter_destroy(vafs->Filter);
     
     // cleanup the base instance
     free(vafs);
@@ -0,0 +1,801 @@
+/**
+ * Copyright 2022, Philip Meulengracht
+ *
+ * This program is free software : you can redistribute it and / or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation ? , either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * VaFs Benchmark
+ * - Builds synthetic images and measures the build, lookup and read paths
+ *   of the library. Results are printed as one JSON object per line.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <vafs/vafs.h>
+#include <vafs/directory.h>
+#include <vafs/file.h>
+#include <vafs/stat.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+
+static int __cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+#else
+#include <unistd.h>
+
+static int __cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+#endif
+
+extern int __install_filter(struct VaFs* vafs, const char* filterName);
+extern int __handle_filter(struct VaFs* vafs);
+
+// The synthetic file contents are cut from a shared pool of data, which
+// compresses roughly like text, so filters have something to work with.
+#define __POOL_SIZE    (4 * 1024 * 1024)
+#define __READ_CHUNK   (64 * 1024)
+#define __RANDOM_CHUNK (4 * 1024)
+#define __MAX_SAMPLES  10000
+
+struct __bench_file {
+    char*    path;
+    uint64_t size;
+};
+
+struct __bench_files {
+    struct __bench_file* files;
+    int                  count;
+    int                  capacity;
+    uint64_t             total;
+};
+
+struct __options {
+    const char* out_path;
+    const char* filters;
+    const char* scenarios;
+    int         scale;
+    int         threads;
+    int         reads;
+    int         keep;
+    uint32_t    seed;
+};
+
+struct __bench_context {
+    struct __options* opts;
+    const char*       scenario;
+    const char*       filter;
+    char*             pool;
+    uint32_t          random;
+};
+
+static uint64_t __now_ns(void)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER        counter;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// xorshift32, the benchmark must produce the same images on every run
+static uint32_t __next_random(struct __bench_context* context)
+{
+    uint32_t x = context->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    context->random = x;
+    return x;
+}
+
+static uint64_t __random_range(struct __bench_context* context, uint64_t limit)
+{
+    uint64_t value = ((uint64_t)__next_random(context) << 32) | __next_random(context);
+    return limit ? value % limit : 0;
+}
+
+static void __report(struct __bench_context* context, const char* metric, double value, const char* unit)
+{
+    printf("{\"scenario\":\"%s\",\"filter\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n",
+        context->scenario, context->filter, metric, value, unit);
+    fflush(stdout);
+}
+
+static int __compare_samples(const void* lh, const void* rh)
+{
+    uint64_t a = *(const uint64_t*)lh;
+    uint64_t b = *(const uint64_t*)rh;
+    return (a > b) - (a < b);
+}
+
+static void __report_percentiles(struct __bench_context* context, const char* metric, uint64_t* samples, int count)
+{
+    static const int percentiles[] = { 50, 90, 99 };
+    char             name[64];
+
+    if (count == 0) {
+        return;
+    }
+
+    qsort(samples, (size_t)count, sizeof(uint64_t), __compare_samples);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        int index = (int)(((int64_t)count * percentiles[i]) / 100);
+        if (index >= count) {
+            index = count - 1;
+        }
+        snprintf(name, sizeof(name), "%s_p%i", metric, percentiles[i]);
+        __report(context, name, (double)samples[index], "ns");
+    }
+}
+
+static double __mib_per_second(uint64_t bytes, uint64_t ns)
+{
+    if (ns == 0) {
+        return 0.0;
+    }
+    return ((double)bytes / (1024.0 * 1024.0)) / ((double)ns / 1000000000.0);
+}
+
+static double __hit_ratio(uint64_t hits, uint64_t misses)
+{
+    if (hits + misses == 0) {
+        return 0.0;
+    }
+    return (double)hits / (double)(hits + misses);
+}
+
+static char* __create_pool(uint32_t seed)
+{
+    static const char* words[] = {
+        "vafs", "block", "stream", "image", "directory", "file", "kernel", "initrd",
+        "cache", "filter", "decode", "symlink", "the", "of", "and", "data", "\n", "    "
+    };
+    struct __bench_context random = { .random = seed ? seed : 1 };
+    char*                  pool;
+    size_t                 i = 0;
+
+    pool = malloc(__POOL_SIZE);
+    if (!pool) {
+        return NULL;
+    }
+
+    // Mostly words, with some noise in between
+    while (i < __POOL_SIZE) {
+        uint32_t value = __next_random(&random);
+        if ((value & 0xF) == 0) {
+            pool[i++] = (char)(value >> 8);
+            continue;
+        }
+
+        const char* word = words[(value >> 4) % (sizeof(words) / sizeof(words[0]))];
+        for (size_t j = 0; word[j] && i < __POOL_SIZE; j++) {
+            pool[i++] = word[j];
+        }
+        if (i < __POOL_SIZE) {
+            pool[i++] = ' ';
+        }
+    }
+    return pool;
+}
+
+static int __add_file(struct __bench_files* files, const char* path, uint64_t size)
+{
+    if (files->count == files->capacity) {
+        int                  capacity = files->capacity ? files->capacity * 2 : 256;
+        struct __bench_file* grown    = realloc(files->files, sizeof(struct __bench_file) * capacity);
+        if (!grown) {
+            errno = ENOMEM;
+            return -1;
+        }
+        files->files    = grown;
+        files->capacity = capacity;
+    }
+
+    files->files[files->count].path = strdup(path);
+    if (!files->files[files->count].path) {
+        errno = ENOMEM;
+        return -1;
+    }
+    files->files[files->count].size = size;
+    files->count++;
+    files->total += size;
+    return 0;
+}
+
+static void __free_files(struct __bench_files* files)
+{
+    for (int i = 0; i < files->count; i++) {
+        free(files->files[i].path);
+    }
+    free(files->files);
+    memset(files, 0, sizeof(struct __bench_files));
+}
+
+static int __write_file(
+    struct __bench_context*     context,
+    struct VaFsDirectoryHandle* directory,
+    const char*                 directoryPath,
+    const char*                 name,
+    uint64_t                    size,
+    struct __bench_files*       files)
+{
+    struct VaFsFileHandle* handle;
+    char                   path[512];
+    uint64_t               written = 0;
+    int                    status;
+
+    status = vafs_directory_create_file(directory, name, 0644, &handle);
+    if (status) {
+        fprintf(stderr, "vafs-bench: failed to create file %s\n", name);
+        return status;
+    }
+
+    while (written < size) {
+        size_t offset = (size_t)__random_range(context, __POOL_SIZE / 2);
+        size_t length = (size_t)(size - written);
+        if (length > __POOL_SIZE / 2) {
+            length = __POOL_SIZE / 2;
+        }
+
+        if (vafs_file_write(handle, context->pool + offset, length)) {
+            fprintf(stderr, "vafs-bench: failed to write file %s\n", name);
+            vafs_file_close(handle);
+            return -1;
+        }
+        written += length;
+    }
+
+    vafs_file_close(handle);
+    if (snprintf(path, sizeof(path), "%s/%s", directoryPath, name) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return __add_file(files, path, size);
+}
+
+// __generate_small writes many small files spread over a hundred directories
+static int __generate_small(struct __bench_context* context, struct VaFsDirectoryHandle* root, struct __bench_files* files)
+{
+    int fileCount = 10000 * context->opts->scale;
+    int status    = 0;
+
+    for (int d = 0; d < 100 && !status; d++) {
+        struct VaFsDirectoryHandle* directory;
+        char                        name[32];
+        char                        path[32];
+
+        snprintf(name, sizeof(name), "d%03i", d);
+        snprintf(path, sizeof(path), "/d%03i", d);
+        status = vafs_directory_create_directory(root, name, 0755, &directory);
+        if (status) {
+            fprintf(stderr, "vafs-bench: failed to create directory %s\n", name);
+            return status;
+        }
+
+        for (int f = d; f < fileCount && !status; f += 100) {
+            snprintf(name, sizeof(name), "f%06i.dat", f);
+            status = __write_file(context, directory, path, name, 256 + __random_range(context, 8 * 1024), files);
+        }
+        vafs_directory_close(directory);
+    }
+    return status;
+}
+
+// __generate_huge writes a few large files
+static int __generate_huge(struct __bench_context* context, struct VaFsDirectoryHandle* root, struct __bench_files* files)
+{
+    int status = 0;
+
+    for (int f = 0; f < 2 * context->opts->scale && !status; f++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "huge%02i.bin", f);
+        status = __write_file(context, root, "", name, 32ULL * 1024 * 1024, files);
+    }
+    return status;
+}
+
+// __generate_deep writes a chain of nested directories with a few files on each level
+static int __generate_deep(struct __bench_context* context, struct VaFsDirectoryHandle* root, struct __bench_files* files)
+{
+    struct VaFsDirectoryHandle* directory = root;
+    char                        path[512] = { 0 };
+    int                         status    = 0;
+
+    for (int level = 0; level < 32 && !status; level++) {
+        struct VaFsDirectoryHandle* next;
+        char                        name[32];
+
+        snprintf(name, sizeof(name), "level%02i", level);
+        status = vafs_directory_create_directory(directory, name, 0755, &next);
+        if (directory != root) {
+            vafs_directory_close(directory);
+        }
+        if (status) {
+            fprintf(stderr, "vafs-bench: failed to create directory %s\n", name);
+            return status;
+        }
+        directory = next;
+        strcat(path, "/");
+        strcat(path, name);
+
+        for (int f = 0; f < 32 * context->opts->scale && !status; f++) {
+            snprintf(name, sizeof(name), "f%04i.dat", f);
+            status = __write_file(context, directory, path, name, 512 + __random_range(context, 32 * 1024), files);
+        }
+    }
+
+    if (directory != root) {
+        vafs_directory_close(directory);
+    }
+    return status;
+}
+
+typedef int (*__generate_func)(struct __bench_context*, struct VaFsDirectoryHandle*, struct __bench_files*);
+
+static const struct {
+    const char*     name;
+    __generate_func generate;
+} g_scenarios[] = {
+    { "small", __generate_small },
+    { "huge",  __generate_huge },
+    { "deep",  __generate_deep },
+};
+
+static int __build_image(
+    struct __bench_context* context,
+    __generate_func         generate,
+    const char*             imagePath,
+    struct __bench_files*   files)
+{
+    struct VaFsConfiguration    configuration;
+    struct VaFsDirectoryHandle* root;
+    struct VaFs*                vafs;
+    uint64_t                    start, elapsed;
+    int                         status;
+    FILE*                       image;
+
+    vafs_config_initialize(&configuration);
+    vafs_config_set_encoder_threads(&configuration, context->opts->threads);
+
+    start  = __now_ns();
+    status = vafs_create(imagePath, &configuration, &vafs);
+    if (status) {
+        fprintf(stderr, "vafs-bench: failed to create image %s\n", imagePath);
+        return status;
+    }
+
+    if (strcmp(context->filter, "none") && __install_filter(vafs, context->filter)) {
+        vafs_close(vafs);
+        return -1;
+    }
+
+    status = vafs_directory_open(vafs, "/", &root);
+    if (status) {
+        fprintf(stderr, "vafs-bench: failed to open root directory\n");
+        vafs_close(vafs);
+        return status;
+    }
+
+    status = generate(context, root, files);
+    vafs_directory_close(root);
+    if (status) {
+        vafs_close(vafs);
+        return status;
+    }
+
+    status = vafs_close(vafs);
+    if (status) {
+        fprintf(stderr, "vafs-bench: failed to write image %s\n", imagePath);
+        return status;
+    }
+    elapsed = __now_ns() - start;
+
+    __report(context, "build_time", (double)elapsed / 1000000.0, "ms");
+    __report(context, "build_throughput", __mib_per_second(files->total, elapsed), "MiB/s");
+    __report(context, "build_files", (double)files->count * 1000000000.0 / (double)(elapsed ? elapsed : 1), "files/s");
+    __report(context, "input_size", (double)files->total, "bytes");
+
+    image = fopen(imagePath, "rb");
+    if (image) {
+        fseek(image, 0, SEEK_END);
+        __report(context, "image_size", (double)ftell(image), "bytes");
+        fclose(image);
+    }
+    return 0;
+}
+
+static int __open_image(const char* imagePath, struct VaFs** vafsOut)
+{
+    if (vafs_open_file(imagePath, vafsOut)) {
+        fprintf(stderr, "vafs-bench: failed to open image %s\n", imagePath);
+        return -1;
+    }
+    if (__handle_filter(*vafsOut)) {
+        vafs_close(*vafsOut);
+        return -1;
+    }
+    return 0;
+}
+
+static int __walk_directory(struct VaFs* vafs, const char* path, int* entriesOut)
+{
+    struct VaFsDirectoryHandle* handle;
+    struct VaFsEntry            entry;
+    char                        subPath[512];
+    int                         status;
+
+    status = vafs_directory_open(vafs, path, &handle);
+    if (status) {
+        fprintf(stderr, "vafs-bench: failed to open directory %s\n", path);
+        return status;
+    }
+
+    while (!vafs_directory_read(handle, &entry)) {
+        (*entriesOut)++;
+        if (entry.Type == VaFsEntryType_Directory) {
+            snprintf(subPath, sizeof(subPath), "%s/%s", strcmp(path, "/") ? path : "", entry.Name);
+            status = __walk_directory(vafs, subPath, entriesOut);
+            if (status) {
+                break;
+            }
+        }
+    }
+    vafs_directory_close(handle);
+    return status;
+}
+
+// __bench_lookups measures the tree walk on a freshly opened image, which loads every
+// directory, and the latency of path lookups once the directories are loaded.
+static int __bench_lookups(struct __bench_context* context, const char* imagePath, struct __bench_files* files, uint64_t* samples)
+{
+    struct VaFsFileHandle* handle;
+    struct vafs_stat       stat;
+    struct VaFsStats       stats;
+    struct VaFs*           vafs;
+    uint64_t               start;
+    int                    entries = 0;
+    int                    count;
+    int                    status;
+
+    if (__open_image(imagePath, &vafs)) {
+        return -1;
+    }
+
+    start  = __now_ns();
+    status = __walk_directory(vafs, "/", &entries);
+    if (status) {
+        vafs_close(vafs);
+        return status;
+    }
+    __report(context, "directory_walk_time", (double)(__now_ns() - start) / 1000000.0, "ms");
+    __report(context, "directory_entries", (double)entries, "entries");
+
+    vafs_get_stats(vafs, &stats);
+    __report(context, "directory_loads", (double)stats.DirectoryLoads, "directories");
+
+    count = files->count < __MAX_SAMPLES ? files->count : __MAX_SAMPLES;
+    for (int i = 0; i < count; i++) {
+        const char* path = files->files[__random_range(context, files->count)].path;
+
+        start = __now_ns();
+        if (vafs_path_stat(vafs, path, 1, &stat)) {
+            fprintf(stderr, "vafs-bench: failed to stat %s\n", path);
+            vafs_close(vafs);
+            return -1;
+        }
+        samples[i] = __now_ns() - start;
+    }
+    __report_percentiles(context, "stat_latency", samples, count);
+
+    for (int i = 0; i < count; i++) {
+        const char* path = files->files[__random_range(context, files->count)].path;
+
+        start = __now_ns();
+        if (vafs_file_open(vafs, path, &handle)) {
+            fprintf(stderr, "vafs-bench: failed to open %s\n", path);
+            vafs_close(vafs);
+            return -1;
+        }
+        samples[i] = __now_ns() - start;
+        vafs_file_close(handle);
+    }
+    __report_percentiles(context, "open_latency", samples, count);
+
+    vafs_close(vafs);
+    return 0;
+}
+
+// __bench_sequential reads every file from start to end in the order they were written
+static int __bench_sequential(struct __bench_context* context, const char* imagePath, struct __bench_files* files, char* buffer)
+{
+    struct VaFsFileHandle* handle;
+    struct VaFsStats       stats;
+    struct VaFs*           vafs;
+    uint64_t               start, elapsed;
+    uint64_t               total = 0;
+
+    if (__open_image(imagePath, &vafs)) {
+        return -1;
+    }
+
+    start = __now_ns();
+    for (int i = 0; i < files->count; i++) {
+        size_t read;
+
+        if (vafs_file_open(vafs, files->files[i].path, &handle)) {
+            fprintf(stderr, "vafs-bench: failed to open %s\n", files->files[i].path);
+            vafs_close(vafs);
+            return -1;
+        }
+
+        while ((read = vafs_file_read(handle, buffer, __READ_CHUNK)) > 0) {
+            total += read;
+        }
+        vafs_file_close(handle);
+    }
+    elapsed = __now_ns() - start;
+
+    if (total != files->total) {
+        fprintf(stderr, "vafs-bench: read %llu bytes, expected %llu\n",
+            (unsigned long long)total, (unsigned long long)files->total);
+        vafs_close(vafs);
+        return -1;
+    }
+
+    vafs_get_stats(vafs, &stats);
+    __report(context, "sequential_read", __mib_per_second(total, elapsed), "MiB/s");
+    __report(context, "sequential_cache_hit_ratio", __hit_ratio(stats.Data.CacheHits, stats.Data.CacheMisses), "ratio");
+    __report(context, "sequential_blocks_decoded", (double)stats.Data.BlocksDecoded, "blocks");
+    __report(context, "sequential_decode_time", (double)stats.Data.DecodeTime / 1000000.0, "ms");
+    vafs_close(vafs);
+    return 0;
+}
+
+// __bench_random reads small chunks at random offsets of random files, files
+// are picked in proportion to their size
+static int __bench_random(struct __bench_context* context, const char* imagePath, struct __bench_files* files, char* buffer, uint64_t* samples)
+{
+    struct VaFsFileHandle** handles;
+    struct VaFsStats        stats;
+    struct VaFs*            vafs;
+    uint64_t                start, elapsed = 0;
+    uint64_t                total = 0;
+    int                     count = context->opts->reads;
+    int                     status = 0;
+
+    if (__open_image(imagePath, &vafs)) {
+        return -1;
+    }
+
+    handles = calloc((size_t)files->count, sizeof(struct VaFsFileHandle*));
+    if (!handles) {
+        vafs_close(vafs);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint64_t position = __random_range(context, files->total);
+        uint64_t offset;
+        int      index = 0;
+        size_t   read;
+
+        // locate the file the position falls into
+        while (position >= files->files[index].size) {
+            position -= files->files[index].size;
+            index++;
+        }
+        offset = position - (position % __RANDOM_CHUNK);
+
+        if (handles[index] == NULL && vafs_file_open(vafs, files->files[index].path, &handles[index])) {
+            fprintf(stderr, "vafs-bench: failed to open %s\n", files->files[index].path);
+            status = -1;
+            break;
+        }
+
+        start = __now_ns();
+        vafs_file_seek(handles[index], (long)offset, SEEK_SET);
+        read = vafs_file_read(handles[index], buffer, __RANDOM_CHUNK);
+        samples[i % __MAX_SAMPLES] = __now_ns() - start;
+        elapsed += samples[i % __MAX_SAMPLES];
+        total   += read;
+    }
+
+    if (!status) {
+        vafs_get_stats(vafs, &stats);
+        __report(context, "random_read", __mib_per_second(total, elapsed), "MiB/s");
+        __report(context, "random_reads", (double)count * 1000000000.0 / (double)(elapsed ? elapsed : 1), "reads/s");
+        __report_percentiles(context, "random_latency", samples, count < __MAX_SAMPLES ? count : __MAX_SAMPLES);
+        __report(context, "random_cache_hit_ratio", __hit_ratio(stats.Data.CacheHits, stats.Data.CacheMisses), "ratio");
+        __report(context, "cache_evictions", (double)stats.CacheEvictions, "blocks");
+    }
+
+    for (int i = 0; i < files->count; i++) {
+        if (handles[i] != NULL) {
+            vafs_file_close(handles[i]);
+        }
+    }
+    free(handles);
+    vafs_close(vafs);
+    return status;
+}
+
+static int __run_scenario(struct __bench_context* context, __generate_func generate, char* buffer, uint64_t* samples)
+{
+    struct __bench_files files = { 0 };
+    char                 imagePath[512];
+    int                  status;
+
+    snprintf(imagePath, sizeof(imagePath), "%s/bench-%s-%s.vafs",
+        context->opts->out_path, context->scenario, context->filter);
+    fprintf(stderr, "vafs-bench: %s with filter %s\n", context->scenario, context->filter);
+
+    // every scenario starts from the same seed, so both filters see the same files
+    context->random = context->opts->seed ? context->opts->seed : 1;
+    status = __build_image(context, generate, imagePath, &files);
+    if (!status) {
+        status = __bench_lookups(context, imagePath, &files, samples);
+    }
+    if (!status) {
+        status = __bench_sequential(context, imagePath, &files, buffer);
+    }
+    if (!status) {
+        status = __bench_random(context, imagePath, &files, buffer, samples);
+    }
+
+    __free_files(&files);
+    if (!context->opts->keep) {
+        remove(imagePath);
+    }
+    return status;
+}
+
+// __in_list returns whether name is one of the entries in the comma separated list
+static int __in_list(const char* list, const char* name)
+{
+    size_t length = strlen(name);
+
+    while (list && *list) {
+        if (!strncmp(list, name, length) && (list[length] == ',' || list[length] == '\0')) {
+            return 1;
+        }
+        list = strchr(list, ',');
+        if (list) {
+            list++;
+        }
+    }
+    return 0;
+}
+
+static void __show_help(void)
+{
+    printf("usage: vafs-bench [options]\n"
+           "    --out <path>        The directory the benchmark images are written to, defaults to .\n"
+           "    --scenarios <list>  The scenarios to run, defaults to small,huge,deep\n"
+           "    --filters <list>    The filters to compare, defaults to none and aplib when available\n"
+           "    --scale <n>         Multiplies the number and size of the generated files, defaults to 1\n"
+           "    --threads <n>       The number of threads to encode blocks with, defaults to the number of cpus\n"
+           "    --reads <n>         The number of random reads per scenario, defaults to 10000\n"
+           "    --seed <n>          The seed of the generated contents, defaults to 1\n"
+           "    --keep              Keep the images once the benchmark has run\n"
+           "    --v,vv              Enables extra tracing output for debugging\n"
+           "Results are written to stdout as one JSON object per line.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct __bench_context context = { 0 };
+    enum VaFsLogLevel      level = VaFsLogLevel_Warning;
+    uint64_t*              samples;
+    char*                  buffer;
+    char*                  filters;
+    char*                  filter;
+    int                    status = 0;
+
+    struct __options opts = {
+        .out_path  = ".",
+#if defined(__VAFS_FILTER_APLIB)
+        .filters   = "none,aplib",
+#else
+        .filters   = "none",
+#endif
+        .scenarios = "small,huge,deep",
+        .scale     = 1,
+        .threads   = __cpu_count(),
+        .reads     = 10000,
+        .keep      = 0,
+        .seed      = 1
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--out") && (i + 1) < argc) {
+            opts.out_path = argv[++i];
+        } else if (!strcmp(argv[i], "--scenarios") && (i + 1) < argc) {
+            opts.scenarios = argv[++i];
+        } else if (!strcmp(argv[i], "--filters") && (i + 1) < argc) {
+            opts.filters = argv[++i];
+        } else if (!strcmp(argv[i], "--scale") && (i + 1) < argc) {
+            opts.scale = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && (i + 1) < argc) {
+            opts.threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--reads") && (i + 1) < argc) {
+            opts.reads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--seed") && (i + 1) < argc) {
+            opts.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--keep")) {
+            opts.keep = 1;
+        } else if (!strcmp(argv[i], "--v")) {
+            level = VaFsLogLevel_Info;
+        } else if (!strcmp(argv[i], "--vv")) {
+            level = VaFsLogLevel_Debug;
+        } else {
+            __show_help();
+            return strcmp(argv[i], "--help") ? -1 : 0;
+        }
+    }
+
+    if (opts.scale <= 0 || opts.reads < 0) {
+        __show_help();
+        return -1;
+    }
+    vafs_log_initalize(level);
+
+    context.opts = &opts;
+    context.pool = __create_pool(opts.seed);
+    buffer       = malloc(__READ_CHUNK);
+    samples      = malloc(sizeof(uint64_t) * __MAX_SAMPLES);
+    filters      = strdup(opts.filters);
+    if (!context.pool || !buffer || !samples || !filters) {
+        fprintf(stderr, "vafs-bench: out of memory\n");
+        return -1;
+    }
+
+    for (filter = strtok(filters, ","); filter != NULL && !status; filter = strtok(NULL, ",")) {
+        context.filter = filter;
+        for (size_t i = 0; i < sizeof(g_scenarios) / sizeof(g_scenarios[0]) && !status; i++) {
+            if (!__in_list(opts.scenarios, g_scenarios[i].name)) {
+                continue;
+            }
+            context.scenario = g_scenarios[i].name;
+            status = __run_scenario(&context, g_scenarios[i].generate, buffer, samples);
+        }
+    }
+
+    free(filters);
+    free(samples);
+    free(buffer);
+    free(context.pool);
+    return status;
+}
@@ -27,7 +27,9 @@
 #include <string.h>
 
 enum VaFsFilterType {
-    VaFsFilterType_APLIB
+    VaFsFilterType_APLIB,
+    VaFsFilterType_LZ4,
+    VaFsFilterType_ZSTD
 };
 
 struct VaFsFeatureFilter {
@@ -35,8 +37,16 @@ struct VaFsFeatureFilter {
     int                      Type;
 };
 
-static struct VaFsGuid g_filterGuid    = VA_FS_FEATURE_FILTER;
-static struct VaFsGuid g_filterOpsGuid = VA_FS_FEATURE_FILTER_OPS;
+// Dictionary that the filter encodes and decodes blocks with, the data
+// of the dictionary follows the feature
+struct VaFsFeatureFilterDictionary {
+    struct VaFsFeatureHeader Header;
+    int                      Type;
+};
+
+static struct VaFsGuid g_filterGuid     = VA_FS_FEATURE_FILTER;
+static struct VaFsGuid g_filterOpsGuid  = VA_FS_FEATURE_FILTER_OPS;
+static struct VaFsGuid g_filterDictGuid = VA_FS_FEATURE_FILTER_DICT;
 
 #if defined(__VAFS_FILTER_APLIB)
 #include <aplib.h>
@@ -60,42 +70,71 @@ static int CB_CALLCONV callback(unsigned int insize, unsigned int inpos,
 	return 1;
 }
 
-static int __aplib_encode(void* Input, uint32_t InputLength, void** Output, uint32_t* OutputLength)
-{
-    void*    compressed;
-    uint32_t compressedSize;
+// The aplib context keeps the work memory and the packing buffer, both
+// are grown to fit the largest block encoded with the context.
+struct __aplib_context {
     void*    workmemory;
+    void*    packed;
+    uint32_t capacity;
+};
 
-    compressed = malloc(aP_max_packed_size(InputLength));
-    if (!compressed) {
+static int __aplib_create_context(void** ContextOut)
+{
+    struct __aplib_context* context = calloc(1, sizeof(struct __aplib_context));
+    if (!context) {
         errno = ENOMEM;
         return -1;
     }
+    *ContextOut = context;
+    return 0;
+}
 
-    workmemory = malloc(aP_workmem_size(InputLength));
-    if (!workmemory) {
-        free(compressed);
-        errno = ENOMEM;
-        return -1;
+static void __aplib_destroy_context(void* Context)
+{
+    struct __aplib_context* context = Context;
+    free(context->workmemory);
+    free(context->packed);
+    free(context);
+}
+
+static int __aplib_encode(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength)
+{
+    struct __aplib_context* context = Context;
+    uint32_t                compressedSize;
+
+    if (InputLength > context->capacity) {
+        free(context->workmemory);
+        free(context->packed);
+        context->workmemory = malloc(aP_workmem_size(InputLength));
+        context->packed     = malloc(aP_max_packed_size(InputLength));
+        context->capacity   = InputLength;
+        if (!context->workmemory || !context->packed) {
+            context->capacity = 0;
+            errno = ENOMEM;
+            return -1;
+        }
     }
 
-    compressedSize = aPsafe_pack(Input, compressed, InputLength, workmemory, callback, NULL);
+    compressedSize = aPsafe_pack(Input, context->packed, InputLength, context->workmemory, callback, NULL);
     if (compressedSize == APLIB_ERROR) {
-        free(compressed);
-        free(workmemory);
         errno = EINVAL;
         return -1;
     }
-    free(workmemory);
 
-    *Output = compressed;
+    if (compressedSize > *OutputLength) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    memcpy(Output, context->packed, compressedSize);
     *OutputLength = compressedSize;
     return 0;
 }
 
-static int __aplib_decode(void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength)
+static int __aplib_decode(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength)
 {
     uint32_t decompressedSize;
+    (void)Context;
 
     decompressedSize = aPsafe_get_orig_size(Input);
     if (decompressedSize == APLIB_ERROR) {
@@ -109,25 +148,234 @@ static int __aplib_decode(void* Input, uint32_t InputLength, void* Output, uint3
     }
 
     decompressedSize = aPsafe_depack(Input, InputLength, Output, decompressedSize);
+    if (decompressedSize == APLIB_ERROR) {
+        errno = EINVAL;
+        return -1;
+    }
     *OutputLength = decompressedSize;
     return 0;
 }
 #endif
 
+#if defined(__VAFS_FILTER_LZ4)
+#include <lz4.h>
+
+// The lz4 context is the state of the compressor, which is only
+// allocated once the context is used for encoding.
+struct __lz4_context {
+    void* state;
+};
+
+static int __lz4_create_context(void** ContextOut)
+{
+    struct __lz4_context* context = calloc(1, sizeof(struct __lz4_context));
+    if (!context) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *ContextOut = context;
+    return 0;
+}
+
+static void __lz4_destroy_context(void* Context)
+{
+    struct __lz4_context* context = Context;
+    free(context->state);
+    free(context);
+}
+
+static int __lz4_encode(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength)
+{
+    struct __lz4_context* context = Context;
+    int                   compressedSize;
+
+    if (context->state == NULL) {
+        context->state = malloc((size_t)LZ4_sizeofState());
+        if (!context->state) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // lz4 only fails when the output buffer is too small
+    compressedSize = LZ4_compress_fast_extState(context->state, Input, Output, (int)InputLength, (int)*OutputLength, 1);
+    if (compressedSize <= 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    *OutputLength = (uint32_t)compressedSize;
+    return 0;
+}
+
+static int __lz4_decode(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength)
+{
+    int decompressedSize;
+    (void)Context;
+
+    decompressedSize = LZ4_decompress_safe(Input, Output, (int)InputLength, (int)*OutputLength);
+    if (decompressedSize < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *OutputLength = (uint32_t)decompressedSize;
+    return 0;
+}
+#endif
+
+#if defined(__VAFS_FILTER_ZSTD)
+#include <zdict.h>
+#include <zstd.h>
+
+// The compression level is only used when creating images, the
+// level does not need to be known to decompress the blocks.
+static int g_zstdLevel = ZSTD_CLEVEL_DEFAULT;
+
+// The dictionary of the image, if it was created with one. The dictionary
+// is prepared once, and shared by all threads that encode or decode blocks.
+static ZSTD_CDict* g_zstdCDict = NULL;
+static ZSTD_DDict* g_zstdDDict = NULL;
+
+// The zstd context holds the compression and decompression contexts, which
+// are created the first time they are needed. When a dictionary is used, the
+// block is also compressed into the scratch buffer for comparison.
+struct __zstd_context {
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+    void*      scratch;
+    uint32_t   scratchSize;
+};
+
+static int __zstd_create_context(void** ContextOut)
+{
+    struct __zstd_context* context = calloc(1, sizeof(struct __zstd_context));
+    if (!context) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *ContextOut = context;
+    return 0;
+}
+
+static void __zstd_destroy_context(void* Context)
+{
+    struct __zstd_context* context = Context;
+    ZSTD_freeCCtx(context->cctx);
+    ZSTD_freeDCtx(context->dctx);
+    free(context->scratch);
+    free(context);
+}
+
+static int __zstd_encode(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength)
+{
+    struct __zstd_context* context = Context;
+    size_t                 compressedSize;
+
+    if (context->cctx == NULL) {
+        context->cctx = ZSTD_createCCtx();
+        if (!context->cctx) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // Compression only fails if the output does not fit, in which case the
+    // block is stored as it is.
+    compressedSize = ZSTD_compressCCtx(context->cctx, Output, *OutputLength, Input, InputLength, g_zstdLevel);
+
+    // When a dictionary is present, the block is compressed both with and without
+    // it, as the dictionary may not suit all blocks of both streams.
+    if (g_zstdCDict != NULL) {
+        size_t dictionarySize;
+
+        if (*OutputLength > context->scratchSize) {
+            free(context->scratch);
+            context->scratch     = malloc(*OutputLength);
+            context->scratchSize = context->scratch != NULL ? *OutputLength : 0;
+        }
+
+        if (context->scratch != NULL) {
+            dictionarySize = ZSTD_compress_usingCDict(context->cctx, context->scratch, *OutputLength,
+                Input, InputLength, g_zstdCDict);
+            if (!ZSTD_isError(dictionarySize) && (ZSTD_isError(compressedSize) || dictionarySize < compressedSize)) {
+                memcpy(Output, context->scratch, dictionarySize);
+                compressedSize = dictionarySize;
+            }
+        }
+    }
+
+    if (ZSTD_isError(compressedSize)) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    *OutputLength = (uint32_t)compressedSize;
+    return 0;
+}
+
+static int __zstd_decode(void* Context, const void* Input, uint32_t InputLength, void* Output, uint32_t* OutputLength)
+{
+    struct __zstd_context* context = Context;
+    size_t                 decompressedSize;
+
+    if (context->dctx == NULL) {
+        context->dctx = ZSTD_createDCtx();
+        if (!context->dctx) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // Blocks that were compressed without the dictionary carry no dictionary id
+    if (g_zstdDDict != NULL && ZSTD_getDictID_fromFrame(Input, InputLength) != 0) {
+        decompressedSize = ZSTD_decompress_usingDDict(context->dctx, Output, *OutputLength, Input, InputLength, g_zstdDDict);
+    } else {
+        decompressedSize = ZSTD_decompressDCtx(context->dctx, Output, *OutputLength, Input, InputLength);
+    }
+
+    if (ZSTD_isError(decompressedSize)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *OutputLength = (uint32_t)decompressedSize;
+    return 0;
+}
+#endif
+
 static int __set_filter_ops(
     struct VaFs*              vafs,
     struct VaFsFeatureFilter* filter)
 {
-    struct VaFsFeatureFilterOps filterOps;
+    struct VaFsFeatureFilterOps2 filterOps;
 
     memcpy(&filterOps.Header.Guid, &g_filterOpsGuid, sizeof(struct VaFsGuid));
-    filterOps.Header.Length = sizeof(struct VaFsFeatureFilterOps);
+    filterOps.Header.Length = sizeof(struct VaFsFeatureFilterOps2);
 
     switch (filter->Type) {
 #if defined(__VAFS_FILTER_APLIB)
         case VaFsFilterType_APLIB: {
-            filterOps.Encode = __aplib_encode;
-            filterOps.Decode = __aplib_decode;
+            filterOps.CreateContext  = __aplib_create_context;
+            filterOps.DestroyContext = __aplib_destroy_context;
+            filterOps.Encode         = __aplib_encode;
+            filterOps.Decode         = __aplib_decode;
+        } break;
+#endif
+#if defined(__VAFS_FILTER_LZ4)
+        case VaFsFilterType_LZ4: {
+            filterOps.CreateContext  = __lz4_create_context;
+            filterOps.DestroyContext = __lz4_destroy_context;
+            filterOps.Encode         = __lz4_encode;
+            filterOps.Decode         = __lz4_decode;
+        } break;
+#endif
+#if defined(__VAFS_FILTER_ZSTD)
+        case VaFsFilterType_ZSTD: {
+            filterOps.CreateContext  = __zstd_create_context;
+            filterOps.DestroyContext = __zstd_destroy_context;
+            filterOps.Encode         = __zstd_encode;
+            filterOps.Decode         = __zstd_decode;
         } break;
 #endif
         default: {
@@ -139,6 +387,39 @@ static int __set_filter_ops(
     return vafs_feature_add(vafs, &filterOps.Header);
 }
 
+static int __load_filter_dictionary(
+    struct VaFs*              vafs,
+    struct VaFsFeatureFilter* filter)
+{
+    struct VaFsFeatureFilterDictionary* dictionary;
+    size_t                              size;
+
+    if (vafs_feature_query(vafs, &g_filterDictGuid, (struct VaFsFeatureHeader**)&dictionary)) {
+        return 0;
+    }
+
+    if (dictionary->Type != filter->Type || dictionary->Header.Length < sizeof(struct VaFsFeatureFilterDictionary)) {
+        fprintf(stderr, "the filter dictionary does not belong to filter type %i\n", filter->Type);
+        errno = EINVAL;
+        return -1;
+    }
+    size = dictionary->Header.Length - sizeof(struct VaFsFeatureFilterDictionary);
+
+#if defined(__VAFS_FILTER_ZSTD)
+    if (filter->Type == VaFsFilterType_ZSTD) {
+        g_zstdDDict = ZSTD_createDDict(dictionary + 1, size);
+        if (!g_zstdDDict) {
+            errno = EINVAL;
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    (void)size;
+    errno = ENOTSUP;
+    return -1;
+}
+
 int __handle_filter(
     struct VaFs* vafs)
 {
@@ -150,16 +431,63 @@ int __handle_filter(
         // no filter present
         return 0;
     }
+
+    status = __load_filter_dictionary(vafs, filter);
+    if (status) {
+        fprintf(stderr, "failed to load the filter dictionary\n");
+        return status;
+    }
     return __set_filter_ops(vafs, filter);
 }
 
+// Filter names may carry an option after a colon, like zstd:19
+static int __is_filter_name(
+    const char*  filterName,
+    const char*  name,
+    const char** optionOut)
+{
+    size_t length = strlen(name);
+    if (strncmp(filterName, name, length)) {
+        return 0;
+    }
+
+    if (filterName[length] == ':') {
+        *optionOut = &filterName[length + 1];
+        return 1;
+    }
+    *optionOut = NULL;
+    return filterName[length] == '\0';
+}
+
 static enum VaFsFilterType __get_filter_from_name(
     const char* filterName)
 {
+    const char* option;
+
 #if defined(__VAFS_FILTER_APLIB)
-    if (!strcmp(filterName, "aplib"))
+    if (__is_filter_name(filterName, "aplib", &option) && option == NULL)
         return VaFsFilterType_APLIB;
 #endif
+#if defined(__VAFS_FILTER_LZ4)
+    if (__is_filter_name(filterName, "lz4", &option) && option == NULL)
+        return VaFsFilterType_LZ4;
+#endif
+#if defined(__VAFS_FILTER_ZSTD)
+    if (__is_filter_name(filterName, "zstd", &option)) {
+        if (option != NULL) {
+            char* end;
+            long  level = strtol(option, &end, 10);
+            if (end == option || *end != '\0' || level < ZSTD_minCLevel() || level > ZSTD_maxCLevel()) {
+                fprintf(stderr, "invalid zstd level %s, must be in the range %i..%i\n",
+                    option, ZSTD_minCLevel(), ZSTD_maxCLevel());
+                return -1;
+            }
+            g_zstdLevel = (int)level;
+        }
+        return VaFsFilterType_ZSTD;
+    }
+#endif
+    (void)option;
     return -1;
 }
 
@@ -185,3 +513,70 @@ int __install_filter(
     }
     return __set_filter_ops(vafs, &filter);
 }
+
+int __train_filter_dictionary(
+    struct VaFs*  vafs,
+    const char*   filterName,
+    size_t        dictionarySize,
+    const void*   samples,
+    const size_t* sampleSizes,
+    unsigned int  sampleCount)
+{
+#if defined(__VAFS_FILTER_ZSTD)
+    struct VaFsFeatureFilterDictionary* dictionary;
+    const char*                         option;
+    size_t                              size;
+    int                                 status;
+
+    if (!__is_filter_name(filterName, "zstd", &option)) {
+        fprintf(stderr, "dictionaries are only supported by the zstd filter\n");
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    dictionary = malloc(sizeof(struct VaFsFeatureFilterDictionary) + dictionarySize);
+    if (!dictionary) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size = ZDICT_trainFromBuffer(dictionary + 1, dictionarySize, samples, sampleSizes, sampleCount);
+    if (ZDICT_isError(size)) {
+        fprintf(stderr, "failed to train dictionary: %s\n", ZDICT_getErrorName(size));
+        free(dictionary);
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(&dictionary->Header.Guid, &g_filterDictGuid, sizeof(struct VaFsGuid));
+    dictionary->Header.Length = (uint32_t)(sizeof(struct VaFsFeatureFilterDictionary) + size);
+    dictionary->Type          = VaFsFilterType_ZSTD;
+
+    // The dictionary must be stored in the image before any block is encoded with it,
+    // blocks encoded without it are still readable as they carry no dictionary id
+    status = vafs_feature_add(vafs, &dictionary->Header);
+    if (status) {
+        free(dictionary);
+        return status;
+    }
+
+    // The level is baked into the prepared dictionary
+    g_zstdCDict = ZSTD_createCDict(dictionary + 1, size, g_zstdLevel);
+    free(dictionary);
+    if (!g_zstdCDict) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+#else
+    (void)vafs;
+    (void)filterName;
+    (void)dictionarySize;
+    (void)samples;
+    (void)sampleSizes;
+    (void)sampleCount;
+    fprintf(stderr, "dictionaries are only supported by the zstd filter\n");
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
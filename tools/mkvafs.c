@@ -427,6 +427,20 @@ int __ministat(
     return 0;
 }
 
+int __filestat(
+    const char* path,
+    uint32_t*   filemode,
+    uint64_t*   size)
+{
+    struct stat st;
+    if (__stat(path, &st, 0) != 0) {
+        return -1;
+    }
+    *filemode = st.st_mode;
+    *size     = (uint64_t)st.st_size;
+    return 0;
+}
+
 
 char* __abspath(const char* path)
 {
@@ -446,6 +460,13 @@ char* __abspath(const char* path)
     return fullPath;
 }
 
+int __cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
 #define __is_file(mode) S_ISREG(mode)
 #define __is_symlink(mode) S_ISLNK(mode)
 #define __is_directory(mode) S_ISDIR(mode)
@@ -491,11 +512,31 @@ int __ministat(
     return 0;
 }
 
+int __filestat(
+    const char* path,
+    uint32_t*   filemode,
+    uint64_t*   size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    *filemode = st.st_mode;
+    *size     = (uint64_t)st.st_size;
+    return 0;
+}
+
 char* __abspath(const char* path)
 {
     return realpath(path, NULL);
 }
 
+int __cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
 #define __is_file(mode) S_ISREG(mode)
 #define __is_symlink(mode) S_ISLNK(mode)
 #define __is_directory(mode) S_ISDIR(mode)
@@ -514,6 +555,108 @@ struct progress_context {
 };
 
 extern int __install_filter(struct VaFs* vafs, const char* filterName);
+extern int __handle_filter(struct VaFs* vafs);
+extern int __train_filter_dictionary(struct VaFs* vafs, const char* filterName, size_t dictionarySize,
+                                     const void* samples, const size_t* sampleSizes, unsigned int sampleCount);
+
+// Dictionaries are trained on the start of each file, as that is where the
+// headers and other shared structures of most file formats are found.
+#define __DICTIONARY_SIZE         (110 * 1024)
+#define __DICTIONARY_SAMPLE_SIZE  (64 * 1024)
+#define __DICTIONARY_SAMPLE_MAX   (16 * 1024 * 1024)
+#define __DICTIONARY_SAMPLE_COUNT 4096
+
+// Space reserved for the features when writing the image directly, this
+// must hold every feature mkvafs adds besides the dictionary
+#define __FEATURE_RESERVE         4096
+
+// Files smaller than a data block, and files that are read at random offsets,
+// are stored in small blocks, so reading a part of them decodes little more
+// than that part. All other files are stored in blocks of the image block size,
+// which compress better.
+#define __SMALL_BLOCK_SIZE        (16 * 1024)
+
+static int __train_dictionary(struct VaFs* vafs, const char* filterName, struct list* files)
+{
+    struct list_item* it;
+    char*             samples;
+    size_t*           sampleSizes;
+    size_t            samplesLength = 0;
+    unsigned int      sampleCount = 0;
+    int               status;
+
+    samples = malloc(__DICTIONARY_SAMPLE_MAX);
+    sampleSizes = malloc(sizeof(size_t) * __DICTIONARY_SAMPLE_COUNT);
+    if (samples == NULL || sampleSizes == NULL) {
+        free(samples);
+        free(sampleSizes);
+        return -1;
+    }
+
+    list_foreach(files, it) {
+        struct platform_file_entry* entry = (struct platform_file_entry*)it;
+        FILE*                       file;
+        size_t                      bytesRead;
+
+        if (entry->type != PLATFORM_FILETYPE_FILE) {
+            continue;
+        }
+
+        if (samplesLength + __DICTIONARY_SAMPLE_SIZE > __DICTIONARY_SAMPLE_MAX || sampleCount == __DICTIONARY_SAMPLE_COUNT) {
+            break;
+        }
+
+        if ((file = fopen(entry->path, "rb")) == NULL) {
+            continue;
+        }
+
+        bytesRead = fread(&samples[samplesLength], 1, __DICTIONARY_SAMPLE_SIZE, file);
+        fclose(file);
+        if (bytesRead > 0) {
+            sampleSizes[sampleCount++] = bytesRead;
+            samplesLength += bytesRead;
+        }
+    }
+
+    status = __train_filter_dictionary(vafs, filterName, __DICTIONARY_SIZE, samples, sampleSizes, sampleCount);
+    free(samples);
+    free(sampleSizes);
+    return status;
+}
+
+static int __install_inline(struct VaFs* vafs, int threshold)
+{
+    struct VaFsFeatureInline inlineFeature = {
+        .Header = { .Guid = VA_FS_FEATURE_INLINE, .Length = sizeof(struct VaFsFeatureInline) }
+    };
+
+    if (threshold < 0 || threshold > VA_FS_INLINE_MAX_SIZE) {
+        fprintf(stderr, "mkvafs: inline threshold must be between 0 and %i\n", VA_FS_INLINE_MAX_SIZE);
+        errno = EINVAL;
+        return -1;
+    }
+
+    inlineFeature.Threshold = (uint32_t)threshold;
+    return vafs_feature_add(vafs, &inlineFeature.Header);
+}
+
+static int __install_checksum(struct VaFs* vafs, const char* name)
+{
+    struct VaFsFeatureChecksum checksum = {
+        .Header = { .Guid = VA_FS_FEATURE_CHECKSUM, .Length = sizeof(struct VaFsFeatureChecksum) }
+    };
+
+    if (!strcmp(name, "crc32")) {
+        checksum.Algorithm = VaFsChecksum_CRC32;
+    } else if (!strcmp(name, "crc32c")) {
+        checksum.Algorithm = VaFsChecksum_CRC32C;
+    } else {
+        fprintf(stderr, "mkvafs: unsupported checksum %s\n", name);
+        errno = EINVAL;
+        return -1;
+    }
+    return vafs_feature_add(vafs, &checksum.Header);
+}
 
 // Prints usage format of this program
 static void __show_help(void)
@@ -521,7 +664,17 @@ static void __show_help(void)
     printf("Usage: mkvafs [options] dir/files ...\n\n"
            "Options\n"
            "    --arch              {i386,amd64,arm,arm64,rv32,rv64,all}\n"
-           "    --compression       {aplib}\n"
+           "    --compression       {aplib,lz4,zstd[:level]}\n"
+           "    --threads           The number of threads to compress with, defaults to the number of cpus\n"
+           "    --checksum          {crc32,crc32c}, the block checksum, defaults to crc32\n"
+           "    --dictionary        Train a compression dictionary from the files, only for zstd\n"
+           "    --no-dedup          Store files with identical contents once for each copy\n"
+           "    --inline            Store files of at most this many bytes in the directory, at most 16384\n"
+           "    --layout-profile    A trace from vafs-util --trace, the files read in it are stored first\n"
+           "                        in the order they were read\n"
+           "    --small-blocks      The block size of small files and randomly read files, defaults to 16384,\n"
+           "                        0 stores all files in blocks of the same size\n"
+           "    --base              A previous image, blocks of unchanged files are copied from it\n"
            "    --out               A path to where the disk image should be written to\n"
            "    --git-ignore        Enable discovery of ignore files and apply to file discovery\n"
            "    --v,vv              Enables extra tracing output for debugging\n");
@@ -583,17 +736,26 @@ static void __write_progress(const char* prefix, struct progress_context* contex
     fflush(stdout);
 }
 
+// Files are streamed into the image in chunks of this size, which keeps
+// memory usage bounded regardless of the size of the input files. The data
+// stream buffers and encodes blocks on its own, so this does not need to
+// match the block size.
+#define __FILE_CHUNK_SIZE (512 * 1024)
+
 static int __write_file(
     struct VaFsDirectoryHandle* directoryHandle,
     const char*                 path,
     const char*                 filename,
-    uint32_t                    permissions)
+    uint32_t                    permissions,
+    uint32_t                    blockSize,
+    int                         align,
+    struct VaFsFileHandle*      baseHandle)
 {
     struct VaFsFileHandle* fileHandle;
     FILE*                  file;
-    long                   fileSize;
-    void*                  fileBuffer;
-    int                    status;
+    void*                  chunkBuffer;
+    size_t                 bytesRead;
+    int                    status = 0;
 
     // create the VaFS file
     status = vafs_directory_create_file(directoryHandle, filename, permissions, &fileHandle);
@@ -602,36 +764,57 @@ static int __write_file(
         return -1;
     }
 
+    if (blockSize && vafs_file_set_block_size(fileHandle, blockSize)) {
+        fprintf(stderr, "mkvafs: failed to set the block size of file '%s'\n", filename);
+        vafs_file_close(fileHandle);
+        return -1;
+    }
+
+    // start the file in a new block, so reading it decodes no other file
+    if (align && vafs_file_align(fileHandle)) {
+        fprintf(stderr, "mkvafs: failed to align file '%s'\n", filename);
+        vafs_file_close(fileHandle);
+        return -1;
+    }
+
     if ((file = fopen(path, "rb")) == NULL) {
         fprintf(stderr, "mkvafs: unable to open file %s\n", path);
+        vafs_file_close(fileHandle);
         return -1;
     }
 
-    fseek(file, 0, SEEK_END);
-    fileSize = ftell(file);
-    if (fileSize) {
-        fileBuffer = malloc(fileSize);
-        if (fileBuffer == NULL) {
-            fprintf(stderr, "mkvafs: failed to allocate memory for file '%s'\n", filename);
-            fclose(file);
-            return -1;
-        }
+    chunkBuffer = malloc(__FILE_CHUNK_SIZE);
+    if (chunkBuffer == NULL) {
+        fprintf(stderr, "mkvafs: failed to allocate memory for file '%s'\n", filename);
+        fclose(file);
+        vafs_file_close(fileHandle);
+        return -1;
+    }
 
-        rewind(file);
-        fread(fileBuffer, 1, fileSize, file);
+    // stream the file into the image, the data stream takes care of block
+    // boundaries and hands off full blocks to the encoders. Blocks that are
+    // unchanged from the base image are copied from there instead.
+    while ((bytesRead = fread(chunkBuffer, 1, __FILE_CHUNK_SIZE, file)) > 0) {
+        if (vafs_file_write_from(fileHandle, baseHandle, chunkBuffer, bytesRead)) {
+            fprintf(stderr, "mkvafs: failed to write file '%s'\n", filename);
+            status = -1;
+            break;
+        }
+    }
 
-        // write the file to the VaFS file
-        vafs_file_write(fileHandle, fileBuffer, fileSize);
-        free(fileBuffer);
+    if (!status && ferror(file)) {
+        fprintf(stderr, "mkvafs: failed to read file %s\n", path);
+        status = -1;
     }
+
+    free(chunkBuffer);
     fclose(file);
 
-    status = vafs_file_close(fileHandle);
-    if (status) {
+    if (vafs_file_close(fileHandle)) {
         fprintf(stderr, "mkvafs: failed to close file '%s'\n", filename);
         return -1;
     }
-    return 0;
+    return status;
 }
 
 struct __options {
@@ -640,6 +823,14 @@ struct __options {
     const char*       image_path;
     const char*       arch;
     const char*       compression;
+    const char*       checksum;
+    int               dictionary;
+    int               dedup;
+    int               inline_threshold;
+    const char*       layout_profile;
+    uint32_t          small_blocks;
+    const char*       base_path;
+    int               threads;
     int               git_ignore;
     enum VaFsLogLevel level;
 };
@@ -706,7 +897,8 @@ static int __is_excluded(struct list* filters, const char* path)
     return 0;
 }
 
-static int __add_platform_file_entry(struct list* to, const char* name, enum platform_filetype type, const char* subPath, const char* path)
+static int __add_platform_file_entry(struct list* to, const char* name, enum platform_filetype type, const char* subPath, const char* path,
+                                     uint32_t mode, uint64_t size)
 {
     struct platform_file_entry* entry;
 
@@ -719,6 +911,8 @@ static int __add_platform_file_entry(struct list* to, const char* name, enum pla
     entry->type = type;
     entry->sub_path = strdup(subPath != NULL ? subPath : name);
     entry->path = strdup(path);
+    entry->mode = mode;
+    entry->size = size;
 
     list_add(to, &entry->list_header);
     return 0;
@@ -731,7 +925,9 @@ static int __platform_file_entry_copy_to(struct platform_file_entry* entry, stru
         entry->name,
         entry->type,
         entry->sub_path,
-        entry->path
+        entry->path,
+        entry->mode,
+        entry->size
     );
 }
 
@@ -885,7 +1081,7 @@ static struct _ignoremap_entry* __find_filter(hashtable_t* ignoreMap, const char
     return filter;
 }
 
-static int __discover_files_in_directory(struct progress_context* progress, const char* path, int gitIgnore)
+static int __discover_files_in_directory(struct progress_context* progress, const char* path, int gitIgnore, int threads)
 {
     int               status = 0;
     struct list       files = LIST_INIT;
@@ -902,7 +1098,9 @@ static int __discover_files_in_directory(struct progress_context* progress, cons
         return status;
     }
 
-    status = utils_getfiles(path, 1, &files);
+    // Crawl the tree on multiple threads, the files are also stat'ed while
+    // crawling so the write phase can use the results directly.
+    status = utils_getfiles_parallel(path, threads, __filestat, &files);
     if (status) {
         fprintf(stderr, "mkvafs: failed to get files for %s\n", path);
         return -1;
@@ -955,11 +1153,12 @@ cleanup:
     return status;
 }
 
-static int __discover_files(struct progress_context* progress, const char** paths, int count, int gitIgnore)
+static int __discover_files(struct progress_context* progress, const char** paths, int count, int gitIgnore, int threads)
 {
     for (int i = 0; i < count; i++) {
         int      status;
         uint32_t filemode;
+        uint64_t filesize;
         char*    abspath;
 
         // resolve the full path first of all
@@ -969,7 +1168,7 @@ static int __discover_files(struct progress_context* progress, const char** path
             return -1;
         }
 
-        status = __ministat(abspath, &filemode);
+        status = __filestat(abspath, &filemode, &filesize);
         if (status) {
             fprintf(stderr, "mkvafs: failed to stat %s\n", abspath);
             free(abspath);
@@ -977,7 +1176,7 @@ static int __discover_files(struct progress_context* progress, const char** path
         }
 
         if (__is_directory(filemode)) {
-            status = __discover_files_in_directory(progress, abspath, gitIgnore);
+            status = __discover_files_in_directory(progress, abspath, gitIgnore, threads);
             if (status) {
                 fprintf(stderr, "mkvafs: failed to discover files in %s\n", abspath);
                 free(abspath);
@@ -986,7 +1185,7 @@ static int __discover_files(struct progress_context* progress, const char** path
         } else if (__is_symlink(filemode)) {
             status = __add_platform_file_entry(
                 &progress->file_list, __get_filename(abspath),
-                PLATFORM_FILETYPE_SYMLINK, NULL, abspath
+                PLATFORM_FILETYPE_SYMLINK, NULL, abspath, 0, 0
             );
             if (status) {
                 fprintf(stderr, "mkvafs: failed to allocate memory for %s\n", abspath);
@@ -997,7 +1196,7 @@ static int __discover_files(struct progress_context* progress, const char** path
         } else if (__is_file(filemode)) {
             status = __add_platform_file_entry(
                 &progress->file_list, __get_filename(abspath),
-                PLATFORM_FILETYPE_FILE, NULL, abspath
+                PLATFORM_FILETYPE_FILE, NULL, abspath, filemode, filesize
             );
             if (status) {
                 fprintf(stderr, "mkvafs: failed to allocate memory for %s\n", abspath);
@@ -1011,6 +1210,475 @@ static int __discover_files(struct progress_context* progress, const char** path
     return 0;
 }
 
+// Files with identical contents are only stored once in the image, the copies
+// share the data of the first file. Only files that share their size with
+// another file are hashed, and matching hashes are confirmed by comparing the
+// contents, so a hash collision never merges two different files.
+struct _dedup_size {
+    uint64_t size;
+    int      count;
+};
+
+struct _dedup_entry {
+    uint64_t    size;
+    uint64_t    content;
+    char*       path;
+    char*       image_path;
+};
+
+struct __dedup_context {
+    hashtable_t sizes;
+    hashtable_t contents;
+    int         files;
+    uint64_t    bytes;
+};
+
+static uint64_t __dedup_size_hash(const void* elem)
+{
+    const struct _dedup_size* entry = elem;
+    return entry->size;
+}
+
+static int __dedup_size_cmp(const void* lh, const void* rh)
+{
+    const struct _dedup_size* lent = lh;
+    const struct _dedup_size* rent = rh;
+    return lent->size == rent->size ? 0 : -1;
+}
+
+static uint64_t __dedup_entry_hash(const void* elem)
+{
+    const struct _dedup_entry* entry = elem;
+    return entry->content ^ (entry->size * 0x9E3779B97F4A7C15ULL);
+}
+
+static int __dedup_entry_cmp(const void* lh, const void* rh)
+{
+    const struct _dedup_entry* lent = lh;
+    const struct _dedup_entry* rent = rh;
+    return (lent->size == rent->size && lent->content == rent->content) ? 0 : -1;
+}
+
+static void __dedup_entry_free(int index, const void* elem, void* userContext)
+{
+    struct _dedup_entry* entry = (struct _dedup_entry*)elem;
+    (void)index;
+    (void)userContext;
+    free(entry->path);
+    free(entry->image_path);
+}
+
+// FNV-1a over the contents of the file
+static int __hash_file(const char* path, uint64_t* hashOut)
+{
+    uint8_t  buffer[64 * 1024];
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    FILE*    file;
+    size_t   bytesRead;
+
+    if ((file = fopen(path, "rb")) == NULL) {
+        return -1;
+    }
+
+    while ((bytesRead = fread(&buffer[0], 1, sizeof(buffer), file)) > 0) {
+        for (size_t i = 0; i < bytesRead; i++) {
+            hash = (hash ^ buffer[i]) * 0x100000001B3ULL;
+        }
+    }
+
+    if (ferror(file)) {
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    *hashOut = hash;
+    return 0;
+}
+
+static int __files_equal(const char* lpath, const char* rpath)
+{
+    uint8_t lbuffer[64 * 1024];
+    uint8_t rbuffer[64 * 1024];
+    FILE*   lfile;
+    FILE*   rfile;
+    int     equal = 0;
+
+    lfile = fopen(lpath, "rb");
+    rfile = fopen(rpath, "rb");
+    if (lfile != NULL && rfile != NULL) {
+        for (;;) {
+            size_t lread = fread(&lbuffer[0], 1, sizeof(lbuffer), lfile);
+            size_t rread = fread(&rbuffer[0], 1, sizeof(rbuffer), rfile);
+            if (lread != rread || memcmp(&lbuffer[0], &rbuffer[0], lread)) {
+                break;
+            }
+            if (lread == 0) {
+                equal = !ferror(lfile) && !ferror(rfile);
+                break;
+            }
+        }
+    }
+
+    if (lfile != NULL) {
+        fclose(lfile);
+    }
+    if (rfile != NULL) {
+        fclose(rfile);
+    }
+    return equal;
+}
+
+static int __dedup_construct(struct __dedup_context* context, struct list* files)
+{
+    struct list_item* it;
+    int               status;
+
+    memset(context, 0, sizeof(struct __dedup_context));
+    status = vafs_hashtable_construct(&context->sizes, 0, sizeof(struct _dedup_size),
+        __dedup_size_hash, __dedup_size_cmp);
+    if (status) {
+        return status;
+    }
+
+    status = vafs_hashtable_construct(&context->contents, 0, sizeof(struct _dedup_entry),
+        __dedup_entry_hash, __dedup_entry_cmp);
+    if (status) {
+        vafs_hashtable_destroy(&context->sizes);
+        return status;
+    }
+
+    // count the number of files of each size
+    list_foreach(files, it) {
+        struct platform_file_entry* entry = (struct platform_file_entry*)it;
+        struct _dedup_size          key = { 0, 1 };
+        struct _dedup_size*         existing;
+
+        if (entry->type != PLATFORM_FILETYPE_FILE || entry->size == 0) {
+            continue;
+        }
+
+        key.size = entry->size;
+        existing = vafs_hashtable_get(&context->sizes, &key);
+        if (existing != NULL) {
+            key.count = existing->count + 1;
+        }
+        vafs_hashtable_set(&context->sizes, &key);
+    }
+    return 0;
+}
+
+static void __dedup_destroy(struct __dedup_context* context)
+{
+    vafs_hashtable_enumerate(&context->contents, __dedup_entry_free, NULL);
+    vafs_hashtable_destroy(&context->contents);
+    vafs_hashtable_destroy(&context->sizes);
+}
+
+static char* __get_image_path(const char* subPath)
+{
+    char* path = malloc(strlen(subPath) + 2);
+    char* c;
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    path[0] = '/';
+    strcpy(&path[subPath[0] == __PATH_SEPARATOR ? 0 : 1], subPath);
+    for (c = path; *c; c++) {
+        if (*c == __PATH_SEPARATOR) {
+            *c = '/';
+        }
+    }
+    return path;
+}
+
+// __dedup_find returns the image path of an earlier file with identical contents,
+// or NULL if there is none. In that case the file is registered as the first copy.
+static const char* __dedup_find(struct __dedup_context* context, struct platform_file_entry* entry)
+{
+    struct _dedup_size   sizeKey = { 0, 0 };
+    struct _dedup_size*  sizeEntry;
+    struct _dedup_entry  key = { 0 };
+    struct _dedup_entry* existing;
+
+    sizeKey.size = entry->size;
+    if (sizeKey.size == 0) {
+        return NULL;
+    }
+
+    sizeEntry = vafs_hashtable_get(&context->sizes, &sizeKey);
+    if (sizeEntry == NULL || sizeEntry->count < 2) {
+        return NULL;
+    }
+
+    key.size = sizeKey.size;
+    if (__hash_file(entry->path, &key.content)) {
+        return NULL;
+    }
+
+    existing = vafs_hashtable_get(&context->contents, &key);
+    if (existing != NULL) {
+        if (__files_equal(existing->path, entry->path)) {
+            context->files++;
+            context->bytes += key.size;
+            return existing->image_path;
+        }
+        return NULL;
+    }
+
+    key.path       = __safe_strdup(entry->path);
+    key.image_path = __get_image_path(entry->sub_path);
+    if (key.path == NULL || key.image_path == NULL) {
+        free(key.path);
+        free(key.image_path);
+        return NULL;
+    }
+    vafs_hashtable_set(&context->contents, &key);
+    return NULL;
+}
+
+static int __share_file(
+    struct VaFs*                vafs,
+    struct VaFsDirectoryHandle* directoryHandle,
+    const char*                 sourcePath,
+    const char*                 filename,
+    uint32_t                    permissions)
+{
+    struct VaFsFileHandle* source;
+    struct VaFsFileHandle* fileHandle;
+    int                    status;
+
+    status = vafs_file_open(vafs, sourcePath, &source);
+    if (status) {
+        fprintf(stderr, "mkvafs: failed to open file '%s'\n", sourcePath);
+        return -1;
+    }
+
+    status = vafs_directory_create_file(directoryHandle, filename, permissions, &fileHandle);
+    if (status) {
+        fprintf(stderr, "mkvafs: failed to create file '%s'\n", filename);
+        vafs_file_close(source);
+        return -1;
+    }
+
+    status = vafs_file_share(fileHandle, source);
+    if (status) {
+        fprintf(stderr, "mkvafs: failed to share data of '%s'\n", sourcePath);
+    }
+
+    vafs_file_close(fileHandle);
+    vafs_file_close(source);
+    return status;
+}
+
+// A layout profile is a trace recorded by vafs-util --trace, each line holds
+// "<offset> <length> <path>" of a read. Files are ranked by their first read,
+// and reads that do not continue where the previous one ended are counted.
+struct _layout_entry {
+    uint64_t hash;
+    char*    path;
+    int      rank;
+    uint64_t next;
+    int      reads;
+    int      seeks;
+};
+
+struct _layout_file {
+    struct platform_file_entry* entry;
+    int                         rank;
+};
+
+static uint64_t __layout_hash(const void* elem)
+{
+    const struct _layout_entry* entry = elem;
+    return entry->hash;
+}
+
+static int __layout_cmp(const void* lh, const void* rh)
+{
+    const struct _layout_entry* lent = lh;
+    const struct _layout_entry* rent = rh;
+    return strcmp(lent->path, rent->path);
+}
+
+static void __layout_entry_free(int index, const void* elem, void* userContext)
+{
+    struct _layout_entry* entry = (struct _layout_entry*)elem;
+    (void)index;
+    (void)userContext;
+    free(entry->path);
+}
+
+static int __layout_rank_cmp(const void* lh, const void* rh)
+{
+    const struct _layout_file* lfile = lh;
+    const struct _layout_file* rfile = rh;
+    return lfile->rank - rfile->rank;
+}
+
+static int __layout_load(const char* profilePath, hashtable_t* ranks)
+{
+    char  line[4096 + 64];
+    FILE* file;
+    int   rank = 0;
+    int   status;
+
+    status = vafs_hashtable_construct(ranks, 0, sizeof(struct _layout_entry),
+        __layout_hash, __layout_cmp);
+    if (status) {
+        return status;
+    }
+
+    if ((file = fopen(profilePath, "r")) == NULL) {
+        fprintf(stderr, "mkvafs: unable to open layout profile %s\n", profilePath);
+        vafs_hashtable_destroy(ranks);
+        return -1;
+    }
+
+    while (fgets(&line[0], sizeof(line), file) != NULL) {
+        struct _layout_entry  key;
+        struct _layout_entry* found;
+        char*                 path;
+        uint64_t              offset;
+        uint64_t              length;
+
+        line[strcspn(&line[0], "\r\n")] = '\0';
+        offset = strtoull(&line[0], &path, 10);
+        length = strtoull(path, &path, 10);
+        if (*path != ' ') {
+            continue;
+        }
+
+        key.path = path + 1;
+        key.hash = __hash_key(key.path);
+        found    = vafs_hashtable_get(ranks, &key);
+        if (found != NULL) {
+            found->reads++;
+            found->seeks += offset != found->next;
+            found->next   = offset + length;
+            continue;
+        }
+
+        key.path  = __safe_strdup(key.path);
+        key.rank  = rank++;
+        key.next  = offset + length;
+        key.reads = 1;
+        key.seeks = offset != 0;
+        if (key.path == NULL) {
+            status = -1;
+            break;
+        }
+        vafs_hashtable_set(ranks, &key);
+    }
+
+    fclose(file);
+    if (status) {
+        vafs_hashtable_enumerate(ranks, __layout_entry_free, NULL);
+        vafs_hashtable_destroy(ranks);
+    }
+    return status;
+}
+
+// __layout_apply moves the files that were read in the profile to the front of the
+// list, in the order they were first read. This places them next to each other in
+// the data stream, so reading them back is a short sequential scan. Files that were
+// not read keep their order after them.
+static int __layout_apply(const char* profilePath, struct list* files, int* placedOut)
+{
+    struct list          ordered = LIST_INIT;
+    struct _layout_file* hot;
+    struct list_item*    it;
+    hashtable_t          ranks;
+    int                  count = 0;
+    int                  status;
+
+    status = __layout_load(profilePath, &ranks);
+    if (status) {
+        return status;
+    }
+
+    hot = malloc(sizeof(struct _layout_file) * (size_t)(files->count + 1));
+    if (hot == NULL) {
+        vafs_hashtable_enumerate(&ranks, __layout_entry_free, NULL);
+        vafs_hashtable_destroy(&ranks);
+        return -1;
+    }
+
+    list_foreach(files, it) {
+        struct platform_file_entry* entry = (struct platform_file_entry*)it;
+        struct _layout_entry        key;
+        struct _layout_entry*       found;
+
+        if (entry->type != PLATFORM_FILETYPE_FILE) {
+            continue;
+        }
+
+        key.path = __get_image_path(entry->sub_path);
+        if (key.path == NULL) {
+            continue;
+        }
+        key.hash = __hash_key(key.path);
+        found    = vafs_hashtable_get(&ranks, &key);
+        free(key.path);
+        if (found != NULL) {
+            // mostly reading at other offsets than where the last read ended
+            entry->random_access = found->seeks * 2 > found->reads;
+            hot[count].entry = entry;
+            hot[count].rank  = found->rank;
+            count++;
+        }
+    }
+
+    qsort(hot, (size_t)count, sizeof(struct _layout_file), __layout_rank_cmp);
+    for (int i = 0; i < count; i++) {
+        list_remove(files, &hot[i].entry->list_header);
+        list_add(&ordered, &hot[i].entry->list_header);
+    }
+    while (files->head != NULL) {
+        it = files->head;
+        list_remove(files, it);
+        list_add(&ordered, it);
+    }
+    *files     = ordered;
+    *placedOut = count;
+
+    free(hot);
+    vafs_hashtable_enumerate(&ranks, __layout_entry_free, NULL);
+    vafs_hashtable_destroy(&ranks);
+    return 0;
+}
+
+// __open_base_file opens the file at the same path in the base image, if it
+// has the same size. Its blocks are reused where the contents are unchanged.
+static struct VaFsFileHandle* __open_base_file(struct VaFs* base, struct platform_file_entry* entry)
+{
+    struct VaFsFileHandle* handle;
+    char*                  imagePath;
+    int                    status;
+
+    if (base == NULL) {
+        return NULL;
+    }
+
+    imagePath = __get_image_path(entry->sub_path);
+    if (imagePath == NULL) {
+        return NULL;
+    }
+
+    status = vafs_file_open(base, imagePath, &handle);
+    free(imagePath);
+    if (status) {
+        return NULL;
+    }
+
+    if ((uint64_t)vafs_file_length(handle) != entry->size) {
+        vafs_file_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
 static struct VaFsDirectoryHandle* __get_directory_handle(struct VaFs* vafs, const char* abs, const char* relative)
 {
     struct VaFsDirectoryHandle* handle;
@@ -1081,6 +1749,7 @@ static struct VaFsDirectoryHandle* __get_directory_handle(struct VaFs* vafs, con
 static int __create_image(struct __options* opts)
 {
     struct VaFs*             vafsHandle;
+    struct VaFs*             baseImage = NULL;
     struct VaFsConfiguration configuration;
     int                      status;
     struct list_item*        it;
@@ -1088,13 +1757,14 @@ static int __create_image(struct __options* opts)
         LIST_INIT,
         0
     };
+    struct __dedup_context   dedup;
 
     // disable progress if we have debug output
     if (opts->level > VaFsLogLevel_Warning) {
         progressContext.disabled = 1;
     }
 
-    status = __discover_files(&progressContext, &opts->paths[0], opts->paths_count, opts->git_ignore);
+    status = __discover_files(&progressContext, &opts->paths[0], opts->paths_count, opts->git_ignore, opts->threads);
     if (status) {
         fprintf(stderr, "mkvafs: failed to discover files: %i\n", status);
         return status;
@@ -1106,14 +1776,55 @@ static int __create_image(struct __options* opts)
         return -1;
     }
 
+    // the base image is read while the new image is written
+    if (opts->base_path != NULL && !strcmp(opts->base_path, opts->image_path)) {
+        fprintf(stderr, "mkvafs: the base image can not be the output image\n");
+        return -1;
+    }
+
+    if (opts->layout_profile != NULL) {
+        int placed;
+        status = __layout_apply(opts->layout_profile, &progressContext.file_list, &placed);
+        if (status) {
+            fprintf(stderr, "mkvafs: cannot apply layout profile %s\n", opts->layout_profile);
+            return status;
+        }
+        if (!progressContext.disabled) {
+            printf("mkvafs: %i files placed from the layout profile\n", placed);
+        }
+    }
+
     vafs_config_initialize(&configuration);
     vafs_config_set_architecture(&configuration, __get_vafs_arch(opts->arch));
+    vafs_config_set_encoder_threads(&configuration, opts->threads);
+    vafs_config_set_direct_write(&configuration,
+        __FEATURE_RESERVE + (opts->dictionary ? __DICTIONARY_SIZE : 0));
     status = vafs_create(opts->image_path, &configuration, &vafsHandle);
     if (status) {
         fprintf(stderr, "mkvafs: cannot create vafs output file: %s\n", opts->image_path);
         return status;
     }
 
+    // The checksum must be selected before anything is written
+    if (opts->checksum != NULL) {
+        status = __install_checksum(vafsHandle, opts->checksum);
+        if (status) {
+            fprintf(stderr, "mkvafs: cannot set checksum: %s\n", opts->checksum);
+            vafs_close(vafsHandle);
+            return status;
+        }
+    }
+
+    // Small files are only inlined when they are written after this
+    if (opts->inline_threshold != 0) {
+        status = __install_inline(vafsHandle, opts->inline_threshold);
+        if (status) {
+            fprintf(stderr, "mkvafs: cannot set inline threshold: %i\n", opts->inline_threshold);
+            vafs_close(vafsHandle);
+            return status;
+        }
+    }
+
     // Was a compression requested?
     if (opts->compression != NULL) {
         status = __install_filter(vafsHandle, opts->compression);
@@ -1122,6 +1833,30 @@ static int __create_image(struct __options* opts)
             vafs_close(vafsHandle);
             return status;
         }
+
+        // The dictionary is an optimization, so the image is still written
+        // without one if it could not be trained
+        if (opts->dictionary && __train_dictionary(vafsHandle, opts->compression, &progressContext.file_list)) {
+            fprintf(stderr, "mkvafs: cannot train dictionary, continuing without one\n");
+        }
+    }
+
+    // Unchanged blocks of files in the base image are copied instead of
+    // encoding them again, the filter is needed to read its directories
+    if (opts->base_path != NULL) {
+        if (vafs_open_file(opts->base_path, &baseImage) || __handle_filter(baseImage)) {
+            fprintf(stderr, "mkvafs: cannot open base image: %s\n", opts->base_path);
+            if (baseImage != NULL) {
+                vafs_close(baseImage);
+            }
+            vafs_close(vafsHandle);
+            return -1;
+        }
+    }
+
+    if (opts->dedup && __dedup_construct(&dedup, &progressContext.file_list)) {
+        fprintf(stderr, "mkvafs: cannot track duplicate files, continuing without\n");
+        opts->dedup = 0;
     }
 
     list_foreach(&progressContext.file_list, it) {
@@ -1143,7 +1878,7 @@ static int __create_image(struct __options* opts)
                 break;
             }
 
-            status = vafs_directory_create_symlink(directoryHandle, entry->path, linkpath);
+            status = vafs_directory_create_symlink(directoryHandle, __get_filename(entry->path), linkpath);
             free(linkpath);
 
             if (status != 0) {
@@ -1152,14 +1887,30 @@ static int __create_image(struct __options* opts)
             }
             progressContext.symlinks++;
         } else if (entry->type == PLATFORM_FILETYPE_FILE) {
-            uint32_t filemode;
-            status = __ministat(entry->path, &filemode);
-            if (status) {
-                fprintf(stderr, "mkvafs: cannot stat file/directory: %s\n", entry->path);
-                break;
+            const char* sharedPath;
+            uint32_t    filemode = entry->mode;
+
+            sharedPath = opts->dedup ? __dedup_find(&dedup, entry) : NULL;
+            if (sharedPath != NULL) {
+                status = __share_file(vafsHandle, directoryHandle, sharedPath, __get_filename(entry->path), __perms(filemode));
+            } else {
+                // Large files are aligned to the blocks, so reading one of them never
+                // decodes the tail of another file, and later builds can reuse them
+                struct VaFsFileHandle* baseHandle = __open_base_file(baseImage, entry);
+                int                    large      = entry->size >= configuration.DataBlockSize;
+                uint32_t               blockSize  = 0;
+                if (opts->small_blocks) {
+                    blockSize = (large && !entry->random_access) ? configuration.DataBlockSize : opts->small_blocks;
+                    if (blockSize > configuration.DataBlockSize) {
+                        blockSize = configuration.DataBlockSize;
+                    }
+                }
+                status = __write_file(directoryHandle, entry->path, __get_filename(entry->path), __perms(filemode),
+                    blockSize, large, baseHandle);
+                if (baseHandle != NULL) {
+                    vafs_file_close(baseHandle);
+                }
             }
-
-            status = __write_file(directoryHandle, entry->path, __get_filename(entry->path), __perms(filemode));
             if (status != 0) {
                 fprintf(stderr, "mkvafs: unable to write file %s\n", entry->path);
                 break;
@@ -1173,6 +1924,18 @@ static int __create_image(struct __options* opts)
         printf("\n");
     }
 
+    if (opts->dedup) {
+        if (dedup.files && !progressContext.disabled) {
+            printf("mkvafs: %i duplicate files shared their data (%llu bytes)\n",
+                dedup.files, (unsigned long long)dedup.bytes);
+        }
+        __dedup_destroy(&dedup);
+    }
+
+    if (baseImage != NULL) {
+        vafs_close(baseImage);
+    }
+
     if (vafs_close(vafsHandle)) {
         fprintf(stderr, "mkvafs: failed to finalize image\n");
     }
@@ -1186,6 +1949,22 @@ static int __parse_options(struct __options* opts, int argc, char *argv[])
             opts->arch = argv[++i];
         } else if (!strcmp(argv[i], "--compression") && (i + 1) < argc) {
             opts->compression = argv[++i];
+        } else if (!strcmp(argv[i], "--checksum") && (i + 1) < argc) {
+            opts->checksum = argv[++i];
+        } else if (!strcmp(argv[i], "--dictionary")) {
+            opts->dictionary = 1;
+        } else if (!strcmp(argv[i], "--no-dedup")) {
+            opts->dedup = 0;
+        } else if (!strcmp(argv[i], "--base") && (i + 1) < argc) {
+            opts->base_path = argv[++i];
+        } else if (!strcmp(argv[i], "--layout-profile") && (i + 1) < argc) {
+            opts->layout_profile = argv[++i];
+        } else if (!strcmp(argv[i], "--small-blocks") && (i + 1) < argc) {
+            opts->small_blocks = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--inline") && (i + 1) < argc) {
+            opts->inline_threshold = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && (i + 1) < argc) {
+            opts->threads = atoi(argv[++i]);
         } else if (!strcmp(argv[i], "--out") && (i + 1) < argc) {
             opts->image_path = argv[++i];
         } else if (!strcmp(argv[i], "--v")) {
@@ -1214,6 +1993,14 @@ int main(int argc, char *argv[])
         .image_path = "image.vafs",
         .arch = NULL,
         .compression = "aplib",
+        .checksum = NULL,
+        .dictionary = 0,
+        .dedup = 1,
+        .inline_threshold = 0,
+        .layout_profile = NULL,
+        .small_blocks = __SMALL_BLOCK_SIZE,
+        .base_path = NULL,
+        .threads = __cpu_count(),
         .git_ignore = 0,
         .level = VaFsLogLevel_Warning
     };
@@ -1228,6 +2015,11 @@ int main(int argc, char *argv[])
         __show_help();
         return -1;
     }
+
+    if (opts.small_blocks && (opts.small_blocks < 8 * 1024 || opts.small_blocks > 1024 * 1024)) {
+        fprintf(stderr, "mkvafs: the small block size must be 0 or from 8192 to 1048576 bytes\n");
+        return -1;
+    }
     vafs_log_initalize(opts.level);
 
 #if defined(_WIN32) || defined(_WIN64)
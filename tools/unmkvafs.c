@@ -27,6 +27,7 @@
 #include <vafs/vafs.h>
 #include <vafs/directory.h>
 #include <vafs/file.h>
+#include <vafs/platform.h>
 
 #if defined(_WIN32) || defined(_WIN64)
 #include "dirent_win32.h"
@@ -91,6 +92,7 @@ int __symlink(const char* path, const char* target)
 struct __options {
     const char*       image_path;
     const char*       out_path;
+    int               jobs;
     enum VaFsLogLevel level;
 };
 
@@ -115,6 +117,7 @@ static void __show_help(void)
 {
     printf("usage: unmkvafs [options] image\n"
            "    --out               A path to where the disk image should be extracted to\n"
+           "    -j                  The number of files to extract in parallel, defaults to 1\n"
            "    --v,vv              Enables extra tracing output for debugging\n");
 }
 
@@ -128,6 +131,18 @@ static const char* __get_relative_path(
     return relative;
 }
 
+// Output paths are always joined with '/', see __extract_directory
+static const char* __get_filename(
+    const char* path)
+{
+    const char* filename = (const char*)strrchr(path, '/');
+    if (filename == NULL)
+        filename = path;
+    else
+        filename++;
+    return filename;
+}
+
 static int __directory_exists(
     const char* path)
 {
@@ -142,33 +157,54 @@ static int __directory_exists(
     return S_ISDIR(st.st_mode);
 }
 
+// Files are extracted in chunks of this size, which keeps memory usage
+// bounded regardless of the size of the files in the image.
+#define __FILE_CHUNK_SIZE (512 * 1024)
+
 static int __extract_file(
     struct VaFsFileHandle* fileHandle,
     const char*            path)
 {
     FILE*  file;
-    size_t fileSize;
-    void*  fileBuffer;
+    size_t bytesLeft;
+    void*  chunkBuffer;
+    int    status = 0;
 
     if ((file = fopen(path, "wb+")) == NULL) {
         fprintf(stderr, "unmkvafs: unable to open file %s\n", path);
         return -1;
     }
 
-    fileSize = vafs_file_length(fileHandle);
-    if (fileSize) {
-        fileBuffer = malloc(fileSize);
-        if (fileBuffer == NULL) {
-            fprintf(stderr, "unmkvafs: unable to allocate memory for file %s\n", path);
-            return -1;
+    chunkBuffer = malloc(__FILE_CHUNK_SIZE);
+    if (chunkBuffer == NULL) {
+        fprintf(stderr, "unmkvafs: unable to allocate memory for file %s\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    bytesLeft = vafs_file_length(fileHandle);
+    while (bytesLeft) {
+        size_t chunkSize = bytesLeft < __FILE_CHUNK_SIZE ? bytesLeft : __FILE_CHUNK_SIZE;
+        size_t bytesRead = vafs_file_read(fileHandle, chunkBuffer, chunkSize);
+        if (bytesRead == 0) {
+            fprintf(stderr, "unmkvafs: failed to read file %s from image\n", path);
+            status = -1;
+            break;
         }
 
-        vafs_file_read(fileHandle, fileBuffer, fileSize);
-        fwrite(fileBuffer, 1, fileSize, file);
-        
-        free(fileBuffer);
+        if (fwrite(chunkBuffer, 1, bytesRead, file) != bytesRead) {
+            fprintf(stderr, "unmkvafs: failed to write file %s\n", path);
+            status = -1;
+            break;
+        }
+        bytesLeft -= bytesRead;
     }
+
+    free(chunkBuffer);
     fclose(file);
+    if (status) {
+        return status;
+    }
 
     // update permissions on file
     return chmod(path, vafs_file_permissions(fileHandle));
@@ -202,8 +238,132 @@ static void __write_progress(const char* prefix, struct progress_context* contex
     fflush(stdout);
 }
 
+// When extracting in parallel, the directory walk creates all directories and
+// symlinks in directory order, and only queues the files. The workers then
+// extract the files, and never have to wait for a directory to be created.
+#define __MAX_JOBS 64
+
+struct __extract_job {
+    struct VaFsFileHandle* handle;
+    char*                  path;
+};
+
+struct __extract_queue {
+    mtx_t                    lock;
+    struct progress_context* progress;
+    struct __extract_job*    jobs;
+    int                      count;
+    int                      capacity;
+    int                      next;
+    int                      status;
+};
+
+static int __queue_file(
+    struct __extract_queue* queue,
+    struct VaFsFileHandle*  fileHandle,
+    const char*             path)
+{
+    if (queue->count == queue->capacity) {
+        int                   capacity = queue->capacity ? queue->capacity * 2 : 256;
+        struct __extract_job* jobs     = realloc(queue->jobs, sizeof(struct __extract_job) * capacity);
+        if (jobs == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        queue->jobs     = jobs;
+        queue->capacity = capacity;
+    }
+
+    queue->jobs[queue->count].handle = fileHandle;
+    queue->jobs[queue->count].path   = strdup(path);
+    if (queue->jobs[queue->count].path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    queue->count++;
+    return 0;
+}
+
+static int __extract_worker(void* context)
+{
+    struct __extract_queue* queue = context;
+
+    for (;;) {
+        struct __extract_job* job;
+        int                   status;
+
+        mtx_lock(&queue->lock);
+        if (queue->status || queue->next == queue->count) {
+            mtx_unlock(&queue->lock);
+            break;
+        }
+        job = &queue->jobs[queue->next++];
+        mtx_unlock(&queue->lock);
+
+        status = __extract_file(job->handle, job->path);
+        if (status) {
+            fprintf(stderr, "unmkvafs: unable to extract file '%s'\n", job->path);
+        }
+
+        // The handle is closed right away, as its reader holds on to the last
+        // block it read, outside of the cache budget
+        if (vafs_file_close(job->handle)) {
+            fprintf(stderr, "unmkvafs: failed to close file '%s'\n", job->path);
+        }
+        job->handle = NULL;
+
+        mtx_lock(&queue->lock);
+        if (status) {
+            queue->status = status;
+        }
+        queue->progress->files++;
+        __write_progress(__get_filename(job->path), queue->progress);
+        mtx_unlock(&queue->lock);
+    }
+    return 0;
+}
+
+static int __extract_queued(
+    struct __extract_queue* queue,
+    int                     jobs)
+{
+    thrd_t threads[__MAX_JOBS];
+    int    started;
+    int    i;
+
+    if (jobs > queue->count) {
+        jobs = queue->count;
+    }
+
+    for (started = 0; started < jobs; started++) {
+        if (thrd_create(&threads[started], __extract_worker, queue) != thrd_success) {
+            break;
+        }
+    }
+
+    // extract on this thread if no workers could be started
+    if (started == 0) {
+        __extract_worker(queue);
+    }
+
+    for (i = 0; i < started; i++) {
+        thrd_join(threads[i], NULL);
+    }
+
+    // only jobs that were never started still hold their handle
+    for (i = 0; i < queue->count; i++) {
+        if (queue->jobs[i].handle != NULL && vafs_file_close(queue->jobs[i].handle)) {
+            fprintf(stderr, "unmkvafs: failed to close file '%s'\n", queue->jobs[i].path);
+        }
+        free(queue->jobs[i].path);
+    }
+    free(queue->jobs);
+    return queue->status;
+}
+
 static int __extract_directory(
     struct progress_context*    progress,
+    struct __extract_queue*     queue,
     struct VaFsDirectoryHandle* directoryHandle,
     const char*                 root,
     const char*                 path)
@@ -253,7 +413,7 @@ static int __extract_directory(
                 return -1;
             }
 
-            status = __extract_directory(progress, subdirectoryHandle, root, filepathBuffer);
+            status = __extract_directory(progress, queue, subdirectoryHandle, root, filepathBuffer);
             if (status) {
                 fprintf(stderr, "unmkvafs: unable to extract directory '%s'\n", __get_relative_path(root, path));
                 return -1;
@@ -291,6 +451,18 @@ static int __extract_directory(
                 return -1;
             }
 
+            // the file handle is closed by the queue once extracted
+            if (queue != NULL) {
+                status = __queue_file(queue, fileHandle, filepathBuffer);
+                if (status) {
+                    fprintf(stderr, "unmkvafs: unable to queue file '%s'\n", __get_relative_path(root, filepathBuffer));
+                    return -1;
+                }
+                __write_progress(dp.Name, progress);
+                free(filepathBuffer);
+                continue;
+            }
+
             status = __extract_file(fileHandle, filepathBuffer);
             if (status) {
                 fprintf(stderr, "unmkvafs: unable to extract file '%s'\n", __get_relative_path(root, path));
@@ -330,11 +502,25 @@ static int __handle_overview(struct VaFs* vafsHandle, struct progress_context* p
     return 0;
 }
 
+static int __handle_readahead(struct VaFs* vafsHandle)
+{
+    struct VaFsFeatureReadahead readahead = {
+        .Header = { .Guid = VA_FS_FEATURE_READAHEAD, .Length = sizeof(struct VaFsFeatureReadahead) },
+        .MaxBlocks = 8
+    };
+
+    // Extraction reads every file from start to end, so let the
+    // library decode the next blocks while we write out the current.
+    return vafs_feature_add(vafsHandle, &readahead.Header);
+}
+
 static int __parse_options(struct __options* opts, int argc, char *argv[])
 {
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "--out") && (i + 1) < argc) {
             opts->out_path = argv[++i];
+        } else if (!strcmp(argv[i], "-j") && (i + 1) < argc) {
+            opts->jobs = atoi(argv[++i]);
         } else if (!strcmp(argv[i], "--v")) {
             opts->level = VaFsLogLevel_Info;
         } else if (!strcmp(argv[i], "--vv")) {
@@ -355,11 +541,13 @@ int main(int argc, char *argv[])
     struct VaFs*                vafsHandle;
     int                         status;
     struct progress_context     progressContext = { 0 };
+    struct __extract_queue      queue = { 0 };
     int                         exitCode = 0;
 
     struct __options opts = { 
         .image_path = NULL,
         .out_path = "vafs-root",
+        .jobs = 1,
         .level = VaFsLogLevel_Warning
     };
     
@@ -391,13 +579,32 @@ int main(int argc, char *argv[])
         goto error;
     }
 
+    status = __handle_readahead(vafsHandle);
+    if (status) {
+        fprintf(stderr, "unmkvafs: failed to enable readahead\n");
+        goto error;
+    }
+
     status = vafs_directory_open(vafsHandle, "/", &directoryHandle);
     if (status) {
         fprintf(stderr, "unmkvafs: cannot open root directory: /\n");
         goto error;
     }
 
-    status = __extract_directory(&progressContext, directoryHandle, opts.out_path, opts.out_path);
+    if (opts.jobs > 1) {
+        queue.progress = &progressContext;
+        mtx_init(&queue.lock, mtx_plain);
+    }
+
+    status = __extract_directory(&progressContext, opts.jobs > 1 ? &queue : NULL,
+        directoryHandle, opts.out_path, opts.out_path);
+    if (opts.jobs > 1) {
+        // a failed walk stops the workers before they pick up any job, like the
+        // serial path stops at the first error; the queued handles are still closed
+        queue.status = status;
+        status = __extract_queued(&queue, MIN(opts.jobs, __MAX_JOBS));
+        mtx_destroy(&queue.lock);
+    }
     if (status != 0) {
         fprintf(stderr, "unmkvafs: unable to extract to directory %s\n", opts.out_path);
         goto error;
@@ -406,6 +613,7 @@ int main(int argc, char *argv[])
     if (!progressContext.disabled) {
         printf("\n");
     }
+    goto exit;
 
 error:
     exitCode = -1;
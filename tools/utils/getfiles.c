@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "utils.h"
+#include <vafs/platform.h>
 
 // include dirent.h for directory operations
 #if defined(_WIN32) || defined(_WIN64)
@@ -189,6 +190,252 @@ int utils_getfiles(const char* path, int recursive, struct list* files)
     return __read_directory(path, NULL, recursive, files);
 }
 
+// The parallel crawl processes each directory as a separate task. A task lists
+// the entries of its directory in readdir order, and keeps a placeholder entry
+// for each subdirectory, which is linked to the task of that subdirectory. Once
+// all tasks are done, the tree is flattened, which restores the exact order the
+// serial crawl would have produced.
+#define __CRAWL_MAX_THREADS 64
+
+struct __crawl_task {
+    char*                 path;
+    char*                 sub_path;
+    struct list           entries;
+    struct __crawl_task** children;
+    int                   children_count;
+    struct __crawl_task*  next;
+};
+
+struct __crawl_context {
+    mtx_t                lock;
+    cnd_t                signal;
+    struct __crawl_task* pending;
+    int                  outstanding;
+    int                  status;
+    utils_stat_fn        stat;
+};
+
+static struct __crawl_task* __crawl_task_new(const char* path, const char* subPath)
+{
+    struct __crawl_task* task;
+
+    task = calloc(1, sizeof(struct __crawl_task));
+    if (task == NULL) {
+        return NULL;
+    }
+
+    task->path     = __safe_strdup(path);
+    task->sub_path = __safe_strdup(subPath);
+    if (task->path == NULL || (subPath != NULL && task->sub_path == NULL)) {
+        free(task->path);
+        free(task->sub_path);
+        free(task);
+        return NULL;
+    }
+    return task;
+}
+
+static int __crawl_directory(struct __crawl_context* context, struct __crawl_task* task)
+{
+    struct __crawl_task** children = NULL;
+    int                   capacity = 0;
+    struct dirent*        dp;
+    DIR*                  d;
+    int                   status = 0;
+    int                   i;
+
+    if ((d = opendir(task->path)) == NULL) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        return -1;
+    }
+
+    while ((dp = readdir(d))) {
+        char* combinedPath;
+        char* combinedSubPath;
+
+        if (strcmp(dp->d_name,".") == 0 || strcmp(dp->d_name,"..") == 0) {
+             continue;
+        }
+
+        combinedPath    = __combine_paths(task->path, dp->d_name);
+        combinedSubPath = __combine_paths(task->sub_path, dp->d_name);
+        if (!combinedPath || !combinedSubPath) {
+            free((void*)combinedPath);
+            free((void*)combinedSubPath);
+            status = -1;
+            break;
+        }
+
+        status = __add_file(dp, combinedPath, combinedSubPath, &task->entries);
+        if (!status && dp->d_type == DT_DIR) {
+            if (task->children_count == capacity) {
+                struct __crawl_task** resized;
+                capacity = capacity ? capacity * 2 : 16;
+                resized  = realloc(children, sizeof(struct __crawl_task*) * capacity);
+                if (resized == NULL) {
+                    status = -1;
+                } else {
+                    children = resized;
+                }
+            }
+
+            if (!status) {
+                children[task->children_count] = __crawl_task_new(combinedPath, combinedSubPath);
+                if (children[task->children_count] == NULL) {
+                    status = -1;
+                } else {
+                    task->children_count++;
+                }
+            }
+        } else if (!status && dp->d_type == DT_REG && context->stat != NULL) {
+            struct platform_file_entry* entry = (struct platform_file_entry*)task->entries.tail;
+            status = context->stat(combinedPath, &entry->mode, &entry->size);
+        }
+
+        free((void*)combinedPath);
+        free((void*)combinedSubPath);
+        if (status) {
+            break;
+        }
+    }
+    closedir(d);
+
+    // Hand the subdirectories to the workers, even on failure, the task owns
+    // them from here on so they are cleaned up with the tree.
+    task->children = children;
+    if (task->children_count) {
+        mtx_lock(&context->lock);
+        for (i = 0; i < task->children_count; i++) {
+            task->children[i]->next = context->pending;
+            context->pending        = task->children[i];
+        }
+        context->outstanding += task->children_count;
+        cnd_broadcast(&context->signal);
+        mtx_unlock(&context->lock);
+    }
+    return status;
+}
+
+static int __crawl_worker(void* arg)
+{
+    struct __crawl_context* context = arg;
+    struct __crawl_task*    task;
+    int                     status;
+
+    mtx_lock(&context->lock);
+    for (;;) {
+        while (context->pending == NULL && context->outstanding && !context->status) {
+            cnd_wait(&context->signal, &context->lock);
+        }
+
+        if (context->pending == NULL || context->status) {
+            break;
+        }
+
+        task             = context->pending;
+        context->pending = task->next;
+        mtx_unlock(&context->lock);
+
+        status = __crawl_directory(context, task);
+
+        mtx_lock(&context->lock);
+        if (status && !context->status) {
+            context->status = status;
+        }
+        if (--context->outstanding == 0 || context->status) {
+            cnd_broadcast(&context->signal);
+        }
+    }
+    mtx_unlock(&context->lock);
+    return 0;
+}
+
+// __crawl_flatten moves the entries of the task tree into files in the serial
+// order, and frees the tasks. The directory placeholders are not kept.
+static void __crawl_flatten(struct __crawl_task* task, struct list* files)
+{
+    struct list_item* item;
+    int               child = 0;
+
+    for (item = task->entries.head; item != NULL;) {
+        struct platform_file_entry* entry = (struct platform_file_entry*)item;
+        item = item->next;
+
+        if (entry->type == PLATFORM_FILETYPE_DIRECTORY && child < task->children_count) {
+            __crawl_flatten(task->children[child++], files);
+            free(entry->name);
+            free(entry->path);
+            free(entry->sub_path);
+            free(entry);
+            continue;
+        }
+        list_add(files, &entry->list_header);
+    }
+
+    free(task->children);
+    free(task->path);
+    free(task->sub_path);
+    free(task);
+}
+
+int utils_getfiles_parallel(const char* path, int threadCount, utils_stat_fn statFn, struct list* files)
+{
+    struct __crawl_context context;
+    struct __crawl_task*   root;
+    thrd_t                 threads[__CRAWL_MAX_THREADS];
+    int                    started;
+    int                    i;
+
+    if (!path || !files) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    root = __crawl_task_new(path, NULL);
+    if (root == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(&context, 0, sizeof(struct __crawl_context));
+    mtx_init(&context.lock, mtx_plain);
+    cnd_init(&context.signal);
+    context.pending     = root;
+    context.outstanding = 1;
+    context.stat        = statFn;
+
+    if (threadCount > __CRAWL_MAX_THREADS) {
+        threadCount = __CRAWL_MAX_THREADS;
+    }
+
+    for (started = 0; started < threadCount; started++) {
+        if (thrd_create(&threads[started], __crawl_worker, &context) != thrd_success) {
+            break;
+        }
+    }
+
+    // crawl on this thread if no workers could be started
+    if (started == 0) {
+        __crawl_worker(&context);
+    }
+
+    for (i = 0; i < started; i++) {
+        thrd_join(threads[i], NULL);
+    }
+
+    cnd_destroy(&context.signal);
+    mtx_destroy(&context.lock);
+
+    __crawl_flatten(root, files);
+    if (context.status) {
+        utils_getfiles_destroy(files);
+        return context.status;
+    }
+    return 0;
+}
+
 int utils_getfiles_destroy(struct list* files)
 {
     struct list_item* item;
@@ -20,6 +20,7 @@
 #define __VAFS_UTILS_H__
 
 #include "list.h"
+#include <stdint.h>
 
 // detect architecture
 #if defined(__x86_64__) || defined(_M_X64)
@@ -95,8 +96,22 @@ struct platform_file_entry {
     enum platform_filetype type;
     char*                  path;
     char*                  sub_path;
+
+    // Filled in during discovery for files when a stat function is
+    // provided, so the file does not have to be stat'ed again later.
+    uint32_t               mode;
+    uint64_t               size;
+
+    // Set by mkvafs when a layout profile shows that the file is read at
+    // random offsets rather than from start to end.
+    int                    random_access;
 };
 
+/**
+ * @brief Retrieves the mode and size of the file at path. Returns 0 on success.
+ */
+typedef int (*utils_stat_fn)(const char* path, uint32_t* mode, uint64_t* size);
+
 #define FILTER_FOLDCASE 0x1
 
 /**
@@ -114,4 +129,12 @@ extern int strfilter(const char* filter, const char* text, int flags);
 extern int utils_getfiles(const char* path, int recursive, struct list* files);
 extern int utils_getfiles_destroy(struct list* files);
 
+/**
+ * @brief Recursively retrieves all files in the given path like utils_getfiles, but
+ * crawls the directories on multiple threads. The resulting list has the same order
+ * as the list returned by utils_getfiles. If statFn is provided, it is invoked on the
+ * crawling threads for each file, and the results are stored in the entries.
+ */
+extern int utils_getfiles_parallel(const char* path, int threadCount, utils_stat_fn statFn, struct list* files);
+
 #endif //!__VAFS_UTILS_H__
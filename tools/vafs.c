@@ -36,6 +36,147 @@
 
 extern int __handle_filter(struct VaFs* vafs);
 
+// Timeout in seconds for cached entries and attributes in the kernel
+#define __VAFS_CACHE_TIMEOUT (24.0 * 60.0 * 60.0)
+
+static void __fill_stat(struct stat* stat, const struct vafs_stat* vstat, int isRoot)
+{
+    memset(stat, 0, sizeof(struct stat));
+    stat->st_blksize = 512;
+    stat->st_mode    = vstat->mode;
+    stat->st_size    = (off_t)vstat->size;
+
+    // root has 2 links
+    stat->st_nlink   = isRoot + 1;
+}
+
+static int __handle_readahead(struct VaFs* vafs)
+{
+    struct VaFsFeatureReadahead readahead = {
+        .Header = { .Guid = VA_FS_FEATURE_READAHEAD, .Length = sizeof(struct VaFsFeatureReadahead) },
+        .MaxBlocks = 8
+    };
+    return vafs_feature_add(vafs, &readahead.Header);
+}
+
+// Set by --preload, the tree is loaded once the filesystem has been mounted
+static int g_preload = 0;
+
+// Set by --trace, every read is recorded as "<offset> <length> <path>", which
+// mkvafs --layout-profile uses to place the files in the order they were read.
+// A single stdio call is atomic for the stream, so readers need no extra lock.
+static FILE* g_trace = NULL;
+
+static void __trace_read(const char* path, off_t offset, size_t count)
+{
+    if (g_trace != NULL) {
+        fprintf(g_trace, "%llu %llu %s\n", (unsigned long long)offset, (unsigned long long)count, path);
+    }
+}
+
+// Set by --stats, the statistics of the image can then be read from this
+// file in the root of the mount. The file is not listed by readdir.
+#define __VAFS_STATS_PATH "/.vafs-stats"
+static int g_stats = 0;
+
+static int __is_stats_path(const char* path)
+{
+    return g_stats && strcmp(path, __VAFS_STATS_PATH) == 0;
+}
+
+static int __format_stream_stats(char* buffer, size_t size, const char* name, const struct VaFsStreamStats* stats)
+{
+    return snprintf(buffer, size,
+        "%s.cache_hits %llu\n"
+        "%s.cache_misses %llu\n"
+        "%s.blocks_decoded %llu\n"
+        "%s.decode_ns %llu\n"
+        "%s.bytes_read %llu\n"
+        "%s.verify_ns %llu\n",
+        name, (unsigned long long)stats->CacheHits,
+        name, (unsigned long long)stats->CacheMisses,
+        name, (unsigned long long)stats->BlocksDecoded,
+        name, (unsigned long long)stats->DecodeTime,
+        name, (unsigned long long)stats->BytesRead,
+        name, (unsigned long long)stats->VerifyTime
+    );
+}
+
+// __read_stats formats the statistics as "<name> <value>" lines, and copies
+// the requested range of the text.
+static int __read_stats(struct VaFs* vafs, char* buffer, size_t count, off_t offset)
+{
+    struct VaFsStats stats;
+    char             text[1024];
+    int              length;
+
+    if (vafs_get_stats(vafs, &stats)) {
+        return -1;
+    }
+
+    length  = __format_stream_stats(text, sizeof(text), "descriptors", &stats.Descriptors);
+    length += __format_stream_stats(text + length, sizeof(text) - length, "data", &stats.Data);
+    length += snprintf(text + length, sizeof(text) - length,
+        "cache_evictions %llu\n"
+        "lock_contention %llu\n"
+        "directory_loads %llu\n",
+        (unsigned long long)stats.CacheEvictions,
+        (unsigned long long)stats.LockContention,
+        (unsigned long long)stats.DirectoryLoads
+    );
+
+    if (offset >= length) {
+        return 0;
+    }
+    if (count > (size_t)(length - offset)) {
+        count = (size_t)(length - offset);
+    }
+    memcpy(buffer, text + offset, count);
+    return (int)count;
+}
+
+static int __handle_preload(struct VaFs* vafs)
+{
+    struct VaFsFeaturePreload preload = {
+        .Header = { .Guid = VA_FS_FEATURE_PRELOAD, .Length = sizeof(struct VaFsFeaturePreload) }
+    };
+    return vafs_feature_add(vafs, &preload.Header);
+}
+
+/**
+ * Initialize filesystem
+ *
+ * Called once the filesystem is mounted, after fuse_main has daemonized the
+ * process. Background workers must be started from here, as threads that are
+ * created before fuse_main do not survive the fork.
+ */
+static void* __vafs_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+{
+    struct fuse_context* context = fuse_get_context();
+    struct VaFs*         vafs    = context->private_data;
+
+    // The image is immutable, so whatever the kernel has cached stays valid
+    // for as long as the filesystem is mounted.
+    cfg->kernel_cache     = 1;
+    cfg->entry_timeout    = __VAFS_CACHE_TIMEOUT;
+    cfg->attr_timeout     = __VAFS_CACHE_TIMEOUT;
+    cfg->negative_timeout = __VAFS_CACHE_TIMEOUT;
+
+    // Let replies move their data through splice when the kernel supports it,
+    // and leave max_read unlimited (0) so the kernel decides the request size.
+    conn->want    |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    conn->max_read = 0;
+
+    if (__handle_readahead(vafs)) {
+        fprintf(stderr, "failed to enable readahead for vafs image\n");
+    }
+
+    if (g_preload && __handle_preload(vafs)) {
+        fprintf(stderr, "failed to enable preloading for vafs image\n");
+    }
+    return vafs;
+}
+
 /** Open a file
  *
  * Open flags are available in fi->flags. The following rules
@@ -95,12 +236,21 @@ int __vafs_open(const char* path, struct fuse_file_info* fi)
 		return -1;
     }
 
+    // the statistics change between reads, so bypass the page cache
+    if (__is_stats_path(path)) {
+        fi->direct_io = 1;
+        fi->fh        = 0;
+        return 0;
+    }
+
     status = vafs_file_open(vafs, path, &handle);
     if (status) {
         return status;
     }
 
-    fi->fh = (uint64_t)handle;
+    // the contents never change, so keep the page cache between opens
+    fi->keep_cache = 1;
+    fi->fh         = (uint64_t)handle;
     return 0;
 }
 
@@ -120,9 +270,14 @@ int __vafs_access(const char* path, int permissions)
     struct vafs_stat     stat;
     int                  status;
 
-    status = vafs_path_stat(vafs, path, 1, &stat);
-    if (status) {
-        return status;
+    if (__is_stats_path(path)) {
+        stat.mode = 0444;
+    }
+    else {
+        status = vafs_path_stat(vafs, path, 1, &stat);
+        if (status) {
+            return status;
+        }
     }
 
     if ((stat.mode & (uint32_t)permissions) != (uint32_t)permissions) {
@@ -146,25 +301,26 @@ int __vafs_read(const char* path, char* buffer, size_t count, off_t offset, stru
     struct fuse_context*   context = fuse_get_context();
     struct VaFs*           vafs    = context->private_data;
     struct VaFsFileHandle* handle  = (struct VaFsFileHandle*)fi->fh;
-    int                    status;
+    size_t                 bytesRead;
+
+    if (__is_stats_path(path)) {
+        return __read_stats(vafs, buffer, count, offset);
+    }
 
     if (handle == NULL) {
         errno = EINVAL;
         return -1;
     }
 
-    if (offset != 0) {
-        status = vafs_file_seek(handle, offset, SEEK_SET);
-        if (status) {
-            return status;
-        }
-    }
+    __trace_read(path, offset, count);
 
-    status = (int)vafs_file_read(handle, buffer, count);
-    if (status) {
-        return status;
+    // positional reads do not touch the position of the handle, so
+    // the handle can be shared between concurrent reads
+    bytesRead = vafs_file_read_at(handle, buffer, count, (uint64_t)offset);
+    if (bytesRead == 0 && errno != ENODATA) {
+        return -1;
     }
-    return (int)count;
+    return (int)bytesRead;
 }
 
 /** Get file attributes.
@@ -197,18 +353,20 @@ int __vafs_getattr(const char* path, struct stat* stat, struct fuse_file_info *f
         return 0;
     }
 
+    if (__is_stats_path(path)) {
+        stat->st_blksize = 512;
+        stat->st_mode    = S_IFREG | 0444;
+        stat->st_nlink   = 1;
+        return 0;
+    }
+
     status = vafs_path_stat(vafs, path, 0, &vstat);
     if (status) {
         return status;
     }
 
-    // root has 2 links
     isRoot = (strcmp(path, "/") == 0);
-
-    stat->st_blksize = 512;
-    stat->st_mode    = vstat.mode;
-    stat->st_size    = (off_t)vstat.size;
-    stat->st_nlink   = isRoot + 1;
+    __fill_stat(stat, &vstat, isRoot);
     return 0;
 }
 
@@ -274,6 +432,10 @@ int __vafs_release(const char* path, struct fuse_file_info* fi)
     struct VaFsFileHandle* handle  = (struct VaFsFileHandle*)fi->fh;
     int                    status;
 
+    if (__is_stats_path(path)) {
+        return 0;
+    }
+
     if (handle == NULL) {
         errno = EINVAL;
         return -1;
@@ -281,6 +443,9 @@ int __vafs_release(const char* path, struct fuse_file_info* fi)
 
     status = vafs_file_close(handle);
     fi->fh = 0;
+    if (g_trace != NULL) {
+        fflush(g_trace);
+    }
     return status;
 }
 
@@ -304,7 +469,8 @@ int __vafs_opendir(const char* path, struct fuse_file_info* fi)
         return status;
     }
 
-    fi->fh = (uint64_t)handle;
+    fi->cache_readdir = 1;
+    fi->fh            = (uint64_t)handle;
     return 0;
 }
 
@@ -347,8 +513,16 @@ int __vafs_readdir(
 
     while (1) {
         struct VaFsEntry entry;
-        //struct stat      stat;
-        status = vafs_directory_read(handle, &entry);
+        struct vafs_stat vstat;
+        struct stat      stat;
+
+        // The attributes come straight from the directory entry, so the kernel
+        // does not need a getattr, and thus a path lookup, for each entry.
+        if (flags & FUSE_READDIR_PLUS) {
+            status = vafs_directory_read_stat(handle, &entry, &vstat);
+        } else {
+            status = vafs_directory_read(handle, &entry);
+        }
         if (status) {
             if (errno != ENOENT) {
                 return status;
@@ -356,18 +530,15 @@ int __vafs_readdir(
             break;
         }
 
-        // TODO support retrieving file attributes from a directory entry
-        /*if (flags & FUSE_READDIR_PLUS) {
+        if (flags & FUSE_READDIR_PLUS) {
+            __fill_stat(&stat, &vstat, 0);
             status = fill(buffer, entry.Name, &stat, 0, FUSE_FILL_DIR_PLUS);
-            if (status) {
-                return status;
-            }
-        } else { */
+        } else {
             status = fill(buffer, entry.Name, NULL, 0, 0);
-            if (status) {
-                return status;
-            }
-        //}
+        }
+        if (status) {
+            return status;
+        }
     }
 
     return 0;
@@ -430,6 +601,7 @@ int __vafs_statfs(const char* path, struct statvfs* stat)
  * filesystem can still be implemented.
  */
 static const struct fuse_operations operations = {
+    .init       = __vafs_init,
     .open       = __vafs_open,
     .access     = __vafs_access,
     .read       = __vafs_read,
@@ -452,6 +624,9 @@ static const struct fuse_operations operations = {
  */
 static struct options {
 	const char* filename;
+	const char* trace;
+	int         preload;
+	int         stats;
 	int         show_help;
 } g_options;
 
@@ -459,6 +634,9 @@ static struct options {
     { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt g_optionsSpec[] = {
 	OPTION("--image=%s", filename),
+	OPTION("--preload", preload),
+	OPTION("--trace=%s", trace),
+	OPTION("--stats", stats),
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	FUSE_OPT_END
@@ -470,6 +648,12 @@ static void __show_help(const char *progname)
 	printf("File-system specific options:\n"
 	       "    --image=<s>         Name of the \"VaFS\" disk image\n"
 	       "                        (default: \"image.vafs\")\n"
+	       "    --preload           Load the directory tree of the image in the\n"
+	       "                        background once mounted\n"
+	       "    --trace=<s>         Record the file reads to this file, for use\n"
+	       "                        with mkvafs --layout-profile\n"
+	       "    --stats             Provide the statistics of the image in the\n"
+	       "                        file " __VAFS_STATS_PATH " of the mount\n"
 	       "\n");
 }
 
@@ -512,11 +696,27 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    g_preload = g_options.preload;
+    g_stats   = g_options.stats;
+
+    // opened before mounting, the working directory changes when daemonized
+    if (g_options.trace != NULL) {
+        g_trace = fopen(g_options.trace, "w");
+        if (g_trace == NULL) {
+            fprintf(stderr, "failed to open trace file %s\n", g_options.trace);
+            vafs_close(vafs);
+            return -1;
+        }
+    }
+
 run_main:
 	status = fuse_main(args.argc, args.argv, &operations, vafs);
     if (vafs != NULL) {
         vafs_close(vafs);
     }
+    if (g_trace != NULL) {
+        fclose(g_trace);
+    }
     fuse_opt_free_args(&args);
     return status;
 }